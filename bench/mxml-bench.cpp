@@ -0,0 +1,769 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// mxml-bench measures the throughput of the parser, the document, XPath and
+// the serializer on synthetic documents. The results can be written to an XML
+// file and compared to those of an earlier run, to catch regressions.
+
+#include "mxml.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef MXML_VERSION
+#define MXML_VERSION "unknown"
+#endif
+
+#ifndef MXML_BENCH_DATA_DIR
+#define MXML_BENCH_DATA_DIR "."
+#endif
+
+namespace fs = std::filesystem;
+
+using namespace std::literals;
+
+// --------------------------------------------------------------------
+// Count the memory allocated by operator new, to measure the footprint
+// of a document. Each block is prefixed with its size.
+
+namespace
+{
+
+std::atomic<std::size_t> s_allocated_bytes = 0, s_allocation_count = 0;
+
+constexpr std::size_t kHeaderSize = alignof(std::max_align_t);
+
+} // namespace
+
+void *operator new(std::size_t size)
+{
+	auto p = static_cast<char *>(std::malloc(size + kHeaderSize));
+	if (p == nullptr)
+		throw std::bad_alloc();
+
+	*reinterpret_cast<std::size_t *>(p) = size;
+	s_allocated_bytes += size;
+	++s_allocation_count;
+
+	return p + kHeaderSize;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	if (ptr != nullptr)
+	{
+		auto p = static_cast<char *>(ptr) - kHeaderSize;
+		s_allocated_bytes -= *reinterpret_cast<std::size_t *>(p);
+		std::free(p);
+	}
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+// --------------------------------------------------------------------
+// The synthetic corpus. Each generator returns a document of at least
+// size bytes, the same every run.
+
+std::string make_records(std::size_t size)
+{
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> d(0, 1000000);
+
+	const char *kTypes[] = { "alpha", "beta", "gamma" };
+
+	std::string result = "<?xml version=\"1.0\"?>\n<records>\n";
+
+	for (int i = 0; result.length() < size; ++i)
+	{
+		result += "  <record id=\"r" + std::to_string(i) + "\" type=\"" + kTypes[i % 3] + "\">";
+		result += "<name>Record number " + std::to_string(i) + "</name>";
+		result += "<value>" + std::to_string(d(rng) / 100.0) + "</value>";
+		result += "<note>Caf\xc3\xa9 cr\xc3\xa8me &amp; more text, value &lt; " + std::to_string(d(rng)) + "</note>";
+		result += "</record>\n";
+	}
+
+	result += "</records>\n";
+
+	return result;
+}
+
+std::string make_deep(std::size_t size)
+{
+	const int kDepth = 200;
+
+	std::string result = "<?xml version=\"1.0\"?>\n<deep>";
+
+	while (result.length() < size)
+	{
+		for (int i = 0; i < kDepth; ++i)
+			result += "<n d=\"" + std::to_string(i) + "\">";
+		result += "bottom";
+		for (int i = 0; i < kDepth; ++i)
+			result += "</n>";
+		result += '\n';
+	}
+
+	result += "</deep>\n";
+
+	return result;
+}
+
+std::string make_namespaces(std::size_t size)
+{
+	const int kNamespaces = 8;
+
+	std::string result = "<?xml version=\"1.0\"?>\n<ns0:root";
+	for (int i = 0; i < kNamespaces; ++i)
+		result += " xmlns:ns" + std::to_string(i) + "=\"http://example.org/ns/" + std::to_string(i) + "\"";
+	result += ">\n";
+
+	for (int i = 0; result.length() < size; ++i)
+	{
+		auto p = [i](int o)
+		{ return "ns" + std::to_string((i + o) % kNamespaces); };
+
+		result += "  <" + p(1) + ":item " + p(2) + ":ref=\"" + std::to_string(i) + "\" xmlns:local=\"urn:local:" + std::to_string(i) + "\">";
+		result += "<" + p(3) + ":name local:lang=\"en\">item " + std::to_string(i) + "</" + p(3) + ":name>";
+		result += "<local:x/><" + p(4) + ":y " + p(5) + ":z=\"1\"/>";
+		result += "</" + p(1) + ":item>\n";
+	}
+
+	result += "</ns0:root>\n";
+
+	return result;
+}
+
+std::string make_entities(std::size_t size)
+{
+	const int kEntities = 16;
+
+	std::string result = "<?xml version=\"1.0\"?>\n<!DOCTYPE text [\n";
+	for (int i = 0; i < kEntities; ++i)
+		result += "<!ENTITY e" + std::to_string(i) + " \"replacement text " + std::to_string(i) + " &#169;\">\n";
+	result += "<!ENTITY nested \"&e1; and &e2;\">\n]>\n<text>\n";
+
+	for (int i = 0; result.length() < size; ++i)
+	{
+		result += "<p a=\"&e" + std::to_string(i % kEntities) + ";\">Text &e" + std::to_string((i + 1) % kEntities) +
+		          "; with &nested; &amp; &lt;markup&gt; &#x263A; &#9731; &eacute;</p>\n";
+	}
+
+	result += "</text>\n";
+
+	// eacute is not a predefined entity
+	result.insert(result.find("]>"), "<!ENTITY eacute \"&#233;\">\n");
+
+	return result;
+}
+
+std::string make_validated(std::size_t size)
+{
+	auto records = make_records(size);
+
+	const char kDTD[] = R"(<!DOCTYPE records [
+<!ELEMENT records (record*)>
+<!ELEMENT record (name, value, note?)>
+<!ATTLIST record id ID #REQUIRED type (alpha|beta|gamma) "alpha">
+<!ELEMENT name (#PCDATA)>
+<!ELEMENT value (#PCDATA)>
+<!ELEMENT note (#PCDATA)>
+]>
+)";
+
+	records.insert(records.find("<records>"), kDTD);
+
+	return records;
+}
+
+std::string to_utf16le(std::string_view s)
+{
+	std::string result = "\xff\xfe";
+	result.reserve(2 * s.length() + 2);
+
+	auto put = [&result](char32_t u)
+	{
+		result += static_cast<char>(u & 0xff);
+		result += static_cast<char>(u >> 8);
+	};
+
+	for (auto ch = s.begin(); ch != s.end();)
+	{
+		char32_t uc = mxml::pop_front_char(ch, s.end());
+		if (uc >= 0x10000)
+		{
+			put(0xD800 + ((uc - 0x10000) >> 10));
+			put(0xDC00 + ((uc - 0x10000) & 0x3ff));
+		}
+		else
+			put(uc);
+	}
+
+	return result;
+}
+
+// The XPath corpus repeats the page in data-013.xml from the XPath test
+// suite, with its text cut short. Returns an empty string if not found.
+
+std::string make_pages(const fs::path &seed, std::size_t size)
+{
+	std::ifstream file(seed, std::ios::binary);
+	if (not file.is_open())
+		return {};
+
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	auto b = data.find("<page>"), e = data.find("</page>");
+	if (b == std::string::npos or e == std::string::npos)
+		return {};
+
+	std::string page = data.substr(b, e + 7 - b);
+
+	// keep the first 1000 bytes of the text, ending at a line break
+	auto tb = page.find("<text");
+	auto te = page.find("</text>");
+	if (tb != std::string::npos and te != std::string::npos and te - tb > 1000)
+		page.erase(page.find('\n', tb + 1000), te - page.find('\n', tb + 1000));
+
+	std::string result = "<?xml version=\"1.0\"?>\n<mediawiki>\n";
+
+	for (int i = 0; result.length() < size; ++i)
+	{
+		auto p = page;
+		p.replace(p.find("<id>") + 4, p.find("</id>") - p.find("<id>") - 4, std::to_string(i));
+		result += p;
+		result += '\n';
+	}
+
+	result += "</mediawiki>\n";
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+// Records for the serializer benchmarks
+
+struct record
+{
+	std::string id;
+	std::string type;
+	std::string name;
+	double value;
+	std::string note;
+
+	template <typename Archive>
+	void serialize(Archive &ar, unsigned long /*version*/)
+	{
+		// clang-format off
+		ar & mxml::make_attribute_nvp("id", id)
+		   & mxml::make_attribute_nvp("type", type)
+		   & mxml::make_element_nvp("name", name)
+		   & mxml::make_element_nvp("value", value)
+		   & mxml::make_element_nvp("note", note);
+		// clang-format on
+	}
+};
+
+struct record_list
+{
+	std::vector<record> records;
+
+	template <typename Archive>
+	void serialize(Archive &ar, unsigned long /*version*/)
+	{
+		ar & mxml::make_element_nvp("record", records);
+	}
+};
+
+// --------------------------------------------------------------------
+
+struct result
+{
+	std::string name;
+	double value;
+	std::string unit;
+	bool higher_is_better;
+	std::size_t iterations;
+};
+
+struct options
+{
+	std::size_t size = 4 * 1024 * 1024;
+	double min_time = 0.5;
+	std::string filter;
+	fs::path output;
+	fs::path baseline;
+	double tolerance = 10;
+	fs::path data_dir = MXML_BENCH_DATA_DIR;
+	bool list = false;
+};
+
+class bench
+{
+  public:
+	bench(const options &opts)
+		: m_options(opts)
+	{
+	}
+
+	bool selected(const std::string &name) const
+	{
+		return m_options.filter.empty() or name.find(m_options.filter) != std::string::npos;
+	}
+
+	// Run f repeatedly for at least min_time seconds, at least three times,
+	// and return the time of the fastest run in seconds
+	std::pair<double, std::size_t> time(const std::function<void()> &f) const
+	{
+		using clock = std::chrono::steady_clock;
+
+		double best = std::numeric_limits<double>::max(), total = 0;
+		std::size_t n = 0;
+
+		while (n < 3 or total < m_options.min_time)
+		{
+			auto start = clock::now();
+			f();
+			std::chrono::duration<double> t = clock::now() - start;
+
+			best = std::min(best, t.count());
+			total += t.count();
+			++n;
+		}
+
+		return { best, n };
+	}
+
+	// Throughput of processing \a bytes bytes in f, in MB/s
+	void throughput(const std::string &name, std::size_t bytes, const std::function<void()> &f)
+	{
+		if (m_options.list)
+			std::cout << name << '\n';
+		else if (selected(name))
+		{
+			auto [t, n] = time(f);
+			add({ name, bytes / t / 1e6, "MB/s", true, n });
+		}
+	}
+
+	// Number of times per second f can be called
+	void rate(const std::string &name, const std::string &unit, const std::function<void()> &f)
+	{
+		if (m_options.list)
+			std::cout << name << '\n';
+		else if (selected(name))
+		{
+			auto [t, n] = time(f);
+			add({ name, 1 / t, unit, true, n });
+		}
+	}
+
+	// A value that should not increase, like the memory used per node
+	void measure(const std::string &name, const std::string &unit, double value)
+	{
+		if (m_options.list)
+			std::cout << name << '\n';
+		else if (selected(name))
+			add({ name, value, unit, false, 1 });
+	}
+
+	const std::vector<result> &results() const { return m_results; }
+
+  private:
+	void add(result &&r)
+	{
+		std::cout << std::left << std::setw(56) << r.name
+				  << std::right << std::setw(14) << std::fixed << std::setprecision(2) << r.value
+				  << ' ' << r.unit << std::endl;
+
+		m_results.emplace_back(std::move(r));
+	}
+
+	const options &m_options;
+	std::vector<result> m_results;
+};
+
+// --------------------------------------------------------------------
+
+std::size_t count_nodes(const mxml::element_container &e)
+{
+	std::size_t result = 1;
+
+	if (auto el = dynamic_cast<const mxml::element *>(&e); el != nullptr)
+		result += el->attributes().size();
+
+	for (auto &n : e.nodes())
+	{
+		if (auto c = dynamic_cast<const mxml::element_container *>(&n); c != nullptr)
+			result += count_nodes(*c);
+		else
+			++result;
+	}
+
+	return result;
+}
+
+void bench_parser(bench &b, const options &opts)
+{
+	struct corpus
+	{
+		const char *name;
+		std::string data;
+		bool validate;
+		bool validate_ns;
+	} corpora[] = {
+		{ "records", make_records(opts.size), false, false },
+		{ "deep", make_deep(opts.size), false, false },
+		{ "namespaces", make_namespaces(opts.size), false, true },
+		{ "entities", make_entities(opts.size), false, false },
+		{ "utf16", to_utf16le(make_records(opts.size)), false, false },
+		{ "validated", make_validated(opts.size), true, false },
+	};
+
+	for (auto &c : corpora)
+	{
+		b.throughput("parser/"s + c.name, c.data.length(), [&]()
+			{
+				mxml::parser p(c.data);
+				p.parse(c.validate, c.validate_ns);
+			});
+	}
+
+	for (auto &c : corpora)
+	{
+		b.throughput("document/"s + c.name, c.data.length(), [&]()
+			{
+				mxml::document doc;
+				doc.set_validating(c.validate);
+				doc.set_validating_ns(c.validate_ns);
+				std::istringstream is(c.data);
+				is >> doc;
+			});
+	}
+
+	auto &records = corpora[0].data;
+
+	b.throughput("document/records-arena", records.length(), [&]()
+		{
+			mxml::document doc;
+			doc.set_use_arena(true);
+			std::istringstream is(records);
+			is >> doc;
+		});
+
+	b.throughput("document/records-parallel", records.length(), [&]()
+		{
+			mxml::document doc;
+			doc.parse_parallel(records);
+		});
+
+	// The memory footprint of the records document, per node
+	if (opts.list or b.selected("document/bytes-per-node"))
+	{
+		std::size_t before = s_allocated_bytes;
+		auto doc = std::make_unique<mxml::document>(std::string_view{ records });
+		std::size_t used = s_allocated_bytes - before;
+
+		b.measure("document/bytes-per-node", "bytes", static_cast<double>(used) / count_nodes(*doc));
+
+		before = s_allocation_count;
+		mxml::document doc2(std::string_view{ records });
+		b.measure("document/allocations-per-node", "count", static_cast<double>(s_allocation_count - before) / count_nodes(doc2));
+	}
+
+	mxml::document doc(std::string_view{ records });
+
+	std::string out;
+	b.throughput("document/write", records.length(), [&]()
+		{
+			std::ostringstream os;
+			os << doc;
+			out = os.str();
+		});
+}
+
+void bench_xpath(bench &b, const options &opts)
+{
+	mxml::document records(std::string_view{ make_records(opts.size) });
+
+	const char *kRecordQueries[] = {
+		"//record",
+		"//record[@type='beta']/name",
+		"/records/record[number(value) > 5000]",
+		"//record[position() = 1000]",
+		"//note[contains(text(), 'crème')]",
+	};
+
+	for (auto q : kRecordQueries)
+	{
+		mxml::xpath xp(q);
+		b.rate("xpath/records:"s + q, "queries/s", [&]()
+			{ xp.evaluate<mxml::node>(records); });
+	}
+
+	auto pages = make_pages(opts.data_dir / "data-013.xml", opts.size);
+	if (pages.empty())
+	{
+		std::cerr << "data-013.xml not found in " << opts.data_dir << ", skipping XPath benchmarks on pages\n";
+		return;
+	}
+
+	mxml::document doc(std::string_view{ pages });
+
+	const char *kPageQueries[] = {
+		"//page/title",
+		"//page[id = '500']",
+		"//revision[contributor/username = 'NL-Romaine']/timestamp",
+		"//revision[contains(text, 'Gebruiker')]/id",
+		"//page[number(revision/contributor/id) > 100000]/title",
+	};
+
+	for (auto q : kPageQueries)
+	{
+		mxml::xpath xp(q);
+		b.rate("xpath/pages:"s + q, "queries/s", [&]()
+			{ xp.evaluate<mxml::node>(doc); });
+	}
+
+	b.rate("xpath/compile", "paths/s", [&]()
+		{
+			for (auto q : kPageQueries)
+				mxml::xpath xp(q);
+		});
+}
+
+void bench_serializer(bench &b, const options &opts)
+{
+	mxml::document doc(std::string_view{ make_records(opts.size) });
+
+	record_list list;
+	mxml::from_xml(doc, "records", list);
+
+	std::string xml;
+	{
+		std::ostringstream os;
+		mxml::to_xml(os, "records", list);
+		xml = os.str();
+	}
+
+	b.throughput("serializer/to_xml-document", xml.length(), [&]()
+		{
+			mxml::document d;
+			mxml::to_xml(d, "records", list);
+		});
+
+	b.throughput("serializer/to_xml-stream", xml.length(), [&]()
+		{
+			std::ostringstream os;
+			mxml::to_xml(os, "records", list);
+		});
+
+	// parsing included, to compare with from_xml-stream
+	b.throughput("serializer/from_xml-document", xml.length(), [&]()
+		{
+			mxml::document d(std::string_view{ xml });
+			record_list l;
+			mxml::from_xml(d, "records", l);
+		});
+
+	b.throughput("serializer/from_xml-document-deserialize-only", xml.length(), [&]()
+		{
+			record_list l;
+			mxml::from_xml(doc, "records", l);
+		});
+
+	b.throughput("serializer/from_xml-stream", xml.length(), [&]()
+		{
+			std::istringstream is(xml);
+			record_list l;
+			mxml::from_xml(is, "records", l);
+		});
+}
+
+// --------------------------------------------------------------------
+
+void write_results(const fs::path &file, const options &opts, const std::vector<result> &results)
+{
+	mxml::element root("mxml-bench", {
+		{ "version", MXML_VERSION },
+		{ "size", std::to_string(opts.size) } });
+
+	for (auto &r : results)
+	{
+		std::ostringstream value;
+		value << r.value;
+
+		root.emplace_back(mxml::element("result", {
+			{ "name", r.name },
+			{ "value", value.str() },
+			{ "unit", r.unit },
+			{ "higher-is-better", r.higher_is_better ? "true" : "false" },
+			{ "iterations", std::to_string(r.iterations) } }));
+	}
+
+	mxml::document doc;
+	doc.emplace_back(std::move(root));
+
+	std::ofstream out(file);
+	if (not out.is_open())
+		throw std::runtime_error("Could not create " + file.string());
+
+	out << std::setw(2) << doc << '\n';
+}
+
+// Compare the results with those in \a file, returns the number of regressions
+int compare_results(const fs::path &file, double tolerance, const std::vector<result> &results)
+{
+	mxml::document baseline{ file };
+
+	int regressions = 0;
+
+	std::cout << '\n'
+			  << "compared to " << file << " (version " << baseline.front().get_attribute("version") << ")\n";
+
+	for (auto &r : results)
+	{
+		mxml::context ctx;
+		ctx.set("name", r.name);
+
+		auto base = mxml::xpath("//result[@name=$name]").first<mxml::element>(baseline, ctx);
+		if (base == nullptr)
+			continue;
+
+		double v = std::stod(base->get_attribute("value"));
+		if (v == 0)
+			continue;
+
+		double change = 100 * (r.value - v) / v;
+		bool regression = r.higher_is_better ? change < -tolerance : change > tolerance;
+
+		std::cout << std::left << std::setw(56) << r.name
+				  << std::right << std::setw(9) << std::showpos << std::fixed << std::setprecision(1) << change << std::noshowpos << '%'
+				  << (regression ? "  REGRESSION" : "") << '\n';
+
+		if (regression)
+			++regressions;
+	}
+
+	return regressions;
+}
+
+// --------------------------------------------------------------------
+
+void usage(std::ostream &os)
+{
+	os << R"(usage: mxml-bench [options]
+
+  --size=N          size of each generated document in MiB (default 4)
+  --min-time=S      run each benchmark for at least S seconds (default 0.5)
+  --filter=TEXT     only run the benchmarks with TEXT in their name
+  --list            list the benchmarks
+  --output=FILE     write the results to FILE as XML
+  --baseline=FILE   compare the results with those in FILE, written earlier
+                    using --output, and fail on a regression
+  --tolerance=P     the change in percent that is still accepted (default 10)
+  --data-dir=DIR    the directory containing data-013.xml from the
+                    XPath test suite
+)";
+}
+
+int main(int argc, char *argv[])
+{
+	options opts;
+
+	try
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string_view arg(argv[i]);
+
+			auto eq = arg.find('=');
+			auto key = arg.substr(0, eq);
+			std::string value{ eq == std::string_view::npos ? "" : arg.substr(eq + 1) };
+
+			if (key == "--size")
+				opts.size = static_cast<std::size_t>(std::stod(value) * 1024 * 1024);
+			else if (key == "--min-time")
+				opts.min_time = std::stod(value);
+			else if (key == "--filter")
+				opts.filter = value;
+			else if (key == "--list")
+				opts.list = true;
+			else if (key == "--output")
+				opts.output = value;
+			else if (key == "--baseline")
+				opts.baseline = value;
+			else if (key == "--tolerance")
+				opts.tolerance = std::stod(value);
+			else if (key == "--data-dir")
+				opts.data_dir = value;
+			else if (key == "--help" or key == "-h")
+			{
+				usage(std::cout);
+				return 0;
+			}
+			else
+			{
+				std::cerr << "Unknown option " << arg << "\n\n";
+				usage(std::cerr);
+				return 1;
+			}
+		}
+
+		bench b(opts);
+
+		bench_parser(b, opts);
+		bench_xpath(b, opts);
+		bench_serializer(b, opts);
+
+		if (not opts.output.empty())
+			write_results(opts.output, opts, b.results());
+
+		if (not opts.baseline.empty() and compare_results(opts.baseline, opts.tolerance, b.results()) > 0)
+			return 1;
+	}
+	catch (const std::exception &ex)
+	{
+		std::cerr << ex.what() << '\n';
+		return 1;
+	}
+
+	return 0;
+}
@@ -30,12 +30,18 @@
  * Main module definition for mxml.
 */
 
+#include "mxml/atom.hpp"
+#include "mxml/compact_document.hpp"
 #include "mxml/doctype.hpp"
 #include "mxml/document.hpp"
 #include "mxml/error.hpp"
 #include "mxml/node.hpp"
 #include "mxml/parser.hpp"
+#include "mxml/reader.hpp"
 #include "mxml/serialize.hpp"
+#include "mxml/stats.hpp"
 #include "mxml/text.hpp"
+#include "mxml/thread_pool.hpp"
 #include "mxml/version.hpp"
+#include "mxml/writer.hpp"
 #include "mxml/xpath.hpp"
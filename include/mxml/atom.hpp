@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * definition of the mxml::atom class, interned element and attribute names
+ */
+
+#include <compare>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace mxml
+{
+
+/** @cond */
+struct atom_entry
+{
+	std::string m_name;
+	const atom_entry *m_local; // the entry for the local name, nullptr if not interned
+	bool m_interned;
+};
+/** @endcond */
+
+/**
+ * @brief An interned name
+ *
+ * XML documents usually contain only a small number of distinct element
+ * and attribute names. When interning is enabled using set_interning,
+ * each distinct name is stored once in a process wide name table and an
+ * atom is a handle referring to it. Comparing two atoms therefore is a
+ * pointer comparison. Names are never removed from the table, nodes can
+ * be moved freely between documents that way.
+ *
+ * Interning is off by default, since the table lives as long as the
+ * process does. It is also limited in size, to protect against documents
+ * with unbounded numbers of distinct names. Names that are not interned
+ * are stored in the atom itself and compared as strings.
+ */
+
+class atom
+{
+  public:
+	/// @brief constructor for an empty name
+	atom() noexcept = default;
+
+	/// @brief constructor interning \a name
+	atom(std::string_view name);
+
+	/// @brief Enable or disable interning of names created from now on.
+	/// Atoms created before remain valid and compare equal to the new ones.
+	static void set_interning(bool enable);
+
+	/// @brief copy constructor
+	atom(const atom &a)
+		: m_entry(a.is_interned() ? a.m_entry : new atom_entry(*a.m_entry))
+	{
+	}
+
+	/// @brief move constructor
+	atom(atom &&a) noexcept
+		: m_entry(std::exchange(a.m_entry, nullptr))
+	{
+	}
+
+	/// @brief assignment operator
+	atom &operator=(atom a) noexcept
+	{
+		std::swap(m_entry, a.m_entry);
+		return *this;
+	}
+
+	/// @brief destructor
+	~atom()
+	{
+		if (not is_interned())
+			delete m_entry;
+	}
+
+	/// @brief swap two atoms
+	friend void swap(atom &a, atom &b) noexcept
+	{
+		std::swap(a.m_entry, b.m_entry);
+	}
+
+	/// @brief The name as a string
+	const std::string &str() const noexcept
+	{
+		return m_entry ? m_entry->m_name : s_empty;
+	}
+
+	/// @brief Return true if the name is empty
+	bool empty() const noexcept { return m_entry == nullptr; }
+
+	/// @brief The part of the name following the colon, if any
+	atom local_name() const
+	{
+		if (is_interned())
+			return atom(m_entry ? m_entry->m_local : nullptr);
+
+		auto &name = m_entry->m_name;
+		return atom(std::string_view{ name }.substr(name.find(':') + 1));
+	}
+
+	/// @brief The part of the name following the colon as a string
+	std::string_view local_str() const noexcept
+	{
+		std::string_view name = str();
+		return name.substr(name.find(':') + 1);
+	}
+
+	/// @brief Return true if the part of the name following the colon is \a local
+	bool local_name_is(const atom &local) const noexcept
+	{
+		if (is_interned() and local.is_interned())
+			return (m_entry ? m_entry->m_local : nullptr) == local.m_entry;
+		return local_str() == local.str();
+	}
+
+	/// @brief Compare two atoms, this is a pointer comparison for interned names
+	friend bool operator==(const atom &a, const atom &b) noexcept
+	{
+		return a.m_entry == b.m_entry or
+		       ((not a.is_interned() or not b.is_interned()) and a.str() == b.str());
+	}
+
+	/// @brief Compare with a string
+	friend bool operator==(const atom &a, std::string_view b) noexcept
+	{
+		return a.str() == b;
+	}
+
+	/// @brief Atoms are ordered by their names
+	friend std::strong_ordering operator<=>(const atom &a, const atom &b) noexcept
+	{
+		return a == b ? std::strong_ordering::equal : a.str().compare(b.str()) <=> 0;
+	}
+
+	/** @cond */
+  private:
+	explicit atom(const atom_entry *entry) noexcept
+		: m_entry(entry)
+	{
+	}
+
+	// false for names that did not fit in the table. The empty name
+	// counts as interned, it is represented by a null pointer.
+	bool is_interned() const noexcept
+	{
+		return m_entry == nullptr or m_entry->m_interned;
+	}
+
+	static const std::string s_empty;
+
+	const atom_entry *m_entry = nullptr;
+	/** @endcond */
+};
+
+} // namespace mxml
@@ -0,0 +1,340 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * definition of the mxml::compact_document class, a compact read-only
+ * representation of a document
+ */
+
+#include "mxml/document.hpp"
+
+#include <compare>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mxml
+{
+
+class compact_document;
+class compact_node_iterator;
+
+// --------------------------------------------------------------------
+/**
+ * @brief A reference to a node in a compact_document
+ *
+ * This is a small value type, a pointer to the document and an index.
+ * It remains valid as long as the compact_document exists. Attributes
+ * are nodes as well, these refer to their element and the attribute.
+ * Nodes of the same document compare in document order.
+ */
+
+class compact_node
+{
+  public:
+	/** @cond */
+	using index_type = std::uint32_t;
+	static constexpr index_type npos = ~index_type{ 0 };
+	/** @endcond */
+
+	/// @brief A null node
+	compact_node() = default;
+
+	/// @brief Return true if this refers to a node
+	explicit operator bool() const { return m_doc != nullptr and m_index != npos; }
+
+	/// @brief Compare two nodes
+	bool operator==(const compact_node &rhs) const = default;
+
+	/// @brief Compare two nodes of the same document in document order
+	auto operator<=>(const compact_node &rhs) const = default;
+
+	/// @brief The type of the node, element, text, attribute, etc.
+	node_type type() const;
+
+	/// @brief The qname of an element or attribute, the target of a processing instruction
+	std::string_view get_qname() const;
+
+	/// @brief The local name of an element or attribute
+	std::string_view name() const;
+
+	/// @brief The namespace URI of an element or attribute, if it can be resolved
+	std::string_view get_ns() const;
+
+	/// @brief Return the namespace URI for a prefix
+	std::string_view namespace_for_prefix(std::string_view prefix) const;
+
+	/// @brief The content of a text, cdata, comment or processing instruction,
+	/// the value of an attribute
+	std::string_view text() const;
+
+	/// @brief All text content concatenated, including that of children.
+	/// This is the same as node::str()
+	std::string str() const;
+
+	/// @brief The value of the xml:lang attribute in scope, like node::lang()
+	std::string_view lang() const;
+
+	/// @brief The value of the attribute declared as ID in the DTD, like element::id()
+	std::string_view id() const;
+
+	/// @brief Return true for an attribute that was declared as ID in the DTD
+	bool is_id() const;
+
+	/// @brief The parent node, null for the document itself. The parent
+	/// of an attribute is its element.
+	compact_node parent() const;
+
+	/// @brief The first child, if any
+	compact_node first_child() const;
+
+	/// @brief The next sibling, if any
+	compact_node next_sibling() const;
+
+	/// @brief The next node in document order, attributes are not included
+	compact_node next() const;
+
+	/// @brief The document node
+	compact_node root() const;
+
+	/// @brief Return true if the node has no children
+	bool empty() const { return not first_child(); }
+
+	/// @brief The value of attribute \a qname, empty if it does not exist
+	std::string_view get_attribute(std::string_view qname) const;
+
+	/// @brief The number of attributes of an element, including namespace declarations
+	size_t attribute_count() const;
+
+	/// @brief The qname and value of attribute number \a i
+	std::pair<std::string_view, std::string_view> attribute(size_t i) const;
+
+	/// @brief The node for attribute number \a i
+	compact_node attribute_node(size_t i) const;
+
+	/// @brief The index of this node in pre-order, the document is zero.
+	/// For attributes this is the index of the element.
+	index_type index() const { return m_index; }
+
+	/// @brief One past the index of the last node in the subtree of this node
+	index_type subtree_end() const;
+
+	/**
+	 * @brief Return the elements that match XPath @a path, using this node
+	 * as context node. See xpath::evaluate(const compact_node &, const context &).
+	 */
+	std::vector<compact_node> find(const std::string &path) const;
+
+	/// @brief The first element that matches XPath @a path, if any
+	compact_node find_first(const std::string &path) const;
+
+	/// @brief Iterator to the first child
+	compact_node_iterator begin() const;
+
+	/// @brief Iterator past the last child
+	compact_node_iterator end() const;
+
+	/** @cond */
+  private:
+	friend class compact_document;
+
+	compact_node(const compact_document *doc, index_type index, index_type attribute = 0)
+		: m_doc(doc)
+		, m_index(doc ? index : npos)
+		, m_attribute(attribute)
+	{
+		if (m_index == npos)
+		{
+			m_doc = nullptr;
+			m_attribute = 0;
+		}
+	}
+
+	const compact_document *m_doc = nullptr;
+	index_type m_index = npos;
+
+	// For attributes one more than the index in the attribute array, zero
+	// for other nodes. That puts attributes after their element and before
+	// its children when comparing.
+	index_type m_attribute = 0;
+	/** @endcond */
+};
+
+// --------------------------------------------------------------------
+/// @brief Forward iterator over the children of a compact_node
+
+class compact_node_iterator
+{
+  public:
+	/** @cond */
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = compact_node;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const compact_node *;
+	using reference = const compact_node &;
+
+	compact_node_iterator() = default;
+	compact_node_iterator(compact_node n)
+		: m_node(n)
+	{
+	}
+
+	reference operator*() const { return m_node; }
+	pointer operator->() const { return &m_node; }
+
+	compact_node_iterator &operator++()
+	{
+		m_node = m_node.next_sibling();
+		return *this;
+	}
+
+	compact_node_iterator operator++(int)
+	{
+		auto tmp(*this);
+		operator++();
+		return tmp;
+	}
+
+	bool operator==(const compact_node_iterator &rhs) const { return m_node == rhs.m_node; }
+
+  private:
+	compact_node m_node;
+	/** @endcond */
+};
+
+inline compact_node_iterator compact_node::begin() const
+{
+	return first_child();
+}
+
+inline compact_node_iterator compact_node::end() const
+{
+	return {};
+}
+
+// --------------------------------------------------------------------
+/**
+ * @brief A compact, read-only document
+ *
+ * The nodes are stored in a single array in document order (pre-order),
+ * linked by indices to their parent and next sibling. All nodes in a
+ * subtree are stored contiguously, so searching a subtree is a linear scan.
+ * Names and text are stored in a single string heap, each distinct name
+ * only once.
+ *
+ * This uses a fraction of the memory of a mxml::document and traversal
+ * is more cache friendly. When parsed directly, no mxml::document is
+ * created. XPaths can be evaluated using compact_node::find or
+ * xpath::evaluate. For modifications, convert to a regular document
+ * using to_document().
+ */
+
+class compact_document
+{
+  public:
+	/// @brief constructor for an empty compact document
+	compact_document() = default;
+
+	/// @brief constructor making a compact copy of @a doc
+	explicit compact_document(const document &doc);
+
+	/// @brief constructor parsing the XML in @a data, using the same
+	/// settings as the document constructor taking a std::string_view
+	explicit compact_document(std::string_view data);
+
+	/// @brief constructor parsing the XML read from @a is
+	explicit compact_document(std::istream &is);
+
+	/// @brief The node for the document itself
+	compact_node root() const { return { this, m_nodes.empty() ? compact_node::npos : 0 }; }
+
+	/// @brief The root element, if any
+	compact_node child() const;
+
+	/// @brief The number of nodes, not counting attributes
+	size_t size() const { return m_nodes.size(); }
+
+	/// @brief The doctype as parsed or as copied from the document
+	doc_type get_doctype() const { return m_doctype; }
+
+	/// @brief Create a regular mxml::document from this compact document
+	document to_document() const;
+
+	/** @cond */
+  private:
+	friend class compact_node;
+	friend class compact_builder;
+
+	using index_type = compact_node::index_type;
+
+	// A string in m_heap
+	struct string_ref
+	{
+		index_type m_offset = 0, m_length = 0;
+	};
+
+	struct node_entry
+	{
+		node_type m_type;
+		index_type m_parent;
+		index_type m_next_sibling;
+		index_type m_end; // one past the last node in the subtree
+		index_type m_name;  // index in m_names
+		string_ref m_text;
+		index_type m_first_attribute;
+		index_type m_attribute_count;
+	};
+
+	struct attribute_entry
+	{
+		index_type m_name;
+		string_ref m_value;
+		bool m_id;
+	};
+
+	std::string_view view(string_ref s) const { return { m_heap.data() + s.m_offset, s.m_length }; }
+	std::string_view name(index_type n) const { return view(m_names[n]); }
+
+	// The attribute of node \a node named \a qname, if any
+	const attribute_entry *find_attribute(index_type node, std::string_view qname) const;
+
+	std::vector<node_entry> m_nodes;
+	std::vector<attribute_entry> m_attributes;
+	std::vector<string_ref> m_names; // distinct names, the first is the empty name
+	std::vector<index_type> m_local_names; // the name index of the local part of each name
+	std::string m_heap;
+
+	doc_type m_doctype;
+	bool m_write_doctype = false;
+	/** @endcond */
+};
+
+} // namespace mxml
@@ -33,9 +33,13 @@
  * @cond
  */
 
+#include "mxml/atom.hpp"
+
 #include <cassert>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace mxml::doctype
@@ -49,7 +53,6 @@ class entity;
 class attribute;
 
 using entity_ptr = std::shared_ptr<entity>;
-using entity_list = std::vector<entity_ptr>;
 
 using element_ptr = std::shared_ptr<element>;
 using element_list = std::vector<element_ptr>;
@@ -57,6 +60,39 @@ using element_list = std::vector<element_ptr>;
 using attribute_ptr = std::shared_ptr<attribute>;
 using attribute_list = std::vector<attribute_ptr>;
 
+// --------------------------------------------------------------------
+// The entities declared in a DTD, in the order of declaration. Only the
+// first declaration of an entity is binding. Entities are looked up by
+// name using a hash table with open addressing, copying a list does not
+// allocate a node per entity that way.
+
+class entity_list
+{
+  public:
+	using const_iterator = std::vector<entity_ptr>::const_iterator;
+
+	const_iterator begin() const { return m_entities.begin(); }
+	const_iterator end() const { return m_entities.end(); }
+
+	bool empty() const { return m_entities.empty(); }
+	std::size_t size() const { return m_entities.size(); }
+
+	// add \a e, unless an entity with the same name was added before.
+	// Returns whether \a e was added.
+	bool insert(entity_ptr e);
+
+	// return the entity named \a name, or nullptr if there is none
+	const entity *find(std::string_view name) const;
+
+  private:
+	void rehash(std::size_t size);
+
+	std::vector<entity_ptr> m_entities;
+
+	// the index in m_entities plus one for each slot, zero for an empty slot
+	std::vector<std::uint32_t> m_slots;
+};
+
 // --------------------------------------------------------------------
 
 enum class content_spec_type
@@ -73,30 +109,72 @@ enum class content_spec_type
 struct content_spec_base;
 using content_spec_base_ptr = std::shared_ptr<content_spec_base>;
 
-struct state_base;
-using state_base_ptr = std::shared_ptr<state_base>;
-
 using content_spec_list = std::vector<content_spec_base_ptr>;
 
+// A content specification compiled into a deterministic automaton.
+// The element names occurring in the specification are numbered and
+// the transitions are stored in a table with a row for each state
+// and a column for each name. This is done once for each element
+// declaration, validating is then a table lookup per child element.
+// Names are kept as atoms, finding the column for an interned name
+// compares pointers only.
+
+class content_model
+{
+  public:
+	content_model(const content_spec_base &allowed);
+
+	content_model(const content_model &) = delete;
+	content_model &operator=(const content_model &) = delete;
+
+	content_spec_type get_content_spec() const { return m_content_spec; }
+
+	// the state after accepting element \a name in \a state,
+	// or -1 if the element is not allowed at this position
+	int next(int state, const atom &name) const;
+
+	// whether the content may end in \a state
+	bool accepts(int state) const { return m_accepting[state]; }
+
+  private:
+	content_spec_type m_content_spec;
+	bool m_any;
+	std::vector<atom> m_names;
+	std::vector<int> m_transitions;
+	std::vector<bool> m_accepting;
+};
+
+using content_model_ptr = std::shared_ptr<const content_model>;
+
 class validator
 {
   public:
-	validator(content_spec_base &allowed);
-	validator(element_ptr e);
+	validator(const content_spec_base &allowed);
+	validator(const element_ptr &e);
 
 	validator(const validator &other) = delete;
 	validator &operator=(const validator &other) = delete;
 
-	bool allow(const std::string &name);
+	bool allow(const atom &name);
 	content_spec_type get_content_spec() const;
-	bool done();
+	bool done() const;
 
   private:
-	state_base_ptr m_state;
-	content_spec_type m_allowed;
+	content_model_ptr m_model;
+	int m_state = 0;
 	bool m_done;
 };
 
+// the positions of the element names in a content specification,
+// used to compile it into a content_model
+struct content_model_builder;
+
+struct content_positions
+{
+	bool nullable = false;
+	std::vector<int> first, last;
+};
+
 // --------------------------------------------------------------------
 
 struct content_spec_base
@@ -106,7 +184,7 @@ struct content_spec_base
 
 	virtual ~content_spec_base() = default;
 
-	virtual state_base_ptr create_state() const = 0;
+	virtual content_positions compile(content_model_builder &b) const = 0;
 	virtual bool element_content() const { return false; }
 
 	content_spec_type get_content_spec() const { return m_content_spec; }
@@ -127,7 +205,7 @@ struct content_spec_any : public content_spec_base
 	{
 	}
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 };
 
 struct content_spec_empty : public content_spec_base
@@ -137,7 +215,7 @@ struct content_spec_empty : public content_spec_base
 	{
 	}
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 };
 
 struct content_spec_element : public content_spec_base
@@ -148,7 +226,7 @@ struct content_spec_element : public content_spec_base
 	{
 	}
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 	bool element_content() const override { return true; }
 
 	std::string m_name;
@@ -164,7 +242,7 @@ struct content_spec_repeated : public content_spec_base
 		assert(allowed);
 	}
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 	bool element_content() const override;
 
 	content_spec_base_ptr m_allowed;
@@ -181,7 +259,7 @@ struct content_spec_seq : public content_spec_base
 
 	void add(content_spec_base_ptr a);
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 	bool element_content() const override;
 
 	content_spec_list m_allowed;
@@ -203,7 +281,7 @@ struct content_spec_choice : public content_spec_base
 
 	void add(content_spec_base_ptr a);
 
-	state_base_ptr create_state() const override;
+	content_positions compile(content_model_builder &b) const override;
 	bool element_content() const override;
 
 	content_spec_list m_allowed;
@@ -277,13 +355,14 @@ class attribute
 	bool is_external() const { return m_external; }
 
   private:
-	// routines used to check _and_ reformat attribute value strings
-	bool is_name(std::string &s) const;
-	bool is_names(std::string &s) const;
-	bool is_nmtoken(std::string &s) const;
-	bool is_nmtokens(std::string &s) const;
+	// routines used to check attribute values, the value is trimmed
+	// already. is_names and is_nmtokens collapse the separating spaces.
+	static bool is_name(std::string_view s);
+	static bool is_names(std::string &s);
+	static bool is_nmtoken(std::string_view s);
+	static bool is_nmtokens(std::string &s);
 
-	bool is_unparsed_entity(const std::string &s, const entity_list &l) const;
+	bool is_unparsed_entity(std::string_view s, const entity_list &l) const;
 
 	std::string m_name;
 	attribute_type m_type;
@@ -321,11 +400,13 @@ class element
 
 	void set_allowed(content_spec_base_ptr allowed);
 	content_spec_base_ptr get_allowed() const { return m_allowed; }
+	const content_model_ptr &get_model() const { return m_model; }
 
   private:
 	std::string m_name;
 	attribute_list m_attlist;
 	content_spec_base_ptr m_allowed;
+	content_model_ptr m_model;
 	bool m_declared, m_external;
 };
 
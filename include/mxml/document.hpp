@@ -33,11 +33,16 @@
 
 #include "mxml/node.hpp"
 #include "mxml/parser.hpp"
+#include "mxml/stats.hpp"
 #include "mxml/version.hpp"
 #include "mxml/text.hpp"
+#include "mxml/thread_pool.hpp"
 
+#include <filesystem>
 #include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
 
 namespace mxml
 {
@@ -112,7 +117,20 @@ class document final : public element_container
 	/// constructor will also validate the input using DTD's found in \a base_dir
 	document(std::istream &is, const std::string &base_dir);
 
-	~document() = default;
+	/// \brief Constructor that will parse the XML contained in the file \a file using
+	/// default settings. The file is memory mapped when the OS supports this.
+	///
+	/// This is a constrained template to avoid ambiguity with the std::string_view
+	/// constructor when passing string literals.
+	template <typename Path>
+		requires std::is_same_v<Path, std::filesystem::path>
+	explicit document(const Path &file)
+		: document()
+	{
+		parse(file);
+	}
+
+	~document();
 
 	friend void swap(document &a, document &b) noexcept;
 
@@ -125,6 +143,12 @@ class document final : public element_container
 	bool is_validating_ns() const { return m_validating_ns; }
 	void set_validating_ns(bool validate) { m_validating_ns = validate; }
 
+	/// dtd_cache: the external DTD subset is looked up in and stored in
+	/// this cache, see mxml::dtd_cache. The cache can be shared by documents
+	/// parsed in different threads.
+	const std::shared_ptr<dtd_cache> &get_dtd_cache() const { return m_dtd_cache; }
+	void set_dtd_cache(std::shared_ptr<dtd_cache> cache) { m_dtd_cache = std::move(cache); }
+
 	/// preserve cdata, preserves CDATA sections instead of converting them
 	/// into text nodes.
 	bool preserves_cdata() const { return m_preserve_cdata; }
@@ -132,6 +156,65 @@ class document final : public element_container
 	/// \brief if \a p is true, the CDATA sections will be preserved when parsing XML, if \a p is false, the content of the CDATA will be treated as text
 	void set_preserve_cdata(bool p) { m_preserve_cdata = p; }
 
+	/// use arena, allocate the node objects created while parsing from a
+	/// monotonic arena owned by this document.
+	bool uses_arena() const { return m_use_arena; }
+
+	/**
+	 * \brief if \a a is true, the nodes created while parsing are allocated
+	 * from an arena owned by the document
+	 *
+	 * This avoids a heap allocation per node and the memory is released at
+	 * once when the document is destroyed. Only the node objects themselves
+	 * come from the arena, the strings they contain (names that are not
+	 * interned, attribute values, text) still use the heap. The memory of nodes removed from
+	 * the document is not reused before that, so this is best used for
+	 * documents that are mostly read. Copying nodes to another document is
+	 * fine, but the children of an element should not be moved to a tree
+	 * that outlives this document, e.g. using swap or element's move
+	 * constructor. The arena is not used by parse_records.
+	 */
+	void set_use_arena(bool a) { m_use_arena = a; }
+
+	/// use index, keep an index of the ID attributes and the element names
+	/// in this document.
+	bool uses_index() const { return m_use_index; }
+
+	/**
+	 * \brief if \a i is true, the document keeps an index of its elements
+	 *
+	 * The index maps the values of ID attributes to their element and the
+	 * local names of elements to the list of those elements in document
+	 * order. It is used by get_element_by_id and by XPaths that search for
+	 * descendants of the document by name, like `//item`. The index is
+	 * built the first time it is needed and again after the document was
+	 * modified, its building is fast, but still takes a walk over the
+	 * entire tree.
+	 */
+	void set_use_index(bool i);
+
+	/// \brief Return the element with an ID attribute whose value is \a id,
+	/// or nullptr if there is none.
+	element *get_element_by_id(std::string_view id);
+
+	/// \brief Return the element with an ID attribute whose value is \a id,
+	/// or nullptr if there is none.
+	const element *get_element_by_id(std::string_view id) const;
+
+	/** @cond */
+	// The elements with local name \a name in document order, or nullptr
+	// if this document does not keep an index
+	const element_set *indexed_elements(const std::string &name) const;
+	/** @endcond */
+
+	/// \brief Count the nodes in this document and estimate the memory
+	/// they use. This takes a walk over the entire tree.
+	document_stats get_stats() const;
+
+	/// \brief The parser_stats of the last parse of this document. These
+	/// are only collected when the library is built with MXML_STATS set.
+	const parser_stats &get_parser_stats() const { return m_parser_stats; }
+
 	/// \brief collapse means replacing e.g. `<foo></foo>` with `<foo/>`
 	bool collapses_empty_tags() const { return m_fmt.collapse_tags; }
 
@@ -202,6 +285,9 @@ class document final : public element_container
 	/// \brief Write out the document
 	friend std::ostream &operator<<(std::ostream &os, const document &doc);
 
+	/// \brief Write out the document to \a w
+	friend writer &operator<<(writer &w, const document &doc);
+
 	/// \brief Read in a document
 	friend std::istream &operator>>(std::istream &is, document &doc);
 
@@ -256,12 +342,59 @@ class document final : public element_container
 	/// @brief Return the concatenation of all contained text nodes
 	std::string str() const override;
 
+	/**
+	 * @brief Parse \a is in streaming mode, calling \a handler for each element matching \a path
+	 *
+	 * Each element matching \a path is built as a complete subtree and passed
+	 * to \a handler once its end tag has been parsed. After the handler returns
+	 * the element is removed from the document again. This keeps memory use
+	 * bounded by the size of the largest record.
+	 *
+	 * While the handler runs, the element is still attached to its parent,
+	 * so namespace lookups and XPath queries work as usual. The handler may
+	 * move the element somewhere else.
+	 *
+	 * The \a path is either a simple name like "record", matching each element
+	 * with that (qualified) name that is not nested inside another match, a
+	 * relative path like "records/record" or an absolute path like "/feed/records/record".
+	 *
+	 * After parsing, the document contains the remaining content. White space
+	 * outside of the matched elements is dropped.
+	 */
+	void parse_records(std::istream &is, std::string_view path, std::function<void(element &)> handler);
+
+	/// @brief Parse \a data in streaming mode, calling \a handler for each element matching \a path
+	void parse_records(std::string_view data, std::string_view path, std::function<void(element &)> handler);
+
+	/**
+	 * @brief Parse \a data using multiple threads
+	 *
+	 * The content of the root element is split at boundaries between its
+	 * child elements. The parts are parsed in parallel, each with a copy
+	 * of the root start tag so that namespace declarations are inherited,
+	 * and the results are combined into this document in document order.
+	 *
+	 * When splitting is not safe, i.e. the input has a DOCTYPE, is UTF-16
+	 * encoded, validation is requested or the input is too small to benefit,
+	 * the data is parsed sequentially.
+	 *
+	 * Line numbers in error messages are relative to the part in which the
+	 * error was found.
+	 *
+	 * @param data The XML to parse, the data should remain valid while parsing.
+	 * @param pool The threads to use, the first part is parsed on the calling thread.
+	 */
+	void parse_parallel(std::string_view data, thread_pool &pool);
+
+	/// @brief Parse \a data using the threads of the shared thread_pool::instance(), see above
+	void parse_parallel(std::string_view data);
+
   protected:
 	/** @cond */
 	node *insert_impl(const node *p, node *n) override;
 
 	void XmlDeclHandler(encoding_type encoding, bool standalone, version_type version);
-	void StartElementHandler(const std::string &name, const std::string &uri, const parser::attr_list_type &atts);
+	void StartElementHandler(std::string_view name, std::string_view uri, const parser::attr_view_list_type &atts);
 	void EndElementHandler(const std::string &name, const std::string &uri);
 	void CharacterDataHandler(const std::string &data);
 	void ProcessingInstructionHandler(const std::string &target, const std::string &data);
@@ -275,19 +408,39 @@ class document final : public element_container
 
 	std::istream *external_entity_ref(const std::string &base, const std::string &pubid, const std::string &sysid);
 	void parse(std::istream &data);
+	void parse(std::string_view data);
+	void parse(const std::filesystem::path &file);
+
+	friend class document_builder;
+
+	template <typename Data>
+	void parse_records_imp(Data &&data, std::string_view path, std::function<void(element &)> &&handler);
+
+	bool is_record(const element &e) const;
+
+	const std::string *prefix_in_scope(std::string_view uri) const;
+
+	// The name with the prefix in scope for \a uri. The result is valid
+	// until the next call.
+	std::string_view qualified_name(std::string_view name, std::string_view uri);
 
 	std::function<std::istream *(const std::string &base, const std::string &pubid, const std::string &sysid)>
 		m_external_entity_ref_loader;
 
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
+
+	void update_indexes() const override;
 
 	std::string m_dtd_dir;
+	std::shared_ptr<dtd_cache> m_dtd_cache;
 
 	// some content information
 	doc_type m_doctype;
 	bool m_validating;
 	bool m_validating_ns = false;
 	bool m_preserve_cdata;
+	bool m_use_arena = false;
+	bool m_use_index = false;
 	bool m_has_xml_decl;
 	encoding_type m_encoding;
 	version_type m_version;
@@ -298,6 +451,8 @@ class document final : public element_container
 
 	format_info m_fmt;
 
+	parser_stats m_parser_stats;
+
 	struct notation
 	{
 		std::string m_name;
@@ -308,9 +463,29 @@ class document final : public element_container
 	element_container *m_cur = nullptr; // construction
 	cdata *m_cdata = nullptr;           // only defined in a CDATA section
 	std::vector<std::pair<std::string, std::string>> m_namespaces;
+
+	// The namespace declarations in scope during construction, with the
+	// index of the first declaration of each open element.
+	std::vector<std::pair<std::string, std::string>> m_ns_scope;
+	std::vector<size_t> m_ns_scope_marks;
+	std::string m_qname; // the prefixed names are built here, see qualified_name
 	std::vector<notation> m_notations;
 	size_t m_root_size_at_first_notation = 0; // for processing instructions that occur before a notation
 
+	// The arenas for the nodes, the first one is used when parsing, others
+	// come from the parts in parse_parallel.
+	std::vector<std::unique_ptr<std::pmr::memory_resource>> m_arenas;
+
+	// streaming mode, see parse_records
+	std::function<void(element &)> m_record_handler;
+	std::vector<std::string> m_record_path;
+	bool m_record_path_absolute = false;
+	element *m_record = nullptr;
+
+	// the indexes, see set_use_index
+	mutable std::unordered_map<std::string, element *> m_id_index;
+	mutable std::unordered_map<std::string, element_set> m_name_index;
+
 	/** @endcond */
 };
 
@@ -29,12 +29,17 @@
 /// \file
 /// the core of the mxml XML library defining the main classes in the DOM API
 
+#include "mxml/atom.hpp"
 #include "mxml/error.hpp"
 #include "mxml/version.hpp"
+#include "mxml/writer.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <compare>
+#include <memory_resource>
+#include <new>
 #include <string>
 #include <utility>
 #include <vector>
@@ -125,6 +130,13 @@ class node
   public:
 	/** @cond */
 	virtual ~node();
+
+	// Nodes are allocated from the memory resource selected for the current
+	// thread using node_resource_scope, or from the heap if there is none.
+	// Each node remembers whether it came from an arena, so it can be deleted anywhere.
+	static void *operator new(std::size_t size);
+	static void operator delete(void *p, std::size_t size);
+	static void operator delete(node *n, std::destroying_delete_t, std::size_t size);
 	/** @endcond */
 
 	/// \brief node_type to be returned by each implementation of this node class
@@ -206,13 +218,30 @@ class node
 	node *prev() { return m_prev; }                                       ///< The previous sibling
 	const node *prev() const { return m_prev; }                           ///< The previous sibling
 
+	/// \brief The position of this node in document order
+	///
+	/// Nodes are numbered in document order on demand, the first time this
+	/// is called after the tree containing this node was modified. Attributes
+	/// follow their element and precede its children.
+	std::size_t document_order() const;
+
+	/** @cond */
+	// The number assigned by the last numbering of the tree, for code that
+	// compares many nodes of a tree after calling document_order() once
+	std::size_t cached_document_order() const noexcept { return m_order; }
+	/** @endcond */
+
 	/// Compare the node with \a n
 	virtual bool equals(const node *n) const;
 
 	/// \brief low level routine for writing out XML
 	///
-	/// This method is usually called by operator<<(std::ostream&, mxml::document&)
-	virtual void write(std::ostream &os, format_info fmt) const = 0;
+	/// This method is usually called by operator<<(std::ostream&, mxml::document&),
+	/// the default implementation calls write_to using a writer for \a os
+	virtual void write(std::ostream &os, format_info fmt) const;
+
+	/// \brief low level routine for writing out XML to the buffer in \a w
+	virtual void write_to(writer &w, format_info fmt) const = 0;
 
   protected:
 	/** @cond */
@@ -221,8 +250,10 @@ class node
 	template <typename>
 	friend class node_list;
 	friend class element;
+	friend class element_container;
 
 	node()
+		: m_in_arena(s_resource != nullptr)
 	{
 		init();
 	}
@@ -268,10 +299,47 @@ class node
 	element_container *m_parent = nullptr;
 	node *m_next;
 	node *m_prev;
+	mutable std::size_t m_order : 63 = 0;
+
+	// Set for nodes allocated from an arena, their memory is released
+	// together with the arena by the document owning it.
+	std::size_t m_in_arena : 1;
+
+  private:
+	friend class node_resource_scope;
+
+	static thread_local std::pmr::memory_resource *s_resource;
 
 	/** @endcond */
 };
 
+/** @cond */
+/// Select the arena for nodes allocated on this thread, for as long as
+/// this object exists. A nullptr selects the heap. Nodes are not returned
+/// to the arena when deleted, its owner releases the memory at once.
+/// This applies to the node objects only, the std::string members of
+/// nodes allocate from the heap as usual.
+class node_resource_scope
+{
+  public:
+	explicit node_resource_scope(std::pmr::memory_resource *resource)
+		: m_saved(std::exchange(node::s_resource, resource))
+	{
+	}
+
+	node_resource_scope(const node_resource_scope &) = delete;
+	node_resource_scope &operator=(const node_resource_scope &) = delete;
+
+	~node_resource_scope()
+	{
+		node::s_resource = m_saved;
+	}
+
+  private:
+	std::pmr::memory_resource *m_saved;
+};
+/** @endcond */
+
 // --------------------------------------------------------------------
 // Basic node list is a private class, it is the base class
 // for node_list
@@ -285,7 +353,7 @@ class basic_node_list
 	{
 		constexpr node_type type() const override { return node_type::header; }
 
-		void write(std::ostream &os, format_info fmt) const override {}
+		void write_to(writer & /*w*/, format_info /*fmt*/) const override {}
 		std::string str() const override { return {}; }
 
 		friend void swap(node_list_header &a, node_list_header &b)
@@ -331,6 +399,11 @@ class basic_node_list
 
 	friend void swap(basic_node_list &a, basic_node_list &b) noexcept
 	{
+		invalidate_document_order(a.m_header->parent());
+		invalidate_document_order(b.m_header->parent());
+		invalidate_namespaces(a.m_header->parent());
+		invalidate_namespaces(b.m_header->parent());
+
 		if (a.m_header != &a.m_header_node and b.m_header != &b.m_header_node)
 			std::swap(a.m_header, b.m_header);
 		else
@@ -346,6 +419,16 @@ class basic_node_list
 	virtual node *insert_impl(const node *p, node *n);
 
 	node *erase_impl(node *n);
+
+  public:
+	// Mark the tree containing \a e as modified, its nodes will be
+	// renumbered and the indexes of a document rebuilt the next time
+	// they are needed
+	static void invalidate_document_order(element_container *e) noexcept;
+
+	// Called when the namespaces in scope of \a e or its descendants
+	// change, the cached lookups become invalid
+	static void invalidate_namespaces(const element_container *e) noexcept;
 };
 
 /** @endcond */
@@ -799,7 +882,8 @@ class element_container : public node, public node_list<element>
 	///
 	/// If you need to find other classes than xml::element, of if your XPath
 	/// contains variables, you should create a mxml::xpath object and use
-	/// its evaluate method.
+	/// its evaluate method. The compiled path is kept in the cache of
+	/// xpath::cached, so repeated calls do not parse it again.
 	element_set find(const std::string &path) const;
 
 	/// \brief return the first element that matches XPath \a path.
@@ -810,9 +894,26 @@ class element_container : public node, public node_list<element>
 	iterator find_first(const std::string &path);
 	const_iterator find_first(const std::string &path) const;
 
+	/** @cond */
+	// Number the nodes of the tree containing this element in document
+	// order, unless that was done already after the last modification
+	void update_document_order() const;
+	/** @endcond */
+
   protected:
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	friend class basic_node_list;
+
+	// Called by update_document_order on the top of the tree, after the
+	// nodes were numbered, for document to rebuild its indexes
+	virtual void update_indexes() const {}
+
+	void write_to(writer &w, format_info fmt) const override;
+	/** @endcond */
+
+  private:
+	/** @cond */
+	mutable std::atomic<bool> m_order_valid = false;
 	/** @endcond */
 };
 
@@ -867,6 +968,8 @@ class node_with_text : public node
 
   protected:
 	/** @cond */
+	friend class document; // for document::get_stats
+
 	std::string m_text;
 	/** @endcond */
 };
@@ -915,7 +1018,7 @@ class comment final : public node_with_text
 	}
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 	/** @endcond */
 };
 
@@ -989,9 +1092,11 @@ class processing_instruction final : public node_with_text
 	}
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 
   private:
+	friend class document; // for document::get_stats
+
 	std::string m_target;
 
 	/** @endcond */
@@ -1043,7 +1148,7 @@ class text final : public node_with_text
 	bool is_space() const;
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 	/** @endcond */
 };
 
@@ -1094,7 +1199,7 @@ class cdata final : public node_with_text
 	}
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 	/** @endcond */
 };
 
@@ -1120,6 +1225,16 @@ class attribute final : public node
 	{
 	}
 
+	/// @brief constructor taking ownership of the strings in \a qname and \a value
+	template <typename S>
+		requires std::is_same_v<S, std::string>
+	attribute(S &&qname, S &&value, bool id = false)
+		: m_qname(std::move(qname))
+		, m_value(std::move(value))
+		, m_id(id)
+	{
+	}
+
 	/// @brief copy constructor
 	attribute(const attribute &attr)
 		: m_qname(attr.m_qname)
@@ -1139,7 +1254,11 @@ class attribute final : public node
 	/// @brief assignment operator
 	attribute &operator=(attribute attr) noexcept
 	{
+		bool ns = is_namespace() or attr.is_namespace();
 		swap(*this, attr);
+		basic_node_list::invalidate_document_order(m_parent);
+		if (ns)
+			basic_node_list::invalidate_namespaces(m_parent);
 		return *this;
 	}
 
@@ -1169,24 +1288,44 @@ class attribute final : public node
 	}
 
 	/// @brief Get the qualified name for this attribute
-	std::string get_qname() const override { return m_qname; }
+	std::string get_qname() const override { return m_qname.str(); }
+
+	/// @brief Get the qualified name for this attribute as an interned name
+	const atom &qname_atom() const noexcept { return m_qname; }
 
 	/// @brief Set the qualified name to \a qn
-	void set_qname(std::string qn) override { m_qname = std::move(qn); }
+	void set_qname(std::string qn) override
+	{
+		bool ns = is_namespace();
+		m_qname = atom(qn);
+		basic_node_list::invalidate_document_order(m_parent);
+		if (ns or is_namespace())
+			basic_node_list::invalidate_namespaces(m_parent);
+	}
 
 	using node::set_qname;
 
+	/// @brief The name for the attribute, without prefix
+	std::string name() const override { return std::string{ m_qname.local_str() }; }
+
 	/// \brief Is this attribute an xmlns attribute?
 	bool is_namespace() const
 	{
-		return m_qname.compare(0, 5, "xmlns") == 0 and (m_qname[5] == 0 or m_qname[5] == ':');
+		auto &qn = m_qname.str();
+		return qn.compare(0, 5, "xmlns") == 0 and (qn[5] == 0 or qn[5] == ':');
 	}
 
 	/// @brief Return the value of this attribute
 	std::string value() const { return m_value; }
 
 	/// @brief Set the value of this attribute to \a v
-	void set_value(const std::string &v) { m_value = v; }
+	void set_value(const std::string &v)
+	{
+		m_value = v;
+		basic_node_list::invalidate_document_order(m_parent);
+		if (is_namespace())
+			basic_node_list::invalidate_namespaces(m_parent);
+	}
 
 	/// \brief same as value, but checks to see if this really is a namespace attribute
 	std::string uri() const;
@@ -1220,10 +1359,14 @@ class attribute final : public node
 	}
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 
   private:
-	std::string m_qname, m_value;
+	friend class element;
+	friend class document; // for document::get_stats
+
+	atom m_qname;
+	std::string m_value;
 	bool m_id;
 	/** @endcond */
 };
@@ -1267,7 +1410,7 @@ class attribute_set : public node_list<attribute>
 	{
 		for (auto i = begin(); i != end(); ++i)
 		{
-			if (i->get_qname() == key)
+			if (i->qname_atom() == key)
 				return i;
 		}
 		return end();
@@ -1294,7 +1437,7 @@ class attribute_set : public node_list<attribute>
 	{
 		bool inserted = false;
 
-		auto i = find(a.get_qname());
+		auto i = find(a.qname_atom().str());
 
 		if (i != node_list::end())
 			*i = std::move(a); // move assign value of a
@@ -1368,6 +1511,9 @@ class element final : public element_container
 		m_attributes.assign(e.m_attributes.begin(), e.m_attributes.end());
 	}
 
+	/// @brief destructor
+	~element();
+
 	/// @brief move constructor
 	element(element &&e) noexcept
 		: m_attributes(this)
@@ -1396,10 +1542,20 @@ class element final : public element_container
 	using node::set_qname;
 
 	/// @brief Return the qualified name
-	std::string get_qname() const override { return m_qname; }
+	std::string get_qname() const override { return m_qname.str(); }
+
+	/// @brief Return the qualified name as an interned name
+	const atom &qname_atom() const noexcept { return m_qname; }
 
 	/// @brief Set the qualified name to \a qn
-	void set_qname(std::string qn) override { m_qname = std::move(qn); }
+	void set_qname(std::string qn) override
+	{
+		m_qname = atom(qn);
+		invalidate_document_order(this);
+	}
+
+	/// @brief The name for the element, without prefix
+	std::string name() const override { return std::string{ m_qname.local_str() }; }
 
 	/// \brief content of a xml:lang attribute of this element, or its nearest ancestor
 	std::string lang() const override;
@@ -1428,6 +1584,9 @@ class element final : public element_container
 
 	// --------------------------------------------------------------------
 
+	/// \brief return the namespace URI for this element
+	std::string get_ns() const override;
+
 	/// \brief return the URI of the namespace for \a prefix
 	std::string namespace_for_prefix(const std::string &prefix) const override;
 
@@ -1451,6 +1610,9 @@ class element final : public element_container
 
 	/// \brief write the element to \a os
 	friend std::ostream &operator<<(std::ostream &os, const element &e);
+
+	/// \brief write the element to \a w
+	friend writer &operator<<(writer &w, const element &e);
 	// 	friend class document;
 
 	/// \brief return the concatenation of the content of all enclosed mxml::text nodes
@@ -1477,11 +1639,25 @@ class element final : public element_container
 	void flatten_text();
 
 	/** @cond */
-	void write(std::ostream &os, format_info fmt) const override;
+	void write_to(writer &w, format_info fmt) const override;
 
   private:
-	std::string m_qname;
+	friend class basic_node_list;
+
+	// The namespace declarations in scope, see node.cpp
+	struct namespace_scope;
+
+	const namespace_scope *in_scope() const;
+	void update_in_scope(namespace_scope *parent, std::size_t generation) const;
+	std::string_view uri_for_prefix(std::string_view prefix) const;
+
+	atom m_qname;
 	attribute_set m_attributes;
+
+	// Cached lookup table for the namespaces in scope, valid if
+	// m_ns_generation is the current namespace generation
+	mutable std::atomic<namespace_scope *> m_ns_scope = nullptr;
+	mutable std::atomic<std::size_t> m_ns_generation = 0;
 	/** @endcond */
 };
 
@@ -32,12 +32,15 @@
  */
 
 #include "mxml/error.hpp"
+#include "mxml/stats.hpp"
 #include "mxml/text.hpp"
 #include "mxml/version.hpp"
 
 #include <functional>
 #include <istream>
+#include <memory>
 #include <string>
+#include <string_view>
 
 namespace mxml
 {
@@ -74,6 +77,73 @@ class not_wf_exception : public exception
 	~not_wf_exception() noexcept {}
 };
 
+/** @cond */
+class dtd;
+/** @endcond */
+
+/// A parsed external DTD subset. It is immutable and can be shared
+/// between parsers, also when these run in different threads.
+using dtd_ptr = std::shared_ptr<const dtd>;
+
+/**
+ * @brief A thread-safe cache of parsed external DTD subsets
+ *
+ * A parser that is given a dtd_cache looks up the external subset
+ * referenced in the DOCTYPE declaration by its public and system ID
+ * before loading it. The system ID is resolved first, relative to the
+ * document and, for an mxml::document, the DTD directory. If it is found,
+ * the declarations are taken from the cache and the DTD is not read nor
+ * parsed again.
+ *
+ * The cache is only used for documents without an internal subset,
+ * declarations in the internal subset take precedence and may change
+ * how the external subset is parsed. Only DTDs parsed by a validating
+ * parser are stored. A public ID and resolved system ID are assumed to
+ * always refer to the same DTD, also when an external_entity_ref_handler
+ * loads it.
+ *
+ * Comments and processing instructions in a DTD taken from the cache
+ * are not reported.
+ *
+ * @code{.cpp}
+ * auto cache = std::make_shared<mxml::dtd_cache>();
+ *
+ * for (auto &message : messages)
+ * {
+ *     mxml::document doc;
+ *     doc.set_validating(true);
+ *     doc.set_dtd_cache(cache);
+ *     doc.parse(message);
+ * }
+ * @endcode
+ */
+
+class dtd_cache
+{
+  public:
+	dtd_cache();
+	~dtd_cache();
+
+	dtd_cache(const dtd_cache &) = delete;
+	dtd_cache &operator=(const dtd_cache &) = delete;
+
+	/// @brief Return the DTD stored for \a pubid and the resolved system ID \a sysid, or nullptr
+	dtd_ptr find(const std::string &pubid, const std::string &sysid) const;
+
+	/// @brief Store \a dtd for \a pubid and the resolved system ID \a sysid. If another DTD was
+	/// stored for these already, that one is kept and returned.
+	dtd_ptr insert(const std::string &pubid, const std::string &sysid, dtd_ptr dtd);
+
+	/// @brief Remove all DTDs
+	void clear();
+
+	/// @brief The number of DTDs stored
+	std::size_t size() const;
+
+  private:
+	struct dtd_cache_imp *m_impl;
+};
+
 /**
  * @brief A SAX parser
  *
@@ -98,9 +168,38 @@ class parser
 
 	using attr_list_type = std::vector<attr>;
 
+	/**
+	 * @brief Struct containing a view on a parsed attribute. The data
+	 * pointed to is owned by the parser and is only valid during the call
+	 * to the handler.
+	 */
+	struct attr_view
+	{
+		std::string_view m_ns;    ///< The namespace for this attribute
+		std::string_view m_name;  ///< The name of the attribute
+		std::string_view m_value; ///< The value of the attribute
+		bool m_id;                ///< Flag indicating the attribute is defined as type ID in its ATTLIST decl
+	};
+
+	using attr_view_list_type = std::vector<attr_view>;
+
 	/// @brief constructor taking a std::istream in \a is
+	///
+	/// If \a is reads from a file or a string, it is read in blocks of 64K
+	/// and when parsing stops early, e.g. because of an error, the stream
+	/// may be positioned beyond the point where parsing stopped. Other
+	/// streams are read a byte at a time.
 	parser(std::istream &is);
 
+	/// @brief constructor taking the XML in a contiguous block of memory in \a data.
+	/// The data is not copied and should remain valid until parse() returns.
+	/// Use std::string_view{ s.data(), s.size() } to parse e.g. a std::span<const char>
+	parser(std::string_view data);
+
+	/// @brief constructor for an incremental, or push, parser. The data is
+	/// passed in chunks using feed().
+	parser();
+
 	/// @brief destructor
 	virtual ~parser();
 
@@ -124,19 +223,78 @@ class parser
 	std::function<std::istream *(const std::string &base, const std::string &pubid, const std::string &uri)> external_entity_ref_handler;
 	std::function<void(const std::string &msg)> report_invalidation_handler;
 
+	/**
+	 * Alternative callbacks receiving std::string_view arguments. The views
+	 * point into buffers owned by the parser and are valid only for the
+	 * duration of the call. Copy the data if you need to keep it.
+	 *
+	 * These are called in addition to the callbacks above, if both are set.
+	 * Element and attribute names and values are scanned into reused
+	 * buffers, copies are only made when start_element_handler is set.
+	 */
+
+	std::function<void(std::string_view name, std::string_view uri, const attr_view_list_type &atts)> start_element_view_handler;
+	std::function<void(std::string_view name, std::string_view uri)> end_element_view_handler;
+	std::function<void(std::string_view data)> character_data_view_handler;
+	std::function<void(std::string_view target, std::string_view data)> processing_instruction_view_handler;
+	std::function<void(std::string_view data)> comment_view_handler;
+
 	/** @brief Start the actual parsing, optionally validating content and namespaces */
 	void parse(bool validate, bool validate_ns);
 
+	/** @brief Use \a cache to look up and store the external DTD subset, see dtd_cache */
+	void set_dtd_cache(std::shared_ptr<dtd_cache> cache)
+	{
+		m_dtd_cache = std::move(cache);
+	}
+
+	/**
+	 * @brief Pass the next chunk of data to a push parser
+	 *
+	 * Only available for parsers constructed with the default constructor.
+	 * The SAX events for all markup completed by \a chunk are fired on the
+	 * calling thread before feed returns. Incomplete markup at the end of a
+	 * chunk is kept until the rest arrives, character data is reported when
+	 * the markup following it is seen. Set \a last to true for the final
+	 * chunk, which may be empty.
+	 *
+	 * The validation flags \a validate and \a validate_ns are used when the
+	 * first chunk starts the parse, they are ignored afterwards.
+	 *
+	 * Parsing errors are thrown from feed. After an exception the parser
+	 * cannot be used anymore.
+	 */
+	void feed(std::string_view chunk, bool last, bool validate = false, bool validate_ns = false);
+
+	/**
+	 * @brief The counters for the input parsed so far, see parser_stats
+	 *
+	 * These are only collected when the library is built with MXML_STATS
+	 * set to 1, otherwise all counters are zero.
+	 */
+	const parser_stats &get_stats() const { return m_stats; }
+
   protected:
 	/** @cond */
 	friend struct parser_imp;
 
+	// Parse up to and including the next start_element, end_element,
+	// character_data, comment or processing_instruction event and return
+	// true, or return false when the document is complete. This is how
+	// mxml::reader drives the parser. The validation flags are used by
+	// the first call only. Comments and processing instructions in the
+	// DTD do not stop the parser.
+	bool parse_next(bool validate, bool validate_ns);
+
 	virtual void xml_decl(encoding_type encoding, bool standalone, version_type version);
 
 	virtual void doctype_decl(const std::string &root, const std::string &publicId, const std::string &uri);
 
-	virtual void start_element(const std::string &name,
-		const std::string &uri, const attr_list_type &atts);
+	// The attributes are passed as views on the buffers of the parser,
+	// the std::string versions for start_element_handler are only
+	// created when that handler is set.
+	virtual void start_element(std::string_view name,
+		std::string_view uri, const attr_view_list_type &atts);
 
 	virtual void end_element(const std::string &name, const std::string &uri);
 
@@ -162,8 +320,15 @@ class parser
 	virtual std::istream *external_entity_ref(const std::string &base,
 		const std::string &pubid, const std::string &uri);
 
+	// The location of the external DTD subset with system ID \a uri, used
+	// as key in the dtd_cache. The default resolves \a uri relative to \a base.
+	virtual std::string dtd_location(const std::string &base, const std::string &uri);
+
+	parser_stats m_stats; // declared before m_impl, which counts in it from the start
 	struct parser_imp *m_impl;
 	std::istream *m_istream;
+	struct push_state *m_push = nullptr;
+	std::shared_ptr<dtd_cache> m_dtd_cache;
 
 	/** @endcond */
 };
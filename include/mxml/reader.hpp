@@ -0,0 +1,131 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * definition of the mxml::reader class, a pull parser interface
+ */
+
+#include "mxml/parser.hpp"
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+namespace mxml
+{
+
+/**
+ * @brief A pull parser
+ *
+ * mxml::reader offers a cursor over the events in an XML document, in
+ * the style of XmlReader or StAX. Call next() to advance to the next
+ * event and use the accessors to inspect it. Use skip_subtree() to skip
+ * over the content of an element you're not interested in.
+ *
+ * @code{.cpp}
+ * mxml::reader r(file);
+ * while (r.next())
+ * {
+ *     if (r.type() == mxml::reader::event_type::start_element and r.name() == "record")
+ *         process(r);
+ *     else if (r.type() == mxml::reader::event_type::start_element)
+ *         r.skip_subtree();
+ * }
+ * @endcode
+ *
+ * Adjacent character data is reported as a single text event. The reader
+ * does not validate, namespaces are processed. Comments and processing
+ * instructions in the DTD are not reported.
+ *
+ * The parser is driven by next(), it parses just enough to find the next
+ * event. The strings returned by the accessors refer to the buffers of
+ * the parser and are valid until the next call to next() or skip_subtree().
+ */
+
+class reader
+{
+  public:
+	/// @brief The type of the current event
+	enum class event_type
+	{
+		none,                  ///< Before the first call to next()
+		start_element,         ///< A start tag
+		end_element,           ///< An end tag, also reported for empty elements
+		text,                  ///< Character data, including CDATA sections
+		comment,               ///< A comment
+		processing_instruction ///< A processing instruction
+	};
+
+	/// @brief constructor taking a std::istream in \a is
+	reader(std::istream &is);
+
+	/// @brief constructor taking the XML in \a data. The data is not copied
+	/// and should remain valid as long as the reader is in use.
+	reader(std::string_view data);
+
+	reader(const reader &) = delete;
+	reader &operator=(const reader &) = delete;
+
+	/// @brief destructor
+	~reader();
+
+	/// @brief Advance to the next event, returns false at the end of the document.
+	/// Errors in the XML are thrown as exceptions from this method.
+	bool next();
+
+	/// @brief When positioned at a start_element, skip all of its content.
+	/// The reader will then be positioned at the matching end_element.
+	void skip_subtree();
+
+	/// @brief The type of the current event
+	event_type type() const;
+
+	/// @brief The local name of the current element, or the target of a processing instruction
+	std::string_view name() const;
+
+	/// @brief The namespace URI of the current element
+	std::string_view uri() const;
+
+	/// @brief The content of a text, comment or processing_instruction event
+	std::string_view value() const;
+
+	/// @brief The attributes of the current start_element
+	const parser::attr_view_list_type &attributes() const;
+
+	/// @brief The nesting depth. The root element has depth 1, the content
+	/// directly inside an element at depth n has depth n as well.
+	int depth() const;
+
+  private:
+	/** @cond */
+	struct reader_imp *m_impl;
+	/** @endcond */
+};
+
+} // namespace mxml
@@ -32,14 +32,20 @@
  */
 
 #include "mxml/node.hpp"
+#include "mxml/reader.hpp"
+#include "mxml/writer.hpp"
 
 #include <algorithm>
+#include <array>
 #include <charconv>
+#include <deque>
+#include <iosfwd>
 #include <map>
 #include <optional>
 #include <source_location>
 #include <string>
 #include <system_error>
+#include <vector>
 
 #if __has_include(<date/date.h>)
 #include <regex>
@@ -182,6 +188,68 @@ struct value_serializer<double> : char_conv_serializer<double>
 	static std::string type_name() { return "xsd:double"; }
 };
 
+/**
+ * \brief Compile time mapping of enum values to strings
+ *
+ * Specialize this template for an enum type to have value_serializer
+ * use constant tables, instead of the map filled at runtime. The
+ * specialization should contain the type name and an array of values:
+ *
+ * \code{.cpp}
+ * template <>
+ * struct mxml::enum_values<color>
+ * {
+ *     static constexpr std::string_view name = "color";
+ *     static constexpr std::array values{
+ *         std::pair{ color::red, std::string_view{ "red" } },
+ *         std::pair{ color::green, std::string_view{ "green" } }
+ *     };
+ * };
+ * \endcode
+ */
+
+template <typename T>
+struct enum_values;
+
+/** @cond */
+
+template <typename T>
+concept has_enum_values = std::is_enum_v<T> and requires { enum_values<T>::values; };
+
+// The values of enum_values<T> sorted by value and by name, for binary search
+template <typename T>
+struct enum_table
+{
+	static constexpr auto sorted(auto less)
+	{
+		auto result = enum_values<T>::values;
+		std::sort(result.begin(), result.end(), less);
+		return result;
+	}
+
+	static constexpr auto by_value = sorted([](auto &a, auto &b)
+		{ return a.first < b.first; });
+
+	static constexpr auto by_name = sorted([](auto &a, auto &b)
+		{ return a.second < b.second; });
+
+	static constexpr std::string_view to_string(T value)
+	{
+		auto i = std::lower_bound(by_value.begin(), by_value.end(), value, [](auto &a, T b)
+			{ return a.first < b; });
+		return i != by_value.end() and i->first == value ? i->second : std::string_view{};
+	}
+
+	static constexpr T from_string(std::string_view value)
+	{
+		auto i = std::lower_bound(by_name.begin(), by_name.end(), value, [](auto &a, std::string_view b)
+			{ return a.second < b; });
+		return i != by_name.end() and i->second == value ? i->first : T{};
+	}
+};
+
+/** @endcond */
+
 /**
  * \brief value_serializer for enum values
  *
@@ -192,6 +260,9 @@ struct value_serializer<double> : char_conv_serializer<double>
  * string.
  *
  * A recent addition is the init() call to initialize the instance
+ *
+ * If enum_values is specialized for the enum, its tables are used
+ * and the instance is not needed.
  */
 
 template <typename T>
@@ -205,16 +276,19 @@ struct value_serializer<T>
 
 	value_map_type m_value_map;
 
+	// the reverse of m_value_map, for from_string
+	std::map<std::string, T, std::less<>> m_name_map;
+
 	/// \brief Initialize a new instance of value_serializer for this enum, with name and a set of name/value pairs
 	static void init(std::string_view name, std::initializer_list<value_map_value_type> values)
 	{
-		instance(name).m_value_map = value_map_type(values);
+		instance(name).assign(values);
 	}
 
 	/// \brief Initialize a new anonymous instance of value_serializer for this enum with a set of name/value pairs
 	static void init(std::initializer_list<value_map_value_type> values)
 	{
-		instance().m_value_map = value_map_type(values);
+		instance().assign(values);
 	}
 
 	static value_serializer &instance(std::string_view name = {})
@@ -227,41 +301,85 @@ struct value_serializer<T>
 
 	value_serializer &operator()(T v, std::string_view name)
 	{
-		m_value_map[v] = name;
+		auto &entry = m_value_map[v];
+
+		// from_string falls back to a search for other values with the old name
+		if (auto i = m_name_map.find(entry); i != m_name_map.end() and i->second == v)
+			m_name_map.erase(i);
+
+		entry = name;
+
+		// The first value with a name wins, as in a search through m_value_map
+		if (auto [i, inserted] = m_name_map.emplace(name, v); not inserted and v < i->second)
+			i->second = v;
+
 		return *this;
 	}
 
 	value_serializer &operator()(std::string_view name, T v)
 	{
-		m_value_map[v] = name;
-		return *this;
+		return operator()(v, name);
 	}
 
 	static std::string type_name()
 	{
-		return instance().m_type_name;
+		if constexpr (has_enum_values<T>)
+			return std::string{ enum_values<T>::name };
+		else
+			return instance().m_type_name;
 	}
 
 	static std::string to_string(T value)
 	{
-		return instance().m_value_map[value];
+		if constexpr (has_enum_values<T>)
+			return std::string{ enum_table<T>::to_string(value) };
+		else
+			return instance().m_value_map[value];
 	}
 
 	static T from_string(std::string_view value)
 	{
-		T result = {};
-		for (auto &t : instance().m_value_map)
-			if (t.second == value)
+		if constexpr (has_enum_values<T>)
+			return enum_table<T>::from_string(value);
+		else
+		{
+			auto &self = instance();
+
+			if (auto i = self.m_name_map.find(value); i != self.m_name_map.end())
+				return i->second;
+
+			// m_value_map might have been changed directly
+			for (auto &t : self.m_value_map)
 			{
-				result = t.first;
-				break;
+				if (t.second == value)
+					return t.first;
 			}
-		return result;
+
+			return T{};
+		}
 	}
 
 	static bool empty()
 	{
-		return instance().m_value_map.empty();
+		if constexpr (has_enum_values<T>)
+			return enum_values<T>::values.empty();
+		else
+			return instance().m_value_map.empty();
+	}
+
+  private:
+	void assign(std::initializer_list<value_map_value_type> values)
+	{
+		m_value_map = value_map_type(values);
+		update_name_map();
+	}
+
+	// The first value with a name wins, as in a search through m_value_map
+	void update_name_map()
+	{
+		m_name_map.clear();
+		for (auto &[v, name] : m_value_map)
+			m_name_map.emplace(name, v);
 	}
 };
 
@@ -449,9 +567,14 @@ inline constexpr bool is_serializable_array_type_v = is_serializable_array_type<
 
 struct serializer;
 struct deserializer;
+class stream_serializer;
+class stream_deserializer;
 
 /**
  * @brief base struct to capture named values in a structure for serializing
+ *
+ * The name is not copied, name value pairs are temporary objects
+ * created in a serialize member and the name usually is a literal.
  */
 template <typename T>
 class name_value_pair
@@ -471,14 +594,14 @@ class name_value_pair
 	name_value_pair &operator=(name_value_pair &&) = default;
 	/** @endcond */
 
-	const std::string &name() const { return m_name; }
+	std::string_view name() const { return m_name; }
 
 	// T &value() { return m_value; }
 	T &value() const { return m_value; }
 
 	/** @cond */
   private:
-	std::string m_name;
+	std::string_view m_name;
 	T &m_value;
 	/** @endcond */
 };
@@ -611,6 +734,195 @@ struct deserializer
 	/** @endcond */
 };
 
+/**
+ * @brief stream_serializer writes the XML for serialized data directly
+ * to an std::ostream or std::string, without creating a tree of elements
+ * first. It is an Archive class like serializer and uses the same
+ * serialize members and name/value pairs.
+ *
+ * Since the output is written as it is produced, the attributes of an
+ * element have to be serialized before its child elements and content.
+ * The output is buffered, it is flushed when the stream_serializer is
+ * destroyed or by calling flush().
+ */
+
+class stream_serializer
+{
+  public:
+	/// @brief constructor, write to \a os
+	stream_serializer(std::ostream &os);
+
+	/// @brief constructor, append to \a s
+	stream_serializer(std::string &s);
+
+	~stream_serializer();
+
+	stream_serializer(const stream_serializer &) = delete;
+	stream_serializer &operator=(const stream_serializer &) = delete;
+
+	/// @brief Write out the buffered output, if writing to an std::ostream
+	void flush();
+
+	/** @cond */
+
+	template <typename T>
+	stream_serializer &operator&(const element_nvp<T> &rhs)
+	{
+		return serialize_element(rhs.name(), rhs.value());
+	}
+
+	template <typename T>
+	stream_serializer &operator&(const attribute_nvp<T> &rhs)
+	{
+		return serialize_attribute(rhs.name(), rhs.value());
+	}
+
+	template <typename T>
+	stream_serializer &serialize_element(const T &data);
+
+	template <typename T>
+	stream_serializer &serialize_element(std::string_view name, const T &data);
+
+	template <typename T>
+	stream_serializer &serialize_attribute(std::string_view name, const T &data);
+
+	// The low level interface, names are written as is, text and
+	// attribute values are escaped
+
+	void start_element(std::string_view name);
+	void end_element();
+	void write_attribute(std::string_view name, std::string_view value);
+	void write_content(std::string_view text);
+
+	/** @endcond */
+
+  private:
+	template <typename T>
+	static constexpr bool is_container_v =
+		std::is_array_v<T> or is_serializable_array_type_v<T, stream_serializer>;
+
+	template <typename T>
+	void write_value(std::string_view name, const T &value);
+
+	void close_start_tag();
+
+	writer m_writer;
+
+	// the names of the open elements, stored one after the other
+	std::string m_names;
+	std::vector<std::size_t> m_name_offsets;
+
+	bool m_start_tag_open = false;
+};
+
+/**
+ * @brief stream_deserializer reads serialized data directly from the
+ * events of an mxml::reader, without a document in memory. It is an
+ * Archive class like deserializer and uses the same serialize members
+ * and name/value pairs.
+ *
+ * The element members of a type are looked up by name for each child
+ * element, unknown elements are skipped. Members named "." are not
+ * supported. The names passed to the name/value pairs are not copied
+ * and should remain valid while the object is read, string literals do.
+ *
+ * @code{.cpp}
+ * mxml::reader r(file);
+ * mxml::stream_deserializer dsr(r);
+ *
+ * record rec;
+ * while (dsr.deserialize_element("record", rec))
+ *     process(rec);
+ * @endcode
+ */
+
+class stream_deserializer
+{
+  public:
+	/// @brief constructor, read from \a r
+	stream_deserializer(reader &r)
+		: m_reader(r)
+	{
+	}
+
+	stream_deserializer(const stream_deserializer &) = delete;
+	stream_deserializer &operator=(const stream_deserializer &) = delete;
+
+	/// @brief Advance the reader to the next element named \a name and
+	/// read it into \a value. Returns false at the end of the document.
+	template <typename T>
+	bool deserialize_element(std::string_view name, T &value);
+
+	/** @cond */
+
+	template <typename T>
+	stream_deserializer &operator&(const element_nvp<T> &rhs);
+
+	template <typename T>
+	stream_deserializer &operator&(const attribute_nvp<T> &rhs);
+
+	/** @endcond */
+
+  private:
+	// Reads the element the reader is positioned on into the object at
+	// \a value. The index is the number of elements with the same name
+	// read before, for arrays.
+	using member_reader = void (*)(stream_deserializer &, void *value, std::size_t index);
+
+	struct member
+	{
+		std::string_view m_name;
+		member_reader m_read;
+		void *m_value;
+		std::size_t m_count;
+	};
+
+	// The element members of an object being read. The frames are
+	// kept for reuse, deque because deeper frames are added while a
+	// reference to the current one is in use.
+	struct frame
+	{
+		std::vector<member> m_members;
+		std::size_t m_size = 0;
+		const parser::attr_view_list_type *m_attributes = nullptr;
+	};
+
+	// The member names of a type sorted, for binary search
+	class member_index
+	{
+	  public:
+		member_index(const frame &f);
+
+		// Returns the index of the member named \a name in \a f, or
+		// f.m_size if there is none
+		std::size_t find(const frame &f, std::string_view name) const;
+
+	  private:
+		std::vector<std::pair<std::string, std::size_t>> m_index;
+	};
+
+	template <typename T>
+	static const member_index &index_for(const frame &f)
+	{
+		static const member_index s_index(f);
+		return s_index;
+	}
+
+	template <typename T>
+	static void read_member(stream_deserializer &d, void *value, std::size_t index);
+
+	template <typename T>
+	void read_object(T &value);
+
+	// The concatenated text in the current element, child elements are skipped
+	const std::string &read_text();
+
+	reader &m_reader;
+	std::deque<frame> m_frames;
+	std::size_t m_depth = 0;
+	std::string m_text;
+};
+
 // --------------------------------------------------------------------
 
 /**
@@ -997,6 +1309,232 @@ deserializer &deserializer::deserialize_attribute(std::string_view name, T &valu
 	return *this;
 }
 
+template <typename T>
+stream_serializer &stream_serializer::serialize_element(const T &value)
+{
+	return serialize_element("", value);
+}
+
+template <typename T>
+stream_serializer &stream_serializer::serialize_element(std::string_view name, const T &value)
+{
+	using value_type = std::remove_cvref_t<T>;
+
+	if constexpr (is_detected_v<serialize_value_t, value_type>)
+		write_value(name, value);
+	else if constexpr (is_container_v<value_type>)
+	{
+		for (auto &v : value)
+			serialize_element(name, v);
+	}
+	else if constexpr (has_serialize_v<value_type, stream_serializer>)
+	{
+		if (name.empty() or name == ".")
+			const_cast<value_type &>(value).serialize(*this, 0UL);
+		else
+		{
+			start_element(name);
+			const_cast<value_type &>(value).serialize(*this, 0UL);
+			end_element();
+		}
+	}
+	else if constexpr (requires { value.has_value(); *value; })
+	{
+		if (value.has_value())
+			serialize_element(name, *value);
+	}
+	else
+		static_assert(not std::is_same_v<value_type, value_type>, "type cannot be serialized");
+
+	return *this;
+}
+
+template <typename T>
+stream_serializer &stream_serializer::serialize_attribute(std::string_view name, const T &value)
+{
+	using value_type = std::remove_cvref_t<T>;
+
+	if constexpr (std::is_same_v<value_type, std::string>)
+		write_attribute(name, value);
+	else if constexpr (has_enum_values<value_type>)
+		write_attribute(name, enum_table<value_type>::to_string(value));
+	else if constexpr (std::is_arithmetic_v<value_type> and not std::is_same_v<value_type, bool>)
+	{
+		char b[32];
+		if (auto r = std::to_chars(b, b + sizeof(b), value); r.ec == std::errc{})
+			write_attribute(name, { b, r.ptr });
+		else
+			write_attribute(name, type_serializer<value_type>::serialize_value(value));
+	}
+	else
+		write_attribute(name, type_serializer<value_type>::serialize_value(value));
+
+	return *this;
+}
+
+template <typename T>
+void stream_serializer::write_value(std::string_view name, const T &value)
+{
+	bool wrap = not(name.empty() or name == ".");
+
+	// like serializer, an empty value still results in a start and end tag
+	if (wrap)
+	{
+		start_element(name);
+		close_start_tag();
+	}
+
+	// numbers and strings are written without creating a string first
+	if constexpr (std::is_same_v<T, std::string>)
+		write_content(value);
+	else if constexpr (has_enum_values<T>)
+		write_content(enum_table<T>::to_string(value));
+	else if constexpr (std::is_arithmetic_v<T> and not std::is_same_v<T, bool>)
+	{
+		char b[32];
+		if (auto r = std::to_chars(b, b + sizeof(b), value); r.ec == std::errc{})
+			write_content({ b, r.ptr });
+		else
+			write_content(type_serializer<T>::serialize_value(value));
+	}
+	else
+		write_content(type_serializer<T>::serialize_value(value));
+
+	if (wrap)
+		end_element();
+}
+
+template <typename T>
+bool stream_deserializer::deserialize_element(std::string_view name, T &value)
+{
+	using value_type = std::remove_cvref_t<T>;
+
+	while (m_reader.next())
+	{
+		if (m_reader.type() == reader::event_type::start_element and m_reader.name() == name)
+		{
+			read_member<value_type>(*this, &value, 0);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template <typename T>
+stream_deserializer &stream_deserializer::operator&(const element_nvp<T> &rhs)
+{
+	auto &f = m_frames[m_depth - 1];
+
+	if (f.m_size == f.m_members.size())
+		f.m_members.emplace_back();
+
+	auto &m = f.m_members[f.m_size++];
+	m.m_name = rhs.name();
+	m.m_read = &read_member<std::remove_cvref_t<T>>;
+	m.m_value = &rhs.value();
+	m.m_count = 0;
+
+	return *this;
+}
+
+template <typename T>
+stream_deserializer &stream_deserializer::operator&(const attribute_nvp<T> &rhs)
+{
+	using value_type = std::remove_cvref_t<T>;
+
+	// like deserializer, empty attributes leave the value untouched
+	for (auto &a : *m_frames[m_depth - 1].m_attributes)
+	{
+		if (a.m_name == rhs.name())
+		{
+			if (not a.m_value.empty())
+				rhs.value() = type_serializer<value_type>::deserialize_value(a.m_value);
+			break;
+		}
+	}
+
+	return *this;
+}
+
+template <typename T>
+void stream_deserializer::read_member(stream_deserializer &d, void *value, std::size_t index)
+{
+	auto &v = *static_cast<T *>(value);
+
+	if constexpr (is_detected_v<serialize_value_t, T>)
+		v = type_serializer<T>::deserialize_value(d.read_text());
+	else if constexpr (std::is_array_v<T> or requires { std::tuple_size<T>::value; })
+	{
+		// fixed size arrays, extra elements are ignored
+		if (index < std::size(v))
+			read_member<std::remove_cvref_t<decltype(v[0])>>(d, &v[index], 0);
+		else
+			d.m_reader.skip_subtree();
+	}
+	else if constexpr (is_serializable_array_type_v<T, stream_deserializer>)
+	{
+		v.emplace_back();
+		read_member<typename T::value_type>(d, &v.back(), 0);
+	}
+	else if constexpr (has_serialize_v<T, stream_deserializer>)
+		d.read_object(v);
+	else if constexpr (requires { v.emplace(); *v; })
+	{
+		v.emplace();
+		read_member<std::remove_cvref_t<decltype(*v)>>(d, &*v, 0);
+	}
+	else
+		static_assert(not std::is_same_v<T, T>, "type cannot be deserialized");
+}
+
+template <typename T>
+void stream_deserializer::read_object(T &value)
+{
+	value = T();
+
+	if (m_frames.size() == m_depth)
+		m_frames.emplace_back();
+
+	auto &f = m_frames[m_depth++];
+	f.m_size = 0;
+	f.m_attributes = &m_reader.attributes();
+
+	// collects the element members, the attributes are read right away
+	value.serialize(*this, 0UL);
+
+	auto &index = index_for<T>(f);
+	std::size_t ix = f.m_size; // the member read last
+
+	while (m_reader.next())
+	{
+		auto type = m_reader.type();
+
+		if (type == reader::event_type::end_element)
+			break;
+
+		if (type != reader::event_type::start_element)
+			continue;
+
+		// The elements usually follow the order of the members, or repeat for arrays
+		auto name = m_reader.name();
+		if (ix + 1 < f.m_size and f.m_members[ix + 1].m_name == name)
+			++ix;
+		else if (ix >= f.m_size or f.m_members[ix].m_name != name)
+			ix = index.find(f, name);
+
+		if (ix < f.m_size)
+		{
+			auto &m = f.m_members[ix];
+			m.m_read(*this, m.m_value, m.m_count++);
+		}
+		else
+			m_reader.skip_subtree();
+	}
+
+	--m_depth;
+}
+
 /** @endcond */
 
 // --------------------------------------------------------------------
@@ -1025,6 +1563,18 @@ void to_xml(mxml::element_container &e, std::string_view name, const T &value)
 	sr.serialize_element(name, value);
 }
 
+/**
+ * @brief Write out \a value as XML to \a os, using \a name as name
+ * for the element to create. No document is created in between.
+ */
+
+template <typename T>
+void to_xml(std::ostream &os, std::string_view name, const T &value)
+{
+	stream_serializer sr(os);
+	sr.serialize_element(name, value);
+}
+
 /**
  * @brief Read in \a value from the XML in document or element \a e
  */
@@ -1048,4 +1598,17 @@ void from_xml(const mxml::element_container &e, std::string_view name, T &value)
 	dsr.deserialize_element(name, value);
 }
 
+/**
+ * @brief Read in \a value from the first element named \a name in the
+ * XML in \a is. No document is created in between.
+ */
+
+template <typename T>
+void from_xml(std::istream &is, std::string_view name, T &value)
+{
+	reader r(is);
+	stream_deserializer dsr(r);
+	dsr.deserialize_element(name, value);
+}
+
 } // namespace mxml
@@ -0,0 +1,146 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * Counters describing the work done by the parser, the size of a document
+ * and the evaluation of an xpath.
+ *
+ * The parser counters and the xpath profile are only collected when the
+ * library is built with MXML_STATS defined to 1, the CMake option
+ * MXML_ENABLE_STATS does that. Otherwise the code collecting them is not
+ * compiled in and the counters remain zero. The layout of the structs
+ * does not depend on this setting.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef MXML_STATS
+/// Set to 1 to have the parser and xpath collect statistics
+#define MXML_STATS 0
+#endif
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+
+/**
+ * @brief Counters for a single run of the parser, see parser::get_stats
+ */
+
+struct parser_stats
+{
+	std::size_t bytes_read = 0;        ///< Bytes read from the input, the document and external entities
+	std::size_t tokens = 0;            ///< Tokens scanned, markup and content
+	std::size_t elements = 0;          ///< Elements parsed
+	std::size_t attributes = 0;        ///< Attributes specified, defaulted attributes are not counted
+	std::size_t entity_expansions = 0; ///< References to general and parameter entities that were expanded
+	std::size_t max_depth = 0;         ///< The deepest nesting of elements, the root element is at depth 1
+	std::size_t allocations = 0;       ///< Input sources and attribute buffers allocated by the parser
+
+	/// Time spent checking content against the content models in the DTD
+	std::chrono::nanoseconds validation_time{ 0 };
+};
+
+// --------------------------------------------------------------------
+
+/**
+ * @brief The number of nodes in a document and an estimate of the memory
+ * they use, see document::get_stats
+ */
+
+struct document_stats
+{
+	std::size_t elements = 0;                ///< Element nodes
+	std::size_t attributes = 0;              ///< Attributes, including namespace declarations
+	std::size_t texts = 0;                   ///< Text nodes
+	std::size_t cdata_sections = 0;          ///< CDATA sections
+	std::size_t comments = 0;                ///< Comments
+	std::size_t processing_instructions = 0; ///< Processing instructions
+
+	/// Approximate number of bytes used by the nodes and their text. Shared
+	/// data like interned names and the overhead of the allocator are not
+	/// included.
+	std::size_t memory = 0;
+};
+
+// --------------------------------------------------------------------
+
+/**
+ * @brief Per step counters for the evaluation of an xpath, see xpath::evaluate
+ *
+ * A profile can be passed to several evaluations, the counters add up.
+ *
+ * @code{.cpp}
+ * mxml::xpath_profile profile;
+ * auto books = mxml::xpath("//book[author='Tolkien']").evaluate<mxml::element>(doc, profile);
+ *
+ * for (auto &step : profile.steps)
+ *     std::cout << step.expression << ": " << step.nodes_visited << " visited, "
+ *               << step.max_node_set_size << " at most" << std::endl;
+ * @endcode
+ */
+
+struct xpath_profile
+{
+	/// The counters for one location step or predicate
+	struct step
+	{
+		std::string expression;            ///< The step, like child::book, or the predicate, like child::book[...]
+		std::size_t evaluations = 0;       ///< The number of times it was evaluated, once for each context node
+		std::size_t nodes_visited = 0;     ///< Nodes tested, along the axis for a step, those filtered for a predicate
+		std::size_t nodes_selected = 0;    ///< Total size of the resulting intermediate node-sets
+		std::size_t max_node_set_size = 0; ///< Size of the largest intermediate node-set
+	};
+
+	/// The steps, in the order in which their first evaluation finished
+	std::vector<step> steps;
+
+	/// @brief Reset all counters
+	void clear()
+	{
+		steps.clear();
+		m_index.clear();
+	}
+
+  private:
+	/** @cond */
+	friend struct expression_context;
+
+	// The expressions are kept alive, so their address is not reused
+	std::unordered_map<std::shared_ptr<const void>, std::size_t> m_index;
+	/** @endcond */
+};
+
+} // namespace mxml
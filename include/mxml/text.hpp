@@ -32,6 +32,7 @@
  */
 
 #include <string>
+#include <string_view>
 
 namespace mxml
 {
@@ -67,6 +68,9 @@ char32_t pop_back_char(std::string &s);
 /// \brief return the first unicode and advance the pointer @a ptr from a string
 char32_t pop_front_char(std::string::const_iterator &ptr, std::string::const_iterator end);
 
+/// \brief return the first unicode and advance the pointer @a ptr from a string_view
+char32_t pop_front_char(std::string_view::const_iterator &ptr, std::string_view::const_iterator end);
+
 /// \brief A simple implementation of trim, removing white space from start and end of \a s
 void trim(std::string &s);
 
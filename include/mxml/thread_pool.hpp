@@ -0,0 +1,86 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * definition of the mxml::thread_pool class, used for parallel parsing
+ * and XPath evaluation
+ */
+
+#include <cstddef>
+#include <functional>
+
+namespace mxml
+{
+
+/**
+ * @brief A fixed set of worker threads
+ *
+ * document::parse_parallel and xpath::evaluate_parallel split their work
+ * in tasks that are run by a thread_pool. Pass the same pool to these
+ * calls to avoid starting threads over and over, or use the one returned
+ * by thread_pool::instance().
+ *
+ * The thread calling run() takes part in the work, a pool of size n
+ * therefore starts n - 1 threads. Calls to run() may be nested and the
+ * pool can be used from several threads at once.
+ */
+
+class thread_pool
+{
+  public:
+	/// @brief constructor for a pool running tasks on \a threads threads,
+	/// std::thread::hardware_concurrency() if zero.
+	explicit thread_pool(unsigned threads = 0);
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	/// @brief destructor, waits for the worker threads to end
+	~thread_pool();
+
+	/// @brief The number of threads running tasks, including the caller of run()
+	unsigned size() const;
+
+	/// @brief Call \a f(i) for each i in [0, \a n) and return when all calls
+	/// are done. f(0) is called on the calling thread, the others on any of
+	/// the threads of the pool. The first exception thrown by \a f is
+	/// rethrown after all calls are done.
+	void run(std::size_t n, const std::function<void(std::size_t)> &f);
+
+	/// @brief The pool shared by calls that are not given one, it is
+	/// created on first use with one thread per core.
+	static thread_pool &instance();
+
+  private:
+	/** @cond */
+	struct thread_pool_imp *m_impl;
+	/** @endcond */
+};
+
+} // namespace mxml
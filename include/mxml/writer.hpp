@@ -0,0 +1,137 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * \file
+ * definition of the mxml::writer class, buffered output of XML
+ */
+
+#include "mxml/version.hpp"
+
+#include <iosfwd>
+#include <string>
+#include <string_view>
+
+namespace mxml
+{
+
+/**
+ * @brief Buffered output for writing XML
+ *
+ * The writer collects output in a buffer and writes it to an std::ostream
+ * or a file descriptor in large blocks, or appends it to an std::string.
+ * This is what the nodes use to write themselves, node::write and the
+ * operator<< for elements and documents create one for the std::ostream.
+ * Elements and documents can also be written to a writer directly.
+ *
+ * Text written with write_escaped is scanned for characters that need
+ * escaping, runs of characters that do not are copied in one go.
+ *
+ * @code{.cpp}
+ * mxml::writer w(fd);
+ * w << doc;
+ * @endcode
+ */
+
+class writer
+{
+  public:
+	/// @brief constructor, write to \a os
+	explicit writer(std::ostream &os);
+
+	/// @brief constructor, append to \a s
+	explicit writer(std::string &s);
+
+	/// @brief constructor, write to the file descriptor \a fd, which is not closed
+	explicit writer(int fd);
+
+	writer(const writer &) = delete;
+	writer &operator=(const writer &) = delete;
+
+	/// @brief destructor, flushes the output
+	~writer();
+
+	/// @brief Write out the buffered output, if not writing to an std::string
+	void flush();
+
+	/// @brief Write character \a c
+	void put(char c)
+	{
+		m_out.push_back(c);
+	}
+
+	/// @brief Write \a s as is
+	void write(std::string_view s)
+	{
+		m_out.append(s);
+		if (m_out.length() >= kFlushSize and &m_out == &m_buffer)
+			flush();
+	}
+
+	/// @brief Write \a n times the character \a c, for indentation
+	void fill(char c, std::size_t n)
+	{
+		m_out.append(n, c);
+	}
+
+	/// @brief Write the number \a n
+	void write(unsigned long long n);
+
+	/// @brief Write \a s, replacing the characters that cannot appear as
+	/// is in XML content or attribute values by an entity or character
+	/// reference. The characters &, < and > are always escaped, a double
+	/// quote if \a escape_quot is true and tabs, carriage returns and
+	/// newlines if \a escape_white_space is true. Characters that are not
+	/// valid in XML version \a version are written as character references.
+	void write_escaped(std::string_view s, bool escape_white_space = false, bool escape_quot = true,
+		version_type version = { 1, 0 });
+
+	/** @cond */
+	writer &operator<<(std::string_view s)
+	{
+		write(s);
+		return *this;
+	}
+
+	writer &operator<<(char c)
+	{
+		put(c);
+		return *this;
+	}
+	/** @endcond */
+
+  private:
+	static constexpr std::size_t kFlushSize = 64 * 1024;
+
+	std::ostream *m_os = nullptr;
+	int m_fd = -1;
+	std::string m_buffer;
+	std::string &m_out;
+};
+
+} // namespace mxml
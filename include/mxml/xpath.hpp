@@ -32,7 +32,10 @@
  */
 
 #include "mxml/node.hpp"
+#include "mxml/stats.hpp"
+#include "mxml/thread_pool.hpp"
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -40,6 +43,8 @@
 namespace mxml
 {
 
+class compact_node;
+
 // --------------------------------------------------------------------
 /// XPath's can contain variables. And variables can contain all kinds of data
 /// like strings, numbers and even node_sets. If you want to use variables,
@@ -101,7 +106,12 @@ class context final
 
 /**
  * @brief Class encapsulating an XPath
- * 
+ *
+ * A compiled xpath is immutable. The same xpath object, or copies of it,
+ * can be evaluated concurrently from multiple threads, against the same
+ * or different documents, as long as none of these documents is being
+ * modified at the same time. Each thread should use its own context
+ * object, copies of a context share their variables.
  */
 
 class xpath final
@@ -110,6 +120,11 @@ class xpath final
 	/// @brief constructor taking a UTF-8 encoded xpath in \a path
 	xpath(const std::string &path);
 
+	/// @brief Return the compiled xpath for \a path from a process wide
+	/// cache, compiling it on first use. The least recently used entries
+	/// are dropped when the cache is full. Safe to call from multiple threads.
+	static xpath cached(const std::string &path);
+
 	/// @brief copy constructor
 	xpath(const xpath &rhs)
 		: m_impl(rhs.m_impl)
@@ -139,6 +154,64 @@ class xpath final
 	template <typename T>
 	std::vector<T *> evaluate(const node &root, const context &ctxt = {}) const;
 
+	/**
+	 * @brief Evaluate an XPath like evaluate() does, adding the counters for
+	 * each of its steps and predicates to @a profile, see xpath_profile.
+	 * The profile is only filled in when the library is built with
+	 * MXML_STATS set to 1.
+	 * Use @a ctxt to provide values for variables.
+	 */
+	template <typename T>
+	std::vector<T *> evaluate(const node &root, xpath_profile &profile, const context &ctxt = {}) const;
+
+	/**
+	 * @brief Evaluate an XPath like evaluate() does, using the threads of
+	 * @a pool. Descendant searches are split into subtrees and the steps
+	 * of a path and its predicates are evaluated for groups of context
+	 * nodes, in parallel. The result is the same as that of evaluate(),
+	 * but for large trees only it is worth the overhead. The tree should
+	 * not be modified during the call.
+	 * Use @a ctxt to provide values for variables.
+	 */
+	template <typename T>
+	std::vector<T *> evaluate_parallel(const node &root, thread_pool &pool, const context &ctxt = {}) const;
+
+	/**
+	 * @brief Evaluate an XPath in parallel as above, using the shared
+	 * thread_pool::instance().
+	 */
+	template <typename T>
+	std::vector<T *> evaluate_parallel(const node &root, const context &ctxt = {}) const
+	{
+		return evaluate_parallel<T>(root, thread_pool::instance(), ctxt);
+	}
+
+	/**
+	 * @brief Evaluate an XPath over a compact_document, using @a root as
+	 * context node. Returns the nodes, including attributes and text, in
+	 * document order. The result is the same as that of evaluate() for
+	 * the document the compact_document was made from.
+	 * Use @a ctxt to provide values for variables.
+	 */
+	std::vector<compact_node> evaluate(const compact_node &root, const context &ctxt = {}) const;
+
+	/**
+	 * @brief Call @a f for each node matching this XPath, in document order,
+	 * until @a f returns false. Where possible the nodes are passed on while
+	 * the tree is searched, so stopping early saves the rest of the search.
+	 * Use @a ctxt to provide values for variables.
+	 */
+	void for_each(const node &root, const std::function<bool(node *)> &f, const context &ctxt = {}) const;
+
+	/**
+	 * @brief Return the first node in document order matching this XPath,
+	 * or nullptr if there is none. For T is element, only elements are
+	 * taken into account.
+	 * Use @a ctxt to provide values for variables.
+	 */
+	template <typename T>
+	T *first(const node &root, const context &ctxt = {}) const;
+
 	/**
 	 * @brief Returns true if the \a n node matches the XPath
 	 * Use @a ctxt to provide values for variables.
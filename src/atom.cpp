@@ -0,0 +1,161 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/atom.hpp"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace mxml
+{
+
+const std::string atom::s_empty;
+
+// --------------------------------------------------------------------
+// The name table. Entries are never removed, the table itself is never
+// destroyed so that nodes in static objects can still be used at exit.
+
+class atom_table
+{
+  public:
+	static atom_table &instance()
+	{
+		static atom_table *s_instance = new atom_table;
+		return *s_instance;
+	}
+
+	const atom_entry *intern(std::string_view name);
+
+  private:
+	// Limits for the table, names beyond these are not interned
+	static constexpr size_t kMaxEntries = 1 << 16, kMaxNameLength = 256;
+
+	const atom_entry *lookup(std::string_view name);
+
+	std::shared_mutex m_mutex;
+	std::deque<atom_entry> m_entries;
+	std::unordered_map<std::string_view, const atom_entry *> m_index;
+	bool m_full = false;
+};
+
+const atom_entry *atom_table::lookup(std::string_view name)
+{
+	std::shared_lock lock(m_mutex);
+
+	auto i = m_index.find(name);
+	return i == m_index.end() ? nullptr : i->second;
+}
+
+const atom_entry *atom_table::intern(std::string_view name)
+{
+	// A small per thread cache avoids taking the lock for the most
+	// common names. Since entries are never removed this is safe.
+	struct cache_entry
+	{
+		size_t m_hash;
+		const atom_entry *m_entry;
+	};
+
+	static thread_local cache_entry s_cache[64] = {};
+
+	auto hash = std::hash<std::string_view>{}(name);
+	auto &c = s_cache[hash % 64];
+
+	if (c.m_entry != nullptr and c.m_hash == hash and c.m_entry->m_name == name)
+		return c.m_entry;
+
+	auto result = lookup(name);
+
+	if (result == nullptr)
+	{
+		std::unique_lock lock(m_mutex);
+
+		if (auto i = m_index.find(name); i != m_index.end())
+			result = i->second;
+		else if (m_full or name.length() > kMaxNameLength)
+			return nullptr;
+		else
+		{
+			// The entry for the local part of a qname is added first
+			const atom_entry *local = nullptr;
+
+			if (auto colon = name.find(':'); colon != std::string_view::npos)
+			{
+				auto local_name = name.substr(colon + 1);
+
+				if (auto i = m_index.find(local_name); i != m_index.end())
+					local = i->second;
+				else if (not local_name.empty())
+				{
+					auto &e = m_entries.emplace_back(std::string{ local_name }, nullptr, true);
+					e.m_local = &e;
+					m_index.emplace(e.m_name, &e);
+					local = &e;
+				}
+			}
+
+			auto &e = m_entries.emplace_back(std::string{ name }, local, true);
+			if (local == nullptr and name.find(':') == std::string_view::npos)
+				e.m_local = &e;
+			m_index.emplace(e.m_name, &e);
+
+			m_full = m_entries.size() >= kMaxEntries;
+
+			result = &e;
+		}
+	}
+
+	c = { hash, result };
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+namespace
+{
+	std::atomic<bool> s_interning = false;
+} // namespace
+
+void atom::set_interning(bool enable)
+{
+	s_interning.store(enable, std::memory_order_relaxed);
+}
+
+atom::atom(std::string_view name)
+{
+	if (not name.empty())
+	{
+		if (s_interning.load(std::memory_order_relaxed))
+			m_entry = atom_table::instance().intern(name);
+		if (m_entry == nullptr)
+			m_entry = new atom_entry{ std::string{ name }, nullptr, false };
+	}
+}
+
+} // namespace mxml
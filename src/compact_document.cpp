@@ -0,0 +1,691 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/compact_document.hpp"
+#include "mxml/parser.hpp"
+#include "mxml/xpath.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+
+node_type compact_node::type() const
+{
+	return m_attribute != 0 ? node_type::attribute : m_doc->m_nodes[m_index].m_type;
+}
+
+std::string_view compact_node::get_qname() const
+{
+	if (m_attribute != 0)
+		return m_doc->name(m_doc->m_attributes[m_attribute - 1].m_name);
+	return m_doc->name(m_doc->m_nodes[m_index].m_name);
+}
+
+std::string_view compact_node::name() const
+{
+	if (m_attribute != 0)
+		return m_doc->name(m_doc->m_local_names[m_doc->m_attributes[m_attribute - 1].m_name]);
+	return m_doc->name(m_doc->m_local_names[m_doc->m_nodes[m_index].m_name]);
+}
+
+std::string_view compact_node::get_ns() const
+{
+	auto qname = get_qname();
+	auto colon = qname.find(':');
+	return namespace_for_prefix(colon == std::string_view::npos ? std::string_view{} : qname.substr(0, colon));
+}
+
+std::string_view compact_node::namespace_for_prefix(std::string_view prefix) const
+{
+	// Same rules as element::namespace_for_prefix
+	for (auto i = m_index; i != npos; i = m_doc->m_nodes[i].m_parent)
+	{
+		auto &e = m_doc->m_nodes[i];
+		if (e.m_type != node_type::element)
+			continue;
+
+		for (auto a = e.m_first_attribute; a < e.m_first_attribute + e.m_attribute_count; ++a)
+		{
+			auto &attr = m_doc->m_attributes[a];
+			auto qn = m_doc->name(attr.m_name);
+
+			if (not qn.starts_with("xmlns"))
+				continue;
+
+			if (qn.length() == 5 ? prefix.empty() : (qn[5] == ':' and qn.substr(6) == prefix))
+			{
+				if (attr.m_value.m_length != 0)
+					return m_doc->view(attr.m_value);
+				break;
+			}
+		}
+	}
+
+	return {};
+}
+
+std::string_view compact_node::text() const
+{
+	if (m_attribute != 0)
+		return m_doc->view(m_doc->m_attributes[m_attribute - 1].m_value);
+	return m_doc->view(m_doc->m_nodes[m_index].m_text);
+}
+
+std::string compact_node::str() const
+{
+	auto &e = m_doc->m_nodes[m_index];
+
+	if (m_attribute != 0 or (e.m_type != node_type::element and e.m_type != node_type::document))
+		return std::string{ text() };
+
+	std::string result;
+	for (auto i = m_index + 1; i < e.m_end; ++i)
+	{
+		auto &n = m_doc->m_nodes[i];
+		if (n.m_type != node_type::element)
+			result += m_doc->view(n.m_text);
+	}
+
+	return result;
+}
+
+std::string_view compact_node::lang() const
+{
+	for (auto i = m_index; i != npos; i = m_doc->m_nodes[i].m_parent)
+	{
+		if (auto a = m_doc->find_attribute(i, "xml:lang"); a != nullptr)
+			return m_doc->view(a->m_value);
+	}
+
+	return {};
+}
+
+std::string_view compact_node::id() const
+{
+	if (m_attribute != 0)
+		return {};
+
+	auto &e = m_doc->m_nodes[m_index];
+
+	for (auto a = e.m_first_attribute; a < e.m_first_attribute + e.m_attribute_count; ++a)
+	{
+		if (m_doc->m_attributes[a].m_id)
+			return m_doc->view(m_doc->m_attributes[a].m_value);
+	}
+
+	return {};
+}
+
+bool compact_node::is_id() const
+{
+	return m_attribute != 0 and m_doc->m_attributes[m_attribute - 1].m_id;
+}
+
+compact_node compact_node::parent() const
+{
+	if (m_attribute != 0)
+		return { m_doc, m_index };
+	return { m_doc, m_doc->m_nodes[m_index].m_parent };
+}
+
+compact_node compact_node::first_child() const
+{
+	if (m_attribute != 0)
+		return {};
+	return { m_doc, m_doc->m_nodes[m_index].m_end > m_index + 1 ? m_index + 1 : npos };
+}
+
+compact_node compact_node::next_sibling() const
+{
+	if (m_attribute != 0)
+		return {};
+	return { m_doc, m_doc->m_nodes[m_index].m_next_sibling };
+}
+
+compact_node compact_node::next() const
+{
+	return { m_doc, m_index + 1 < m_doc->m_nodes.size() ? m_index + 1 : npos };
+}
+
+compact_node compact_node::root() const
+{
+	return m_doc->root();
+}
+
+std::string_view compact_node::get_attribute(std::string_view qname) const
+{
+	const compact_document::attribute_entry *a = nullptr;
+	if (m_attribute == 0)
+		a = m_doc->find_attribute(m_index, qname);
+	return a != nullptr ? m_doc->view(a->m_value) : std::string_view{};
+}
+
+size_t compact_node::attribute_count() const
+{
+	return m_attribute != 0 ? 0 : m_doc->m_nodes[m_index].m_attribute_count;
+}
+
+std::pair<std::string_view, std::string_view> compact_node::attribute(size_t i) const
+{
+	auto a = attribute_node(i);
+	return { a.get_qname(), a.text() };
+}
+
+compact_node compact_node::attribute_node(size_t i) const
+{
+	if (i >= attribute_count())
+		throw exception("attribute index out of range");
+
+	return { m_doc, m_index, static_cast<index_type>(m_doc->m_nodes[m_index].m_first_attribute + i + 1) };
+}
+
+compact_node::index_type compact_node::subtree_end() const
+{
+	return m_doc->m_nodes[m_index].m_end;
+}
+
+std::vector<compact_node> compact_node::find(const std::string &path) const
+{
+	auto result = xpath::cached(path).evaluate(*this);
+
+	result.erase(std::remove_if(result.begin(), result.end(), [](const compact_node &n)
+					 { return n.type() != node_type::element; }),
+		result.end());
+
+	return result;
+}
+
+compact_node compact_node::find_first(const std::string &path) const
+{
+	for (auto &n : xpath::cached(path).evaluate(*this))
+	{
+		if (n.type() == node_type::element)
+			return n;
+	}
+
+	return {};
+}
+
+// --------------------------------------------------------------------
+// Construction of the arrays, in document order. Used for copying a
+// document as well as by the parser below.
+
+class compact_builder
+{
+  public:
+	using index_type = compact_node::index_type;
+	static constexpr index_type npos = compact_node::npos;
+
+	compact_builder(compact_document &doc)
+		: m_doc(doc)
+	{
+		add_name({});
+
+		m_doc.m_nodes.push_back({ node_type::document, npos, npos, 1, 0, {}, 0, 0 });
+		m_stack.push_back({ 0, npos });
+	}
+
+	// Returns true while inside the root element
+	bool in_element() const { return m_stack.size() > 1; }
+
+	void start_element(std::string_view qname)
+	{
+		auto name = add_name(qname);
+		auto ix = add_node(node_type::element);
+		m_doc.m_nodes[ix].m_name = name;
+		m_stack.push_back({ ix, npos });
+	}
+
+	// Attributes are added directly after their element. Like in an
+	// attribute_set, a second attribute with the same name replaces the first.
+	void add_attribute(std::string_view qname, std::string_view value, bool id)
+	{
+		if (m_doc.m_attributes.size() >= kMax)
+			throw exception("document too large for compact_document");
+
+		auto name = add_name(qname);
+		auto &e = m_doc.m_nodes[m_stack.back().m_index];
+
+		for (auto a = e.m_first_attribute; a < e.m_first_attribute + e.m_attribute_count; ++a)
+		{
+			if (m_doc.m_attributes[a].m_name == name)
+			{
+				m_doc.m_attributes[a] = { name, add_string(value), id };
+				return;
+			}
+		}
+
+		m_doc.m_attributes.push_back({ name, add_string(value), id });
+		++e.m_attribute_count;
+	}
+
+	void end_element()
+	{
+		m_doc.m_nodes[m_stack.back().m_index].m_end = static_cast<index_type>(m_doc.m_nodes.size());
+		m_stack.pop_back();
+	}
+
+	// A text, cdata or comment node
+	void add_text(node_type type, std::string_view data)
+	{
+		auto text = add_string(data);
+		m_doc.m_nodes[add_node(type)].m_text = text;
+	}
+
+	// Character data, appended to the last node if that is text, like
+	// element::add_text does
+	void append_text(std::string_view data)
+	{
+		auto last = m_stack.back().m_last_child;
+
+		if (last != npos and last + 1 == m_doc.m_nodes.size())
+		{
+			auto &t = m_doc.m_nodes[last];
+			if (t.m_type == node_type::text and t.m_text.m_offset + t.m_text.m_length == m_doc.m_heap.length())
+			{
+				if (m_doc.m_heap.length() + data.length() > kMax)
+					throw exception("document too large for compact_document");
+
+				m_doc.m_heap.append(data);
+				t.m_text.m_length += static_cast<index_type>(data.length());
+				return;
+			}
+		}
+
+		add_text(node_type::text, data);
+	}
+
+	void add_processing_instruction(std::string_view target, std::string_view data)
+	{
+		auto name = add_name(target);
+		auto text = add_string(data);
+
+		auto &e = m_doc.m_nodes[add_node(node_type::processing_instruction)];
+		e.m_name = name;
+		e.m_text = text;
+	}
+
+	void set_doctype(const doc_type &doctype, bool write)
+	{
+		m_doc.m_doctype = doctype;
+		m_doc.m_write_doctype = write;
+	}
+
+	void finish()
+	{
+		assert(m_stack.size() == 1);
+		end_element();
+	}
+
+  private:
+	static constexpr std::size_t kMax = std::numeric_limits<index_type>::max() - 1;
+
+	compact_document::string_ref add_string(std::string_view s)
+	{
+		if (m_doc.m_heap.length() + s.length() > kMax)
+			throw exception("document too large for compact_document");
+
+		compact_document::string_ref result{ static_cast<index_type>(m_doc.m_heap.length()), static_cast<index_type>(s.length()) };
+		m_doc.m_heap.append(s);
+		return result;
+	}
+
+	std::pair<index_type, bool> intern(std::string_view s)
+	{
+		auto i = m_names.find(std::string{ s });
+		if (i != m_names.end())
+			return { i->second, false };
+
+		auto result = static_cast<index_type>(m_doc.m_names.size());
+		m_doc.m_names.push_back(add_string(s));
+		m_doc.m_local_names.push_back(result);
+		m_names.emplace(s, result);
+
+		return { result, true };
+	}
+
+	index_type add_name(std::string_view s)
+	{
+		auto [result, inserted] = intern(s);
+
+		if (auto colon = s.find(':'); inserted and colon != std::string_view::npos)
+			m_doc.m_local_names[result] = intern(s.substr(colon + 1)).first;
+
+		return result;
+	}
+
+	// Append a node as the last child of the current element
+	index_type add_node(node_type type)
+	{
+		if (m_doc.m_nodes.size() >= kMax)
+			throw exception("document too large for compact_document");
+
+		auto ix = static_cast<index_type>(m_doc.m_nodes.size());
+		auto &f = m_stack.back();
+
+		if (f.m_last_child != npos)
+			m_doc.m_nodes[f.m_last_child].m_next_sibling = ix;
+		f.m_last_child = ix;
+
+		m_doc.m_nodes.push_back({ type, f.m_index, npos, ix + 1, 0, {}, static_cast<index_type>(m_doc.m_attributes.size()), 0 });
+
+		return ix;
+	}
+
+	struct frame
+	{
+		index_type m_index, m_last_child;
+	};
+
+	compact_document &m_doc;
+	std::vector<frame> m_stack;
+
+	std::unordered_map<std::string, index_type> m_names;
+};
+
+// --------------------------------------------------------------------
+// The parser used to construct a compact_document directly, without a
+// document. Element names are resolved like document does.
+
+class compact_document_parser : public parser
+{
+  public:
+	compact_document_parser(compact_document &doc, std::string_view data)
+		: parser(data)
+		, m_builder(doc)
+	{
+	}
+
+	compact_document_parser(compact_document &doc, std::istream &is)
+		: parser(is)
+		, m_builder(doc)
+	{
+	}
+
+	void build()
+	{
+		parse(false, false);
+		m_builder.finish();
+	}
+
+  protected:
+	void doctype_decl(const std::string &root, const std::string &publicId, const std::string &uri) override
+	{
+		m_builder.set_doctype({ root, publicId, uri }, false);
+	}
+
+	void start_element(std::string_view name, std::string_view uri, const attr_view_list_type &atts) override
+	{
+		using namespace std::literals;
+
+		// The declarations on this element come in scope first
+		m_ns_scope_marks.push_back(m_ns_scope.size());
+		m_ns_scope.insert(m_ns_scope.end(), m_namespaces.begin(), m_namespaces.end());
+
+		m_builder.start_element(qualified_name(name, uri));
+
+		for (const auto &[prefix, ns] : m_namespaces)
+			m_builder.add_attribute(prefix.empty() ? "xmlns"s : "xmlns:"s + prefix, ns, false);
+
+		for (auto &a : atts)
+			m_builder.add_attribute(qualified_name(a.m_name, a.m_ns), a.m_value, a.m_id);
+
+		m_namespaces.clear();
+	}
+
+	void end_element(const std::string & /*name*/, const std::string & /*uri*/) override
+	{
+		m_ns_scope.resize(m_ns_scope_marks.back());
+		m_ns_scope_marks.pop_back();
+
+		m_builder.end_element();
+	}
+
+	void character_data(const std::string &data) override
+	{
+		if (m_builder.in_element())
+			m_builder.append_text(data);
+	}
+
+	void processing_instruction(const std::string &target, const std::string &data) override
+	{
+		m_builder.add_processing_instruction(target, data);
+	}
+
+	void comment(const std::string &data) override
+	{
+		m_builder.add_text(node_type::comment, data);
+	}
+
+	void start_namespace_decl(const std::string &prefix, const std::string &uri) override
+	{
+		m_namespaces.emplace_back(prefix, uri);
+	}
+
+  private:
+	// The name with the prefix in scope for \a uri, see document::prefix_in_scope.
+	// The result is valid until the next call.
+	std::string_view qualified_name(std::string_view name, std::string_view uri)
+	{
+		if (uri.empty())
+			return name;
+
+		size_t end = m_ns_scope.size();
+		for (auto m = m_ns_scope_marks.rbegin(); m != m_ns_scope_marks.rend(); ++m)
+		{
+			for (auto i = *m; i < end; ++i)
+			{
+				if (m_ns_scope[i].second != uri)
+					continue;
+
+				if (m_ns_scope[i].first.empty())
+					return name;
+
+				m_qname.assign(m_ns_scope[i].first);
+				m_qname += ':';
+				m_qname += name;
+				return m_qname;
+			}
+			end = *m;
+		}
+
+		throw exception("namespace not found: " + std::string{ uri });
+	}
+
+	compact_builder m_builder;
+
+	std::vector<std::pair<std::string, std::string>> m_namespaces;
+	std::vector<std::pair<std::string, std::string>> m_ns_scope;
+	std::vector<size_t> m_ns_scope_marks;
+	std::string m_qname;
+};
+
+// --------------------------------------------------------------------
+
+compact_document::compact_document(const document &doc)
+{
+	compact_builder builder(*this);
+
+	// Walk the tree in pre-order without recursion
+	struct frame
+	{
+		node_list<>::const_iterator m_cur, m_end;
+	};
+
+	std::vector<frame> stack;
+
+	const auto doc_nodes = doc.nodes();
+	stack.push_back({ doc_nodes.begin(), doc_nodes.end() });
+
+	while (not stack.empty())
+	{
+		auto &f = stack.back();
+
+		if (f.m_cur == f.m_end)
+		{
+			stack.pop_back();
+			if (not stack.empty())
+				builder.end_element();
+			continue;
+		}
+
+		const node &n = *f.m_cur++;
+
+		switch (n.type())
+		{
+			case node_type::element:
+			{
+				auto &el = static_cast<const element &>(n);
+				builder.start_element(el.qname_atom().str());
+
+				for (auto &a : el.attributes())
+					builder.add_attribute(a.qname_atom().str(), a.value(), a.is_id());
+
+				// f is no longer valid after this
+				const auto children = el.nodes();
+				stack.push_back({ children.begin(), children.end() });
+				break;
+			}
+
+			case node_type::processing_instruction:
+				builder.add_processing_instruction(static_cast<const processing_instruction &>(n).get_target(),
+					static_cast<const processing_instruction &>(n).get_text());
+				break;
+
+			case node_type::text:
+			case node_type::cdata:
+			case node_type::comment:
+				builder.add_text(n.type(), static_cast<const node_with_text &>(n).get_text());
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	builder.set_doctype(doc.get_doctype(), doc.writes_doctype());
+	builder.finish();
+}
+
+compact_document::compact_document(std::string_view data)
+{
+	compact_document_parser p(*this, data);
+	p.build();
+}
+
+compact_document::compact_document(std::istream &is)
+{
+	compact_document_parser p(*this, is);
+	p.build();
+}
+
+compact_node compact_document::child() const
+{
+	for (auto n : root())
+	{
+		if (n.type() == node_type::element)
+			return n;
+	}
+
+	return {};
+}
+
+const compact_document::attribute_entry *compact_document::find_attribute(index_type node, std::string_view qname) const
+{
+	auto &e = m_nodes[node];
+
+	for (auto a = e.m_first_attribute; a < e.m_first_attribute + e.m_attribute_count; ++a)
+	{
+		if (name(m_attributes[a].m_name) == qname)
+			return &m_attributes[a];
+	}
+
+	return nullptr;
+}
+
+document compact_document::to_document() const
+{
+	document result;
+
+	if (m_nodes.empty())
+		return result;
+
+	result.set_doctype(m_doctype);
+	result.set_write_doctype(m_write_doctype);
+
+	// the containers for the elements created so far, by index
+	std::vector<element_container *> containers(m_nodes.size(), nullptr);
+	containers[0] = &result;
+
+	for (index_type i = 1; i < m_nodes.size(); ++i)
+	{
+		auto &e = m_nodes[i];
+		auto parent = containers[e.m_parent];
+		assert(parent != nullptr);
+
+		switch (e.m_type)
+		{
+			case node_type::element:
+			{
+				auto el = static_cast<element *>(&*parent->nodes().emplace_back(element(name(e.m_name))));
+
+				for (auto a = e.m_first_attribute; a < e.m_first_attribute + e.m_attribute_count; ++a)
+					el->attributes().emplace(name(m_attributes[a].m_name), view(m_attributes[a].m_value), m_attributes[a].m_id);
+
+				containers[i] = el;
+				break;
+			}
+
+			case node_type::text:
+				parent->nodes().emplace_back(text(std::string{ view(e.m_text) }));
+				break;
+
+			case node_type::cdata:
+				parent->nodes().emplace_back(cdata(std::string{ view(e.m_text) }));
+				break;
+
+			case node_type::comment:
+				parent->nodes().emplace_back(comment(std::string{ view(e.m_text) }));
+				break;
+
+			case node_type::processing_instruction:
+				parent->nodes().emplace_back(processing_instruction(std::string{ name(e.m_name) }, std::string{ view(e.m_text) }));
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return result;
+}
+
+} // namespace mxml
@@ -28,8 +28,10 @@
 #include "mxml/error.hpp"
 #include "mxml/text.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <functional>
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -37,488 +39,262 @@ namespace mxml::doctype
 {
 
 // --------------------------------------------------------------------
-// validator code
 
-// a refcounted state base class
-struct state_base : std::enable_shared_from_this<state_base>
+bool entity_list::insert(entity_ptr e)
 {
-	state_base() = default;
+	if (find(e->name()) != nullptr)
+		return false;
 
-	virtual std::tuple<bool, bool> allow(const std::string &name) = 0;
-	virtual bool allow_char_data() { return false; }
-	virtual bool allow_empty() { return false; }
-	virtual bool must_be_empty() { return false; }
+	// keep the table at most half full
+	if ((m_entities.size() + 1) * 2 > m_slots.size())
+		rehash(m_slots.empty() ? 16 : m_slots.size() * 2);
 
-	virtual void reset() {}
+	m_entities.push_back(std::move(e));
 
-  protected:
-	virtual ~state_base() = default;
-};
+	const std::size_t mask = m_slots.size() - 1;
+	auto slot = std::hash<std::string_view>{}(m_entities.back()->name()) & mask;
+	while (m_slots[slot] != 0)
+		slot = (slot + 1) & mask;
+	m_slots[slot] = static_cast<std::uint32_t>(m_entities.size());
 
-struct state_any : public state_base
-{
-	virtual std::tuple<bool, bool>
-	allow(const std::string & /*name*/) { return std::make_tuple(true, true); }
-	virtual bool allow_char_data() { return true; }
-	virtual bool allow_empty() { return true; }
-};
+	return true;
+}
 
-struct state_empty : public state_base
+const entity *entity_list::find(std::string_view name) const
 {
-	virtual std::tuple<bool, bool>
-	allow(const std::string & /*name*/) { return std::make_tuple(false, true); }
-	virtual bool allow_empty() { return true; }
-	virtual bool must_be_empty() { return true; }
-};
+	if (m_slots.empty())
+		return nullptr;
 
-struct state_element : public state_base
-{
-	state_element(const std::string &name)
-		: m_name(name)
-		, m_done(false)
-	{
-	}
+	const std::size_t mask = m_slots.size() - 1;
 
-	virtual std::tuple<bool, bool>
-	allow(const std::string &name)
+	for (auto slot = std::hash<std::string_view>{}(name) & mask; m_slots[slot] != 0; slot = (slot + 1) & mask)
 	{
-		bool result = false;
-		if (not m_done and m_name == name)
-			m_done = result = true;
-		//									m_done = true;
-		return std::make_tuple(result, m_done);
+		auto &e = m_entities[m_slots[slot] - 1];
+		if (e->name() == name)
+			return e.get();
 	}
 
-	virtual void reset() { m_done = false; }
-
-	std::string m_name;
-	bool m_done;
-};
+	return nullptr;
+}
 
-struct state_repeated : public state_base
+void entity_list::rehash(std::size_t size)
 {
-	state_repeated(content_spec_base_ptr sub)
-		: m_sub(sub->create_state())
-		, m_state(0)
-	{
-	}
+	m_slots.assign(size, 0);
 
-	virtual void reset()
+	const std::size_t mask = size - 1;
+	for (std::size_t i = 0; i < m_entities.size(); ++i)
 	{
-		m_sub->reset();
-		m_state = 0;
+		auto slot = std::hash<std::string_view>{}(m_entities[i]->name()) & mask;
+		while (m_slots[slot] != 0)
+			slot = (slot + 1) & mask;
+		m_slots[slot] = static_cast<std::uint32_t>(i + 1);
 	}
+}
 
-	virtual bool allow_char_data() { return m_sub->allow_char_data(); }
-
-	state_base_ptr m_sub;
-	int m_state;
-};
-
-// repeat for ?
-
-struct state_repeated_zero_or_once : public state_repeated
-{
-	state_repeated_zero_or_once(content_spec_base_ptr sub)
-		: state_repeated(sub)
-	{
-	}
-
-	std::tuple<bool, bool> allow(const std::string &name);
-
-	virtual bool allow_empty() { return true; }
-};
+// --------------------------------------------------------------------
+// validator code
+//
+// Content specifications are compiled into a deterministic automaton
+// using the positions of the element names in the specification. For
+// each position the positions that may follow it are collected, the
+// states of the automaton are the sets of positions that may have
+// matched the last child element.
 
-std::tuple<bool, bool> state_repeated_zero_or_once::allow(const std::string &name)
+struct content_model_builder
 {
-	// use a state machine
-	enum State
-	{
-		Start = 0,
-		Loop
-	};
-
-	bool result = false, done = false;
-
-	switch (m_state)
+	int add_position(const atom &name)
 	{
-		case State::Start:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == true)
-				m_state = State::Loop;
-			else
-				done = true;
-			break;
-
-		case State::Loop:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == false and done)
-				done = true;
-			break;
+		m_names.push_back(name);
+		m_follow.emplace_back();
+		return static_cast<int>(m_names.size() - 1);
 	}
 
-	return std::make_tuple(result, done);
-}
-
-struct state_repeated_any : public state_repeated
-{
-	state_repeated_any(content_spec_base_ptr sub)
-		: state_repeated(sub)
+	void add_follow(const std::vector<int> &from, const std::vector<int> &to)
 	{
+		for (int p : from)
+			m_follow[p].insert(m_follow[p].end(), to.begin(), to.end());
 	}
 
-	std::tuple<bool, bool> allow(const std::string &name);
-
-	virtual bool allow_empty() { return true; }
+	std::vector<atom> m_names;
+	std::vector<std::vector<int>> m_follow;
 };
 
-std::tuple<bool, bool> state_repeated_any::allow(const std::string &name)
+content_model::content_model(const content_spec_base &allowed)
+	: m_content_spec(allowed.get_content_spec())
+	, m_any(m_content_spec == content_spec_type::Any)
 {
-	// use a state machine
-	enum State
+	if (m_any)
 	{
-		Start = 0,
-		Loop
-	};
-
-	bool result = false, done = false;
-
-	switch (m_state)
-	{
-		case State::Start:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == true)
-				m_state = State::Loop;
-			else
-				done = true;
-			break;
-
-		case State::Loop:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == false and done)
-			{
-				m_sub->reset();
-				std::tie(result, done) = m_sub->allow(name);
-				if (result == false)
-					done = true;
-			}
-			break;
+		m_accepting.push_back(true);
+		return;
 	}
 
-	return std::make_tuple(result, done);
-}
+	content_model_builder b;
+	auto root = allowed.compile(b);
 
-struct state_repeated_at_least_once : public state_repeated
-{
-	state_repeated_at_least_once(content_spec_base_ptr sub)
-		: state_repeated(sub)
-	{
-	}
+	m_names = b.m_names;
+	std::sort(m_names.begin(), m_names.end());
+	m_names.erase(std::unique(m_names.begin(), m_names.end()), m_names.end());
 
-	std::tuple<bool, bool> allow(const std::string &name);
+	const std::size_t position_count = b.m_names.size();
 
-	virtual bool allow_empty() { return m_sub->allow_empty(); }
-};
+	std::vector<std::size_t> symbol(position_count);
+	for (std::size_t p = 0; p < position_count; ++p)
+		symbol[p] = std::lower_bound(m_names.begin(), m_names.end(), b.m_names[p]) - m_names.begin();
 
-std::tuple<bool, bool> state_repeated_at_least_once::allow(const std::string &name)
-{
-	// use a state machine
-	enum State
-	{
-		Start = 0,
-		FirstLoop,
-		NextLoop
-	};
-
-	bool result = false, done = false;
+	std::vector<bool> is_last(position_count, false);
+	for (int p : root.last)
+		is_last[p] = true;
 
-	switch (m_state)
-	{
-		case State::Start:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == true)
-				m_state = State::FirstLoop;
-			break;
+	// State 0 is the start state, it is not in the map
+	std::map<std::vector<int>, int> state_numbers;
+	std::vector<std::vector<int>> states{ {} };
 
-		case State::FirstLoop:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == false and done)
-			{
-				m_sub->reset();
-				std::tie(result, done) = m_sub->allow(name);
-				if (result == true)
-					m_state = State::NextLoop;
-			}
-			break;
+	m_accepting.push_back(root.nullable);
 
-		case State::NextLoop:
-			std::tie(result, done) = m_sub->allow(name);
-			if (result == false and done)
-			{
-				m_sub->reset();
-				std::tie(result, done) = m_sub->allow(name);
-				if (result == false)
-					done = true;
-			}
-			break;
-	}
-
-	return std::make_tuple(result, done);
-}
+	std::vector<int> candidates, next;
 
-// allow a sequence
-
-struct state_seq : public state_base
-{
-	state_seq(const content_spec_list &allowed)
-		: m_state(0)
+	for (std::size_t state = 0; state < states.size(); ++state)
 	{
-		for (auto a : allowed)
-			m_states.emplace_back(a->create_state());
-	}
-
-	virtual std::tuple<bool, bool>
-	allow(const std::string &name);
+		candidates.clear();
+		if (state == 0)
+			candidates = root.first;
+		else
+		{
+			for (int p : states[state])
+				candidates.insert(candidates.end(), b.m_follow[p].begin(), b.m_follow[p].end());
+		}
 
-	virtual void reset()
-	{
-		m_state = 0;
-		for (auto state : m_states)
-			state->reset();
-		;
-	}
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
 
-	virtual bool allow_char_data()
-	{
-		bool result = false;
-		for (auto s : m_states)
+		for (std::size_t sym = 0; sym < m_names.size(); ++sym)
 		{
-			if (s->allow_char_data())
+			next.clear();
+			for (int p : candidates)
 			{
-				result = true;
-				break;
+				if (symbol[p] == sym)
+					next.push_back(p);
 			}
-		}
-
-		return result;
-	}
-
-	virtual bool allow_empty();
-
-	std::vector<state_base_ptr> m_states;
-	std::vector<state_base_ptr>::iterator m_next;
-	int m_state;
-};
 
-std::tuple<bool, bool> state_seq::allow(const std::string &name)
-{
-	bool result = false, done = false;
-
-	enum State
-	{
-		Start,
-		Element
-	};
-
-	switch (m_state)
-	{
-		case State::Start:
-			m_next = m_states.begin();
-			if (m_next == m_states.end())
+			if (next.empty())
 			{
-				done = true;
-				break;
+				m_transitions.push_back(-1);
+				continue;
 			}
-			m_state = State::Element;
-			// fall through
 
-		case State::Element:
-			std::tie(result, done) = (*m_next)->allow(name);
-			while (result == false and done)
+			auto [i, inserted] = state_numbers.emplace(next, static_cast<int>(states.size()));
+			if (inserted)
 			{
-				++m_next;
-
-				if (m_next == m_states.end())
-				{
-					done = true;
-					break;
-				}
-
-				std::tie(result, done) = (*m_next)->allow(name);
+				states.push_back(next);
+				m_accepting.push_back(std::any_of(next.begin(), next.end(), [&is_last](int p)
+					{ return is_last[p]; }));
 			}
-			break;
-	}
-
-	return std::make_tuple(result, done);
-}
 
-bool state_seq::allow_empty()
-{
-	bool result = true;
-
-	for (auto s : m_states)
-	{
-		if (not s->allow_empty())
-		{
-			result = false;
-			break;
+			m_transitions.push_back(i->second);
 		}
 	}
-
-	return result;
 }
 
-// allow one of a list
-
-struct state_choice : public state_base
-{
-	state_choice(const content_spec_list &allowed, bool mixed)
-		: m_mixed(mixed)
-		, m_state(0)
-	{
-		for (auto a : allowed)
-			m_states.push_back(a->create_state());
-	}
-
-	virtual std::tuple<bool, bool>
-	allow(const std::string &name);
-
-	virtual void reset()
-	{
-		m_state = 0;
-		for (auto state : m_states)
-			state->reset();
-	}
-
-	virtual bool allow_char_data() { return m_mixed; }
-
-	virtual bool allow_empty();
-
-	std::vector<state_base_ptr> m_states;
-	bool m_mixed;
-	int m_state;
-	state_base_ptr m_sub;
-};
-
-std::tuple<bool, bool> state_choice::allow(const std::string &name)
+int content_model::next(int state, const atom &name) const
 {
-	bool result = false, done = false;
+	if (m_any)
+		return state;
 
-	enum State
-	{
-		Start,
-		Choice
-	};
+	auto i = std::find(m_names.begin(), m_names.end(), name);
+	if (i == m_names.end())
+		return -1;
 
-	switch (m_state)
-	{
-		case State::Start:
-			for (auto choice : m_states)
-			{
-				std::tie(result, done) = choice->allow(name);
-				if (result == true)
-				{
-					m_sub = choice;
-					m_state = State::Choice;
-					break;
-				}
-			}
-			break;
-
-		case State::Choice:
-			std::tie(result, done) = m_sub->allow(name);
-			break;
-	}
-
-	return std::make_tuple(result, done);
-}
-
-bool state_choice::allow_empty()
-{
-	using namespace std::placeholders;
-	return m_mixed or
-	       std::find_if(m_states.begin(), m_states.end(), std::bind(&state_base::allow_empty, _1)) != m_states.end();
+	return m_transitions[state * m_names.size() + (i - m_names.begin())];
 }
 
 // --------------------------------------------------------------------
 
-validator::validator(content_spec_base &allowed)
-	: m_state(allowed.create_state())
-	, m_allowed(allowed.get_content_spec())
-	, m_done(m_state->allow_empty())
+validator::validator(const content_spec_base &allowed)
+	: m_model(std::make_shared<content_model>(allowed))
+	, m_done(m_model->accepts(0))
 {
 }
 
-validator::validator(element_ptr e)
+validator::validator(const element_ptr &e)
 {
-	if (auto allowed = e ? e->get_allowed() : nullptr; allowed != nullptr)
-	{
-		m_allowed = allowed->get_content_spec();
-		m_state = allowed->create_state();
-		m_done = m_state->allow_empty();
-	}
+	static const content_model_ptr s_any = std::make_shared<content_model>(content_spec_any{});
+
+	if (e and e->get_model())
+		m_model = e->get_model();
 	else
-	{
-		m_allowed = content_spec_type::Any;
-		m_state = std::make_shared<state_any>();
-		m_done = true;
-	}
+		m_model = s_any;
+
+	m_done = m_model->accepts(0);
 }
 
-bool validator::allow(const std::string &name)
+bool validator::allow(const atom &name)
 {
-	bool result;
-	std::tie(result, m_done) = m_state->allow(name);
-	return result;
+	int next = m_model->next(m_state, name);
+	if (next < 0)
+		return false;
+
+	m_state = next;
+	m_done = m_model->accepts(next);
+	return true;
 }
 
-bool validator::done()
+bool validator::done() const
 {
 	return m_done;
 }
 
 content_spec_type validator::get_content_spec() const
 {
-	return m_allowed;
+	return m_model->get_content_spec();
 }
 
 // --------------------------------------------------------------------
 
-state_base_ptr content_spec_any::create_state() const
+content_positions content_spec_any::compile(content_model_builder & /*b*/) const
 {
-	return std::make_shared<state_any>();
+	return { .nullable = true, .first = {}, .last = {} };
 }
 
 // --------------------------------------------------------------------
 
-state_base_ptr content_spec_empty::create_state() const
+content_positions content_spec_empty::compile(content_model_builder & /*b*/) const
 {
-	return std::make_shared<state_empty>();
+	return { .nullable = true, .first = {}, .last = {} };
 }
 
 // --------------------------------------------------------------------
 
-state_base_ptr content_spec_element::create_state() const
+content_positions content_spec_element::compile(content_model_builder &b) const
 {
-	return std::make_shared<state_element>(m_name);
+	int p = b.add_position(atom(m_name));
+	return { false, { p }, { p } };
 }
 
 // --------------------------------------------------------------------
 
-state_base_ptr content_spec_repeated::create_state() const
+content_positions content_spec_repeated::compile(content_model_builder &b) const
 {
+	auto result = m_allowed->compile(b);
+
 	switch (m_repetition)
 	{
 		case '?':
-			return std::make_shared<state_repeated_zero_or_once>(m_allowed);
+			result.nullable = true;
+			break;
 		case '*':
-			return std::make_shared<state_repeated_any>(m_allowed);
+			b.add_follow(result.last, result.first);
+			result.nullable = true;
+			break;
 		case '+':
-			return std::make_shared<state_repeated_at_least_once>(m_allowed);
+			b.add_follow(result.last, result.first);
+			break;
 		default:
 			assert(false);
 			throw exception("illegal repetition character");
 	}
+
+	return result;
 }
 
 bool content_spec_repeated::element_content() const
@@ -533,9 +309,28 @@ void content_spec_seq::add(content_spec_base_ptr a)
 	m_allowed.push_back(a);
 }
 
-state_base_ptr content_spec_seq::create_state() const
+content_positions content_spec_seq::compile(content_model_builder &b) const
 {
-	return std::make_shared<state_seq>(m_allowed);
+	content_positions result{ .nullable = true, .first = {}, .last = {} };
+
+	for (auto a : m_allowed)
+	{
+		auto r = a->compile(b);
+
+		b.add_follow(result.last, r.first);
+
+		if (result.nullable)
+			result.first.insert(result.first.end(), r.first.begin(), r.first.end());
+
+		if (r.nullable)
+			result.last.insert(result.last.end(), r.last.begin(), r.last.end());
+		else
+			result.last = std::move(r.last);
+
+		result.nullable = result.nullable and r.nullable;
+	}
+
+	return result;
 }
 
 bool content_spec_seq::element_content() const
@@ -559,9 +354,20 @@ void content_spec_choice::add(content_spec_base_ptr a)
 	m_allowed.push_back(a);
 }
 
-state_base_ptr content_spec_choice::create_state() const
+content_positions content_spec_choice::compile(content_model_builder &b) const
 {
-	return std::make_shared<state_choice>(m_allowed, m_mixed);
+	content_positions result{ .nullable = m_mixed, .first = {}, .last = {} };
+
+	for (auto a : m_allowed)
+	{
+		auto r = a->compile(b);
+
+		result.first.insert(result.first.end(), r.first.begin(), r.first.end());
+		result.last.insert(result.last.end(), r.last.begin(), r.last.end());
+		result.nullable = result.nullable or r.nullable;
+	}
+
+	return result;
 }
 
 bool content_spec_choice::element_content() const
@@ -585,18 +391,32 @@ bool content_spec_choice::element_content() const
 
 // --------------------------------------------------------------------
 
-bool attribute::is_name(std::string &s) const
+namespace
 {
-	bool result = true;
+	// replace each run of white space in s by a single space
+	void collapse_space(std::string &s)
+	{
+		std::string::size_type n = 0;
+		for (std::string::size_type i = 0; i < s.length(); ++i)
+		{
+			if (not isspace(s[i]))
+				s[n++] = s[i];
+			else if (n == 0 or s[n - 1] != ' ')
+				s[n++] = ' ';
+		}
+		s.resize(n);
+	}
+} // namespace
 
-	trim(s);
+bool attribute::is_name(std::string_view s)
+{
+	bool result = true;
 
 	if (not s.empty())
 	{
-		std::string::iterator c = s.begin();
+		auto c = s.begin();
 
-		if (c != s.end())
-			result = is_name_start_char(*c);
+		result = is_name_start_char(*c);
 
 		while (result and ++c != s.end())
 			result = is_name_char(*c);
@@ -605,99 +425,75 @@ bool attribute::is_name(std::string &s) const
 	return result;
 }
 
-bool attribute::is_names(std::string &s) const
+bool attribute::is_names(std::string &s)
 {
-	bool result = true;
+	bool result = true, collapse = false;
 
-	trim(s);
+	auto c = s.begin();
 
-	if (not s.empty())
+	while (result and c != s.end())
 	{
-		std::string::iterator c = s.begin();
-		std::string t;
-
-		while (result and c != s.end())
-		{
-			result = is_name_start_char(*c);
-			t += *c;
-			++c;
+		result = is_name_start_char(*c);
+		if (not result)
+			break;
 
-			while (result and c != s.end() and is_name_char(*c))
-			{
-				t += *c;
-				++c;
-			}
+		while (++c != s.end() and is_name_char(*c))
+			;
 
-			if (c == s.end())
-				break;
+		if (c == s.end())
+			break;
 
-			result = isspace(*c) != 0;
+		auto b = c;
+		while (c != s.end() and isspace(*c))
 			++c;
-			t += ' ';
 
-			while (c != s.end() and isspace(*c))
-				++c;
-		}
-
-		swap(s, t);
+		result = c != b;
+		collapse = collapse or c - b > 1 or *b != ' ';
 	}
 
+	if (result and collapse)
+		collapse_space(s);
+
 	return result;
 }
 
-bool attribute::is_nmtoken(std::string &s) const
+bool attribute::is_nmtoken(std::string_view s)
 {
-	trim(s);
-
 	bool result = not s.empty();
 
-	std::string::iterator c = s.begin();
+	auto c = s.begin();
 	while (result and ++c != s.end())
 		result = is_name_char(*c);
 
 	return result;
 }
 
-bool attribute::is_nmtokens(std::string &s) const
+bool attribute::is_nmtokens(std::string &s)
 {
-	// remove leading and trailing spaces
-	trim(s);
-
-	bool result = not s.empty();
+	bool result = not s.empty(), collapse = false;
 
-	std::string::iterator c = s.begin();
-	std::string t;
+	auto c = s.begin();
 
 	while (result and c != s.end())
 	{
-		result = false;
-
-		do
-		{
-			if (not is_name_char(*c))
-				break;
-			result = true;
-			t += *c;
+		auto b = c;
+		while (c != s.end() and is_name_char(*c))
 			++c;
-		} while (c != s.end());
 
+		result = c != b;
 		if (not result or c == s.end())
 			break;
 
-		result = false;
-		do
-		{
-			if (*c != ' ')
-				break;
-			result = true;
+		b = c;
+		while (c != s.end() and *c == ' ')
 			++c;
-		} while (c != s.end() and *c == ' ');
 
-		t += ' ';
+		result = c != b;
+		collapse = collapse or c - b > 1;
 	}
 
-	if (result)
-		swap(s, t);
+	if (result and collapse)
+		collapse_space(s);
 
 	return result;
 }
@@ -706,6 +502,9 @@ bool attribute::validate_value(std::string &value, const entity_list &entities)
 {
 	bool result = true;
 
+	if (m_type != attribute_type::CDATA)
+		trim(value);
+
 	if (m_type == attribute_type::CDATA)
 		result = true;
 	else if (m_type == attribute_type::ENTITY)
@@ -721,10 +520,11 @@ bool attribute::validate_value(std::string &value, const entity_list &entities)
 		result = is_names(value);
 		if (result)
 		{
-			std::string::size_type i = 0, j = value.find(' ');
+			std::string_view v{ value };
+			std::string::size_type i = 0, j = v.find(' ');
 			for (;;)
 			{
-				if (not is_unparsed_entity(value.substr(i, j - i), entities))
+				if (not is_unparsed_entity(v.substr(i, j - i), entities))
 				{
 					result = false;
 					break;
@@ -734,7 +534,7 @@ bool attribute::validate_value(std::string &value, const entity_list &entities)
 					break;
 
 				i = j + 1;
-				j = value.find(' ', i);
+				j = v.find(' ', i);
 			}
 		}
 	}
@@ -745,10 +545,7 @@ bool attribute::validate_value(std::string &value, const entity_list &entities)
 	else if (m_type == attribute_type::NMTOKENS)
 		result = is_nmtokens(value);
 	else if (m_type == attribute_type::Enumerated or m_type == attribute_type::Notation)
-	{
-		trim(value);
 		result = find(m_enum.begin(), m_enum.end(), value) != m_enum.end();
-	}
 
 	if (result and m_default == attribute_default::Fixed and value != m_default_value)
 		result = false;
@@ -756,16 +553,10 @@ bool attribute::validate_value(std::string &value, const entity_list &entities)
 	return result;
 }
 
-bool attribute::is_unparsed_entity(const std::string &s, const entity_list &l) const
+bool attribute::is_unparsed_entity(std::string_view s, const entity_list &l) const
 {
-	bool result = false;
-
-	entity_list::const_iterator i = std::find_if(l.begin(), l.end(), [s](auto e)
-		{ return e->name() == s; });
-	if (i != l.end())
-		result = (*i)->is_parsed() == false;
-
-	return result;
+	auto e = l.find(s);
+	return e != nullptr and not e->is_parsed();
 }
 
 // --------------------------------------------------------------------
@@ -773,6 +564,7 @@ bool attribute::is_unparsed_entity(const std::string &s, const entity_list &l) c
 void element::set_allowed(content_spec_base_ptr allowed)
 {
 	m_allowed = allowed;
+	m_model = allowed ? std::make_shared<content_model>(*allowed) : nullptr;
 }
 
 void element::add_attribute(attribute_ptr attrib)
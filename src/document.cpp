@@ -35,9 +35,77 @@
 #include <memory>
 #include <istream>
 
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MXML_HAS_MMAP 1
+#endif
+
 namespace mxml
 {
 
+// --------------------------------------------------------------------
+// A read-only view on the contents of a file. Memory mapped when possible,
+// otherwise the file is read in a buffer.
+
+class mapped_file
+{
+  public:
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	mapped_file(const std::filesystem::path &file)
+	{
+#if MXML_HAS_MMAP
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw exception("Could not open file " + file.string());
+
+		struct stat st{};
+		if (::fstat(fd, &st) == 0 and st.st_size > 0)
+		{
+			void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				::madvise(data, st.st_size, MADV_SEQUENTIAL);
+				m_data = static_cast<const char *>(data);
+				m_length = st.st_size;
+			}
+		}
+
+		::close(fd);
+
+		if (m_data != nullptr or st.st_size == 0)
+			return;
+#endif
+		std::ifstream in(file, std::ios::binary);
+		if (not in.is_open())
+			throw exception("Could not open file " + file.string());
+
+		m_buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	~mapped_file()
+	{
+#if MXML_HAS_MMAP
+		if (m_data != nullptr)
+			::munmap(const_cast<char *>(m_data), m_length);
+#endif
+	}
+
+	std::string_view view() const
+	{
+		return m_data ? std::string_view{ m_data, m_length } : std::string_view{ m_buffer };
+	}
+
+  private:
+	const char *m_data = nullptr;
+	size_t m_length = 0;
+	std::string m_buffer;
+};
+
 // --------------------------------------------------------------------
 
 document::document()
@@ -52,9 +120,12 @@ document::document()
 
 document::document(const document &doc)
 	: element_container(doc)
+	, m_dtd_cache(doc.m_dtd_cache)
 	, m_doctype(doc.m_doctype)
 	, m_validating(doc.m_validating)
 	, m_preserve_cdata(doc.m_preserve_cdata)
+	, m_use_arena(doc.m_use_arena)
+	, m_use_index(doc.m_use_index)
 	, m_has_xml_decl(doc.m_has_xml_decl)
 	, m_encoding(doc.m_encoding)
 	, m_version(doc.m_version)
@@ -66,16 +137,7 @@ document::document(const document &doc)
 document::document(std::string_view s)
 	: document()
 {
-	struct membuf : public std::streambuf
-	{
-		membuf(char *text, size_t length)
-		{
-			this->setg(text, text, text + length);
-		}
-	} buffer(const_cast<char *>(s.data()), s.length());
-
-	std::istream is(&buffer);
-	parse(is);
+	parse(s);
 }
 
 document::document(std::istream &is)
@@ -92,15 +154,27 @@ document::document(std::istream &is, const std::string &base_dir)
 	parse(is);
 }
 
+document::~document()
+{
+	// The nodes should be gone before the arenas are released
+	element_container::clear();
+}
+
 void swap(document &a, document &b) noexcept
 {
 	swap(static_cast<element_container &>(a), static_cast<element_container &>(b));
 
 	std::swap(a.m_dtd_dir, b.m_dtd_dir);
+	std::swap(a.m_dtd_cache, b.m_dtd_cache);
 	std::swap(a.m_doctype, b.m_doctype);
 	std::swap(a.m_validating, b.m_validating);
 	std::swap(a.m_validating_ns, b.m_validating_ns);
 	std::swap(a.m_preserve_cdata, b.m_preserve_cdata);
+	std::swap(a.m_use_arena, b.m_use_arena);
+	std::swap(a.m_arenas, b.m_arenas);
+	std::swap(a.m_use_index, b.m_use_index);
+	std::swap(a.m_id_index, b.m_id_index);
+	std::swap(a.m_name_index, b.m_name_index);
 	std::swap(a.m_has_xml_decl, b.m_has_xml_decl);
 	std::swap(a.m_encoding, b.m_encoding);
 	std::swap(a.m_version, b.m_version);
@@ -109,6 +183,7 @@ void swap(document &a, document &b) noexcept
 	std::swap(a.m_write_doctype, b.m_write_doctype);
 	std::swap(a.m_write_xml_decl, b.m_write_xml_decl);
 	std::swap(a.m_fmt, b.m_fmt);
+	std::swap(a.m_parser_stats, b.m_parser_stats);
 	std::swap(a.m_cur, b.m_cur);
 	std::swap(a.m_cdata, b.m_cdata);
 	std::swap(a.m_namespaces, b.m_namespaces);
@@ -173,68 +248,78 @@ std::ostream &operator<<(std::ostream &os, const document &doc)
 	return os;
 }
 
+writer &operator<<(writer &w, const document &doc)
+{
+	doc.write_to(w, doc.m_fmt);
+	return w;
+}
+
 std::istream &operator>>(std::istream &is, document &doc)
 {
 	doc.parse(is);
 	return is;
 }
 
-void document::write(std::ostream &os, format_info fmt) const
+void document::write_to(writer &w, format_info fmt) const
 {
 	if (m_version > version_type{ 1, 0 } or m_write_xml_decl)
 	{
 		assert(m_encoding == encoding_type::UTF8);
 
-		os << "<?xml version=\"" << int(m_version.major) << '.' << int(m_version.minor) << "\"";
+		w << "<?xml version=\"";
+		w.write(static_cast<unsigned long long>(m_version.major));
+		w.put('.');
+		w.write(static_cast<unsigned long long>(m_version.minor));
+		w.put('"');
 
-		// os << " encoding=\"UTF-8\"";
+		// w << " encoding=\"UTF-8\"";
 
 		if (m_standalone)
-			os << " standalone=\"yes\"";
+			w << " standalone=\"yes\"";
 
-		os << "?>";
+		w << "?>";
 
 		if (m_wrap_prolog)
-			os << '\n';
+			w << '\n';
 	}
 
 	if (not m_notations.empty() or m_write_doctype)
 	{
-		os << "<!DOCTYPE " << (empty() ? "" : child()->get_qname());
+		w << "<!DOCTYPE " << (empty() ? "" : child()->get_qname());
 		if (m_write_doctype and not m_doctype.m_dtd.empty())
 		{
 			if (m_doctype.m_pubid.empty())
-				os << " SYSTEM \"";
+				w << " SYSTEM \"";
 			else
-				os << " PUBLIC \"" << m_doctype.m_pubid << "\" \"";
-			os << m_doctype.m_dtd << '"';
+				w << " PUBLIC \"" << m_doctype.m_pubid << "\" \"";
+			w << m_doctype.m_dtd << '"';
 		}
 
 		if (not m_notations.empty())
 		{
-			os << " [\n";
+			w << " [\n";
 
 			for (auto &[name, sysid, pubid] : m_notations)
 			{
-				os << "<!NOTATION " << name;
+				w << "<!NOTATION " << name;
 				if (not pubid.empty())
 				{
-					os << " PUBLIC \'" << pubid << '\'';
+					w << " PUBLIC \'" << pubid << '\'';
 					if (not sysid.empty())
-						os << " \'" << sysid << '\'';
+						w << " \'" << sysid << '\'';
 				}
 				else
-					os << " SYSTEM \'" << sysid << '\'';
-				os << ">\n";
+					w << " SYSTEM \'" << sysid << '\'';
+				w << ">\n";
 			}
-			os << "]";
+			w << "]";
 		}
 
-		os << ">\n";
+		w << ">\n";
 	}
 
 	for (auto &n : nodes())
-		n.write(os, fmt);
+		n.write_to(w, fmt);
 }
 
 // --------------------------------------------------------------------
@@ -250,72 +335,237 @@ node *document::insert_impl(const node *p, node *n)
 }
 
 // --------------------------------------------------------------------
+// indexes
 
-void document::XmlDeclHandler(encoding_type /*encoding*/, bool standalone, version_type version)
+namespace
 {
-	m_has_xml_decl = true;
-	// m_encoding = encoding;
-	m_standalone = standalone;
-	m_version = version;
 
-	m_fmt.version = version;
+// Call \a f for the elements below \a top in document order until it
+// returns false
+template <typename F>
+void visit_elements(const element_container &top, F &&f)
+{
+	using const_iterator = element_container::const_iterator;
+
+	std::vector<std::pair<const_iterator, const_iterator>> stack;
+	stack.emplace_back(top.begin(), top.end());
+
+	while (not stack.empty())
+	{
+		auto &[i, end] = stack.back();
+		if (i == end)
+		{
+			stack.pop_back();
+			continue;
+		}
+
+		const element &e = *i++;
+		if (not f(e))
+			break;
+
+		stack.emplace_back(e.begin(), e.end());
+	}
 }
 
-void document::StartElementHandler(const std::string &name, const std::string &uri, const parser::attr_list_type &atts)
+} // namespace
+
+void document::set_use_index(bool i)
 {
-	using namespace std::literals;
+	m_use_index = i;
+	m_id_index.clear();
+	m_name_index.clear();
 
-	std::string qname{ name };
-	if (not uri.empty())
-	{
-		std::string prefix;
-		bool found;
+	// have the indexes built the next time they are used
+	invalidate_document_order(this);
+}
 
-		auto i = std::find_if(m_namespaces.begin(), m_namespaces.end(),
-			[uri](auto &ns)
-			{ return ns.second == uri; });
+void document::update_indexes() const
+{
+	m_id_index.clear();
+	m_name_index.clear();
 
-		if (i != m_namespaces.end())
+	if (not m_use_index)
+		return;
+
+	visit_elements(*this, [this](const element &e)
 		{
-			prefix = i->first;
-			found = true;
-		}
-		else
-			std::tie(prefix, found) = m_cur->prefix_for_namespace(uri);
+			auto el = const_cast<element *>(&e);
 
-		if (prefix.empty() and not found)
-			throw exception("namespace not found: "s + std::string{ uri });
+			m_name_index[std::string{ e.qname_atom().local_str() }].push_back(el);
 
-		if (not prefix.empty())
-			qname = std::string{ prefix } + ':' + std::string{ name };
-	}
+			for (auto &a : e.attributes())
+			{
+				if (a.is_id())
+					m_id_index.emplace(a.value(), el);
+			}
 
-	m_cur = (element *)(static_cast<element *>(m_cur)->emplace_back(qname));
+			return true; });
+}
 
-	for (const auto &[prefix, uri] : m_namespaces)
+element *document::get_element_by_id(std::string_view id)
+{
+	return const_cast<element *>(const_cast<const document &>(*this).get_element_by_id(id));
+}
+
+const element *document::get_element_by_id(std::string_view id) const
+{
+	const element *result = nullptr;
+
+	if (m_use_index)
 	{
-		// assert(m_cur->type() == nodes_type::element);
-		if (prefix.empty())
-			static_cast<element *>(m_cur)->attributes().emplace("xmlns", uri);
-		else
-			static_cast<element *>(m_cur)->attributes().emplace("xmlns:"s + prefix, uri);
+		update_document_order();
+
+		if (auto i = m_id_index.find(std::string{ id }); i != m_id_index.end())
+			result = i->second;
+	}
+	else
+	{
+		visit_elements(*this, [id, &result](const element &e)
+			{
+				for (auto &a : e.attributes())
+				{
+					if (a.is_id() and a.value() == id)
+					{
+						result = &e;
+						break;
+					}
+				}
+
+				return result == nullptr; });
 	}
 
-	for (auto &a : atts)
+	return result;
+}
+
+const element_set *document::indexed_elements(const std::string &name) const
+{
+	if (not m_use_index)
+		return nullptr;
+
+	update_document_order();
+
+	static const element_set s_empty;
+	auto i = m_name_index.find(name);
+	return i != m_name_index.end() ? &i->second : &s_empty;
+}
+
+// --------------------------------------------------------------------
+// statistics
+
+namespace
+{
+
+// The memory allocated for the characters of \a s, if these do not fit
+// in the string object itself
+std::size_t allocated(const std::string &s)
+{
+	static const std::size_t kInline = std::string().capacity();
+	return s.capacity() > kInline ? s.capacity() + 1 : 0;
+}
+
+} // namespace
+
+document_stats document::get_stats() const
+{
+	document_stats result;
+
+	auto count = [&result](const element_container &c)
 	{
-		qname = a.m_name;
-		if (not a.m_ns.empty())
+		for (auto &n : c.nodes())
 		{
-			auto p = m_cur->prefix_for_namespace(a.m_ns);
-			if (not p.second)
-				throw exception("namespace not found: " + a.m_ns);
+			switch (n.type())
+			{
+				case node_type::text:
+					++result.texts;
+					result.memory += sizeof(text) + allocated(static_cast<const text &>(n).m_text);
+					break;
+
+				case node_type::cdata:
+					++result.cdata_sections;
+					result.memory += sizeof(cdata) + allocated(static_cast<const cdata &>(n).m_text);
+					break;
+
+				case node_type::comment:
+					++result.comments;
+					result.memory += sizeof(comment) + allocated(static_cast<const comment &>(n).m_text);
+					break;
+
+				case node_type::processing_instruction:
+				{
+					auto &pi = static_cast<const processing_instruction &>(n);
+					++result.processing_instructions;
+					result.memory += sizeof(processing_instruction) + allocated(pi.m_text) + allocated(pi.m_target);
+					break;
+				}
 
-			qname = p.first.empty() ? a.m_name : p.first + ':' + a.m_name;
+				default:
+					break;
+			}
 		}
+	};
+
+	count(*this);
+
+	visit_elements(*this, [&](const element &e)
+		{
+			++result.elements;
+			result.memory += sizeof(element);
+
+			for (auto &a : e.attributes())
+			{
+				++result.attributes;
+				result.memory += sizeof(attribute) + allocated(a.m_value);
+			}
+
+			count(e);
+
+			return true; });
 
-		static_cast<element *>(m_cur)->attributes().emplace(qname, a.m_value, a.m_id);
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+void document::XmlDeclHandler(encoding_type /*encoding*/, bool standalone, version_type version)
+{
+	m_has_xml_decl = true;
+	// m_encoding = encoding;
+	m_standalone = standalone;
+	m_version = version;
+
+	m_fmt.version = version;
+}
+
+void document::StartElementHandler(std::string_view name, std::string_view uri, const parser::attr_view_list_type &atts)
+{
+	// The declarations on this element come in scope first
+	m_ns_scope_marks.push_back(m_ns_scope.size());
+	m_ns_scope.insert(m_ns_scope.end(), m_namespaces.begin(), m_namespaces.end());
+
+	// The names and values are constructed in the tree directly from the
+	// views on the parser's buffers, they are copied only once.
+	m_cur = (element *)(static_cast<element *>(m_cur)->emplace_back(qualified_name(name, uri)));
+
+	if (m_record_handler and m_record == nullptr and is_record(*static_cast<element *>(m_cur)))
+		m_record = static_cast<element *>(m_cur);
+
+	auto &attributes = static_cast<element *>(m_cur)->attributes();
+
+	for (const auto &[prefix, uri] : m_namespaces)
+	{
+		m_qname.assign("xmlns");
+		if (not prefix.empty())
+		{
+			m_qname += ':';
+			m_qname += prefix;
+		}
+
+		attributes.emplace(std::string_view{ m_qname }, std::string_view{ uri });
 	}
 
+	for (auto &a : atts)
+		attributes.emplace(qualified_name(a.m_name, a.m_ns), a.m_value, a.m_id);
+
 	m_namespaces.clear();
 }
 
@@ -352,7 +602,18 @@ void document::EndElementHandler(const std::string & /*name*/, const std::string
 	assert(m_cur->name() == qname);
 #endif
 
+	m_ns_scope.resize(m_ns_scope_marks.back());
+	m_ns_scope_marks.pop_back();
+
+	auto e = m_cur;
 	m_cur = m_cur->parent();
+
+	if (e == m_record)
+	{
+		m_record = nullptr;
+		m_record_handler(*static_cast<element *>(e));
+		m_cur->erase(static_cast<element *>(e));
+	}
 }
 
 void document::CharacterDataHandler(const std::string &data)
@@ -360,7 +621,49 @@ void document::CharacterDataHandler(const std::string &data)
 	if (m_cdata != nullptr)
 		m_cdata->append(data);
 	else if (m_cur != this)
+	{
+		if (m_record_handler and m_record == nullptr and data.find_first_not_of(" \t\r\n") == std::string::npos)
+			return;
+
 		static_cast<element *>(m_cur)->add_text(data);
+	}
+}
+
+const std::string *document::prefix_in_scope(std::string_view uri) const
+{
+	// Search the elements from the inside out, the declarations of a
+	// single element are searched in order of appearance.
+	size_t end = m_ns_scope.size();
+	for (auto m = m_ns_scope_marks.rbegin(); m != m_ns_scope_marks.rend(); ++m)
+	{
+		for (auto i = *m; i < end; ++i)
+		{
+			if (m_ns_scope[i].second == uri)
+				return &m_ns_scope[i].first;
+		}
+		end = *m;
+	}
+
+	return nullptr;
+}
+
+std::string_view document::qualified_name(std::string_view name, std::string_view uri)
+{
+	if (uri.empty())
+		return name;
+
+	auto prefix = prefix_in_scope(uri);
+
+	if (prefix == nullptr)
+		throw exception("namespace not found: " + std::string{ uri });
+
+	if (prefix->empty())
+		return name;
+
+	m_qname.assign(*prefix);
+	m_qname += ':';
+	m_qname += name;
+	return m_qname;
 }
 
 void document::ProcessingInstructionHandler(const std::string &target, const std::string &data)
@@ -446,33 +749,455 @@ std::istream *document::external_entity_ref(const std::string &base, const std::
 	return result;
 }
 
+// --------------------------------------------------------------------
+// The parser used to construct documents. Events are passed on to the
+// document directly instead of via the std::function callbacks.
+
+class document_builder : public parser
+{
+  public:
+	document_builder(document &doc, std::istream &is)
+		: parser(is)
+		, m_doc(doc)
+	{
+	}
+
+	document_builder(document &doc, std::string_view data)
+		: parser(data)
+		, m_doc(doc)
+	{
+	}
+
+	void build()
+	{
+		m_doc.m_cur = &m_doc;
+		m_doc.m_ns_scope.clear();
+		m_doc.m_ns_scope_marks.clear();
+
+		// records are removed as soon as they are processed, an arena
+		// would only grow in that case.
+		std::pmr::memory_resource *arena = nullptr;
+		if (m_doc.m_use_arena and not m_doc.m_record_handler)
+		{
+			if (m_doc.m_arenas.empty())
+				m_doc.m_arenas.emplace_back(std::make_unique<std::pmr::monotonic_buffer_resource>(kInitialArenaSize));
+			arena = m_doc.m_arenas.front().get();
+		}
+
+		node_resource_scope scope(arena);
+
+		set_dtd_cache(m_doc.m_dtd_cache);
+
+		parse(m_doc.m_validating, m_doc.m_validating_ns);
+
+		m_doc.m_parser_stats = get_stats();
+
+		assert(m_doc.m_cur == &m_doc);
+	}
+
+  protected:
+	void xml_decl(encoding_type encoding, bool standalone, version_type version) override
+	{
+		m_doc.XmlDeclHandler(encoding, standalone, version);
+	}
+
+	void doctype_decl(const std::string &root, const std::string &publicId, const std::string &uri) override
+	{
+		m_doc.DoctypeDeclHandler(root, publicId, uri);
+	}
+
+	void start_element(std::string_view name, std::string_view uri, const attr_view_list_type &atts) override
+	{
+		m_doc.StartElementHandler(name, uri, atts);
+	}
+
+	void end_element(const std::string &name, const std::string &uri) override
+	{
+		m_doc.EndElementHandler(name, uri);
+	}
+
+	void character_data(const std::string &data) override
+	{
+		m_doc.CharacterDataHandler(data);
+	}
+
+	void processing_instruction(const std::string &target, const std::string &data) override
+	{
+		m_doc.ProcessingInstructionHandler(target, data);
+	}
+
+	void comment(const std::string &data) override
+	{
+		m_doc.CommentHandler(data);
+	}
+
+	void start_cdata_section() override
+	{
+		if (m_doc.m_preserve_cdata)
+			m_doc.StartCdataSectionHandler();
+	}
+
+	void end_cdata_section() override
+	{
+		if (m_doc.m_preserve_cdata)
+			m_doc.EndCdataSectionHandler();
+	}
+
+	void start_namespace_decl(const std::string &prefix, const std::string &uri) override
+	{
+		m_doc.StartNamespaceDeclHandler(prefix, uri);
+	}
+
+	void notation_decl(const std::string &name, const std::string &systemId, const std::string &publicId) override
+	{
+		m_doc.NotationDeclHandler(name, systemId, publicId);
+	}
+
+	std::istream *external_entity_ref(const std::string &base, const std::string &pubid, const std::string &uri) override
+	{
+		return m_doc.external_entity_ref(base, pubid, uri);
+	}
+
+	// external_entity_ref falls back to the DTD directory for files not found
+	std::string dtd_location(const std::string &base, const std::string &uri) override
+	{
+		auto result = parser::dtd_location(base, uri);
+
+		std::error_code ec;
+		if (not m_doc.m_dtd_dir.empty() and not std::filesystem::exists(result, ec))
+			result = m_doc.m_dtd_dir + '/' + result;
+
+		return result;
+	}
+
+  private:
+	static constexpr size_t kInitialArenaSize = 64 * 1024;
+
+	document &m_doc;
+};
+
 void document::parse(std::istream &is)
 {
-	parser p(is);
+	document_builder b(*this, is);
+	b.build();
+}
 
-	using namespace std::placeholders;
+void document::parse(std::string_view s)
+{
+	document_builder b(*this, s);
+	b.build();
+}
+
+void document::parse(const std::filesystem::path &file)
+{
+	mapped_file data(file);
+	parse(data.view());
+}
+
+// --------------------------------------------------------------------
 
-	p.xml_decl_handler = std::bind(&document::XmlDeclHandler, this, _1, _2, _3);
-	p.doctype_decl_handler = std::bind(&document::DoctypeDeclHandler, this, _1, _2, _3);
-	p.start_element_handler = std::bind(&document::StartElementHandler, this, _1, _2, _3);
-	p.end_element_handler = std::bind(&document::EndElementHandler, this, _1, _2);
-	p.character_data_handler = std::bind(&document::CharacterDataHandler, this, _1);
-	if (m_preserve_cdata)
+bool document::is_record(const element &e) const
+{
+	const element_container *p = &e;
+
+	for (auto n = m_record_path.rbegin(); n != m_record_path.rend(); ++n)
 	{
-		p.start_cdata_section_handler = std::bind(&document::StartCdataSectionHandler, this);
-		p.end_cdata_section_handler = std::bind(&document::EndCdataSectionHandler, this);
+		if (p == this or static_cast<const element *>(p)->qname_atom().str() != *n)
+			return false;
+		p = p->parent();
 	}
-	p.start_namespace_decl_handler = std::bind(&document::StartNamespaceDeclHandler, this, _1, _2);
-	p.processing_instruction_handler = std::bind(&document::ProcessingInstructionHandler, this, _1, _2);
-	p.comment_handler = std::bind(&document::CommentHandler, this, _1);
-	p.notation_decl_handler = std::bind(&document::NotationDeclHandler, this, _1, _2, _3);
-	p.external_entity_ref_handler = std::bind(&document::external_entity_ref, this, _1, _2, _3);
 
-	m_cur = this;
+	return not m_record_path_absolute or p == this;
+}
+
+template <typename Data>
+void document::parse_records_imp(Data &&data, std::string_view path, std::function<void(element &)> &&handler)
+{
+	if (not handler)
+		throw exception("No handler specified for parse_records");
 
-	p.parse(m_validating, m_validating_ns);
+	m_record_path.clear();
+	m_record_path_absolute = path.starts_with('/');
 
-	assert(m_cur == this);
+	std::string_view::size_type b = m_record_path_absolute ? 1 : 0;
+	for (;;)
+	{
+		auto e = path.find('/', b);
+		m_record_path.emplace_back(path.substr(b, e - b));
+		if (m_record_path.back().empty())
+			throw exception("Invalid path for parse_records: " + std::string{ path });
+		if (e == std::string_view::npos)
+			break;
+		b = e + 1;
+	}
+
+	m_record_handler = std::move(handler);
+	m_record = nullptr;
+
+	try
+	{
+		parse(data);
+	}
+	catch (...)
+	{
+		m_record_handler = {};
+		m_record = nullptr;
+		throw;
+	}
+
+	m_record_handler = {};
+}
+
+void document::parse_records(std::istream &is, std::string_view path, std::function<void(element &)> handler)
+{
+	parse_records_imp(is, path, std::move(handler));
+}
+
+void document::parse_records(std::string_view data, std::string_view path, std::function<void(element &)> handler)
+{
+	parse_records_imp(data, path, std::move(handler));
+}
+
+// --------------------------------------------------------------------
+// Support for parallel parsing. A quick scan over the input locates the
+// root element and the boundaries between its child elements.
+
+struct split_info
+{
+	std::string m_prefix; // XML declaration followed by the root start tag
+	std::string m_suffix; // the root end tag
+	std::vector<size_t> m_splits;
+};
+
+bool find_split_points(std::string_view data, size_t chunk_size, split_info &info)
+{
+	using namespace std::literals;
+
+	const auto npos = std::string_view::npos;
+
+	size_t p = 0;
+
+	if (data.starts_with("\xfe\xff"sv) or data.starts_with("\xff\xfe"sv))
+		return false;
+
+	if (data.starts_with("\xef\xbb\xbf"sv))
+		p = 3;
+
+	std::string xml_decl;
+
+	// the prolog
+	for (;;)
+	{
+		p = data.find_first_not_of(" \t\r\n", p);
+		if (p == npos or data[p] != '<')
+			return false;
+
+		auto s = data.substr(p);
+
+		if (s.starts_with("<?xml "sv) or s.starts_with("<?xml\t"sv) or s.starts_with("<?xml\n"sv) or s.starts_with("<?xml\r"sv))
+		{
+			auto e = data.find("?>"sv, p);
+			if (e == npos)
+				return false;
+			xml_decl = data.substr(p, e + 2 - p);
+			p = e + 2;
+		}
+		else if (s.starts_with("<?"sv))
+		{
+			auto e = data.find("?>"sv, p);
+			if (e == npos)
+				return false;
+			p = e + 2;
+		}
+		else if (s.starts_with("<!--"sv))
+		{
+			auto e = data.find("-->"sv, p);
+			if (e == npos)
+				return false;
+			p = e + 3;
+		}
+		else if (s.starts_with("<!"sv)) // DOCTYPE, no way we're going to split this
+			return false;
+		else
+			break;
+	}
+
+	// helper to skip over a tag, returns position after the closing '>'
+	auto skip_tag = [data](size_t p) -> size_t
+	{
+		for (;;)
+		{
+			p = data.find_first_of("\"'>", p);
+			if (p == npos)
+				break;
+
+			if (data[p] == '>')
+				return p + 1;
+
+			p = data.find(data[p], p + 1);
+			if (p == npos)
+				break;
+			++p;
+		}
+
+		return npos;
+	};
+
+	size_t root_start = p;
+	size_t root_name_end = data.find_first_of(" \t\r\n/>", root_start);
+	size_t root_end = skip_tag(root_start);
+
+	if (root_name_end == npos or root_end == npos or data[root_end - 2] == '/')
+		return false;
+
+	info.m_prefix = xml_decl + std::string{ data.substr(root_start, root_end - root_start) };
+	info.m_suffix = "</" + std::string{ data.substr(root_start + 1, root_name_end - root_start - 1) } + ">";
+	info.m_splits.clear();
+
+	// the content
+	int depth = 0;
+	size_t next_split = root_end + chunk_size;
+
+	for (p = root_end;;)
+	{
+		p = data.find('<', p);
+		if (p == npos)
+			return false;
+
+		auto s = data.substr(p);
+
+		if (s.starts_with("<!--"sv))
+			p = data.find("-->"sv, p);
+		else if (s.starts_with("<![CDATA["sv))
+			p = data.find("]]>"sv, p);
+		else if (s.starts_with("<?"sv))
+			p = data.find("?>"sv, p);
+		else if (s.starts_with("<!"sv))
+			return false;
+		else if (s.starts_with("</"sv))
+		{
+			if (depth-- == 0)
+				break; // the end tag of the root element
+			p = skip_tag(p);
+		}
+		else
+		{
+			if (depth == 0 and p >= next_split)
+			{
+				info.m_splits.push_back(p);
+				next_split = p + chunk_size;
+			}
+
+			p = skip_tag(p);
+			if (p != npos and data[p - 2] != '/')
+				++depth;
+		}
+
+		if (p == npos)
+			return false;
+		++p;
+	}
+
+	return not info.m_splits.empty();
+}
+
+void document::parse_parallel(std::string_view data)
+{
+	parse_parallel(data, thread_pool::instance());
+}
+
+void document::parse_parallel(std::string_view data, thread_pool &pool)
+{
+	// Parts smaller than this are not worth the overhead
+	const size_t kMinChunkSize = 256 * 1024;
+
+	const unsigned threads = pool.size();
+
+	split_info info;
+
+	if (threads <= 1 or m_validating or data.length() < 2 * kMinChunkSize or
+		not find_split_points(data, std::max(kMinChunkSize, data.length() / (4 * threads)), info))
+	{
+		parse(data);
+		return;
+	}
+
+	const auto &splits = info.m_splits;
+	size_t n = splits.size() + 1;
+
+	// The first part is parsed into this document directly, on this thread
+	std::vector<document> parts(n - 1);
+	std::vector<std::exception_ptr> errors(n);
+
+	pool.run(n, [&](size_t i)
+		{
+			try
+			{
+				if (i == 0)
+				{
+					std::string text{ data.substr(0, splits.front()) };
+					text.append(info.m_suffix);
+
+					parse(std::string_view{ text });
+				}
+				else
+				{
+					auto &part = parts[i - 1];
+					part.m_preserve_cdata = m_preserve_cdata;
+					part.m_validating_ns = m_validating_ns;
+					part.m_use_arena = m_use_arena;
+
+					std::string text = info.m_prefix;
+					if (i < n - 1)
+						text.append(data.substr(splits[i - 1], splits[i] - splits[i - 1])).append(info.m_suffix);
+					else
+						text.append(data.substr(splits[i - 1]));
+
+					part.parse(std::string_view{ text });
+				}
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		});
+
+	// report the first error in the document
+	for (auto &e : errors)
+	{
+		if (e)
+			std::rethrow_exception(e);
+	}
+
+	// Move the content into our own root element, in order. The children
+	// of the moved nodes stay where they were allocated, so we take over
+	// the arenas of the parts.
+	auto root = child();
+	assert(root != nullptr);
+
+	node_resource_scope scope(m_arenas.empty() ? nullptr : m_arenas.front().get());
+
+	for (auto &part : parts)
+	{
+		std::move(part.m_arenas.begin(), part.m_arenas.end(), std::back_inserter(m_arenas));
+		part.m_arenas.clear();
+
+		auto part_root = part.child();
+		assert(part_root != nullptr);
+
+		for (auto &n : part_root->nodes())
+			root->nodes().emplace_back(std::move(n));
+	}
+
+	// and the nodes following the root element in the last part
+	bool after_root = false;
+	for (auto &n : parts.back().nodes())
+	{
+		if (after_root)
+			nodes().emplace_back(std::move(n));
+		else if (&n == parts.back().child())
+			after_root = true;
+	}
 }
 
 std::string document::str() const
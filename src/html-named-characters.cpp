@@ -26,12 +26,24 @@
 
 #include "mxml/doctype.hpp"
 
+#include <array>
+#include <cstdint>
+#include <deque>
 #include <string>
+#include <string_view>
 
 namespace mxml::doctype
 {
 
-general_entity kNamedHTMLCharacters[] = {
+namespace
+{
+
+struct named_character
+{
+	std::string_view m_name, m_value;
+};
+
+constexpr named_character kNamedHTMLCharacters[] = {
 	{ "AElig", "Æ" },
 	{ "AMP", "&" },
 	{ "Aacute", "Á" },
@@ -2159,22 +2171,86 @@ general_entity kNamedHTMLCharacters[] = {
 	{ "zwnj", "‌" }
 };
 
+constexpr std::size_t kNamedHTMLCharacterCount = std::size(kNamedHTMLCharacters);
+
+// FNV-1a
+constexpr std::uint32_t hash_name(std::string_view name)
+{
+	std::uint32_t h = 2166136261u;
+	for (char ch : name)
+	{
+		h ^= static_cast<unsigned char>(ch);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// A hash table for the names, computed at compile time. A slot contains
+// the index in kNamedHTMLCharacters plus one, or zero when it is empty.
+// Collisions are resolved by linear probing, the table is about a quarter
+// full so almost all names are found in the first slot.
+
+constexpr std::size_t kHashTableSize = 8192;
+
+constexpr auto kHashTable = []()
+{
+	std::array<std::uint16_t, kHashTableSize> table{};
+
+	for (std::size_t i = 0; i < kNamedHTMLCharacterCount; ++i)
+	{
+		auto slot = hash_name(kNamedHTMLCharacters[i].m_name) % kHashTableSize;
+		while (table[slot] != 0)
+			slot = (slot + 1) % kHashTableSize;
+		table[slot] = static_cast<std::uint16_t>(i + 1);
+	}
+
+	return table;
+}();
+
+constexpr std::size_t max_probe_length()
+{
+	std::size_t result = 0;
+
+	for (std::size_t i = 0; i < kNamedHTMLCharacterCount; ++i)
+	{
+		std::size_t n = 1;
+		for (auto slot = hash_name(kNamedHTMLCharacters[i].m_name) % kHashTableSize;
+			 kHashTable[slot] != i + 1; slot = (slot + 1) % kHashTableSize)
+		{
+			++n;
+		}
+
+		if (result < n)
+			result = n;
+	}
+
+	return result;
+}
+
+static_assert(max_probe_length() <= 8, "too many collisions in the named character table");
+
+} // namespace
+
 const general_entity *get_named_character(std::string_view name)
 {
-	int L = 0, R = sizeof(kNamedHTMLCharacters) / sizeof(general_entity);
-	while (L <= R)
+	// The entity objects are only created when HTML named characters are
+	// used. Their order is the same as in kNamedHTMLCharacters.
+	static const std::deque<general_entity> s_entities = []()
+	{
+		std::deque<general_entity> result;
+		for (auto &nc : kNamedHTMLCharacters)
+			result.emplace_back(std::string{ nc.m_name }, std::string{ nc.m_value });
+		return result;
+	}();
+
+	for (auto slot = hash_name(name) % kHashTableSize; kHashTable[slot] != 0; slot = (slot + 1) % kHashTableSize)
 	{
-		int i = (L + R) / 2;
-		int d = kNamedHTMLCharacters[i].name().compare(name);
-		if (d == 0)
-			return kNamedHTMLCharacters + i;
-		if (d < 0)
-			L = i + 1;
-		else
-			R = i - 1;
+		auto i = kHashTable[slot] - 1;
+		if (kNamedHTMLCharacters[i].m_name == name)
+			return &s_entities[i];
 	}
 
 	return nullptr;
 }
 
-} // namespace mxml::doctype
\ No newline at end of file
+} // namespace mxml::doctype
@@ -30,6 +30,7 @@
 
 #include <cassert>
 #include <map>
+#include <mutex>
 #include <set>
 #include <stack>
 #include <string>
@@ -44,85 +45,42 @@ const std::set<std::string> kEmptyHTMLElements{
 
 // --------------------------------------------------------------------
 
-void write_string(std::ostream &os, const std::string &s, bool escape_whitespace, bool escape_quot, bool trim, version_type version)
+node::~node()
 {
-	bool last_is_space = false;
-
-	auto sp = s.cbegin();
-	auto se = s.cend();
-
-	while (sp < se)
-	{
-		auto sb = sp;
+}
 
-		char32_t c = pop_front_char(sp, se);
+void node::write(std::ostream &os, format_info fmt) const
+{
+	writer w(os);
+	write_to(w, fmt);
+}
 
-		switch (c)
-		{
-			case '&':
-				os << "&amp;";
-				last_is_space = false;
-				break;
-			case '<':
-				os << "&lt;";
-				last_is_space = false;
-				break;
-			case '>':
-				os << "&gt;";
-				last_is_space = false;
-				break;
-			case '\"':
-				if (escape_quot)
-					os << "&quot;";
-				else
-					os << static_cast<char>(c);
-				last_is_space = false;
-				break;
-			case '\n':
-				if (escape_whitespace)
-					os << "&#10;";
-				else
-					os << static_cast<char>(c);
-				last_is_space = true;
-				break;
-			case '\r':
-				if (escape_whitespace)
-					os << "&#13;";
-				else
-					os << static_cast<char>(c);
-				last_is_space = false;
-				break;
-			case '\t':
-				if (escape_whitespace)
-					os << "&#9;";
-				else
-					os << static_cast<char>(c);
-				last_is_space = false;
-				break;
-			case ' ':
-				if (not trim or not last_is_space)
-					os << ' ';
-				last_is_space = true;
-				break;
-			case 0: throw exception("Invalid null character in XML content");
-			default:
-				if (c >= 0x0A0 or (version == version_type{ 1, 0 } ? is_valid_xml_1_0_char(c) : is_valid_xml_1_1_char(c)))
-					for (auto ci = sb; ci < sp; ++ci)
-						os << *ci;
-				else
-					os << "&#" << static_cast<int>(c) << ';';
-				last_is_space = false;
-				break;
-		}
+thread_local std::pmr::memory_resource *node::s_resource = nullptr;
 
-		sb = sp;
-	}
+void *node::operator new(std::size_t size)
+{
+	if (s_resource != nullptr)
+		return s_resource->allocate(size, alignof(std::max_align_t));
+	return ::operator new(size);
 }
 
-// --------------------------------------------------------------------
+// only used when a constructor throws, the resource is still the same
+void node::operator delete(void *p, std::size_t size)
+{
+	if (s_resource != nullptr)
+		s_resource->deallocate(p, size, alignof(std::max_align_t));
+	else
+		::operator delete(p, size);
+}
 
-node::~node()
+void node::operator delete(node *n, std::destroying_delete_t, std::size_t size)
 {
+	bool in_arena = n->m_in_arena;
+
+	n->~node();
+
+	if (not in_arena)
+		::operator delete(n, size);
 }
 
 element_container *node::root()
@@ -141,6 +99,18 @@ const element_container *node::root() const
 	return result;
 }
 
+std::size_t node::document_order() const
+{
+	const node *n = this;
+	if (n->type() != node_type::element and n->type() != node_type::document)
+		n = m_parent;
+
+	if (n != nullptr)
+		static_cast<const element_container *>(n)->update_document_order();
+
+	return m_order;
+}
+
 bool node::equals(const node *n) const
 {
 	assert(false);
@@ -225,6 +195,13 @@ void basic_node_list::clear()
 {
 	// avoid deep recursion and stack overflows
 
+	invalidate_document_order(m_header->m_parent);
+
+	// removed elements are deleted, only declarations matter here. This is
+	// also called by destructors, when the parent may be partly destroyed.
+	if (m_header->m_next != m_header and m_header->m_next->type() == node_type::attribute)
+		invalidate_namespaces(m_header->m_parent);
+
 	std::stack<basic_node_list *> stack;
 
 	stack.push(this);
@@ -233,34 +210,29 @@ void basic_node_list::clear()
 	{
 		auto nl = stack.top();
 
-		for (auto n = nl->m_header->m_next; n != nl->m_header; n = n->m_next)
-		{
-			if (n->type() != node_type::element)
-				continue;
-
-			auto e = static_cast<element_container *>(n);
-			if (e->empty())
-				continue;
-
-			stack.push(e);
-			break;
-		}
-
-		if (stack.top() != nl)
-			continue;
-
-		// nothing was added, we can safely delete nl
-		stack.pop();
-
+		// delete the leading nodes that have no children left, descend
+		// into the first one that does. Nodes are unlinked as we go so
+		// the list is never scanned twice.
 		for (auto n = nl->m_header->m_next; n != nl->m_header;)
 		{
+			if (n->type() == node_type::element and not static_cast<element_container *>(n)->empty())
+			{
+				stack.push(static_cast<element_container *>(n));
+				break;
+			}
+
 			auto t = n->m_next;
+			nl->m_header->m_next = t;
+			t->m_prev = nl->m_header;
+
 			assert(n->type() != node_type::header);
 			delete n;
 			n = t;
 		}
 
-		nl->m_header->m_next = nl->m_header->m_prev = nl->m_header;
+		// nothing was added, nl is now empty
+		if (stack.top() == nl)
+			stack.pop();
 	}
 }
 
@@ -276,6 +248,13 @@ node *basic_node_list::insert_impl(const node *p, node *n)
 	if (n->parent() != nullptr or n->next() != n or n->prev() != n)
 		throw exception("attempt to add a node that already has a parent or siblings");
 
+	invalidate_document_order(m_header->m_parent);
+
+	if (n->type() == node_type::element)
+		invalidate_namespaces(static_cast<element *>(n));
+	else if (n->type() == node_type::attribute and static_cast<attribute *>(n)->is_namespace())
+		invalidate_namespaces(m_header->m_parent);
+
 	n->parent(m_header->m_parent);
 
 	n->prev(p->prev());
@@ -294,6 +273,12 @@ node *basic_node_list::erase_impl(node *n)
 	if (n->m_parent != m_header->m_parent)
 		throw exception("attempt to remove node whose parent is invalid");
 
+	invalidate_document_order(m_header->m_parent);
+
+	// removed elements are deleted, only declarations matter here
+	if (n->type() == node_type::attribute and static_cast<attribute *>(n)->is_namespace())
+		invalidate_namespaces(m_header->m_parent);
+
 	node *result = n->next();
 
 	n->next()->prev(n->prev());
@@ -307,45 +292,103 @@ node *basic_node_list::erase_impl(node *n)
 	return result;
 }
 
+void basic_node_list::invalidate_document_order(element_container *e) noexcept
+{
+	// A tree that was numbered has all its elements marked valid, and an
+	// element marked invalid has only invalid ancestors. So we can stop at
+	// the first one that is invalid already, which makes building a tree
+	// one node at a time cheap.
+	while (e != nullptr and e->m_order_valid.load(std::memory_order_relaxed))
+	{
+		e->m_order_valid.store(false, std::memory_order_relaxed);
+		e = e->m_parent;
+	}
+}
+
+// --------------------------------------------------------------------
+// The namespaces in scope of an element are cached. A cache is valid as
+// long as its generation equals s_ns_generation. That counter is
+// incremented by any change that affects the namespaces in scope of an
+// element with a valid cache, which invalidates all caches at once. The
+// caches of an element are only computed after those of its parent, so
+// the descendants of an element without a valid cache have none either
+// and changes to them need not be counted.
+
+namespace
+{
+	std::atomic<std::size_t> s_ns_generation = 1;
+	std::mutex s_ns_mutex;
+} // namespace
+
+struct element::namespace_scope
+{
+	// The number of elements using this scope, elements without
+	// declarations of their own share the scope of their parent
+	std::atomic<std::size_t> m_refs = 1;
+
+	// Pairs of prefix and uri, the declarations of the innermost element
+	// first. These are views on the attributes, they are not read anymore
+	// once those attributes change since that invalidates the scope.
+	std::vector<std::pair<std::string_view, std::string_view>> m_bindings;
+
+	static void release(namespace_scope *scope) noexcept
+	{
+		if (scope != nullptr and scope->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete scope;
+	}
+};
+
+void basic_node_list::invalidate_namespaces(const element_container *e) noexcept
+{
+	if (e != nullptr and e->type() == node_type::element)
+	{
+		auto generation = s_ns_generation.load(std::memory_order_relaxed);
+		if (static_cast<const element *>(e)->m_ns_generation.load(std::memory_order_relaxed) == generation)
+			s_ns_generation.fetch_add(1, std::memory_order_release);
+	}
+}
+
 // --------------------------------------------------------------------
 // comment
 
-void comment::write(std::ostream &os, format_info fmt) const
+void comment::write_to(writer &w, format_info fmt) const
 {
 	if (not fmt.suppress_comments)
 	{
-		os << "<!--";
+		w.write("<!--");
 
 		bool lastWasHyphen = false;
 		for (char ch : m_text)
 		{
 			if (ch == '-' and lastWasHyphen)
-				os << ' ';
+				w.put(' ');
 
-			os << ch;
+			w.put(ch);
 			lastWasHyphen = ch == '-';
 		}
 
-		os << "-->";
+		w.write("-->");
 
 		if (fmt.indent_width != 0)
-			os << '\n';
+			w.put('\n');
 	}
 }
 
 // --------------------------------------------------------------------
 // processing_instruction
 
-void processing_instruction::write(std::ostream &os, format_info fmt) const
+void processing_instruction::write_to(writer &w, format_info fmt) const
 {
 	if (fmt.indent)
-		os << '\n'
-		   << std::string(fmt.indent_level * fmt.indent_width, ' ');
+	{
+		w.put('\n');
+		w.fill(' ', fmt.indent_level * fmt.indent_width);
+	}
 
-	os << "<?" << m_target << ' ' << m_text << "?>";
+	w << "<?" << m_target << ' ' << m_text << "?>";
 
 	if (fmt.indent != 0)
-		os << '\n';
+		w.put('\n');
 }
 
 // --------------------------------------------------------------------
@@ -385,24 +428,26 @@ bool text::is_space() const
 	return result;
 }
 
-void text::write(std::ostream &os, format_info fmt) const
+void text::write_to(writer &w, format_info fmt) const
 {
-	write_string(os, m_text, fmt.escape_white_space, fmt.escape_double_quote, false, fmt.version);
+	w.write_escaped(m_text, fmt.escape_white_space, fmt.escape_double_quote, fmt.version);
 }
 
 // --------------------------------------------------------------------
 // cdata
 
-void cdata::write(std::ostream &os, format_info fmt) const
+void cdata::write_to(writer &w, format_info fmt) const
 {
 	if (fmt.indent)
-		os << '\n'
-		   << std::string(fmt.indent_level * fmt.indent_width, ' ');
+	{
+		w.put('\n');
+		w.fill(' ', fmt.indent_level * fmt.indent_width);
+	}
 
-	os << "<![CDATA[" << m_text << "]]>";
+	w << "<![CDATA[" << m_text << "]]>";
 
 	if (fmt.indent)
-		os << '\n';
+		w.put('\n');
 }
 
 // --------------------------------------------------------------------
@@ -416,48 +461,130 @@ std::string attribute::uri() const
 	return m_value;
 }
 
-void attribute::write(std::ostream &os, format_info fmt) const
+void attribute::write_to(writer &w, format_info fmt) const
 {
 	if (fmt.indent_width != 0)
-		os << '\n'
-		   << std::string(fmt.indent_width, ' ');
+	{
+		w.put('\n');
+		w.fill(' ', fmt.indent_width);
+	}
 	else
-		os << ' ';
+		w.put(' ');
 
-	os << m_qname << "=\"";
+	w << m_qname.str() << "=\"";
 
-	write_string(os, m_value, fmt.escape_white_space, true, false, fmt.version);
+	w.write_escaped(m_value, fmt.escape_white_space, true, fmt.version);
 
-	os << '"';
+	w.put('"');
 }
 
 // --------------------------------------------------------------------
 // element_container
 
+namespace
+{
+	// collect the text in one string, instead of concatenating the result
+	// of str() for each level
+	void append_str(const element_container &c, std::string &result)
+	{
+		for (auto &n : c.nodes())
+		{
+			if (n.type() == node_type::element)
+				append_str(static_cast<const element &>(n), result);
+			else
+				result += n.str();
+		}
+	}
+} // namespace
+
 std::string element_container::str() const
 {
 	std::string result;
-
-	for (auto &n : nodes())
-		result += n.str();
-
+	append_str(*this, result);
 	return result;
 }
 
-void element_container::write(std::ostream &os, format_info fmt) const
+void element_container::write_to(writer & /*w*/, format_info /*fmt*/) const
+{
+}
+
+void element_container::update_document_order() const
 {
+	const element_container *top = this;
+	while (top->m_parent != nullptr)
+		top = top->m_parent;
+
+	if (top->m_order_valid.load(std::memory_order_acquire))
+		return;
+
+	// Several threads may be evaluating xpaths over the same const tree
+	static std::mutex s_order_mutex;
+	std::lock_guard lock(s_order_mutex);
+
+	if (top->m_order_valid.load(std::memory_order_relaxed))
+		return;
+
+	std::size_t nr = 0;
+
+	struct frame
+	{
+		const element_container *m_container;
+		const node *m_next;
+	};
+
+	std::vector<frame> stack;
+
+	auto enter = [&](const element_container *e)
+	{
+		e->m_order = nr++;
+
+		if (e->type() == node_type::element)
+		{
+			for (auto &a : static_cast<const element *>(e)->attributes())
+				a.m_order = nr++;
+		}
+
+		stack.push_back({ e, e->m_header->m_next });
+	};
+
+	enter(top);
+
+	while (not stack.empty())
+	{
+		auto &f = stack.back();
+
+		if (f.m_next == f.m_container->m_header)
+		{
+			if (f.m_container != top)
+				f.m_container->m_order_valid.store(true, std::memory_order_relaxed);
+			stack.pop_back();
+			continue;
+		}
+
+		auto n = f.m_next;
+		f.m_next = n->m_next;
+
+		if (n->type() == node_type::element)
+			enter(static_cast<const element *>(n));
+		else
+			n->m_order = nr++;
+	}
+
+	top->update_indexes();
+
+	top->m_order_valid.store(true, std::memory_order_release);
 }
 
 element_set element_container::find(const std::string &path) const
 {
-	return xpath(path).evaluate<element>(*this);
+	return xpath::cached(path).evaluate<element>(*this);
 }
 
 element_container::iterator element_container::find_first(const std::string &path)
 {
-	element_set s = xpath(path).evaluate<element>(*this);
+	element *e = xpath::cached(path).first<element>(*this);
 
-	return s.empty() ? end() : iterator(s.front());
+	return e == nullptr ? end() : iterator(e);
 }
 
 element_container::const_iterator element_container::find_first(const std::string &path) const
@@ -671,61 +798,139 @@ void element::flatten_text()
 	}
 }
 
-std::string element::namespace_for_prefix(const std::string &prefix) const
+element::~element()
 {
-	std::string result;
+	namespace_scope::release(m_ns_scope.load(std::memory_order_relaxed));
+}
 
-	for (auto &a : m_attributes)
-	{
-		if (not a.is_namespace())
-			continue;
+auto element::in_scope() const -> const namespace_scope *
+{
+	auto generation = s_ns_generation.load(std::memory_order_acquire);
+	if (m_ns_generation.load(std::memory_order_acquire) == generation)
+		return m_ns_scope.load(std::memory_order_relaxed);
 
-		if (a.name() == "xmlns")
-		{
-			if (prefix.empty())
-			{
-				result = a.value();
-				break;
-			}
-			continue;
-		}
+	std::unique_lock lock(s_ns_mutex);
+
+	// collect the elements without a valid scope, starting here and
+	// stopping at the first ancestor that has one
+	std::vector<const element *> stale{ this };
+	namespace_scope *scope = nullptr;
 
-		if (a.name() == prefix)
+	for (auto p = m_parent; p != nullptr and p->type() == node_type::element; p = p->m_parent)
+	{
+		auto e = static_cast<const element *>(p);
+		if (e->m_ns_generation.load(std::memory_order_acquire) == generation)
 		{
-			result = a.value();
+			scope = e->m_ns_scope.load(std::memory_order_relaxed);
 			break;
 		}
+		stale.push_back(e);
 	}
 
-	if (result.empty() and m_parent != nullptr)
-		result = m_parent->namespace_for_prefix(prefix);
+	for (auto e = stale.rbegin(); e != stale.rend(); ++e)
+	{
+		(*e)->update_in_scope(scope, generation);
+		scope = (*e)->m_ns_scope.load(std::memory_order_relaxed);
+	}
 
-	return result;
+	return scope;
 }
 
-std::pair<std::string, bool> element::prefix_for_namespace(const std::string &uri) const
+void element::update_in_scope(namespace_scope *parent, std::size_t generation) const
 {
-	std::string result;
-	bool found = false;
+	auto current = m_ns_scope.load(std::memory_order_relaxed);
+	auto scope = parent;
 
-	for (auto &a : m_attributes)
+	if (std::any_of(m_attributes.begin(), m_attributes.end(), [](const attribute &a) { return a.is_namespace(); }))
 	{
-		if (not a.is_namespace())
-			continue;
+		std::vector<std::pair<std::string_view, std::string_view>> bindings;
 
-		if (a.value() == uri)
+		for (auto &a : m_attributes)
 		{
-			found = true;
-			if (a.get_qname().length() > 6)
-				result = a.get_qname().substr(6);
-			break;
+			if (not a.is_namespace())
+				continue;
+
+			std::string_view qn = a.m_qname.str();
+			bindings.emplace_back(qn.substr(qn.length() > 5 ? 6 : 5), a.m_value);
+		}
+
+		if (parent != nullptr)
+			bindings.insert(bindings.end(), parent->m_bindings.begin(), parent->m_bindings.end());
+
+		// Keep the current scope if it refers to exactly the same strings.
+		// Other threads may be reading it, this happens when the scopes of
+		// a tree that did not change are revalidated after a change to
+		// another tree.
+		auto same = [](std::string_view a, std::string_view b)
+		{
+			return a.data() == b.data() and a.length() == b.length();
+		};
+
+		auto same_binding = [same](auto &a, auto &b)
+		{
+			return same(a.first, b.first) and same(a.second, b.second);
+		};
+
+		if (current != nullptr and
+			std::equal(bindings.begin(), bindings.end(), current->m_bindings.begin(), current->m_bindings.end(), same_binding))
+			scope = current;
+		else
+		{
+			scope = new namespace_scope;
+			scope->m_bindings = std::move(bindings);
+		}
+	}
+	else if (scope != nullptr and scope != current)
+		scope->m_refs.fetch_add(1, std::memory_order_relaxed);
+
+	if (scope != current)
+	{
+		m_ns_scope.store(scope, std::memory_order_relaxed);
+		namespace_scope::release(current);
+	}
+
+	m_ns_generation.store(generation, std::memory_order_release);
+}
+
+std::string_view element::uri_for_prefix(std::string_view prefix) const
+{
+	if (auto scope = in_scope(); scope != nullptr)
+	{
+		// an empty uri undeclares the prefix, continue with the parent
+		for (auto &[p, uri] : scope->m_bindings)
+		{
+			if (p == prefix and not uri.empty())
+				return uri;
 		}
 	}
 
-	if (not found and m_parent != nullptr)
-		std::tie(result, found) = m_parent->prefix_for_namespace(uri);
+	return {};
+}
+
+std::string element::get_ns() const
+{
+	std::string_view qn = m_qname.str();
+	auto colon = qn.find(':');
+	return std::string{ uri_for_prefix(colon != std::string_view::npos ? qn.substr(0, colon) : std::string_view{}) };
+}
+
+std::string element::namespace_for_prefix(const std::string &prefix) const
+{
+	return std::string{ uri_for_prefix(prefix) };
+}
+
+std::pair<std::string, bool> element::prefix_for_namespace(const std::string &uri) const
+{
+	if (auto scope = in_scope(); scope != nullptr)
+	{
+		for (auto &[prefix, u] : scope->m_bindings)
+		{
+			if (u == uri)
+				return { std::string{ prefix }, true };
+		}
+	}
 
-	return make_pair(result, found);
+	return {};
 }
 
 void element::move_to_name_space(const std::string &prefix, const std::string &uri,
@@ -800,7 +1005,7 @@ void element::move_to_name_space(const std::string &prefix, const std::string &u
 	}
 }
 
-void element::write(std::ostream &os, format_info fmt) const
+void element::write_to(writer &w, format_info fmt) const
 {
 	// if width is set, we wrap and indent the file
 	size_t indentation = fmt.indent_level * fmt.indent_width;
@@ -808,12 +1013,11 @@ void element::write(std::ostream &os, format_info fmt) const
 	if (fmt.indent)
 	{
 		if (fmt.indent_level > 0)
-			os << '\n';
-		if (indentation > 0)
-			os << std::string(indentation, ' ');
+			w.put('\n');
+		w.fill(' ', indentation);
 	}
 
-	os << '<' << m_qname;
+	w << '<' << m_qname.str();
 
 	// if the left flag is set, wrap and indent attributes as well
 	auto attr_fmt = fmt;
@@ -821,32 +1025,34 @@ void element::write(std::ostream &os, format_info fmt) const
 
 	for (auto &attr : m_attributes)
 	{
-		attr.write(os, attr_fmt);
+		attr.write_to(w, attr_fmt);
 		if (attr_fmt.indent_width == 0 and fmt.indent_attributes)
-			attr_fmt.indent_width = indentation + 1 + m_qname.length() + 1;
+			attr_fmt.indent_width = indentation + 1 + m_qname.str().length() + 1;
 	}
 
-	if ((fmt.html and kEmptyHTMLElements.count(m_qname)) or
+	if ((fmt.html and kEmptyHTMLElements.count(m_qname.str())) or
 		(not fmt.html and fmt.collapse_tags and nodes().empty()))
-		os << "/>";
+		w.write("/>");
 	else
 	{
-		os << '>';
+		w.put('>');
 		auto sub_fmt = fmt;
 		++sub_fmt.indent_level;
 
 		bool wrote_element = false;
 		for (auto &n : nodes())
 		{
-			n.write(os, sub_fmt);
+			n.write_to(w, sub_fmt);
 			wrote_element = n.type() == node_type::element;
 		}
 
 		if (wrote_element and fmt.indent != 0)
-			os << '\n'
-			   << std::string(indentation, ' ');
+		{
+			w.put('\n');
+			w.fill(' ', indentation);
+		}
 
-		os << "</" << m_qname << '>';
+		w << "</" << m_qname.str() << '>';
 	}
 }
 
@@ -865,6 +1071,12 @@ std::ostream &operator<<(std::ostream &os, const element &e)
 	return os;
 }
 
+writer &operator<<(writer &w, const element &e)
+{
+	e.write_to(w, {});
+	return w;
+}
+
 // --------------------------------------------------------------------
 
 void fix_namespaces(element &e, const element &source, const element &dest)
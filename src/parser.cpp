@@ -30,9 +30,15 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <sstream>
 #include <stack>
@@ -41,6 +47,22 @@
 #include <vector>
 #include <string>
 
+#if defined(__SSE2__) or defined(_M_X64) or (defined(_M_IX86_FP) and _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MXML_SCAN_SSE2 1
+#elif defined(__ARM_NEON) and defined(__aarch64__)
+#include <arm_neon.h>
+#define MXML_SCAN_NEON 1
+#endif
+
+// Count an event in the parser_stats of the parser, used in parser_imp.
+// Expands to nothing unless the library is built with MXML_STATS set.
+#if MXML_STATS
+#define MXML_COUNT(counter) (++m_parser.m_stats.counter)
+#else
+#define MXML_COUNT(counter) ((void)0)
+#endif
+
 namespace mxml
 {
 
@@ -67,11 +89,11 @@ std::string to_hex(uint32_t i)
 /// \brief our own implementation of iequals: compares \a a with \a b case-insensitive
 ///
 /// This is a limited use function, works only reliably with ASCII. But that's OK.
-bool iequals(const std::string &a, const std::string &b)
+bool iequals(std::string_view a, std::string_view b)
 {
 	bool equal = a.length() == b.length();
 
-	for (std::string::size_type i = 0; equal and i < a.length(); ++i)
+	for (std::string_view::size_type i = 0; equal and i < a.length(); ++i)
 		equal = std::toupper(a[i]) == std::toupper(b[i]);
 
 	return equal;
@@ -105,6 +127,77 @@ bool is_valid_url(std::string_view url)
 	return cp > 1 and cp != std::string::npos and std::isalpha(url[0]);
 }
 
+// --------------------------------------------------------------------
+// Bulk scanning of character data. Most of the text in an XML document
+// consists of plain 7-bit characters that need no decoding and no validity
+// checks. find_end_of_plain_run returns a pointer to the first byte in the
+// range [ptr, end) that does need attention: a control character other than
+// tab or newline, a non ASCII byte, DEL or one of the stop characters a, b
+// and c.
+
+inline bool is_plain_char(char8_t ch, char8_t a, char8_t b, char8_t c)
+{
+	return ((ch >= 0x20 and ch < 0x7f) or ch == '\t' or ch == '\n') and ch != a and ch != b and ch != c;
+}
+
+const char8_t *find_end_of_plain_run(const char8_t *ptr, const char8_t *end, char8_t a, char8_t b, char8_t c)
+{
+#if MXML_SCAN_SSE2
+	const __m128i k_space = _mm_set1_epi8(0x20);
+	const __m128i k_del = _mm_set1_epi8(0x7f);
+	const __m128i k_tab = _mm_set1_epi8('\t');
+	const __m128i k_nl = _mm_set1_epi8('\n');
+	const __m128i k_a = _mm_set1_epi8(static_cast<char>(a));
+	const __m128i k_b = _mm_set1_epi8(static_cast<char>(b));
+	const __m128i k_c = _mm_set1_epi8(static_cast<char>(c));
+
+	while (end - ptr >= 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+
+		// signed compare, so bytes >= 0x80 are caught here as well
+		__m128i m = _mm_or_si128(_mm_cmplt_epi8(v, k_space), _mm_cmpeq_epi8(v, k_del));
+		m = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, k_tab), _mm_cmpeq_epi8(v, k_nl)), m);
+		m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, k_a), _mm_or_si128(_mm_cmpeq_epi8(v, k_b), _mm_cmpeq_epi8(v, k_c))));
+
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+		if (mask != 0)
+			return ptr + std::countr_zero(mask);
+
+		ptr += 16;
+	}
+#elif MXML_SCAN_NEON
+	const uint8x16_t k_space = vdupq_n_u8(0x20);
+	const uint8x16_t k_del = vdupq_n_u8(0x7f);
+	const uint8x16_t k_tab = vdupq_n_u8('\t');
+	const uint8x16_t k_nl = vdupq_n_u8('\n');
+	const uint8x16_t k_a = vdupq_n_u8(a);
+	const uint8x16_t k_b = vdupq_n_u8(b);
+	const uint8x16_t k_c = vdupq_n_u8(c);
+
+	while (end - ptr >= 16)
+	{
+		uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(ptr));
+
+		uint8x16_t m = vorrq_u8(vcltq_u8(v, k_space), vcgeq_u8(v, k_del));
+		m = vbicq_u8(m, vorrq_u8(vceqq_u8(v, k_tab), vceqq_u8(v, k_nl)));
+		m = vorrq_u8(m, vorrq_u8(vceqq_u8(v, k_a), vorrq_u8(vceqq_u8(v, k_b), vceqq_u8(v, k_c))));
+
+		// the scalar loop below locates the exact position
+		if (vmaxvq_u8(m) != 0)
+			break;
+
+		ptr += 16;
+	}
+#endif
+
+	while (ptr < end and is_plain_char(*ptr, a, b, c))
+		++ptr;
+
+	return ptr;
+}
+
+// --------------------------------------------------------------------
 // parsing XML is somewhat like macro processing,
 // we can encounter entities that need to be expanded into replacement text
 // and so we declare data_source objects that can be stacked.
@@ -140,7 +233,7 @@ class data_source
 		, m_encoding(encoding_type::UTF8)
 		, m_line_nr(1)
 	{
-		static int s_next_id = 0;
+		static std::atomic<int> s_next_id = 0;
 		m_id = s_next_id++;
 	}
 
@@ -149,6 +242,21 @@ class data_source
 	// data_source is a virtual base class. Derivatives need to declare the next function.
 	virtual char32_t get_next_char() = 0;
 
+	// Append a run of plain characters (see find_end_of_plain_run) to \a s,
+	// stopping at any of \a a, \a b or \a c. Sources that cannot do this
+	// efficiently append nothing, the parser then continues one character at a time.
+	virtual void append_plain_run(std::string & /*s*/, char8_t /*a*/, char8_t /*b*/, char8_t /*c*/) {}
+
+	// Add the number of bytes read from the input so far, and from now on,
+	// to \a counter. Sources that do not read input, like the replacement
+	// text of entities, do not count anything.
+	virtual void count_bytes_read(std::size_t & /*counter*/) {}
+
+	// Returns true if the input available so far is used up but more is
+	// expected later on. The end of file token is then not the end of the
+	// document, the parser suspends itself instead, see push_data_source.
+	virtual bool waiting() const { return false; }
+
 	void base(std::string_view dir) { m_base = dir; }
 	const std::string &base() const { return m_base; }
 
@@ -172,162 +280,413 @@ class data_source
 };
 
 // --------------------------------------------------------------------
-// An std::istream implementation of data_source.
+// Input that is not UTF-8 is transcoded to UTF-8 in bulk before it is
+// handed to the tokenizer, that way all encodings share the same fast
+// paths. Most text consists of 7-bit characters, runs of those are
+// copied sixteen at a time when SIMD instructions are available.
 
-class istream_data_source : public data_source
+/// \brief utf-8 is not single byte e.g.
+constexpr bool is_single_byte_encoding(encoding_type enc)
 {
-  public:
-	istream_data_source(std::istream &data)
-		: m_data(&data)
-		, m_owns_data(false)
+	return enc == encoding_type::ASCII or enc == encoding_type::ISO88591 or enc == encoding_type::UTF8;
+}
+
+inline char8_t *put_utf8(char8_t *out, char32_t uc)
+{
+	if (uc < 0x080)
+		*out++ = static_cast<char8_t>(uc);
+	else if (uc < 0x0800)
 	{
-		guess_encoding();
+		*out++ = static_cast<char8_t>(0x0c0 | (uc >> 6));
+		*out++ = static_cast<char8_t>(0x080 | (uc & 0x3f));
 	}
-
-	istream_data_source(std::istream *data)
-		: m_data(data)
+	else if (uc < 0x00010000)
 	{
-		guess_encoding();
+		*out++ = static_cast<char8_t>(0x0e0 | (uc >> 12));
+		*out++ = static_cast<char8_t>(0x080 | ((uc >> 6) & 0x3f));
+		*out++ = static_cast<char8_t>(0x080 | (uc & 0x3f));
 	}
-
-	~istream_data_source()
+	else
 	{
-		if (m_owns_data)
-			delete m_data;
+		*out++ = static_cast<char8_t>(0x0f0 | (uc >> 18));
+		*out++ = static_cast<char8_t>(0x080 | ((uc >> 12) & 0x3f));
+		*out++ = static_cast<char8_t>(0x080 | ((uc >> 6) & 0x3f));
+		*out++ = static_cast<char8_t>(0x080 | (uc & 0x3f));
 	}
 
-	virtual bool has_bom() { return m_has_bom; }
+	return out;
+}
 
-	virtual char32_t get_next_char();
-	virtual void encoding(encoding_type enc);
+// Append the ISO-8859-1 encoded text in [ptr, end) to \a s as UTF-8
 
-  private:
-	void guess_encoding();
-	void parse_text_decl();
-	char32_t next_utf8_char();
-	char32_t next_utf16le_char();
-	char32_t next_utf16be_char();
-	char32_t next_iso88591_char();
-	char32_t next_ascii_char();
+void latin1_to_utf8(const char8_t *ptr, const char8_t *end, std::string &s)
+{
+	auto offset = s.length();
+	s.resize(offset + 2 * (end - ptr));
 
-	char8_t next_byte()
+	auto out = reinterpret_cast<char8_t *>(s.data()) + offset;
+
+	while (ptr < end)
 	{
-		int result = m_data->rdbuf()->sbumpc();
+#if MXML_SCAN_SSE2
+		while (end - ptr >= 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+			if (_mm_movemask_epi8(v) != 0)
+				break;
 
-		if (result == std::streambuf::traits_type::eof())
-			result = 0;
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), v);
+			ptr += 16;
+			out += 16;
+		}
+#elif MXML_SCAN_NEON
+		while (end - ptr >= 16)
+		{
+			uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(ptr));
+			if (vmaxvq_u8(v) >= 0x80)
+				break;
 
-		return static_cast<char8_t>(result);
-	}
+			vst1q_u8(reinterpret_cast<uint8_t *>(out), v);
+			ptr += 16;
+			out += 16;
+		}
+#endif
 
-	std::istream *m_data;
-	bool m_owns_data = true;
-	char32_t m_char_buffer = 0; // used in detecting \r\n algorithm
+		for (auto n = std::min<std::ptrdiff_t>(end - ptr, 16); n > 0; --n)
+			out = put_utf8(out, *ptr++);
+	}
 
-	typedef char32_t (istream_data_source::*next_func)(void);
+	s.resize(out - reinterpret_cast<char8_t *>(s.data()));
+}
 
-	next_func m_next;
-	bool m_has_bom = false;
-};
+// Append the UTF-16 encoded text in [ptr, end) to \a s as UTF-8. Returns a
+// pointer to the first byte that was not transcoded: either an incomplete
+// code unit or surrogate pair at the end of the input, or an unpaired surrogate.
 
-void istream_data_source::guess_encoding()
+const char8_t *utf16_to_utf8(const char8_t *ptr, const char8_t *end, bool big_endian, std::string &s)
 {
-	// see if there is a BOM
-	// if there isn't, we assume the data is UTF-8
+	auto offset = s.length();
+	s.resize(offset + 3 * ((end - ptr) / 2));
+
+	auto out = reinterpret_cast<char8_t *>(s.data()) + offset;
+
+	auto unit = [big_endian](const char8_t *p)
+	{
+		return big_endian
+		           ? (static_cast<char32_t>(p[0]) << 8) | p[1]
+		           : (static_cast<char32_t>(p[1]) << 8) | p[0];
+	};
 
-	int ch = m_data->rdbuf()->sgetc();
-	if (ch != std::streambuf::traits_type::eof())
+	bool stop = false;
+	while (not stop and end - ptr >= 2)
 	{
-		char ch1 = static_cast<char>(ch);
+#if MXML_SCAN_SSE2
+		// 7-bit characters have all bits but the lower seven cleared, the
+		// byte order in the 16-bit lanes is swapped for big endian input
+		const __m128i k_mask = _mm_set1_epi16(static_cast<short>(big_endian ? 0x80ff : 0xff80));
 
-		if (ch1 == static_cast<char>(0xfe))
+		while (end - ptr >= 32)
 		{
-			char ch2 = static_cast<char>(m_data->rdbuf()->snextc());
+			__m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+			__m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr + 16));
+
+			__m128i m = _mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(v1, v2), k_mask), _mm_setzero_si128());
+			if (_mm_movemask_epi8(m) != 0xffff)
+				break;
 
-			if (ch2 == static_cast<char>(0xff))
+			if (big_endian)
 			{
-				m_data->rdbuf()->snextc();
-				m_encoding = encoding_type::UTF16BE;
-				m_has_bom = true;
+				v1 = _mm_srli_epi16(v1, 8);
+				v2 = _mm_srli_epi16(v2, 8);
 			}
-			else
-				m_data->rdbuf()->sungetc();
+
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(v1, v2));
+			ptr += 32;
+			out += 16;
 		}
-		else if (ch1 == static_cast<char>(0xff))
+#elif MXML_SCAN_NEON
+		while (end - ptr >= 32)
 		{
-			char ch2 = static_cast<char>(m_data->rdbuf()->snextc());
+			// de-interleave the low and high bytes of sixteen code units
+			uint8x16x2_t v = vld2q_u8(reinterpret_cast<const uint8_t *>(ptr));
+			uint8x16_t lo = big_endian ? v.val[1] : v.val[0];
+			uint8x16_t hi = big_endian ? v.val[0] : v.val[1];
 
-			if (ch2 == static_cast<char>(0xfe))
-			{
-				m_data->rdbuf()->snextc();
-				m_encoding = encoding_type::UTF16LE;
-				m_has_bom = true;
-			}
-			else
-				m_data->rdbuf()->sungetc();
+			if (vmaxvq_u8(vorrq_u8(hi, vandq_u8(lo, vdupq_n_u8(0x80)))) != 0)
+				break;
+
+			vst1q_u8(reinterpret_cast<uint8_t *>(out), lo);
+			ptr += 32;
+			out += 16;
 		}
-		else if (ch1 == static_cast<char>(0xef))
+#endif
+
+		for (int n = 0; n < 16 and end - ptr >= 2; ++n)
 		{
-			char ch2 = static_cast<char>(m_data->rdbuf()->snextc());
-			char ch3 = static_cast<char>(m_data->rdbuf()->snextc());
+			char32_t uc = unit(ptr);
 
-			if (ch2 == static_cast<char>(0xbb) and ch3 == static_cast<char>(0xbf))
+			if (uc >= 0x0D800 and uc <= 0x0DFFF)
 			{
-				m_data->rdbuf()->snextc();
-				m_encoding = encoding_type::UTF8;
-				m_has_bom = true;
+				char32_t uc2 = end - ptr >= 4 ? unit(ptr + 2) : 0;
+				if (uc > 0x0DBFF or uc2 < 0x0DC00 or uc2 > 0x0DFFF)
+				{
+					stop = true;
+					break;
+				}
+
+				uc = (uc - 0x0D800) * 0x400 + (uc2 - 0x0DC00) + 0x010000;
+				ptr += 4;
 			}
 			else
-			{
-				m_data->rdbuf()->sungetc();
-				m_data->rdbuf()->sputbackc(ch1);
-			}
+				ptr += 2;
+
+			out = put_utf8(out, uc);
 		}
 	}
 
-	encoding(m_encoding);
+	s.resize(out - reinterpret_cast<char8_t *>(s.data()));
+
+	return ptr;
 }
 
-/// \brief utf-8 is not single byte e.g.
-constexpr bool is_single_byte_encoding(encoding_type enc)
+// --------------------------------------------------------------------
+// A data_source reading blocks of bytes. UTF-8 and ASCII input is read
+// as is, other encodings are transcoded to UTF-8 a block at a time.
+
+class block_data_source : public data_source
 {
-	return enc == encoding_type::ASCII or enc == encoding_type::ISO88591 or enc == encoding_type::UTF8;
+  public:
+	virtual bool has_bom() { return m_has_bom; }
+
+	virtual char32_t get_next_char();
+	virtual void encoding(encoding_type enc);
+
+	virtual void append_plain_run(std::string &s, char8_t a, char8_t b, char8_t c)
+	{
+		if (m_char_buffer != 0)
+			return;
+
+		auto e = find_end_of_plain_run(m_ptr, m_end, a, b, c);
+		if (e > m_ptr)
+		{
+			s.append(reinterpret_cast<const char *>(m_ptr), e - m_ptr);
+			m_line_nr += static_cast<int>(std::count(m_ptr, e, '\n'));
+			m_ptr = e;
+		}
+	}
+
+	virtual void count_bytes_read(std::size_t &counter)
+	{
+		counter += m_bytes_read;
+		m_counter = &counter;
+	}
+
+  protected:
+	// Derived classes provide the first block of input in [m_raw, m_raw_end)
+	// and then call guess_encoding
+	void guess_encoding();
+
+	// Called when the input in [m_raw, m_raw_end) is used up, except perhaps
+	// for an incomplete character. Should provide more input, keeping the
+	// bytes that were left over in front. Returns false at the end of input.
+	virtual bool underflow() { return false; }
+
+	// Returns true when all input provided so far was read
+	bool exhausted() const
+	{
+		return m_ptr == m_end and (not transcoding() or m_raw == m_raw_end) and m_char_buffer == 0;
+	}
+
+	// Derived classes call this for each block of \a n bytes they read
+	void bytes_read(std::size_t n)
+	{
+		m_bytes_read += n;
+		if (m_counter != nullptr)
+			*m_counter += n;
+	}
+
+	const char8_t *m_raw = nullptr;
+	const char8_t *m_raw_end = nullptr;
+
+  private:
+	static constexpr std::ptrdiff_t kTranscodeBlockSize = 16 * 1024;
+
+	bool transcoding() const { return not is_single_byte_encoding(m_encoding) or m_encoding == encoding_type::ISO88591; }
+
+	bool fill();
+	void transcode();
+	char32_t next_char();
+	char32_t next_utf8_char();
+	char32_t next_utf16_char();
+
+	char8_t next_byte()
+	{
+		if (m_ptr == m_end and not fill())
+			return 0;
+		return *m_ptr++;
+	}
+
+	// The UTF-8 text read by the tokenizer, this is either the input itself
+	// or the transcoded input in m_text
+	const char8_t *m_ptr = nullptr;
+	const char8_t *m_end = nullptr;
+	std::string m_text;
+
+	char32_t m_char_buffer = 0; // used in detecting \r\n algorithm
+	bool m_has_bom = false;
+
+	std::size_t m_bytes_read = 0;
+	std::size_t *m_counter = nullptr;
+};
+
+void block_data_source::guess_encoding()
+{
+	// see if there is a BOM
+	// if there isn't, we assume the data is UTF-8
+
+	while (m_raw_end - m_raw < 3 and underflow())
+		;
+
+	auto length = m_raw_end - m_raw;
+
+	if (length >= 2 and m_raw[0] == 0xfe and m_raw[1] == 0xff)
+	{
+		m_raw += 2;
+		m_encoding = encoding_type::UTF16BE;
+		m_has_bom = true;
+	}
+	else if (length >= 2 and m_raw[0] == 0xff and m_raw[1] == 0xfe)
+	{
+		m_raw += 2;
+		m_encoding = encoding_type::UTF16LE;
+		m_has_bom = true;
+	}
+	else if (length >= 3 and m_raw[0] == 0xef and m_raw[1] == 0xbb and m_raw[2] == 0xbf)
+	{
+		m_raw += 3;
+		m_encoding = encoding_type::UTF8;
+		m_has_bom = true;
+	}
+
+	if (not transcoding())
+	{
+		m_ptr = m_raw;
+		m_end = m_raw_end;
+	}
 }
 
-void istream_data_source::encoding(encoding_type enc)
+void block_data_source::encoding(encoding_type enc)
 {
 	if (enc != m_encoding)
 	{
-		if (is_single_byte_encoding(enc) and is_single_byte_encoding(m_encoding))
-			m_encoding = enc;
-		else
+		if (not is_single_byte_encoding(enc) or not is_single_byte_encoding(m_encoding))
 			throw invalid_exception("Invalid encoding specified, incompatible with actual encoding");
+
+		if (enc == encoding_type::ISO88591)
+		{
+			// transcode the rest of the input
+			m_raw = m_ptr;
+			m_raw_end = m_end;
+			m_ptr = m_end = nullptr;
+		}
+		else if (m_encoding == encoding_type::ISO88591)
+		{
+			// back to reading the input directly, each character not yet
+			// read from the transcoded text was a single byte of input
+			m_raw -= std::count_if(m_ptr, m_end, [](char8_t ch)
+				{ return (ch & 0x0c0) != 0x080; });
+			m_ptr = m_raw;
+			m_end = m_raw_end;
+		}
 	}
 
 	data_source::encoding(enc);
+}
 
-	switch (m_encoding)
+bool block_data_source::fill()
+{
+	if (transcoding())
+		transcode();
+	else
 	{
-		case encoding_type::UTF8:
-			m_next = &istream_data_source::next_utf8_char;
-			break;
-		case encoding_type::UTF16LE:
-			m_next = &istream_data_source::next_utf16le_char;
-			break;
-		case encoding_type::UTF16BE:
-			m_next = &istream_data_source::next_utf16be_char;
-			break;
-		case encoding_type::ISO88591:
-			m_next = &istream_data_source::next_iso88591_char;
+		m_raw = m_raw_end = m_end;
+		if (underflow())
+		{
+			m_ptr = m_raw;
+			m_end = m_raw_end;
+		}
+	}
+
+	return m_ptr < m_end;
+}
+
+void block_data_source::transcode()
+{
+	m_text.clear();
+
+	while (m_text.empty())
+	{
+		auto e = m_raw + std::min(m_raw_end - m_raw, kTranscodeBlockSize);
+
+		if (m_encoding == encoding_type::ISO88591)
+		{
+			latin1_to_utf8(m_raw, e, m_text);
+			m_raw = e;
+		}
+		else
+			m_raw = utf16_to_utf8(m_raw, e, m_encoding == encoding_type::UTF16BE, m_text);
+
+		if (not m_text.empty())
 			break;
-		case encoding_type::ASCII:
-			m_next = &istream_data_source::next_ascii_char;
+
+		// Nothing could be transcoded, perhaps more input completes the character
+		if (m_raw_end - m_raw < 4 and underflow())
+			continue;
+
+		if (m_raw == m_raw_end)
 			break;
-		default: break;
+
+		// An unpaired surrogate or a truncated character, the slow path reports the error
+		append(m_text, next_utf16_char());
+	}
+
+	m_ptr = reinterpret_cast<const char8_t *>(m_text.data());
+	m_end = m_ptr + m_text.length();
+}
+
+char32_t block_data_source::next_utf16_char()
+{
+	auto next_raw_byte = [this]()
+	{
+		return m_raw < m_raw_end ? *m_raw++ : 0;
+	};
+
+	auto next_unit = [&]()
+	{
+		char8_t c1 = next_raw_byte(), c2 = next_raw_byte();
+
+		return m_encoding == encoding_type::UTF16BE
+		           ? (static_cast<char32_t>(c1) << 8) | c2
+		           : (static_cast<char32_t>(c2) << 8) | c1;
+	};
+
+	char32_t ch = next_unit();
+
+	if (ch >= 0x0D800 and ch <= 0x0DBFF)
+	{
+		char32_t uc2 = next_unit();
+		if (uc2 >= 0x0DC00 and uc2 <= 0x0DFFF)
+			ch = (ch - 0x0D800) * 0x400 + (uc2 - 0x0DC00) + 0x010000;
+		else
+			throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: leading surrogate character without trailing surrogate character");
 	}
+	else if (ch >= 0x0DC00 and ch <= 0x0DFFF)
+		throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: trailing surrogate character without a leading surrogate");
+
+	return ch;
 }
 
-char32_t istream_data_source::next_utf8_char()
+char32_t block_data_source::next_utf8_char()
 {
 	char32_t result = next_byte();
 
@@ -367,75 +726,35 @@ char32_t istream_data_source::next_utf8_char()
 	return result;
 }
 
-char32_t istream_data_source::next_utf16le_char()
+char32_t block_data_source::next_char()
 {
-	char8_t c1 = next_byte(), c2 = next_byte();
-
-	char32_t ch = (static_cast<char32_t>(c2) << 8) | c1;
-
-	if (ch >= 0x080)
+	if (m_encoding == encoding_type::ASCII)
 	{
-		// surrogate support
-		if (ch >= 0x0D800 and ch <= 0x0DBFF)
-		{
-			char32_t uc2 = next_utf16le_char();
-			if (uc2 >= 0x0DC00 and uc2 <= 0x0DFFF)
-				ch = (ch - 0x0D800) * 0x400 + (uc2 - 0x0DC00) + 0x010000;
-			else
-				throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: leading surrogate character without trailing surrogate character");
-		}
-		else if (ch >= 0x0DC00 and ch <= 0x0DFFF)
-			throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: trailing surrogate character without a leading surrogate");
+		char32_t c = next_byte();
+		if (c > 127)
+			throw not_wf_exception("Invalid ascii value");
+		return c;
 	}
 
-	return ch;
+	// transcoded input is UTF-8 as well
+	return next_utf8_char();
 }
 
-char32_t istream_data_source::next_utf16be_char()
+char32_t block_data_source::get_next_char()
 {
-	char8_t c1 = next_byte(), c2 = next_byte();
-
-	char32_t ch = (static_cast<char32_t>(c1) << 8) | c2;
-
-	if (ch >= 0x080)
+	// Fast path, plain 7-bit characters need no further processing
+	if (m_char_buffer == 0 and m_ptr < m_end and *m_ptr < 0x80 and *m_ptr != '\r')
 	{
-		// surrogate support
-		if (ch >= 0x0D800 and ch <= 0x0DBFF)
-		{
-			char32_t uc2 = next_utf16be_char();
-			if (uc2 >= 0x0DC00 and uc2 <= 0x0DFFF)
-				ch = (ch - 0x0D800) * 0x400 + (uc2 - 0x0DC00) + 0x010000;
-			else
-				throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: leading surrogate character without trailing surrogate character");
-		}
-		else if (ch >= 0x0DC00 and ch <= 0x0DFFF)
-			throw not_wf_exception("Document (line: " + std::to_string(m_line_nr) + " not well-formed: trailing surrogate character without a leading surrogate");
+		char32_t ch = *m_ptr++;
+		if (ch == '\n')
+			++m_line_nr;
+		return ch;
 	}
 
-	return ch;
-}
-
-char32_t istream_data_source::next_iso88591_char()
-{
-	return (char32_t)next_byte();
-}
-
-char32_t istream_data_source::next_ascii_char()
-{
-	char32_t c = next_byte();
-
-	if (c > 127)
-		throw not_wf_exception("Invalid ascii value");
-
-	return c;
-}
-
-char32_t istream_data_source::get_next_char()
-{
 	char32_t ch = m_char_buffer;
 
 	if (ch == 0)
-		ch = (this->*m_next)();
+		ch = next_char();
 	else
 		m_char_buffer = 0;
 
@@ -444,7 +763,7 @@ char32_t istream_data_source::get_next_char()
 
 	if (ch == '\r')
 	{
-		ch = (this->*m_next)();
+		ch = next_char();
 		if (ch != '\n' and (m_version == version_type{ 1, 0 } or ch != 0x85 or m_encoding == encoding_type::ASCII))
 			m_char_buffer = ch;
 		ch = '\n';
@@ -464,17 +783,352 @@ char32_t istream_data_source::get_next_char()
 	return ch;
 }
 
+// --------------------------------------------------------------------
+// An std::istream implementation of data_source.
+
+class istream_data_source : public block_data_source
+{
+  public:
+	istream_data_source(std::istream &data)
+		: m_data(&data)
+		, m_owns_data(false)
+		, m_block_size(block_size(data))
+	{
+		guess_encoding();
+	}
+
+	istream_data_source(std::istream *data)
+		: m_data(data)
+		, m_block_size(block_size(*data))
+	{
+		guess_encoding();
+	}
+
+	~istream_data_source()
+	{
+		if (m_owns_data)
+			delete m_data;
+	}
+
+  private:
+	static constexpr std::streamsize kMaxBlockSize = 64 * 1024;
+
+	// Files and strings are read in blocks, other streams, like pipes or
+	// sockets, a byte at a time. That way no data following the document
+	// is taken from those streams when parsing stops.
+	static std::streamsize block_size(std::istream &data)
+	{
+		auto buf = data.rdbuf();
+		if (dynamic_cast<std::filebuf *>(buf) != nullptr or dynamic_cast<std::stringbuf *>(buf) != nullptr)
+			return kMaxBlockSize;
+		return 1;
+	}
+
+	virtual bool underflow();
+
+	std::istream *m_data;
+	bool m_owns_data = true;
+	std::streamsize m_block_size;
+	std::string m_block;
+};
+
+bool istream_data_source::underflow()
+{
+	std::streamsize n = m_block_size;
+
+	// keep what was left over from the previous block
+	std::size_t keep = m_raw_end - m_raw;
+	if (keep > 0)
+		m_block.erase(0, reinterpret_cast<const char *>(m_raw) - m_block.data());
+	m_block.resize(keep + n);
+
+	n = m_data->rdbuf()->sgetn(m_block.data() + keep, n);
+	m_block.resize(keep + n);
+
+	bytes_read(n);
+
+	m_raw = reinterpret_cast<const char8_t *>(m_block.data());
+	m_raw_end = m_raw + m_block.length();
+
+	return n > 0;
+}
+
+// --------------------------------------------------------------------
+// A data_source reading directly from a contiguous block of memory.
+// The data is not copied, so it should stay valid while parsing.
+
+class buffer_data_source : public block_data_source
+{
+  public:
+	buffer_data_source(const char *data, size_t length)
+	{
+		m_raw = reinterpret_cast<const char8_t *>(data);
+		m_raw_end = m_raw + length;
+
+		bytes_read(length);
+		guess_encoding();
+	}
+};
+
+// --------------------------------------------------------------------
+// The input of a push parser. The chunks passed to parser::feed are
+// collected here and scanned for the end of the last complete piece of
+// markup: a tag, comment, processing instruction, CDATA section, document
+// type declaration or reference, or the end of the text in front of it.
+// Only the input up to there is released to the tokenizer, that way the
+// tokenizer never runs out of input halfway a token. It sees the end of
+// file instead, which suspends the parser until more input is fed.
+
+struct push_state
+{
+	void append(std::string_view chunk, bool last)
+	{
+		m_data.append(chunk);
+		m_last = last;
+
+		scan();
+
+		if (m_last)
+			m_released = m_data.length();
+	}
+
+	// The tokenizer needs the first bytes to detect the encoding
+	bool ready() const { return m_released > 0 or m_last; }
+
+	// Move the input that was released into \a block
+	std::size_t release(std::string &block)
+	{
+		auto n = m_released;
+
+		block.append(m_data, 0, n);
+		m_data.erase(0, n);
+
+		m_scanned -= n;
+		m_released = 0;
+
+		return n;
+	}
+
+	void scan();
+
+	std::string m_data;
+	std::size_t m_scanned = 0, m_released = 0;
+	bool m_last = false;
+
+	// The scanner state
+	enum state_type
+	{
+		state_Text,
+		state_Reference,
+		state_TagOpen,
+		state_Tag,
+		state_Bang,
+		state_BangDash,
+		state_Comment,
+		state_PI,
+		state_CData,
+		state_Decl,
+		state_Subset
+	} m_state = state_Text;
+
+	unsigned m_unit_size = 0; // 2 for UTF-16, 0 when not known yet
+	bool m_big_endian = false;
+	bool m_in_subset = false; // in the internal subset of the document type declaration
+	char32_t m_quote = 0;     // the quote character of the string we're in
+	char32_t m_prev = ' ';    // the previous character
+	int m_run = 0;            // the number of - ] or ? seen before a >
+};
+
+void push_state::scan()
+{
+	if (m_unit_size == 0)
+	{
+		// Only UTF-16 with a byte order mark has two byte code units, the
+		// markup is ASCII in all other supported encodings.
+		if (m_data.length() < 2 and not m_last)
+			return;
+
+		if (m_data.starts_with("\xfe\xff"))
+		{
+			m_unit_size = 2;
+			m_big_endian = true;
+		}
+		else if (m_data.starts_with("\xff\xfe"))
+			m_unit_size = 2;
+		else
+			m_unit_size = 1;
+	}
+
+	auto data = reinterpret_cast<const char8_t *>(m_data.data());
+
+	// the end of a construct, release the input up to and including the last unit
+	auto done = [this]()
+	{
+		if (m_in_subset)
+			m_state = state_Subset;
+		else
+		{
+			m_state = state_Text;
+			m_released = m_scanned + m_unit_size;
+		}
+	};
+
+	for (; m_scanned + m_unit_size <= m_data.length(); m_scanned += m_unit_size)
+	{
+		char32_t ch = data[m_scanned];
+		if (m_unit_size == 2)
+		{
+			ch = m_big_endian
+			         ? (ch << 8) | data[m_scanned + 1]
+			         : (static_cast<char32_t>(data[m_scanned + 1]) << 8) | ch;
+		}
+
+		switch (m_state)
+		{
+			case state_Text:
+				if (ch == '<' or ch == '&')
+				{
+					// The tokenizer takes a null character for the end of file,
+					// that is only an error if more input follows
+					if (m_prev != 0)
+						m_released = m_scanned;
+					m_state = ch == '<' ? state_TagOpen : state_Reference;
+				}
+				break;
+
+			case state_Reference:
+				if (ch == ';')
+					done();
+				else if (ch == '<')
+					m_state = state_TagOpen;
+				else if (ch <= ' ')
+					m_state = state_Text; // not a reference, the tokenizer will complain
+				break;
+
+			case state_TagOpen:
+				m_run = 0;
+				if (ch == '!')
+					m_state = state_Bang;
+				else if (ch == '?')
+					m_state = state_PI;
+				else if (ch == '>')
+					done();
+				else
+					m_state = state_Tag;
+				break;
+
+			case state_Tag:
+			case state_Decl:
+				if (m_quote != 0)
+				{
+					if (ch == m_quote)
+						m_quote = 0;
+				}
+				else if (ch == '"' or ch == '\'')
+					m_quote = ch;
+				else if (ch == '>')
+					done();
+				else if (ch == '[' and m_state == state_Decl and not m_in_subset)
+				{
+					m_in_subset = true;
+					m_state = state_Subset;
+				}
+				break;
+
+			case state_Bang:
+				if (ch == '-')
+					m_state = state_BangDash;
+				else if (ch == '[' and not m_in_subset)
+					m_state = state_CData;
+				else if (ch == '>')
+					done();
+				else
+					m_state = state_Decl;
+				break;
+
+			case state_BangDash:
+				m_state = ch == '-' ? state_Comment : state_Decl;
+				break;
+
+			case state_Comment:
+			case state_CData:
+			case state_PI:
+				if (ch == '>' and m_run >= (m_state == state_PI ? 1 : 2))
+					done();
+				else if (ch == (m_state == state_Comment ? '-' : m_state == state_CData ? ']' : '?'))
+					++m_run;
+				else
+					m_run = 0;
+				break;
+
+			case state_Subset:
+				if (ch == '<')
+					m_state = state_TagOpen;
+				else if (ch == ']')
+				{
+					m_in_subset = false;
+					m_state = state_Decl;
+				}
+				break;
+		}
+
+		m_prev = ch;
+	}
+}
+
+// The data_source for a push parser, reading the input released by push_state
+
+class push_data_source : public block_data_source
+{
+  public:
+	push_data_source(push_state &push)
+		: m_push(push)
+	{
+		guess_encoding();
+	}
+
+	bool waiting() const override { return not m_push.m_last and exhausted(); }
+
+  private:
+	bool underflow() override
+	{
+		if (m_push.m_released == 0)
+			return false;
+
+		// keep what was left over from the previous block
+		m_block.erase(0, reinterpret_cast<const char *>(m_raw) - m_block.data());
+
+		bytes_read(m_push.release(m_block));
+
+		m_raw = reinterpret_cast<const char8_t *>(m_block.data());
+		m_raw_end = m_raw + m_block.length();
+
+		return true;
+	}
+
+	push_state &m_push;
+	std::string m_block;
+};
+
 // --------------------------------------------------------------------
 
 class string_data_source : public data_source
 {
   public:
-	string_data_source(const std::string &data)
+	// The text in data is not copied, it should outlive the data source
+	string_data_source(std::string_view data)
 		: m_data(data)
 		, m_ptr(m_data.cbegin())
 	{
 	}
 
+	string_data_source(std::string &&data)
+		: m_text(std::move(data))
+		, m_data(m_text)
+		, m_ptr(m_data.cbegin())
+	{
+	}
+
 	char32_t get_next_char()
 	{
 		char32_t result = 0;
@@ -488,17 +1142,33 @@ class string_data_source : public data_source
 		return result;
 	}
 
+	void append_plain_run(std::string &s, char8_t a, char8_t b, char8_t c)
+	{
+		auto b_ptr = reinterpret_cast<const char8_t *>(m_data.data()) + (m_ptr - m_data.cbegin());
+		auto e_ptr = find_end_of_plain_run(b_ptr, reinterpret_cast<const char8_t *>(m_data.data() + m_data.length()), a, b, c);
+		if (e_ptr > b_ptr)
+		{
+			s.append(reinterpret_cast<const char *>(b_ptr), e_ptr - b_ptr);
+			m_line_nr += static_cast<int>(std::count(b_ptr, e_ptr, '\n'));
+			m_ptr += e_ptr - b_ptr;
+		}
+	}
+
   private:
-	std::string m_data;
-	std::string::const_iterator m_ptr;
+	std::string m_text;
+	std::string_view m_data;
+	std::string_view::const_iterator m_ptr;
 };
 
 // --------------------------------------------------------------------
 
+// The replacement text of an entity is used as is, entities are
+// not removed while parsing.
+
 class entity_data_source : public string_data_source
 {
   public:
-	entity_data_source(const std::string &text, const std::string &entity_path)
+	entity_data_source(std::string_view text, const std::string &entity_path)
 		: string_data_source(text)
 	{
 		base(entity_path);
@@ -537,28 +1207,118 @@ class valid_nesting_validator
 	int m_id;
 };
 
+// --------------------------------------------------------------------
+// A parsed external DTD subset, the declarations are shared between the
+// parsers using it and are not modified after the DTD is parsed.
+
+class dtd
+{
+  public:
+	struct notation
+	{
+		std::string m_name, m_sysid, m_pubid;
+	};
+
+	doctype::element_list m_elements;
+	doctype::entity_list m_parameter_entities;
+	doctype::entity_list m_general_entities;
+	std::set<std::string> m_notations;
+	std::vector<notation> m_notation_decls;
+
+	// the DTD was parsed checking the namespace constraints
+	bool m_validated_ns;
+};
+
+struct dtd_cache_imp
+{
+	mutable std::mutex m_mutex;
+	std::map<std::pair<std::string, std::string>, dtd_ptr> m_dtds;
+};
+
+dtd_cache::dtd_cache()
+	: m_impl(new dtd_cache_imp)
+{
+}
+
+dtd_cache::~dtd_cache()
+{
+	delete m_impl;
+}
+
+dtd_ptr dtd_cache::find(const std::string &pubid, const std::string &sysid) const
+{
+	std::lock_guard lock(m_impl->m_mutex);
+
+	auto i = m_impl->m_dtds.find({ pubid, sysid });
+	return i == m_impl->m_dtds.end() ? nullptr : i->second;
+}
+
+dtd_ptr dtd_cache::insert(const std::string &pubid, const std::string &sysid, dtd_ptr dtd)
+{
+	std::lock_guard lock(m_impl->m_mutex);
+
+	return m_impl->m_dtds.emplace(std::make_pair(pubid, sysid), std::move(dtd)).first->second;
+}
+
+void dtd_cache::clear()
+{
+	std::lock_guard lock(m_impl->m_mutex);
+	m_impl->m_dtds.clear();
+}
+
+std::size_t dtd_cache::size() const
+{
+	std::lock_guard lock(m_impl->m_mutex);
+	return m_impl->m_dtds.size();
+}
+
 // --------------------------------------------------------------------
 
 struct parser_imp
 {
-	parser_imp(std::istream &data, parser &parser);
+	parser_imp(data_source *source, parser &parser);
 
 	~parser_imp();
 
-	// Here comes the parser part
-	void parse(bool validate, bool validate_ns);
+	// Here comes the parser part. Returns true when the document is
+	// complete, false when the parser is suspended, see resume.
+	bool parse(bool validate, bool validate_ns);
+
+	// Continue parsing until the document is complete, or until the input
+	// of a push parser is used up. Returns true when the document is complete.
+	bool resume();
+
+	// Parse up to and including the next event reported from the content,
+	// prolog or epilog, used by mxml::reader. Returns false when the
+	// document is complete.
+	bool step(bool validate, bool validate_ns);
+
+	// The parser is suspended when the input ran out, but more is expected,
+	// or when an event was reported while stepping
+	bool suspended() const
+	{
+		return m_paused or (m_lookahead == XMLToken::Eof and m_source.top()->waiting());
+	}
+
+	void event_reported()
+	{
+		m_paused = m_stepping;
+	}
 
 	// the productions. Some are inlined below for obvious reasons.
 	// names of the productions try to follow those in the TR http://www.w3.org/TR/xml
-	void prolog();
 	void xml_decl();
 	void text_decl();
 
 	void s(bool at_least_one = false);
 	void eq();
 	void misc();
-	void element(doctype::validator &valid);
-	void content(doctype::validator &valid);
+
+	// The elements are not parsed recursively, the open elements are kept
+	// on a stack instead so the parser can be suspended in content.
+	void start_tag(doctype::validator &valid);
+	void end_tag();
+	void content();
 
 	void comment();
 	void pi();
@@ -588,22 +1348,20 @@ struct parser_imp
 	void parse_general_entity_declaration(std::string &s);
 
 	// same goes for attribute values
-	std::string normalize_attribute_value(const std::string &s, bool isCDATA)
-	{
-		push_data_source(new string_data_source(s), false);
-
-		std::string result = normalize_attribute_value();
-
-		if (m_standalone and result != s)
-			not_valid("Document cannot be standalone since an attribute was modified");
-
-		if (not isCDATA)
-			collapse_spaces(result);
+	void normalize_attribute_value(std::string_view s, bool isCDATA, std::string &result);
 
+	std::string normalize_attribute_value(std::string_view s, bool isCDATA)
+	{
+		std::string result;
+		normalize_attribute_value(s, isCDATA, result);
 		return result;
 	}
 
-	std::string normalize_attribute_value();
+	void normalize_attribute_value(std::string &result);
+
+	// Append the character for a character reference or predefined entity
+	// at the start of \a s, returns the length of the reference or zero
+	std::size_t append_simple_reference(std::string_view s, std::string &result);
 
 	void collapse_spaces(std::string &s);
 
@@ -714,6 +1472,13 @@ struct parser_imp
 
 	char32_t get_next_char();
 
+	// bulk append plain characters to m_token, stopping at a, b or c
+	void append_plain_run(char8_t a, char8_t b, char8_t c)
+	{
+		if (m_buffer_ptr == m_buffer.begin() and not m_source.empty())
+			m_source.top()->append_plain_run(m_token, a, b, c);
+	}
+
 	// Recognizing tokens differs if we are expecting markup or content in elements:
 	XMLToken get_next_token();
 	XMLToken get_next_content();
@@ -801,9 +1566,27 @@ struct parser_imp
 	void push_data_source(data_source *source, bool insert)
 	{
 		source->version(m_version);
+#if MXML_STATS
+		source->count_bytes_read(m_parser.m_stats.bytes_read);
+#endif
+		MXML_COUNT(allocations);
 		m_source.emplace(this, source, insert);
 	}
 
+	// Run one of the checks of a validator, timed when collecting statistics
+	template <typename F>
+	bool validate(F &&check)
+	{
+#if MXML_STATS
+		auto start = std::chrono::steady_clock::now();
+		bool result = check();
+		m_parser.m_stats.validation_time += std::chrono::steady_clock::now() - start;
+		return result;
+#else
+		return check();
+#endif
+	}
+
 	void pop_data_source()
 	{
 		assert(not m_source.empty());
@@ -816,22 +1599,31 @@ struct parser_imp
 	  public:
 		ns_state(parser_imp *imp)
 			: m_parser_imp(imp)
-			, m_next(imp->m_ns)
 		{
+		}
+
+		// Bring the state in scope for a new element, the namespaces declared
+		// for a previous element are forgotten.
+		void enter()
+		{
+			m_default_ns.clear();
+			m_known.clear();
+			m_unbound.clear();
+
+			m_next = m_parser_imp->m_ns;
 			m_parser_imp->m_ns = this;
 		}
 
-		~ns_state()
+		void leave()
 		{
 			m_parser_imp->m_ns = m_next;
 		}
 
-		std::string default_ns()
+		const std::string &default_ns() const
 		{
-			std::string result = m_default_ns;
-			if (result.empty() and m_next != nullptr)
-				result = m_next->default_ns();
-			return result;
+			if (m_default_ns.empty() and m_next != nullptr)
+				return m_next->default_ns();
+			return m_default_ns;
 		}
 
 		void default_ns(const std::string &ns)
@@ -839,11 +1631,13 @@ struct parser_imp
 			m_default_ns = ns;
 		}
 
-		std::string ns_for_prefix(const std::string &prefix)
+		// The view refers to the state the prefix is bound in, it is valid
+		// until that goes out of scope.
+		std::string_view ns_for_prefix(std::string_view prefix) const
 		{
-			std::string result;
+			std::string_view result;
 
-			if (m_unbound.count(prefix) == 0)
+			if (not m_unbound.contains(prefix))
 			{
 				auto np = m_known.find(prefix);
 				if (np != m_known.end())
@@ -865,13 +1659,13 @@ struct parser_imp
 			m_unbound.insert(prefix);
 		}
 
-		bool is_known_prefix(const std::string &prefix)
+		bool is_known_prefix(std::string_view prefix) const
 		{
 			bool result = false;
 
-			if (not m_unbound.count(prefix))
+			if (not m_unbound.contains(prefix))
 			{
-				if (m_known.count(prefix))
+				if (m_known.contains(prefix))
 					result = true;
 				else if (m_next != nullptr)
 					result = m_next->is_known_prefix(prefix);
@@ -880,9 +1674,9 @@ struct parser_imp
 			return result;
 		}
 
-		bool is_known_uri(const std::string &uri)
+		bool is_known_uri(const std::string &uri) const
 		{
-			for (auto k : m_known)
+			for (auto &k : m_known)
 			{
 				if (k.second == uri)
 					return true;
@@ -894,10 +1688,49 @@ struct parser_imp
 	  private:
 		parser_imp *m_parser_imp;
 		std::string m_default_ns;
-		ns_state *m_next;
+		ns_state *m_next = nullptr;
 
-		std::map<std::string, std::string> m_known;
-		std::set<std::string> m_unbound;
+		std::map<std::string, std::string, std::less<>> m_known;
+		std::set<std::string, std::less<>> m_unbound;
+	};
+
+	// An element whose start tag was parsed, but its end tag not yet. The
+	// frames are reused, the strings in them keep their capacity.
+	struct element_frame
+	{
+		element_frame(parser_imp *imp)
+			: m_ns(imp)
+		{
+		}
+
+		void enter(const doctype::element_ptr &dte)
+		{
+			m_dte = dte;
+			m_valid.emplace(dte);
+			m_ns.enter();
+			m_has_content = false;
+		}
+
+		void leave()
+		{
+			m_ns.leave();
+			m_valid.reset();
+			m_dte.reset();
+		}
+
+		std::string m_name, m_uri; // as passed to start_element
+		std::string m_qname;       // the name as written in the start tag
+		doctype::element_ptr m_dte;
+		std::optional<doctype::validator> m_valid;
+		ns_state m_ns;
+		bool m_has_content = false;
+	};
+
+	// The replacement text of an entity reference in content
+	struct entity_frame
+	{
+		std::size_t m_depth; // the number of open elements at the reference
+		bool m_in_external_dtd;
 	};
 
 	bool is_char(char32_t uc)
@@ -955,20 +1788,113 @@ struct parser_imp
 	bool m_in_declsep = false;
 	bool m_in_external_dtd = false;
 	bool m_in_content = false;
+	bool m_stepping = false;
+	bool m_paused = false;
 
 	std::vector<std::string> m_entities_on_stack;
 	ns_state *m_ns;
 
+	enum class parse_state
+	{
+		XMLDecl,
+		Prolog,
+		Content,
+		Epilog,
+		Done
+	} m_state = parse_state::XMLDecl;
+
+	// the validator for the root element
+	std::optional<doctype::validator> m_root_valid;
+
+	// The open elements. The frames are reused, creating one for each
+	// element is expensive. The ns_state objects in them are linked, so
+	// the frames are allocated separately and never move.
+	class element_stack
+	{
+	  public:
+		element_frame &push(parser_imp *imp, const doctype::element_ptr &dte)
+		{
+			if (m_size == m_frames.size())
+				m_frames.emplace_back(new element_frame(imp));
+			m_top = m_frames[m_size++].get();
+			m_top->enter(dte);
+			return *m_top;
+		}
+
+		void pop()
+		{
+			m_frames[--m_size]->leave();
+			m_top = m_size > 0 ? m_frames[m_size - 1].get() : nullptr;
+		}
+
+		element_frame &back() { return *m_top; }
+
+		bool empty() const { return m_size == 0; }
+		std::size_t size() const { return m_size; }
+
+	  private:
+		std::vector<std::unique_ptr<element_frame>> m_frames;
+		std::size_t m_size = 0;
+		element_frame *m_top = nullptr;
+	} m_elements;
+	std::vector<entity_frame> m_entity_frames;
+
 	std::string m_root_element;
 	doctype::entity_list m_parameter_entities;
 	doctype::entity_list m_general_entities;
 	doctype::element_list m_doctype;
 
-	std::set<std::string> m_notations;
-	std::set<std::string> m_ids;            // attributes of type ID should be unique
-	std::set<std::string> m_unresolved_ids; // keep track of IDREFS that were not found yet
+	std::set<std::string> m_notations;
+	std::vector<dtd::notation> m_notation_decls; // kept for storing the DTD in a dtd_cache
+	std::set<std::string> m_ids;            // attributes of type ID should be unique
+	std::set<std::string> m_unresolved_ids; // keep track of IDREFS that were not found yet
+
+	doctype::attribute_ptr m_xmlSpaceAttr;
+
+	// The attributes of the element being parsed. The buffers are reused
+	// for all elements, only the first m_attr_count are in use. The views
+	// passed to start_element point into them.
+	struct attr_buffer
+	{
+		std::string m_name, m_value; // the qualified name and normalized value
+		std::string_view m_ns;       // the namespace, bound in one of the open elements
+		std::size_t m_local = 0;     // offset of the local name in m_name
+		bool m_id = false;
+		bool m_decl = false; // a namespace declaration, not passed as attribute
+	};
+
+	std::vector<attr_buffer> m_attr_buffers;
+	std::size_t m_attr_count = 0;
+	parser::attr_view_list_type m_attr_views;
+
+	attr_buffer &add_attr_buffer()
+	{
+		if (m_attr_count == m_attr_buffers.size())
+		{
+			MXML_COUNT(allocations);
+			m_attr_buffers.emplace_back();
+		}
+
+		auto &result = m_attr_buffers[m_attr_count++];
+		result.m_ns = {};
+		result.m_local = 0;
+		result.m_id = false;
+		result.m_decl = false;
+		return result;
+	}
 
-	doctype::attribute_ptr m_xmlSpaceAttr;
+	// The element name in the start tag being parsed, the copies used for
+	// the old style callbacks and a buffer for attribute values with references
+	std::string m_start_name;
+	std::string m_name_copy, m_uri_copy;
+	parser::attr_list_type m_attrs;
+	std::string m_attr_text;
+
+	// The data passed to end_element, comment and processing_instruction.
+	// It is kept until the next such event, a mxml::reader refers to it
+	// after the callback returned.
+	std::string m_end_name, m_end_uri;
+	std::string m_pi_target, m_data;
 };
 
 // --------------------------------------------------------------------
@@ -992,7 +1918,7 @@ inline void parser_imp::eq()
 
 // --------------------------------------------------------------------
 
-parser_imp::parser_imp(std::istream &data, parser &parser)
+parser_imp::parser_imp(data_source *source, parser &parser)
 	: m_parser(parser)
 	, m_validating(true)
 	, m_has_dtd(false)
@@ -1001,16 +1927,16 @@ parser_imp::parser_imp(std::istream &data, parser &parser)
 	, m_standalone(false)
 	, m_ns(nullptr)
 {
-	push_data_source(new istream_data_source(data), false);
+	push_data_source(source, false);
 
 	m_encoding = m_source.top()->encoding();
 
 	// these entities are always recognized:
-	m_general_entities.push_back(std::make_shared<doctype::general_entity>("lt", "&#60;"));
-	m_general_entities.push_back(std::make_shared<doctype::general_entity>("gt", "&#62;"));
-	m_general_entities.push_back(std::make_shared<doctype::general_entity>("amp", "&#38;"));
-	m_general_entities.push_back(std::make_shared<doctype::general_entity>("apos", "&#39;"));
-	m_general_entities.push_back(std::make_shared<doctype::general_entity>("quot", "&#34;"));
+	m_general_entities.insert(std::make_shared<doctype::general_entity>("lt", "&#60;"));
+	m_general_entities.insert(std::make_shared<doctype::general_entity>("gt", "&#62;"));
+	m_general_entities.insert(std::make_shared<doctype::general_entity>("amp", "&#38;"));
+	m_general_entities.insert(std::make_shared<doctype::general_entity>("apos", "&#39;"));
+	m_general_entities.insert(std::make_shared<doctype::general_entity>("quot", "&#34;"));
 
 	m_xmlSpaceAttr.reset(new doctype::attribute("xml:space", doctype::attribute_type::Enumerated, { "preserve", "default" }));
 }
@@ -1023,15 +1949,12 @@ parser_imp::~parser_imp()
 
 const doctype::entity &parser_imp::get_general_entity(const std::string &name) const
 {
-	for (auto e : m_general_entities)
+	if (auto e = m_general_entities.find(name); e != nullptr)
 	{
-		if (e->name() == name)
-		{
-			if (e->is_external() and m_standalone)
-				not_valid("Document cannot be standalone since entity " + std::string{ name } + " is defined externally");
+		if (e->is_external() and m_standalone)
+			not_valid("Document cannot be standalone since entity " + std::string{ name } + " is defined externally");
 
-			return *e;
-		}
+		return *e;
 	}
 
 	if (m_is_html5)
@@ -1047,11 +1970,8 @@ const doctype::entity &parser_imp::get_general_entity(const std::string &name) c
 
 const doctype::entity &parser_imp::get_parameter_entity(const std::string &name) const
 {
-	for (auto e : m_parameter_entities)
-	{
-		if (e->name() == name)
-			return *e;
-	}
+	if (auto e = m_parameter_entities.find(name); e != nullptr)
+		return *e;
 
 	not_well_formed("Undefined parameter entity '" + m_token + '\'');
 	throw 0;
@@ -1196,6 +2116,8 @@ parser_imp::XMLToken parser_imp::get_next_token()
 	int state = state_Start;
 	bool might_be_name = false;
 
+	MXML_COUNT(tokens);
+
 	m_token.clear();
 
 	while (token == XMLToken::Undef)
@@ -1354,10 +2276,13 @@ parser_imp::XMLToken parser_imp::get_next_token()
 				if (uc == quote_char)
 				{
 					token = XMLToken::String;
-					m_token = m_token.substr(1, m_token.length() - 2);
+					m_token.pop_back(); // strip the delimiters in place, keeping the capacity
+					m_token.erase(0, 1);
 				}
 				else if (uc == 0)
 					not_well_formed("unexpected end of file, runaway std::string");
+				else
+					append_plain_run(static_cast<char8_t>(quote_char), static_cast<char8_t>(quote_char), static_cast<char8_t>(quote_char));
 				break;
 
 			// Names
@@ -1405,7 +2330,8 @@ parser_imp::XMLToken parser_imp::get_next_token()
 			case state_PERef + 1:
 				if (uc == ';')
 				{
-					m_token = m_token.substr(1, m_token.length() - 2);
+					m_token.pop_back();
+					m_token.erase(0, 1);
 					token = XMLToken::PEReference;
 				}
 				else if (not is_name_char(uc))
@@ -1441,6 +2367,8 @@ parser_imp::XMLToken parser_imp::get_next_content()
 	int state = state_Start;
 	char32_t charref = 0;
 
+	MXML_COUNT(tokens);
+
 	m_token.clear();
 
 	while (token == XMLToken::Undef)
@@ -1507,6 +2435,8 @@ parser_imp::XMLToken parser_imp::get_next_content()
 				}
 				else if (not is_referrable_char(uc))
 					not_well_formed("Illegal character in content text");
+				else
+					append_plain_run('<', '&', ']');
 				break;
 
 			// beginning of a tag?
@@ -1570,6 +2500,8 @@ parser_imp::XMLToken parser_imp::get_next_content()
 					state += 1;
 				else if (uc == 0)
 					not_well_formed("runaway cdata section");
+				else
+					append_plain_run(']', ']', ']');
 				break;
 
 			case state_CDATA + 3:
@@ -1585,7 +2517,8 @@ parser_imp::XMLToken parser_imp::get_next_content()
 				if (uc == '>')
 				{
 					token = XMLToken::CDSect;
-					m_token = m_token.substr(9, m_token.length() - 12);
+					m_token.erase(m_token.length() - 3);
+					m_token.erase(0, 9);
 				}
 				else if (uc == 0)
 					not_well_formed("runaway cdata section");
@@ -1609,7 +2542,8 @@ parser_imp::XMLToken parser_imp::get_next_content()
 					if (uc != ';')
 						not_well_formed("invalid entity found in content, missing semicolon?");
 					token = XMLToken::Reference;
-					m_token = m_token.substr(1, m_token.length() - 2);
+					m_token.pop_back();
+					m_token.erase(0, 1);
 				}
 				break;
 
@@ -1746,69 +2680,118 @@ version_type parser_imp::parse_version()
 	return result;
 }
 
-void parser_imp::parse(bool validate, bool validate_ns)
+bool parser_imp::parse(bool validate, bool validate_ns)
 {
 	m_validating = validate;
 	m_validating_ns = validate_ns;
 
-	m_lookahead = get_next_token();
+	return resume();
+}
 
-	prolog();
+bool parser_imp::step(bool validate, bool validate_ns)
+{
+	if (not std::exchange(m_stepping, true))
+	{
+		m_validating = validate;
+		m_validating_ns = validate_ns;
+	}
 
-	auto e = get_element(m_root_element);
+	resume();
+	return m_paused;
+}
 
-	if (m_has_dtd and e == nullptr and m_validating)
-		not_valid("Element '" + m_root_element + "' is not defined in DTD");
+bool parser_imp::resume()
+{
+	if (m_state == parse_state::Done)
+		return true;
 
-	if (e)
-	{
-		doctype::content_spec_element allowed(m_root_element);
-		doctype::validator valid(allowed);
+	// Unless the parser paused after an event, this is either the start or
+	// the input ran out. In both cases the lookahead is end of file and we
+	// scan the next token (again).
+	if (not std::exchange(m_paused, false) and m_lookahead == XMLToken::Eof)
+		match(XMLToken::Eof);
 
-		element(valid);
-	}
-	else
+	while (not suspended())
 	{
-		doctype::content_spec_any allowed;
-		doctype::validator valid(allowed);
+		switch (m_state)
+		{
+			case parse_state::XMLDecl:
+				xml_decl();
+				m_state = parse_state::Prolog;
+				break;
 
-		element(valid);
-	}
+			case parse_state::Prolog:
+			{
+				misc();
 
-	misc();
+				if (suspended())
+					break;
 
-	if (m_lookahead != XMLToken::Eof)
-		not_well_formed("garbage at end of file");
+				if (m_lookahead == XMLToken::DocType and not m_has_dtd)
+				{
+					doctypedecl();
+					break;
+				}
 
-	if (not m_unresolved_ids.empty())
-	{
-		std::ostringstream os;
-		os << "document contains references to the following undefined ID's: '";
-		for (bool first = true; auto &id : m_unresolved_ids)
-		{
-			if (not std::exchange(first, false))
-				os << ", ";
-			os << id;
-		}
-		os << '\'';
+				if (not m_has_dtd and m_validating)
+					not_valid("document type declaration is missing");
 
-		not_valid(os.str());
-	}
-}
+				auto e = get_element(m_root_element);
 
-void parser_imp::prolog()
-{
-	xml_decl();
+				if (m_has_dtd and e == nullptr and m_validating)
+					not_valid("Element '" + m_root_element + "' is not defined in DTD");
+
+				if (e)
+					m_root_valid.emplace(doctype::content_spec_element(m_root_element));
+				else
+					m_root_valid.emplace(doctype::content_spec_any());
 
-	misc();
+				start_tag(*m_root_valid);
 
-	if (m_lookahead == XMLToken::DocType)
-	{
-		doctypedecl();
-		misc();
+				m_state = parse_state::Content;
+				break;
+			}
+
+			case parse_state::Content:
+				content();
+
+				if (m_elements.empty())
+					m_state = parse_state::Epilog;
+				break;
+
+			case parse_state::Epilog:
+				misc();
+
+				if (suspended())
+					break;
+
+				if (m_lookahead != XMLToken::Eof)
+					not_well_formed("garbage at end of file");
+
+				if (not m_unresolved_ids.empty())
+				{
+					std::ostringstream os;
+					os << "document contains references to the following undefined ID's: '";
+					for (bool first = true; auto &id : m_unresolved_ids)
+					{
+						if (not std::exchange(first, false))
+							os << ", ";
+						os << id;
+					}
+					os << '\'';
+
+					not_valid(os.str());
+				}
+
+				m_state = parse_state::Done;
+				return true;
+
+			case parse_state::Done:
+				return true;
+		}
 	}
-	else if (m_validating)
-		not_valid("document type declaration is missing");
+
+	return false;
 }
 
 void parser_imp::xml_decl()
@@ -1937,25 +2920,27 @@ void parser_imp::text_decl()
 
 void parser_imp::misc()
 {
-	for (;;)
+	while (not suspended())
 	{
 		switch (m_lookahead)
 		{
 			case XMLToken::Space:
 				s();
-				continue;
+				break;
 
 			case XMLToken::Comment:
 				comment();
-				continue;
+				event_reported();
+				break;
 
 			case XMLToken::PI:
 				pi();
-				continue;
-			default:;
-		}
+				event_reported();
+				break;
 
-		break;
+			default:
+				return;
+		}
 	}
 }
 
@@ -1972,7 +2957,8 @@ void parser_imp::doctypedecl()
 
 	m_root_element = name;
 
-	std::unique_ptr<data_source> dtd;
+	std::string pubid, uri;
+	bool has_external_id = false, has_internal_subset = false;
 
 	if (m_lookahead == XMLToken::Space)
 	{
@@ -1980,8 +2966,6 @@ void parser_imp::doctypedecl()
 
 		if (m_lookahead == XMLToken::Name)
 		{
-			std::string pubid, uri;
-
 			if (m_token == "SYSTEM")
 			{
 				match(XMLToken::Name);
@@ -2014,10 +2998,7 @@ void parser_imp::doctypedecl()
 				not_well_formed("Expected external id starting with either SYSTEM or PUBLIC");
 
 			match(XMLToken::String);
-			dtd.reset(get_data_source(pubid, uri));
-
-			if (m_validating and not dtd)
-				not_valid("Could not load DTD " + uri);
+			has_external_id = true;
 
 			m_parser.doctype_decl(m_root_element, pubid, uri);
 		}
@@ -2027,6 +3008,8 @@ void parser_imp::doctypedecl()
 
 	if (m_lookahead == XMLToken::OpenBracket)
 	{
+		has_internal_subset = true;
+
 		match(XMLToken::OpenBracket);
 		intsubset();
 		match(XMLToken::CloseBracket);
@@ -2035,24 +3018,74 @@ void parser_imp::doctypedecl()
 	}
 
 	// internal subset takes precedence over external subset, so
-	// if the external subset is defined, include it here.
-	if (dtd.get() != nullptr)
+	// if the external subset is defined, include it here. Without
+	// an internal subset, a previously parsed DTD can be used.
+	if (has_external_id)
 	{
-		push_data_source(dtd.release(), false);
+		auto &cache = m_parser.m_dtd_cache;
+		bool use_cache = cache and not has_internal_subset and not m_standalone;
 
-		m_external_subset = true;
-		m_in_external_dtd = true;
+		dtd_ptr cached;
+		std::string location;
+		if (use_cache)
+		{
+			location = m_parser.dtd_location(m_source.top()->base(), uri);
+			cached = cache->find(pubid, location);
+		}
 
-		m_lookahead = get_next_token();
+		if (cached and (cached->m_validated_ns or not m_validating_ns))
+		{
+			m_doctype = cached->m_elements;
+			m_parameter_entities = cached->m_parameter_entities;
+			m_general_entities = cached->m_general_entities;
+			m_notations = cached->m_notations;
 
-		text_decl();
+			for (auto &n : cached->m_notation_decls)
+				m_parser.notation_decl(n.m_name, n.m_sysid, n.m_pubid);
 
-		extsubset();
+			m_external_subset = true;
+		}
+		else
+		{
+			std::unique_ptr<data_source> dtd_source(get_data_source(pubid, uri));
 
-		match(XMLToken::Eof);
+			if (m_validating and not dtd_source)
+				not_valid("Could not load DTD " + uri);
 
-		pop_data_source();
-		m_in_external_dtd = false;
+			if (dtd_source)
+			{
+				push_data_source(dtd_source.release(), false);
+
+				m_external_subset = true;
+				m_in_external_dtd = true;
+
+				m_lookahead = get_next_token();
+
+				text_decl();
+
+				extsubset();
+
+				match(XMLToken::Eof);
+
+				pop_data_source();
+				m_in_external_dtd = false;
+
+				// a validating parser has thrown by now if the DTD is not valid
+				if (use_cache and m_validating)
+				{
+					auto parsed = std::make_shared<dtd>();
+
+					parsed->m_elements = m_doctype;
+					parsed->m_parameter_entities = m_parameter_entities;
+					parsed->m_general_entities = m_general_entities;
+					parsed->m_notations = m_notations;
+					parsed->m_notation_decls = m_notation_decls;
+					parsed->m_validated_ns = m_validating_ns;
+
+					cache->insert(pubid, location, std::move(parsed));
+				}
+			}
+		}
 	}
 
 	match(XMLToken::GreaterThan);
@@ -2086,6 +3119,7 @@ void parser_imp::pereference()
 {
 	const doctype::entity &e = get_parameter_entity(m_token);
 
+	MXML_COUNT(entity_expansions);
 	push_data_source(new parameter_entity_data_source(e.get_replacement(), e.get_path()), true);
 
 	match(XMLToken::PEReference);
@@ -2138,6 +3172,7 @@ void parser_imp::declsep()
 
 			match(XMLToken::PEReference);
 
+			MXML_COUNT(entity_expansions);
 			push_data_source(new parameter_entity_data_source(e.get_replacement(), e.get_path()), false);
 
 			m_lookahead = get_next_token();
@@ -2617,12 +3652,8 @@ void parser_imp::parameter_entity_decl()
 
 	match(XMLToken::GreaterThan);
 
-	if (find_if(m_parameter_entities.begin(), m_parameter_entities.end(),
-			[name](auto e)
-			{ return e->name() == name; }) == m_parameter_entities.end())
-	{
-		m_parameter_entities.push_back(std::make_shared<doctype::parameter_entity>(name, value, path));
-	}
+	if (m_parameter_entities.find(name) == nullptr)
+		m_parameter_entities.insert(std::make_shared<doctype::parameter_entity>(name, value, path));
 }
 
 void parser_imp::general_entity_decl()
@@ -2673,17 +3704,17 @@ void parser_imp::general_entity_decl()
 
 	match(XMLToken::GreaterThan);
 
-	if (std::find_if(m_general_entities.begin(), m_general_entities.end(),
-			[name](auto e)
-			{ return e->name() == name; }) == m_general_entities.end())
+	if (m_general_entities.find(name) == nullptr)
 	{
-		m_general_entities.push_back(std::make_shared<doctype::general_entity>(name, value, external, parsed));
+		auto e = std::make_shared<doctype::general_entity>(name, value, external, parsed);
 
 		if (not parsed)
-			m_general_entities.back()->set_ndata(ndata);
+			e->set_ndata(ndata);
 
 		if (m_in_external_dtd)
-			m_general_entities.back()->set_externally_defined(true);
+			e->set_externally_defined(true);
+
+		m_general_entities.insert(std::move(e));
 	}
 }
 
@@ -2956,6 +3987,8 @@ void parser_imp::notation_decl()
 
 	collapse_spaces(pubid);
 
+	m_notation_decls.push_back({ name, sysid, pubid });
+
 	m_parser.notation_decl(name, sysid, pubid);
 }
 
@@ -2963,10 +3996,11 @@ data_source *parser_imp::get_data_source(const std::string &pubid, std::string u
 {
 	data_source *result = nullptr;
 
-	std::istream *is = m_parser.external_entity_ref(m_source.top()->base(), pubid, uri);
-	if (is != nullptr)
+	std::unique_ptr<std::istream> is(m_parser.external_entity_ref(m_source.top()->base(), pubid, uri));
+	if (is)
 	{
-		result = new istream_data_source(is);
+		result = new istream_data_source(is.get());
+		is.release();
 
 		std::string::size_type s = uri.rfind('/');
 		if (s == std::string::npos)
@@ -3353,10 +4387,119 @@ void parser_imp::parse_general_entity_declaration(std::string &s)
 	swap(s, result);
 }
 
-std::string parser_imp::normalize_attribute_value()
+std::size_t parser_imp::append_simple_reference(std::string_view s, std::string &result)
 {
-	std::string result;
+	auto semi = s.find(';');
+	if (semi == std::string_view::npos or semi < 3 or semi > 10)
+		return 0;
+
+	auto ref = s.substr(1, semi - 1);
+
+	if (ref[0] == '#')
+	{
+		bool hex = ref[1] == 'x';
+		auto digits = ref.substr(hex ? 2 : 1);
+		if (digits.empty())
+			return 0;
+
+		char32_t charref = 0;
+		for (char ch : digits)
+		{
+			if (ch >= '0' and ch <= '9')
+				charref = charref * (hex ? 16 : 10) + (ch - '0');
+			else if (hex and ch >= 'a' and ch <= 'f')
+				charref = (charref << 4) + (ch - 'a' + 10);
+			else if (hex and ch >= 'A' and ch <= 'F')
+				charref = (charref << 4) + (ch - 'A' + 10);
+			else
+				return 0;
+		}
+
+		if (not is_referrable_char(charref))
+			return 0;
+
+		append(result, charref);
+	}
+	else
+	{
+		// Only the predefined entities, and only when a DTD cannot redefine them
+		if (m_has_dtd)
+			return 0;
+
+		char ch;
+		if (ref == "amp")
+			ch = '&';
+		else if (ref == "lt")
+			ch = '<';
+		else if (ref == "gt")
+			ch = '>';
+		else if (ref == "quot")
+			ch = '"';
+		else if (ref == "apos")
+			ch = '\'';
+		else
+			return 0;
+
+		MXML_COUNT(entity_expansions);
+		result += ch;
+	}
 
+	return semi + 1;
+}
+
+void parser_imp::normalize_attribute_value(std::string_view s, bool isCDATA, std::string &result)
+{
+	result.clear();
+
+	// Values with only text, character references and predefined entities
+	// are handled directly. Anything else, including errors, is left to
+	// the full version reading from a data source.
+	bool modified = false, simple = true;
+
+	for (std::string_view::size_type i = 0; simple and i < s.length();)
+	{
+		auto e = s.find_first_of("\t\r\n&<", i);
+		result.append(s.substr(i, e - i));
+
+		if (e == std::string_view::npos)
+			break;
+
+		if (s[e] == '&')
+		{
+			auto n = append_simple_reference(s.substr(e), result);
+			simple = n > 0;
+			i = e + n;
+		}
+		else if (s[e] == '<')
+			simple = false;
+		else
+		{
+			result += ' ';
+			i = e + 1;
+		}
+
+		modified = true;
+	}
+
+	if (not simple)
+	{
+		// The token is swapped out when a data source is pushed, read from a copy
+		m_attr_text.assign(s);
+		push_data_source(new string_data_source(std::string_view{ m_attr_text }), false);
+
+		result.clear();
+		normalize_attribute_value(result);
+	}
+
+	if (m_standalone and modified)
+		not_valid("Document cannot be standalone since an attribute was modified");
+
+	if (not isCDATA)
+		collapse_spaces(result);
+}
+
+void parser_imp::normalize_attribute_value(std::string &result)
+{
 	char32_t charref = 0;
 	std::string name;
 
@@ -3488,10 +4631,10 @@ std::string parser_imp::normalize_attribute_value()
 					if (e.is_externally_defined() and m_standalone)
 						not_well_formed("document marked as standalone but an external entity is referenced");
 
+					MXML_COUNT(entity_expansions);
 					push_data_source(new entity_data_source(e.get_replacement(), m_source.top()->base()), false);
 
-					std::string replacement = normalize_attribute_value();
-					result += replacement;
+					normalize_attribute_value(result);
 
 					state = state_Start;
 
@@ -3513,8 +4656,6 @@ std::string parser_imp::normalize_attribute_value()
 		not_well_formed("invalid reference");
 
 	m_source.pop();
-
-	return result;
 }
 
 void parser_imp::collapse_spaces(std::string &s)
@@ -3545,15 +4686,20 @@ void parser_imp::collapse_spaces(std::string &s)
 	s.erase(o, s.end());
 }
 
-void parser_imp::element(doctype::validator &valid)
+void parser_imp::start_tag(doctype::validator &valid)
 {
-	save_state in_content(m_in_content, false);
+	m_in_content = false;
 
 	match(XMLToken::STag);
-	std::string name = m_token;
+	auto &name = m_start_name;
+	name.assign(m_token);
 	match(XMLToken::Name);
 
-	if (not valid.allow(name))
+	MXML_COUNT(elements);
+
+	// Without a DTD all content models are ANY, skip creating the atom then
+	if (valid.get_content_spec() != doctype::content_spec_type::Any and
+		not validate([&] { return valid.allow(atom(name)); }))
 		not_valid("element '" + name + "' not expected at this position");
 
 	auto dte = get_element(name);
@@ -3561,12 +4707,17 @@ void parser_imp::element(doctype::validator &valid)
 	if (m_has_dtd and dte == nullptr and m_validating)
 		not_valid("Element '" + name + "' is not defined in DTD");
 
-	doctype::validator sub_valid(dte);
+	auto &frame = m_elements.push(this, dte);
 
-	std::vector<parser::attr> attrs;
+#if MXML_STATS
+	m_parser.m_stats.max_depth = std::max(m_parser.m_stats.max_depth, m_elements.size());
+#endif
 
-	ns_state ns(this);
-	std::set<std::string> seen;
+	// The attributes are only needed up until the call to start_element
+	// so it is safe to reuse the buffers in child elements.
+	m_attr_count = 0;
+
+	auto &ns = frame.m_ns;
 
 	for (;;)
 	{
@@ -3578,12 +4729,18 @@ void parser_imp::element(doctype::validator &valid)
 		if (m_lookahead != XMLToken::Name)
 			break;
 
-		std::string attr_name = m_token;
+		auto &attr = add_attr_buffer();
+		auto &attr_name = attr.m_name;
+		attr_name.assign(m_token);
 		match(XMLToken::Name);
 
-		if (seen.count(attr_name) > 0)
-			not_well_formed("multiple values for attribute '" + attr_name + "'");
-		seen.insert(attr_name);
+		for (std::size_t i = 0; i + 1 < m_attr_count; ++i)
+		{
+			if (m_attr_buffers[i].m_name == attr_name)
+				not_well_formed("multiple values for attribute '" + attr_name + "'");
+		}
+
+		MXML_COUNT(attributes);
 
 		eq();
 
@@ -3596,7 +4753,8 @@ void parser_imp::element(doctype::validator &valid)
 		if (dta == nullptr and m_validating)
 			not_valid("undeclared attribute '" + attr_name + "'");
 
-		std::string attr_value = normalize_attribute_value(m_token, dta == nullptr or dta->get_type() == doctype::attribute_type::CDATA);
+		auto &attr_value = attr.m_value;
+		normalize_attribute_value(m_token, dta == nullptr or dta->get_type() == doctype::attribute_type::CDATA, attr_value);
 		match(XMLToken::String);
 
 		if (m_validating and
@@ -3610,6 +4768,8 @@ void parser_imp::element(doctype::validator &valid)
 		// had a crash suddenly here deep down in starts_with...
 		if (attr_name == "xmlns" or attr_name.starts_with("xmlns:")) // namespace support
 		{
+			attr.m_decl = true;
+
 			if (not((m_version > version_type{ 1, 0 } and attr_value.empty()) or is_valid_url(attr_value)))
 				not_well_formed("Not a valid namespace URI: " + attr_value);
 
@@ -3651,7 +4811,11 @@ void parser_imp::element(doctype::validator &valid)
 
 			if (dta != nullptr)
 			{
-				std::string v(attr_value);
+				bool check_modified = m_validating and m_standalone and dta->is_external();
+
+				std::string v;
+				if (check_modified)
+					v = attr_value;
 
 				if (not dta->validate_value(attr_value, m_general_entities))
 				{
@@ -3661,7 +4825,7 @@ void parser_imp::element(doctype::validator &valid)
 						not_valid("invalid value ('" + attr_value + "') for attribute " + attr_name + "");
 				}
 
-				if (m_validating and m_standalone and dta->is_external() and v != attr_value)
+				if (check_modified and v != attr_value)
 					not_valid("attribute value modified as a result of an external defined attlist declaration, which is not valid in a standalone document");
 
 				if (dta->get_type() == doctype::attribute_type::ID)
@@ -3716,10 +4880,7 @@ void parser_imp::element(doctype::validator &valid)
 				}
 			}
 
-			parser::attr a;
-			a.m_name = attr_name;
-			a.m_value = attr_value;
-			a.m_id = id;
+			attr.m_id = id;
 
 			if (m_ns != nullptr and dta == nullptr)
 			{
@@ -3729,21 +4890,19 @@ void parser_imp::element(doctype::validator &valid)
 					if (attr_name.find(':', d + 1) != std::string::npos)
 						not_well_formed("Multiple colons in attribute name");
 
-					auto prefix = attr_name.substr(0, d);
+					std::string_view prefix{ attr_name.data(), d };
 					if (not iequals(prefix, "xml"))
 					{
-						std::string nsv = m_ns->ns_for_prefix(prefix);
+						auto nsv = m_ns->ns_for_prefix(prefix);
 
 						if (nsv.empty())
 							not_well_formed("Unbound attribute prefix");
 
-						a.m_ns = nsv;
-						a.m_name = attr_name.substr(d + 1);
+						attr.m_ns = nsv;
+						attr.m_local = d + 1;
 					}
 				}
 			}
-
-			attrs.push_back(a);
 		}
 	}
 
@@ -3755,7 +4914,7 @@ void parser_imp::element(doctype::validator &valid)
 		auto cp = name.find(':');
 		if (cp != std::string::npos)
 		{
-			auto prefix = name.substr(0, cp);
+			std::string_view prefix{ name.data(), cp };
 			if (not ns.is_known_prefix(prefix))
 				not_well_formed("Unknown prefix for element " + name);
 		}
@@ -3764,11 +4923,14 @@ void parser_imp::element(doctype::validator &valid)
 	{
 		for (auto dta : dte->get_attributes())
 		{
-			std::string attr_name = dta->name();
+			auto &attr_name = dta->name();
 
-			auto ai = find_if(attrs.begin(), attrs.end(),
-				[attr_name](auto &a)
-				{ return a.m_name == attr_name; });
+			bool specified = false;
+			for (std::size_t i = 0; i < m_attr_count and not specified; ++i)
+			{
+				auto &a = m_attr_buffers[i];
+				specified = not a.m_decl and std::string_view{ a.m_name }.substr(a.m_local) == attr_name;
+			}
 
 			doctype::attribute_default defType;
 			std::string defValue;
@@ -3777,99 +4939,139 @@ void parser_imp::element(doctype::validator &valid)
 
 			if (defType == doctype::attribute_default::Required)
 			{
-				if (ai == attrs.end())
+				if (not specified)
 					not_valid("missing #REQUIRED attribute '" + attr_name + "' for element '" + name + "'");
 			}
-			else if (not defValue.empty() and ai == attrs.end())
+			else if (not defValue.empty() and not specified)
 			{
 				if (m_validating and m_standalone and dta->is_external())
 					not_valid("default value for attribute defined in external declaration which is not allowed in a standalone document");
 
-				parser::attr def_attr;
+				auto &def_attr = add_attr_buffer();
 				def_attr.m_name = attr_name;
-				def_attr.m_value = normalize_attribute_value(defValue, dta->get_type() == doctype::attribute_type::CDATA);
-				def_attr.m_id = false;
+				normalize_attribute_value(defValue, dta->get_type() == doctype::attribute_type::CDATA, def_attr.m_value);
 
 				if (m_ns != nullptr)
 				{
 					std::string::size_type d = attr_name.find(':');
 					if (d != std::string::npos)
 					{
-						std::string nsv = m_ns->ns_for_prefix(attr_name.substr(0, d));
+						auto nsv = m_ns->ns_for_prefix(std::string_view{ attr_name }.substr(0, d));
 
 						if (not nsv.empty())
 						{
 							def_attr.m_ns = nsv;
-							def_attr.m_name = attr_name.substr(d + 1);
+							def_attr.m_local = d + 1;
 						}
 					}
 				}
-
-				attrs.push_back(def_attr);
 			}
 		}
 	}
 
 	// now find out the namespace we're supposed to pass
-	std::string uri, raw(name);
+	auto &uri = frame.m_uri;
+	frame.m_qname = name;
 
 	std::string::size_type c = name.find(':');
 	if (c != std::string::npos and c > 0)
 	{
-		uri = ns.ns_for_prefix(name.substr(0, c));
-		name.erase(0, c + 1);
+		uri = ns.ns_for_prefix(std::string_view{ name }.substr(0, c));
+		frame.m_name.assign(name, c + 1);
 	}
 	else
+	{
 		uri = ns.default_ns();
+		frame.m_name = name;
+	}
+
+	// The views on the attributes, the namespace declarations are not reported
+	auto &attrs = m_attr_views;
+	attrs.clear();
+
+#if MXML_STATS
+	auto capacity = attrs.capacity();
+#endif
+
+	for (std::size_t i = 0; i < m_attr_count; ++i)
+	{
+		auto &a = m_attr_buffers[i];
+		if (not a.m_decl)
+			attrs.emplace_back(a.m_ns, std::string_view{ a.m_name }.substr(a.m_local), a.m_value, a.m_id);
+	}
 
 	// sort the attributes
 	sort(attrs.begin(), attrs.end(), [](auto &a, auto &b)
 		{ return a.m_name < b.m_name; });
 
-	if (m_lookahead == XMLToken::Slash)
-	{
-		match(XMLToken::Slash);
-		m_parser.start_element(name, uri, attrs);
-		m_parser.end_element(name, uri);
-	}
-	else
-	{
-		m_parser.start_element(name, uri, attrs);
+#if MXML_STATS
+	if (attrs.capacity() > capacity)
+		MXML_COUNT(allocations);
+#endif
 
+	m_parser.start_element(std::string_view{ frame.m_name }, std::string_view{ uri }, attrs);
+	event_reported();
+
+	// The end of an empty element is left to content(), it is a separate event
+	if (m_lookahead != XMLToken::Slash)
+	{
 		m_in_content = true;
 		match(XMLToken::GreaterThan);
+	}
+}
 
-		if (m_lookahead != XMLToken::ETag)
-			content(sub_valid);
+void parser_imp::end_tag()
+{
+	auto &frame = m_elements.back();
 
+	if (m_lookahead == XMLToken::Slash) // an empty element, ends with '/>'
+		match(XMLToken::Slash);
+	else
+	{
 		m_in_content = false;
 
 		match(XMLToken::ETag);
 
-		if (m_token != raw)
+		if (m_token != frame.m_qname)
 			not_well_formed("end tag does not match start tag");
 
 		match(XMLToken::Name);
 
 		s();
-
-		m_parser.end_element(name, uri);
 	}
 
-	in_content.reset();
+	// The frame is popped below, the names should outlive it
+	std::swap(m_end_name, frame.m_name);
+	std::swap(m_end_uri, frame.m_uri);
+
+	m_parser.end_element(m_end_name, m_end_uri);
+	event_reported();
+
+	auto dte = frame.m_dte;
+	bool done = dte == nullptr or validate([&] { return frame.m_valid->done(); });
+	m_elements.pop();
+
+	m_in_content = not m_elements.empty();
 	match(XMLToken::GreaterThan);
 
-	if (m_validating and dte != nullptr and not sub_valid.done())
+	if (m_validating and not done)
 		not_valid("missing child elements for element '" + dte->name() + "'");
 }
 
-void parser_imp::content(doctype::validator &valid)
+void parser_imp::content()
 {
-	if (valid.get_content_spec() == doctype::content_spec_type::Empty and m_lookahead != XMLToken::ETag)
-		not_valid("Content is not allowed in an element declared to be EMPTY");
-
-	do
+	while (not m_elements.empty() and not suspended())
 	{
+		auto &frame = m_elements.back();
+		auto &valid = *frame.m_valid;
+
+		if (m_lookahead != XMLToken::ETag and m_lookahead != XMLToken::Slash and
+			not std::exchange(frame.m_has_content, true) and
+			valid.get_content_spec() == doctype::content_spec_type::Empty)
+		{
+			not_valid("Content is not allowed in an element declared to be EMPTY");
+		}
+
 		switch (m_lookahead)
 		{
 			case XMLToken::Content:
@@ -3879,6 +5081,7 @@ void parser_imp::content(doctype::validator &valid)
 				else if (valid.get_content_spec() == doctype::content_spec_type::Children and m_lookahead == XMLToken::Content)
 					not_valid("character data '" + m_token + "' not allowed in element");
 				m_parser.character_data(m_token);
+				event_reported();
 				match(m_lookahead);
 				break;
 
@@ -3888,6 +5091,7 @@ void parser_imp::content(doctype::validator &valid)
 				else if (valid.get_content_spec() == doctype::content_spec_type::Children and is_space(m_token))
 					not_valid("Element may not contain reference to space");
 				m_parser.character_data(m_token);
+				event_reported();
 				match(m_lookahead);
 				break;
 
@@ -3906,11 +5110,13 @@ void parser_imp::content(doctype::validator &valid)
 				if (not e.is_parsed())
 					not_well_formed("content has a general entity reference to an unparsed entity");
 
+				MXML_COUNT(entity_expansions);
 				push_data_source(new entity_data_source(e.get_replacement(), m_source.top()->base()), false);
 
 				m_lookahead = get_next_content();
 
-				save_state in_external_dtd(m_in_external_dtd, e.is_externally_defined());
+				m_entity_frames.push_back({ m_elements.size(), m_in_external_dtd });
+				m_in_external_dtd = e.is_externally_defined();
 
 				// a children production may not contain references to spaces
 				if (m_lookahead == XMLToken::Space and valid.get_content_spec() == doctype::content_spec_type::Children)
@@ -3921,32 +5127,49 @@ void parser_imp::content(doctype::validator &valid)
 					if (m_lookahead == XMLToken::Eof)
 						not_valid("Element may not contain reference to space");
 					m_parser.character_data(space);
+					event_reported();
 				}
+				break;
+			}
 
-				if (m_lookahead != XMLToken::Eof)
-					content(valid);
-
-				if (m_lookahead != XMLToken::Eof)
-					not_well_formed("entity reference should be a valid content production");
+			case XMLToken::Eof:
+				// The end of the replacement text of an entity reference
+				if (m_entity_frames.empty() or m_entity_frames.back().m_depth != m_elements.size())
+					match(XMLToken::ETag); // will fail and report error
 
 				pop_data_source();
 
 				match(XMLToken::Reference);
 
 				m_entities_on_stack.pop_back();
+
+				m_in_external_dtd = m_entity_frames.back().m_in_external_dtd;
+				m_entity_frames.pop_back();
+				break;
+
+			case XMLToken::ETag:
+				if (not m_entity_frames.empty() and m_entity_frames.back().m_depth == m_elements.size())
+					not_well_formed("entity reference should be a valid content production");
+
+				end_tag();
+				break;
+
+			case XMLToken::Slash: // the end of an empty element
+				end_tag();
 				break;
-			}
 
 			case XMLToken::STag:
-				element(valid);
+				start_tag(valid);
 				break;
 
 			case XMLToken::PI:
 				pi();
+				event_reported();
 				break;
 
 			case XMLToken::Comment:
 				comment();
+				event_reported();
 				break;
 
 			case XMLToken::CDSect:
@@ -3960,6 +5183,7 @@ void parser_imp::content(doctype::validator &valid)
 					not_valid("Element may not contain CDATA section containing only space");
 
 				m_parser.end_cdata_section();
+				event_reported();
 
 				match(XMLToken::CDSect);
 				break;
@@ -3967,7 +5191,7 @@ void parser_imp::content(doctype::validator &valid)
 			default:
 				match(XMLToken::Content); // will fail and report error
 		}
-	} while (m_lookahead != XMLToken::ETag and m_lookahead != XMLToken::Eof);
+	}
 }
 
 void parser_imp::comment()
@@ -4025,7 +5249,9 @@ void parser_imp::comment()
 
 	assert(m_token.length() >= 3);
 	m_token.erase(m_token.end() - 3, m_token.end());
-	m_parser.comment(m_token);
+
+	std::swap(m_data, m_token);
+	m_parser.comment(m_data);
 
 	in_content.reset();
 	match(XMLToken::Comment);
@@ -4039,7 +5265,8 @@ void parser_imp::pi()
 	// read characters until we reach -->
 	// check all characters in between for validity
 
-	std::string pi_target = m_token.substr(2);
+	auto &pi_target = m_pi_target;
+	pi_target.assign(m_token, 2);
 
 	if (pi_target.empty())
 		not_well_formed("processing instruction target missing");
@@ -4116,7 +5343,9 @@ void parser_imp::pi()
 	}
 
 	m_token.erase(m_token.end() - 2, m_token.end());
-	m_parser.processing_instruction(pi_target, m_token);
+
+	std::swap(m_data, m_token);
+	m_parser.processing_instruction(pi_target, m_data);
 
 	in_content.reset();
 	match(XMLToken::PI);
@@ -4125,8 +5354,21 @@ void parser_imp::pi()
 // --------------------------------------------------------------------
 
 parser::parser(std::istream &data)
-	: m_impl(new parser_imp(data, *this))
+	: m_impl(new parser_imp(new istream_data_source(data), *this))
+	, m_istream(nullptr)
+{
+}
+
+parser::parser(std::string_view data)
+	: m_impl(new parser_imp(new buffer_data_source(data.data(), data.length()), *this))
+	, m_istream(nullptr)
+{
+}
+
+parser::parser()
+	: m_impl(nullptr)
 	, m_istream(nullptr)
+	, m_push(new push_state)
 {
 }
 
@@ -4134,47 +5376,119 @@ parser::~parser()
 {
 	delete m_impl;
 	delete m_istream;
+	delete m_push;
 }
 
 void parser::parse(bool validate, bool validate_ns)
 {
+	if (m_push != nullptr)
+		throw exception("parse cannot be used on a push parser, use feed instead");
+
 	m_impl->parse(validate, validate_ns);
 }
 
+bool parser::parse_next(bool validate, bool validate_ns)
+{
+	if (m_push != nullptr)
+		throw exception("parse_next cannot be used on a push parser");
+
+	return m_impl->step(validate, validate_ns);
+}
+
+void parser::feed(std::string_view chunk, bool last, bool validate, bool validate_ns)
+{
+	if (m_push == nullptr)
+		throw exception("feed can only be used on a push parser");
+
+	if (m_push->m_last)
+		throw exception("push parser is finished, no more data is expected");
+
+	m_push->append(chunk, last);
+
+	try
+	{
+		if (m_impl != nullptr)
+			m_impl->resume();
+		else if (m_push->ready())
+		{
+			m_impl = new parser_imp(new push_data_source(*m_push), *this);
+			m_impl->parse(validate, validate_ns);
+		}
+	}
+	catch (...)
+	{
+		m_push->m_last = true;
+		throw;
+	}
+}
+
 void parser::xml_decl(encoding_type encoding, bool standalone, version_type version)
 {
 	if (xml_decl_handler)
 		xml_decl_handler(encoding, standalone, version);
 }
 
-void parser::start_element(const std::string &name, const std::string &uri, const std::vector<attr> &atts)
+void parser::start_element(std::string_view name, std::string_view uri, const attr_view_list_type &atts)
 {
 	if (start_element_handler)
-		start_element_handler(name, uri, atts);
+	{
+		auto &imp = *m_impl;
+
+		imp.m_name_copy.assign(name);
+		imp.m_uri_copy.assign(uri);
+
+		auto &attrs = imp.m_attrs;
+		attrs.resize(atts.size());
+
+		for (std::size_t i = 0; i < atts.size(); ++i)
+		{
+			attrs[i].m_ns.assign(atts[i].m_ns);
+			attrs[i].m_name.assign(atts[i].m_name);
+			attrs[i].m_value.assign(atts[i].m_value);
+			attrs[i].m_id = atts[i].m_id;
+		}
+
+		start_element_handler(imp.m_name_copy, imp.m_uri_copy, attrs);
+	}
+
+	if (start_element_view_handler)
+		start_element_view_handler(name, uri, atts);
 }
 
 void parser::end_element(const std::string &name, const std::string &uri)
 {
 	if (end_element_handler)
 		end_element_handler(name, uri);
+
+	if (end_element_view_handler)
+		end_element_view_handler(name, uri);
 }
 
 void parser::character_data(const std::string &data)
 {
 	if (character_data_handler)
 		character_data_handler(data);
+
+	if (character_data_view_handler)
+		character_data_view_handler(data);
 }
 
 void parser::processing_instruction(const std::string &target, const std::string &data)
 {
 	if (processing_instruction_handler)
 		processing_instruction_handler(target, data);
+
+	if (processing_instruction_view_handler)
+		processing_instruction_view_handler(target, data);
 }
 
 void parser::comment(const std::string &data)
 {
 	if (comment_handler)
 		comment_handler(data);
+
+	if (comment_view_handler)
+		comment_view_handler(data);
 }
 
 void parser::start_cdata_section()
@@ -4221,6 +5535,11 @@ std::istream *parser::external_entity_ref(const std::string &base, const std::st
 	return result;
 }
 
+std::string parser::dtd_location(const std::string &base, const std::string &uri)
+{
+	return base.empty() or is_absolute_path(uri) ? uri : base + '/' + uri;
+}
+
 void parser::report_invalidation(const std::string &msg)
 {
 	if (report_invalidation_handler)
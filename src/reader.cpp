@@ -0,0 +1,262 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/reader.hpp"
+
+#include <utility>
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+// The parser is stepped from next(), it stops after each event. The
+// name, uri, attributes and data of an event are those passed to the
+// callbacks, they are owned by the parser and remain valid until it
+// is stepped again. Character data is collected in m_text, adjacent
+// text is reported as a single event.
+
+struct reader_imp
+{
+	class event_parser : public parser
+	{
+	  public:
+		event_parser(std::istream &is, reader_imp &imp)
+			: parser(is)
+			, m_imp(imp)
+		{
+		}
+
+		event_parser(std::string_view data, reader_imp &imp)
+			: parser(data)
+			, m_imp(imp)
+		{
+		}
+
+		using parser::parse_next;
+
+	  protected:
+		void start_element(std::string_view name, std::string_view uri, const attr_view_list_type &atts) override
+		{
+			m_imp.start_element(name, uri, atts);
+		}
+
+		void end_element(const std::string &name, const std::string &uri) override
+		{
+			m_imp.end_element(name, uri);
+		}
+
+		void character_data(const std::string &data) override
+		{
+			m_imp.character_data(data);
+		}
+
+		void processing_instruction(const std::string &target, const std::string &data) override
+		{
+			m_imp.event(reader::event_type::processing_instruction, target, {}, data);
+		}
+
+		void comment(const std::string &data) override
+		{
+			m_imp.event(reader::event_type::comment, {}, {}, data);
+		}
+
+	  private:
+		reader_imp &m_imp;
+	};
+
+	template <typename Data>
+	reader_imp(Data &&data)
+		: m_parser(std::forward<Data>(data), *this)
+	{
+	}
+
+	// --------------------------------------------------------------------
+	// called by the parser
+
+	void start_element(std::string_view name, std::string_view uri, const parser::attr_view_list_type &atts)
+	{
+		++m_depth;
+		event(reader::event_type::start_element, name, uri, {});
+		m_attrs = &atts;
+	}
+
+	void end_element(const std::string &name, const std::string &uri)
+	{
+		event(reader::event_type::end_element, name, uri, {});
+		--m_depth;
+	}
+
+	void character_data(const std::string &data)
+	{
+		m_event = reader::event_type::text;
+
+		if (m_skip_depth == 0)
+		{
+			if (m_text.empty())
+				m_text_depth = m_depth;
+			m_text += data;
+		}
+	}
+
+	void event(reader::event_type type, std::string_view name, std::string_view uri, std::string_view value)
+	{
+		m_event = type;
+		m_name = name;
+		m_uri = uri;
+		m_value = value;
+		m_attrs = nullptr;
+		m_event_depth = m_depth;
+	}
+
+	// --------------------------------------------------------------------
+
+	bool next()
+	{
+		m_text.clear();
+
+		// the event following a text was parsed already
+		if (std::exchange(m_pending, false))
+		{
+			m_type = m_event;
+			return true;
+		}
+
+		while (m_parser.parse_next(false, false))
+		{
+			if (m_event == reader::event_type::text)
+				continue;
+
+			m_pending = not m_text.empty();
+			m_type = m_pending ? reader::event_type::text : m_event;
+			return true;
+		}
+
+		m_type = reader::event_type::none;
+		return false;
+	}
+
+	void skip_subtree()
+	{
+		if (m_type != reader::event_type::start_element)
+			throw exception("skip_subtree can only be called on a start_element");
+
+		// The events in the subtree are ignored, the callbacks only track the depth
+		m_skip_depth = m_depth;
+
+		while (m_parser.parse_next(false, false) and m_depth >= m_skip_depth)
+			;
+
+		m_skip_depth = 0;
+		m_type = m_event;
+	}
+
+	// true if the current event is the last one reported by the parser
+	bool at_event() const
+	{
+		return m_type != reader::event_type::none and m_type != reader::event_type::text;
+	}
+
+	event_parser m_parser;
+
+	// the current event
+	reader::event_type m_type = reader::event_type::none;
+	std::string m_text;
+	int m_text_depth = 0;
+	bool m_pending = false;
+
+	// the last event reported by the parser
+	reader::event_type m_event = reader::event_type::none;
+	std::string_view m_name, m_uri, m_value;
+	const parser::attr_view_list_type *m_attrs = nullptr;
+	int m_event_depth = 0;
+
+	int m_depth = 0;
+	int m_skip_depth = 0;
+};
+
+// --------------------------------------------------------------------
+
+reader::reader(std::istream &is)
+	: m_impl(new reader_imp(is))
+{
+}
+
+reader::reader(std::string_view data)
+	: m_impl(new reader_imp(data))
+{
+}
+
+reader::~reader()
+{
+	delete m_impl;
+}
+
+bool reader::next()
+{
+	return m_impl->next();
+}
+
+void reader::skip_subtree()
+{
+	m_impl->skip_subtree();
+}
+
+reader::event_type reader::type() const
+{
+	return m_impl->m_type;
+}
+
+std::string_view reader::name() const
+{
+	return m_impl->at_event() ? m_impl->m_name : std::string_view{};
+}
+
+std::string_view reader::uri() const
+{
+	return m_impl->at_event() ? m_impl->m_uri : std::string_view{};
+}
+
+std::string_view reader::value() const
+{
+	if (m_impl->m_type == event_type::text)
+		return m_impl->m_text;
+	return m_impl->at_event() ? m_impl->m_value : std::string_view{};
+}
+
+const parser::attr_view_list_type &reader::attributes() const
+{
+	static const parser::attr_view_list_type kEmpty;
+	return m_impl->m_type == event_type::start_element ? *m_impl->m_attrs : kEmpty;
+}
+
+int reader::depth() const
+{
+	if (m_impl->m_type == event_type::text)
+		return m_impl->m_text_depth;
+	return m_impl->at_event() ? m_impl->m_event_depth : 0;
+}
+
+} // namespace mxml
@@ -0,0 +1,189 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/error.hpp"
+#include "mxml/serialize.hpp"
+
+#include <algorithm>
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+
+stream_serializer::stream_serializer(std::ostream &os)
+	: m_writer(os)
+{
+}
+
+stream_serializer::stream_serializer(std::string &s)
+	: m_writer(s)
+{
+}
+
+stream_serializer::~stream_serializer()
+{
+	try
+	{
+		while (not m_name_offsets.empty())
+			end_element();
+		flush();
+	}
+	catch (...)
+	{
+	}
+}
+
+void stream_serializer::flush()
+{
+	m_writer.flush();
+}
+
+void stream_serializer::close_start_tag()
+{
+	if (m_start_tag_open)
+	{
+		m_writer.put('>');
+		m_start_tag_open = false;
+	}
+}
+
+void stream_serializer::start_element(std::string_view name)
+{
+	close_start_tag();
+
+	m_writer.put('<');
+	m_writer.write(name);
+
+	m_name_offsets.push_back(m_names.length());
+	m_names += name;
+
+	m_start_tag_open = true;
+}
+
+void stream_serializer::end_element()
+{
+	if (m_name_offsets.empty())
+		throw exception("end_element called without open element");
+
+	auto offset = m_name_offsets.back();
+	m_name_offsets.pop_back();
+
+	if (m_start_tag_open)
+	{
+		m_writer.write("/>");
+		m_start_tag_open = false;
+	}
+	else
+	{
+		m_writer.write("</");
+		m_writer.write(std::string_view{ m_names }.substr(offset));
+		m_writer.put('>');
+	}
+
+	m_names.erase(offset);
+}
+
+void stream_serializer::write_attribute(std::string_view name, std::string_view value)
+{
+	// like serializer, attributes outside an element are ignored
+	if (m_name_offsets.empty())
+		return;
+
+	if (not m_start_tag_open)
+		throw exception("attribute " + std::string{ name } + " is serialized after the content of its element");
+
+	m_writer.put(' ');
+	m_writer.write(name);
+	m_writer.write("=\"");
+	m_writer.write_escaped(value);
+	m_writer.put('"');
+}
+
+void stream_serializer::write_content(std::string_view text)
+{
+	if (text.empty())
+		return;
+
+	close_start_tag();
+	m_writer.write_escaped(text);
+}
+
+// --------------------------------------------------------------------
+
+stream_deserializer::member_index::member_index(const frame &f)
+{
+	for (std::size_t i = 0; i < f.m_size; ++i)
+		m_index.emplace_back(f.m_members[i].m_name, i);
+
+	std::sort(m_index.begin(), m_index.end());
+}
+
+std::size_t stream_deserializer::member_index::find(const frame &f, std::string_view name) const
+{
+	auto i = std::lower_bound(m_index.begin(), m_index.end(), name, [](auto &a, std::string_view b)
+		{ return a.first < b; });
+
+	// A serialize member might not always pass the same members, check
+	// the name in the frame and search there if it is not right
+	if (i != m_index.end() and i->first == name and i->second < f.m_size and f.m_members[i->second].m_name == name)
+		return i->second;
+
+	std::size_t result = 0;
+	while (result < f.m_size and f.m_members[result].m_name != name)
+		++result;
+
+	return result;
+}
+
+const std::string &stream_deserializer::read_text()
+{
+	m_text.clear();
+
+	while (m_reader.next())
+	{
+		switch (m_reader.type())
+		{
+			case reader::event_type::text:
+				m_text += m_reader.value();
+				break;
+
+			case reader::event_type::start_element:
+				m_reader.skip_subtree();
+				break;
+
+			case reader::event_type::end_element:
+				return m_text;
+
+			default:
+				break;
+		}
+	}
+
+	throw exception("unexpected end of document");
+}
+
+} // namespace mxml
@@ -198,7 +198,11 @@ char32_t pop_back_char(std::string& s)
 }
 
 /// \brief return the first unicode and the advanced pointer from a string
-char32_t pop_front_char(std::string::const_iterator &ptr, std::string::const_iterator end)
+namespace
+{
+
+template <typename Iterator>
+char32_t pop_front_char_impl(Iterator &ptr, Iterator end)
 {
 	char32_t result = static_cast<unsigned char>(*ptr);
 	++ptr;
@@ -251,6 +255,18 @@ char32_t pop_front_char(std::string::const_iterator &ptr, std::string::const_ite
 	return result;
 }
 
+} // namespace
+
+char32_t pop_front_char(std::string::const_iterator &ptr, std::string::const_iterator end)
+{
+	return pop_front_char_impl(ptr, end);
+}
+
+char32_t pop_front_char(std::string_view::const_iterator &ptr, std::string_view::const_iterator end)
+{
+	return pop_front_char_impl(ptr, end);
+}
+
 // --------------------------------------------------------------------
 
 /// \brief A simple implementation of trim, removing white space from start and end of \a s
@@ -0,0 +1,203 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/thread_pool.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+// Each call to run() is a job on the queue. Threads take the next index
+// of the first job until all indices are taken, the job is then removed
+// from the queue. The caller of run() waits until all calls have ended.
+
+struct thread_pool_job
+{
+	const std::function<void(std::size_t)> &m_f;
+	std::size_t m_n;
+	std::size_t m_next = 0, m_done = 0;
+	std::exception_ptr m_error{};
+};
+
+struct thread_pool_imp
+{
+	thread_pool_imp(unsigned threads)
+		: m_size(threads)
+	{
+		for (unsigned i = 1; i < threads; ++i)
+			m_threads.emplace_back([this]()
+				{ worker(); });
+	}
+
+	~thread_pool_imp()
+	{
+		{
+			std::unique_lock lock(m_mutex);
+			m_stop = true;
+			m_work_cv.notify_all();
+		}
+
+		for (auto &t : m_threads)
+			t.join();
+	}
+
+	void worker()
+	{
+		std::unique_lock lock(m_mutex);
+
+		for (;;)
+		{
+			m_work_cv.wait(lock, [this]
+				{ return m_stop or not m_jobs.empty(); });
+
+			if (m_stop)
+				break;
+
+			work(*m_jobs.front(), lock);
+		}
+	}
+
+	// Call the function of job for the indices not yet taken, lock is
+	// held on entry and on return
+	void work(thread_pool_job &job, std::unique_lock<std::mutex> &lock)
+	{
+		while (job.m_next < job.m_n)
+		{
+			std::size_t i = job.m_next++;
+
+			if (job.m_next == job.m_n)
+			{
+				if (auto j = std::find(m_jobs.begin(), m_jobs.end(), &job); j != m_jobs.end())
+					m_jobs.erase(j);
+			}
+
+			lock.unlock();
+
+			std::exception_ptr error;
+			try
+			{
+				job.m_f(i);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			lock.lock();
+
+			if (error and not job.m_error)
+				job.m_error = error;
+
+			if (++job.m_done == job.m_n)
+				m_done_cv.notify_all();
+		}
+	}
+
+	unsigned m_size;
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv, m_done_cv;
+	std::deque<thread_pool_job *> m_jobs;
+	bool m_stop = false;
+};
+
+// --------------------------------------------------------------------
+
+thread_pool::thread_pool(unsigned threads)
+	: m_impl(new thread_pool_imp(std::max(threads ? threads : std::thread::hardware_concurrency(), 1U)))
+{
+}
+
+thread_pool::~thread_pool()
+{
+	delete m_impl;
+}
+
+unsigned thread_pool::size() const
+{
+	return m_impl->m_size;
+}
+
+void thread_pool::run(std::size_t n, const std::function<void(std::size_t)> &f)
+{
+	if (n == 0)
+		return;
+
+	thread_pool_job job{ f, n };
+
+	std::unique_lock lock(m_impl->m_mutex);
+
+	// index 0 is taken by this thread before the others can see the job
+	if (n > 1 and not m_impl->m_threads.empty())
+	{
+		job.m_next = 1;
+		m_impl->m_jobs.push_back(&job);
+		m_impl->m_work_cv.notify_all();
+
+		lock.unlock();
+
+		std::exception_ptr error;
+		try
+		{
+			f(0);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		lock.lock();
+
+		if (error and not job.m_error)
+			job.m_error = error;
+
+		++job.m_done;
+	}
+
+	m_impl->work(job, lock);
+
+	m_impl->m_done_cv.wait(lock, [&job]
+		{ return job.m_done == job.m_n; });
+
+	if (job.m_error)
+		std::rethrow_exception(job.m_error);
+}
+
+thread_pool &thread_pool::instance()
+{
+	static thread_pool s_instance;
+	return s_instance;
+}
+
+} // namespace mxml
@@ -0,0 +1,260 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2024 Maarten L. Hekkelman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mxml/error.hpp"
+#include "mxml/text.hpp"
+#include "mxml/writer.hpp"
+
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <ostream>
+#include <system_error>
+
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+#if defined(__SSE2__) or defined(_M_X64) or (defined(_M_IX86_FP) and _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MXML_SCAN_SSE2 1
+#elif defined(__ARM_NEON) and defined(__aarch64__)
+#include <arm_neon.h>
+#define MXML_SCAN_NEON 1
+#endif
+
+namespace mxml
+{
+
+// --------------------------------------------------------------------
+// Bulk scanning of output. Most text consists of 7-bit characters that
+// can be copied as is. find_end_of_plain_output returns a pointer to the
+// first byte in the range [ptr, end) that is not: a control character
+// other than tab, newline or carriage return, a non ASCII byte, DEL,
+// one of &, < and > or, if requested, a double quote. Tab, newline and
+// carriage return stop the run if \a ws is true.
+
+inline bool is_plain_output_char(char ch, bool quot, bool ws)
+{
+	auto uc = static_cast<unsigned char>(ch);
+
+	if (uc < 0x20)
+		return not ws and (ch == '\t' or ch == '\n' or ch == '\r');
+
+	return uc < 0x7f and ch != '&' and ch != '<' and ch != '>' and (not quot or ch != '"');
+}
+
+const char *find_end_of_plain_output(const char *ptr, const char *end, bool quot, bool ws)
+{
+#if MXML_SCAN_SSE2
+	// The characters that are excluded, or not, are replaced by a space
+	// when they are not relevant. A space never stops a run.
+	const __m128i k_space = _mm_set1_epi8(0x20);
+	const __m128i k_del = _mm_set1_epi8(0x7f);
+	const __m128i k_amp = _mm_set1_epi8('&');
+	const __m128i k_lt = _mm_set1_epi8('<');
+	const __m128i k_gt = _mm_set1_epi8('>');
+	const __m128i k_quot = _mm_set1_epi8(quot ? '"' : ' ');
+	const __m128i k_tab = _mm_set1_epi8(ws ? ' ' : '\t');
+	const __m128i k_nl = _mm_set1_epi8(ws ? ' ' : '\n');
+	const __m128i k_cr = _mm_set1_epi8(ws ? ' ' : '\r');
+
+	while (end - ptr >= 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+
+		// signed compare, so bytes >= 0x80 are caught here as well
+		__m128i m = _mm_or_si128(_mm_cmplt_epi8(v, k_space), _mm_cmpeq_epi8(v, k_del));
+		m = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, k_tab), _mm_or_si128(_mm_cmpeq_epi8(v, k_nl), _mm_cmpeq_epi8(v, k_cr))), m);
+		m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, k_amp), _mm_or_si128(_mm_cmpeq_epi8(v, k_lt), _mm_cmpeq_epi8(v, k_gt))));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, k_quot));
+
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+		if (mask != 0)
+			return ptr + std::countr_zero(mask);
+
+		ptr += 16;
+	}
+#elif MXML_SCAN_NEON
+	const uint8x16_t k_space = vdupq_n_u8(0x20);
+	const uint8x16_t k_del = vdupq_n_u8(0x7f);
+	const uint8x16_t k_amp = vdupq_n_u8('&');
+	const uint8x16_t k_lt = vdupq_n_u8('<');
+	const uint8x16_t k_gt = vdupq_n_u8('>');
+	const uint8x16_t k_quot = vdupq_n_u8(quot ? '"' : ' ');
+	const uint8x16_t k_tab = vdupq_n_u8(ws ? ' ' : '\t');
+	const uint8x16_t k_nl = vdupq_n_u8(ws ? ' ' : '\n');
+	const uint8x16_t k_cr = vdupq_n_u8(ws ? ' ' : '\r');
+
+	while (end - ptr >= 16)
+	{
+		uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(ptr));
+
+		uint8x16_t m = vorrq_u8(vcltq_u8(v, k_space), vcgeq_u8(v, k_del));
+		m = vbicq_u8(m, vorrq_u8(vceqq_u8(v, k_tab), vorrq_u8(vceqq_u8(v, k_nl), vceqq_u8(v, k_cr))));
+		m = vorrq_u8(m, vorrq_u8(vceqq_u8(v, k_amp), vorrq_u8(vceqq_u8(v, k_lt), vceqq_u8(v, k_gt))));
+		m = vorrq_u8(m, vceqq_u8(v, k_quot));
+
+		// the scalar loop below locates the exact position
+		if (vmaxvq_u8(m) != 0)
+			break;
+
+		ptr += 16;
+	}
+#endif
+
+	while (ptr < end and is_plain_output_char(*ptr, quot, ws))
+		++ptr;
+
+	return ptr;
+}
+
+// --------------------------------------------------------------------
+
+writer::writer(std::ostream &os)
+	: m_os(&os)
+	, m_out(m_buffer)
+{
+	m_buffer.reserve(kFlushSize + 1024);
+}
+
+writer::writer(std::string &s)
+	: m_out(s)
+{
+}
+
+writer::writer(int fd)
+	: m_fd(fd)
+	, m_out(m_buffer)
+{
+	m_buffer.reserve(kFlushSize + 1024);
+}
+
+writer::~writer()
+{
+	try
+	{
+		flush();
+	}
+	catch (...)
+	{
+	}
+}
+
+void writer::flush()
+{
+	if (&m_out != &m_buffer or m_buffer.empty())
+		return;
+
+	if (m_os != nullptr)
+		m_os->write(m_buffer.data(), m_buffer.length());
+	else
+	{
+		const char *p = m_buffer.data();
+		std::size_t n = m_buffer.length();
+
+		while (n > 0)
+		{
+#if defined(_WIN32)
+			auto r = ::_write(m_fd, p, static_cast<unsigned int>(n));
+#else
+			auto r = ::write(m_fd, p, n);
+#endif
+			if (r < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				m_buffer.clear();
+				throw std::system_error(errno, std::generic_category(), "Error writing XML");
+			}
+
+			p += r;
+			n -= r;
+		}
+	}
+
+	m_buffer.clear();
+}
+
+void writer::write(unsigned long long n)
+{
+	char b[24];
+	auto r = std::to_chars(b, b + sizeof(b), n);
+	m_out.append(b, r.ptr);
+}
+
+void writer::write_escaped(std::string_view s, bool escape_white_space, bool escape_quot, version_type version)
+{
+	auto sp = s.data();
+	auto se = sp + s.length();
+
+	while (sp < se)
+	{
+		auto r = find_end_of_plain_output(sp, se, escape_quot, escape_white_space);
+
+		m_out.append(sp, r);
+
+		if (r == se)
+			break;
+
+		sp = r;
+
+		switch (*sp)
+		{
+			case '&': m_out += "&amp;"; ++sp; continue;
+			case '<': m_out += "&lt;"; ++sp; continue;
+			case '>': m_out += "&gt;"; ++sp; continue;
+			case '"': m_out += "&quot;"; ++sp; continue;
+			case '\n': m_out += "&#10;"; ++sp; continue;
+			case '\r': m_out += "&#13;"; ++sp; continue;
+			case '\t': m_out += "&#9;"; ++sp; continue;
+			case 0: throw exception("Invalid null character in XML content");
+			default: break;
+		}
+
+		// A control character or a non ASCII character, decode it
+		auto cb = sp;
+		auto i = s.begin() + (sp - s.data());
+		char32_t c = pop_front_char(i, s.end());
+		sp = s.data() + (i - s.begin());
+
+		if (c >= 0x0A0 or (version == version_type{ 1, 0 } ? is_valid_xml_1_0_char(c) : is_valid_xml_1_1_char(c)))
+			m_out.append(cb, sp);
+		else
+		{
+			m_out += "&#";
+			write(static_cast<unsigned long long>(c));
+			m_out += ';';
+		}
+	}
+
+	if (m_out.length() >= kFlushSize and &m_out == &m_buffer)
+		flush();
+}
+
+} // namespace mxml
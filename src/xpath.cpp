@@ -24,6 +24,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "mxml/compact_document.hpp"
+#include "mxml/document.hpp"
 #include "mxml/error.hpp"
 #include "mxml/node.hpp"
 #include "mxml/text.hpp"
@@ -34,10 +36,14 @@
 #include <cmath>
 #include <functional>
 #include <iterator>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace mxml
@@ -198,38 +204,67 @@ const CoreFunctionInfo kCoreFunctionInfo[kCoreFunctionCount] = {
 // the expressions are implemented as interpreter objects
 // they return 'objects' that can hold various data.
 
+// Evaluated over a compact_document, node-sets contain compact nodes
+using compact_node_set = std::vector<compact_node>;
+
 enum class object_type
 {
 	undef,
 	node_set,
+	compact_node_set,
 	boolean,
 	number,
 	string
 };
 
+// The nodes in node-sets are node pointers or compact nodes, the
+// functions of both are reached using deref.
+
+inline const node &deref(const node *n)
+{
+	return *n;
+}
+
+inline const compact_node &deref(const compact_node &n)
+{
+	return n;
+}
+
 class object
 {
   public:
 	object();
 	object(node_set ns);
+	object(compact_node_set ns);
 	object(bool b);
 	object(double n);
-	object(const std::string &s);
+	object(std::string s);
 	object(std::string_view s);
 	object(const object &o);
+	object(object &&o) noexcept;
 	object &operator=(const object &o);
+	object &operator=(object &&o) noexcept;
 
-	bool operator==(const object o);
-	bool operator<(const object o);
+	bool operator==(const object &o) const;
+	bool operator<(const object &o) const;
 
 	object_type type() const { return m_type; }
 
 	template <typename T>
 	T as() const;
 
+	// The string value, as a view on the string held by this object if
+	// it is a string, or on \a buffer which is filled otherwise.
+	std::string_view as_view(std::string &buffer) const;
+
+	// Move the node-set out of this object, which is left empty
+	node_set release_node_set();
+	compact_node_set release_compact_node_set();
+
   private:
 	object_type m_type;
 	node_set m_node_set;
+	compact_node_set m_compact_node_set;
 	bool m_boolean;
 	double m_number;
 	std::string m_string;
@@ -247,7 +282,13 @@ object::object()
 
 object::object(node_set ns)
 	: m_type(object_type::node_set)
-	, m_node_set(ns)
+	, m_node_set(std::move(ns))
+{
+}
+
+object::object(compact_node_set ns)
+	: m_type(object_type::compact_node_set)
+	, m_compact_node_set(std::move(ns))
 {
 }
 
@@ -263,9 +304,9 @@ object::object(double n)
 {
 }
 
-object::object(const std::string &s)
+object::object(std::string s)
 	: m_type(object_type::string)
-	, m_string(s)
+	, m_string(std::move(s))
 {
 }
 
@@ -281,6 +322,7 @@ object::object(const object &o)
 	switch (m_type)
 	{
 		case object_type::node_set: m_node_set = o.m_node_set; break;
+		case object_type::compact_node_set: m_compact_node_set = o.m_compact_node_set; break;
 		case object_type::boolean: m_boolean = o.m_boolean; break;
 		case object_type::number: m_number = o.m_number; break;
 		case object_type::string: m_string = o.m_string; break;
@@ -288,12 +330,27 @@ object::object(const object &o)
 	}
 }
 
+object::object(object &&o) noexcept
+	: m_type(o.m_type)
+{
+	switch (m_type)
+	{
+		case object_type::node_set: m_node_set = std::move(o.m_node_set); break;
+		case object_type::compact_node_set: m_compact_node_set = std::move(o.m_compact_node_set); break;
+		case object_type::boolean: m_boolean = o.m_boolean; break;
+		case object_type::number: m_number = o.m_number; break;
+		case object_type::string: m_string = std::move(o.m_string); break;
+		default: break;
+	}
+}
+
 object &object::operator=(const object &o)
 {
 	m_type = o.m_type;
 	switch (m_type)
 	{
 		case object_type::node_set: m_node_set = o.m_node_set; break;
+		case object_type::compact_node_set: m_compact_node_set = o.m_compact_node_set; break;
 		case object_type::boolean: m_boolean = o.m_boolean; break;
 		case object_type::number: m_number = o.m_number; break;
 		case object_type::string: m_string = o.m_string; break;
@@ -302,6 +359,35 @@ object &object::operator=(const object &o)
 	return *this;
 }
 
+object &object::operator=(object &&o) noexcept
+{
+	m_type = o.m_type;
+	switch (m_type)
+	{
+		case object_type::node_set: m_node_set = std::move(o.m_node_set); break;
+		case object_type::compact_node_set: m_compact_node_set = std::move(o.m_compact_node_set); break;
+		case object_type::boolean: m_boolean = o.m_boolean; break;
+		case object_type::number: m_number = o.m_number; break;
+		case object_type::string: m_string = std::move(o.m_string); break;
+		default: break;
+	}
+	return *this;
+}
+
+node_set object::release_node_set()
+{
+	if (m_type != object_type::node_set)
+		throw exception("object is not of type node-set");
+	return std::move(m_node_set);
+}
+
+compact_node_set object::release_compact_node_set()
+{
+	if (m_type != object_type::compact_node_set)
+		throw exception("object is not of type node-set");
+	return std::move(m_compact_node_set);
+}
+
 template <>
 const node_set &object::as<const node_set &>() const
 {
@@ -310,6 +396,14 @@ const node_set &object::as<const node_set &>() const
 	return m_node_set;
 }
 
+template <>
+const compact_node_set &object::as<const compact_node_set &>() const
+{
+	if (m_type != object_type::compact_node_set)
+		throw exception("object is not of type node-set");
+	return m_compact_node_set;
+}
+
 template <>
 bool object::as<bool>() const
 {
@@ -318,6 +412,7 @@ bool object::as<bool>() const
 	{
 		case object_type::number: result = m_number != 0 and not std::isnan(m_number); break;
 		case object_type::node_set: result = not m_node_set.empty(); break;
+		case object_type::compact_node_set: result = not m_compact_node_set.empty(); break;
 		case object_type::string: result = not m_string.empty(); break;
 		case object_type::boolean: result = m_boolean; break;
 		default: result = false; break;
@@ -334,12 +429,13 @@ double object::as<double>() const
 	{
 		case object_type::number: result = m_number; break;
 		case object_type::node_set:
+		case object_type::compact_node_set:
 		{
-			if (m_node_set.empty())
+			if (m_type == object_type::node_set ? m_node_set.empty() : m_compact_node_set.empty())
 				result = std::nan("1");
 			else
 			{
-				auto s = m_node_set.front()->str();
+				auto s = m_type == object_type::node_set ? m_node_set.front()->str() : m_compact_node_set.front().str();
 				if (auto r = std::from_chars(s.data(), s.data() + s.size(), result); r.ec != std::errc{})
 					result = std::nan("1");
 			}
@@ -387,13 +483,26 @@ std::string object::as<std::string>() const
 			for (auto &n : m_node_set)
 				result += n->str();
 			break;
+		case object_type::compact_node_set:
+			for (auto &n : m_compact_node_set)
+				result += n.str();
+			break;
 		default: break;
 	}
 
 	return result;
 }
 
-bool object::operator==(const object o)
+std::string_view object::as_view(std::string &buffer) const
+{
+	if (m_type == object_type::string)
+		return m_string;
+
+	buffer = as<std::string>();
+	return buffer;
+}
+
+bool object::operator==(const object &o) const
 {
 	bool result = false;
 
@@ -402,6 +511,7 @@ bool object::operator==(const object o)
 		switch (m_type)
 		{
 			case object_type::node_set: result = m_node_set == o.m_node_set; break;
+			case object_type::compact_node_set: result = m_compact_node_set == o.m_compact_node_set; break;
 			case object_type::boolean: result = m_boolean == o.m_boolean; break;
 			case object_type::number: result = m_number == o.m_number; break;
 			case object_type::string: result = m_string == o.m_string; break;
@@ -413,7 +523,10 @@ bool object::operator==(const object o)
 		if (m_type == object_type::number or o.m_type == object_type::number)
 			result = as<double>() == o.as<double>();
 		else if (m_type == object_type::string or o.m_type == object_type::string)
-			result = as<std::string>() == o.as<std::string>();
+		{
+			std::string b1, b2;
+			result = as_view(b1) == o.as_view(b2);
+		}
 		else if (m_type == object_type::boolean or o.m_type == object_type::boolean)
 			result = as<bool>() == o.as<bool>();
 	}
@@ -421,12 +534,13 @@ bool object::operator==(const object o)
 	return result;
 }
 
-bool object::operator<(const object o)
+bool object::operator<(const object &o) const
 {
 	bool result = false;
 	switch (m_type)
 	{
 		case object_type::node_set: result = m_node_set < o.m_node_set; break;
+		case object_type::compact_node_set: result = m_compact_node_set < o.m_compact_node_set; break;
 		case object_type::boolean: result = m_boolean < o.m_boolean; break;
 		case object_type::number: result = m_number < o.m_number; break;
 		case object_type::string: result = m_string < o.m_string; break;
@@ -435,67 +549,108 @@ bool object::operator<(const object o)
 	return result;
 }
 
+// --------------------------------------------------------------------
+// Node sets are kept in document order, without duplicates. Combining the
+// results of several steps can break that, this restores it. Most of the
+// time the nodes are still in order, which is checked first.
+
+void sort_document_order(node_set &s)
+{
+	if (s.size() < 2)
+		return;
+
+	s.front()->document_order();
+
+	auto before = [](const node *a, const node *b)
+	{
+		return a->cached_document_order() < b->cached_document_order();
+	};
+
+	auto not_before = [before](const node *a, const node *b)
+	{
+		return not before(a, b);
+	};
+
+	if (std::adjacent_find(s.begin(), s.end(), not_before) == s.end())
+		return;
+
+	std::sort(s.begin(), s.end(), before);
+	s.erase(std::unique(s.begin(), s.end()), s.end());
+}
+
+// Compact nodes compare in document order
+void sort_document_order(compact_node_set &s)
+{
+	if (std::adjacent_find(s.begin(), s.end(), std::greater_equal<>()) == s.end())
+		return;
+
+	std::sort(s.begin(), s.end());
+	s.erase(std::unique(s.begin(), s.end()), s.end());
+}
+
 // --------------------------------------------------------------------
 // visiting (or better, collecting) other nodes in the hierarchy is done here.
+// Nodes that pass the predicate are passed to the sink, which returns false
+// if no more nodes are wanted. The functions return false in that case.
 
-template <typename PREDICATE>
-void iterate_child_elements(element_container *context, node_set &s, bool deep, PREDICATE pred)
+template <typename PREDICATE, typename SINK>
+bool iterate_child_elements(element_container *context, bool deep, PREDICATE &pred, SINK &sink)
 {
 	for (element &child : *context)
 	{
-		if (find(s.begin(), s.end(), &child) != s.end())
-			continue;
-
-		if (pred(&child))
-			s.push_back(&child);
+		if (pred(&child) and not sink(&child))
+			return false;
 
-		if (deep)
-			iterate_child_elements(&child, s, true, pred);
+		if (deep and not iterate_child_elements(&child, true, pred, sink))
+			return false;
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-void iterate_child_nodes(element_container *context, node_set &s, bool deep, PREDICATE pred)
+template <typename PREDICATE, typename SINK>
+bool iterate_child_nodes(element_container *context, bool deep, PREDICATE &pred, SINK &sink)
 {
 	for (node &child : context->nodes())
 	{
-		if (find(s.begin(), s.end(), &child) != s.end())
-			continue;
-
-		if (pred(&child))
-			s.push_back(&child);
+		if (pred(&child) and not sink(&child))
+			return false;
 
-		if (deep)
+		if (deep and child.type() == node_type::element)
 		{
-			if (child.type() == node_type::element)
-				iterate_child_nodes(static_cast<element_container *>(&child), s, true, pred);
+			if (not iterate_child_nodes(static_cast<element_container *>(&child), true, pred, sink))
+				return false;
 		}
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-inline void iterate_children(element_container *context, node_set &s, bool deep, PREDICATE pred, bool elementsOnly)
+template <typename PREDICATE, typename SINK>
+inline bool iterate_children(element_container *context, bool deep, PREDICATE &pred, bool elementsOnly, SINK &sink)
 {
 	if (elementsOnly)
-		iterate_child_elements(context, s, deep, pred);
+		return iterate_child_elements(context, deep, pred, sink);
 	else
-		iterate_child_nodes(context, s, deep, pred);
+		return iterate_child_nodes(context, deep, pred, sink);
 }
 
-template <typename PREDICATE>
-void iterate_ancestor(element_container *e, node_set &s, PREDICATE pred)
+template <typename PREDICATE, typename SINK>
+bool iterate_ancestor(element_container *e, PREDICATE &pred, SINK &sink)
 {
 	auto n = e->parent();
 	while (n != nullptr and n->type() != node_type::document)
 	{
-		if (pred(n))
-			s.push_back(n);
+		if (pred(n) and not sink(n))
+			return false;
 		n = n->parent();
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-void iterate_preceding(node *n, node_set &s, bool sibling, PREDICATE pred, bool elementsOnly)
+template <typename PREDICATE, typename SINK>
+bool iterate_preceding(node *n, bool sibling, PREDICATE &pred, bool elementsOnly, SINK &sink)
 {
 	while (n != nullptr and n->type() != node_type::document)
 	{
@@ -513,16 +668,18 @@ void iterate_preceding(node *n, node_set &s, bool sibling, PREDICATE pred, bool
 		if (n->type() != node_type::element)
 			continue;
 
-		if (pred(n))
-			s.push_back(n);
+		if (pred(n) and not sink(n))
+			return false;
 
-		if (sibling == false)
-			iterate_children(static_cast<element *>(n), s, true, pred, elementsOnly);
+		if (sibling == false and not iterate_children(static_cast<element *>(n), true, pred, elementsOnly, sink))
+			return false;
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-void iterate_following(node *n, node_set &s, bool sibling, PREDICATE pred, bool elementsOnly)
+template <typename PREDICATE, typename SINK>
+bool iterate_following(node *n, bool sibling, PREDICATE &pred, bool elementsOnly, SINK &sink)
 {
 	while (n != nullptr and n->type() != node_type::document)
 	{
@@ -540,35 +697,186 @@ void iterate_following(node *n, node_set &s, bool sibling, PREDICATE pred, bool
 		if (n->type() != node_type::element)
 			continue;
 
-		if (pred(n))
-			s.push_back(n);
+		if (pred(n) and not sink(n))
+			return false;
 
-		if (sibling == false)
-			iterate_children(static_cast<element *>(n), s, true, pred, elementsOnly);
+		if (sibling == false and not iterate_children(static_cast<element *>(n), true, pred, elementsOnly, sink))
+			return false;
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-void iterate_attributes(element *e, node_set &s, PREDICATE pred)
+template <typename PREDICATE, typename SINK>
+bool iterate_attributes(element *e, PREDICATE &pred, SINK &sink)
 {
 	for (auto &a : e->attributes())
 	{
-		if (pred(&a))
-			s.push_back(&a);
+		if (pred(&a) and not sink(&a))
+			return false;
 	}
+
+	return true;
 }
 
-template <typename PREDICATE>
-void iterate_namespaces(element *e, node_set &s, PREDICATE pred)
+template <typename PREDICATE, typename SINK>
+bool iterate_namespaces(element *e, PREDICATE &pred, SINK &sink)
 {
 	for (auto &a : e->attributes())
 	{
 		if (not a.is_namespace())
 			continue;
 
-		if (pred(&a))
-			s.push_back(&a);
+		if (pred(&a) and not sink(&a))
+			return false;
+	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------
+// The same for the nodes of a compact_document, passing the nodes in the
+// same order. Like above, following and preceding skip the siblings that
+// are not elements. A subtree is stored contiguously, in document order.
+
+template <typename PREDICATE, typename SINK>
+bool iterate_children(const compact_node &context, bool deep, PREDICATE &pred, bool elementsOnly, SINK &sink)
+{
+	if (deep)
+	{
+		auto end = context.subtree_end();
+		for (auto n = context.next(); n and n.index() < end; n = n.next())
+		{
+			if ((not elementsOnly or n.type() == node_type::element) and pred(n) and not sink(n))
+				return false;
+		}
+	}
+	else
+	{
+		for (auto n : context)
+		{
+			if ((not elementsOnly or n.type() == node_type::element) and pred(n) and not sink(n))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+template <typename PREDICATE, typename SINK>
+bool iterate_ancestor(const compact_node &e, PREDICATE &pred, SINK &sink)
+{
+	for (auto n = e.parent(); n and n.type() != node_type::document; n = n.parent())
+	{
+		if (pred(n) and not sink(n))
+			return false;
+	}
+
+	return true;
+}
+
+template <typename PREDICATE, typename SINK>
+bool iterate_preceding(compact_node n, bool sibling, PREDICATE &pred, bool elementsOnly, SINK &sink)
+{
+	// Siblings are linked forward only, collect those before n first
+	compact_node_set before;
+
+	while (n and n.type() != node_type::document)
+	{
+		auto parent = n.parent();
+
+		before.clear();
+		for (auto c : parent)
+		{
+			if (c == n)
+				break;
+			before.push_back(c);
+		}
+
+		for (auto c = before.rbegin(); c != before.rend(); ++c)
+		{
+			if (c->type() != node_type::element)
+				continue;
+
+			if (pred(*c) and not sink(*c))
+				return false;
+
+			if (sibling == false and not iterate_children(*c, true, pred, elementsOnly, sink))
+				return false;
+		}
+
+		if (sibling)
+			break;
+
+		n = parent;
+	}
+
+	return true;
+}
+
+template <typename PREDICATE, typename SINK>
+bool iterate_following(compact_node n, bool sibling, PREDICATE &pred, bool elementsOnly, SINK &sink)
+{
+	while (n and n.type() != node_type::document)
+	{
+		if (not n.next_sibling())
+		{
+			if (sibling)
+				break;
+
+			n = n.parent();
+			continue;
+		}
+
+		n = n.next_sibling();
+
+		if (n.type() != node_type::element)
+			continue;
+
+		if (pred(n) and not sink(n))
+			return false;
+
+		if (sibling == false and not iterate_children(n, true, pred, elementsOnly, sink))
+			return false;
+	}
+
+	return true;
+}
+
+template <typename PREDICATE, typename SINK>
+bool iterate_attributes(const compact_node &e, bool namespaces, PREDICATE &pred, SINK &sink)
+{
+	for (std::size_t i = 0; i < e.attribute_count(); ++i)
+	{
+		auto a = e.attribute_node(i);
+
+		if (namespaces and not(a.get_qname() == "xmlns" or a.get_qname().starts_with("xmlns:")))
+			continue;
+
+		if (pred(a) and not sink(a))
+			return false;
 	}
+
+	return true;
+}
+
+// --------------------------------------------------------------------
+// Parallel evaluation, see xpath::evaluate_parallel. Work is only split
+// when there is enough of it.
+
+const std::size_t kMinParallelNodes = 128;
+
+// Call \a f(begin, end) for consecutive ranges covering [0, n), using the
+// threads in \a pool. There are more ranges than threads so that a thread
+// finishing early can take the next one. The first exception thrown is
+// rethrown after all ranges are done.
+template <typename F>
+void run_parallel(thread_pool &pool, std::size_t n, F &&f)
+{
+	std::size_t chunks = std::min<std::size_t>(n, 8 * pool.size());
+
+	pool.run(chunks, [&](std::size_t i)
+		{ f(i * n / chunks, (i + 1) * n / chunks); });
 }
 
 // --------------------------------------------------------------------
@@ -599,8 +907,45 @@ struct context_imp : public context_imp_base
 	std::map<std::string, object> m_variables;
 };
 
+// --------------------------------------------------------------------
+// Node-sets that are no longer needed are kept here to be reused. That
+// saves the allocations for the intermediate results of steps that are
+// evaluated for each node in a node-set. A pool is used by one thread.
+
+class node_set_pool
+{
+  public:
+	node_set get()
+	{
+		node_set result;
+		if (not m_free.empty())
+		{
+			result = std::move(m_free.back());
+			m_free.pop_back();
+		}
+		return result;
+	}
+
+	void put(node_set &&s)
+	{
+		if (s.capacity() > 0 and m_free.size() < kMaxFree)
+		{
+			s.clear();
+			m_free.emplace_back(std::move(s));
+		}
+	}
+
+  private:
+	static constexpr std::size_t kMaxFree = 16;
+
+	std::vector<node_set> m_free;
+};
+
 struct expression_context : public context_imp_base
 {
+	using node_set_type = node_set;
+	using node_handle = node *;
+
 	expression_context(const context_imp_base &next, const node *n, const node_set &s)
 		: m_next(next)
 		, m_node(const_cast<node *>(n))
@@ -608,6 +953,16 @@ struct expression_context : public context_imp_base
 	{
 	}
 
+	// A nested context, shares the node-set pool and profile of \a outer
+	expression_context(expression_context &outer, const node *n, const node_set &s)
+		: m_next(outer)
+		, m_node(const_cast<node *>(n))
+		, m_node_set(s)
+		, m_pool(outer.m_pool)
+		, m_profile(outer.m_profile)
+	{
+	}
+
 	const object &get(const std::string &name) const override
 	{
 		return m_next.get(name);
@@ -616,13 +971,45 @@ struct expression_context : public context_imp_base
 	size_t position() const;
 	size_t last() const;
 
+	node_set new_node_set()
+	{
+		return m_pool ? m_pool->get() : node_set{};
+	}
+
+	void recycle(node_set &&s)
+	{
+		if (m_pool)
+			m_pool->put(std::move(s));
+	}
+
+#if MXML_STATS
+	// Add an evaluation of \a e that looked at \a visited nodes and
+	// selected \a selected of these to the profile, if there is one
+	void profile(const class expression &e, std::size_t visited, std::size_t selected);
+#endif
+
 	const context_imp_base &m_next;
 	node *m_node;
 	const node_set &m_node_set;
+
+	// The position of m_node in m_node_set, if known
+	size_t m_position = 0;
+
+	node_set_pool *m_pool = nullptr;
+
+	xpath_profile *m_profile = nullptr;
+
+	// The threads the evaluation in this context may use, if any. This
+	// is passed on along the steps of a path only, predicates and
+	// function arguments are evaluated on a single thread.
+	thread_pool *m_thread_pool = nullptr;
 };
 
 size_t expression_context::position() const
 {
+	if (m_position > 0)
+		return m_position;
+
 	size_t result = 0;
 	for (const node *n : m_node_set)
 	{
@@ -642,145 +1029,832 @@ size_t expression_context::last() const
 	return m_node_set.size();
 }
 
-// --------------------------------------------------------------------
+// The context for evaluating over a compact_document. There are no
+// threads, node-set pools or profiles here.
 
-class expression
+struct compact_expression_context : public context_imp_base
 {
-  public:
-	virtual ~expression() {}
-	virtual object evaluate(expression_context &context) = 0;
-};
-
-using expression_ptr = std::shared_ptr<expression>;
-using expression_list = std::vector<expression_ptr>;
+	using node_set_type = compact_node_set;
+	using node_handle = compact_node;
 
-// --------------------------------------------------------------------
+	compact_expression_context(const context_imp_base &next, compact_node n, const compact_node_set &s)
+		: m_next(next)
+		, m_node(n)
+		, m_node_set(s)
+	{
+	}
 
-class step_expression : public expression
-{
-  public:
-	step_expression(AxisType axis)
-		: m_axis(axis)
+	const object &get(const std::string &name) const override
 	{
+		return m_next.get(name);
 	}
 
-  protected:
-	template <typename T>
-	object evaluate(expression_context &context, T pred, bool elementsOnly);
+	size_t position() const;
+	size_t last() const { return m_node_set.size(); }
 
-	AxisType m_axis;
+	const context_imp_base &m_next;
+	compact_node m_node;
+	const compact_node_set &m_node_set;
+
+	// The position of m_node in m_node_set, if known
+	size_t m_position = 0;
 };
 
-template <typename T>
-object step_expression::evaluate(expression_context &context, T pred, bool elementsOnly)
+size_t compact_expression_context::position() const
 {
-	node_set result;
+	if (m_position > 0)
+		return m_position;
 
-	if (context.m_node->type() == node_type::element or context.m_node->type() == node_type::document)
-	{
-		element_container *context_element = static_cast<element_container *>(context.m_node);
-		switch (m_axis)
-		{
-			case AxisType::Parent:
-			{
-				auto p = context.m_node->parent();
-				if (p != nullptr and pred(p))
-					result.push_back(p);
-				break;
-			}
+	if (m_node_set.empty())
+		throw exception("invalid context for position");
 
-			case AxisType::Ancestor:
-				iterate_ancestor(context_element, result, pred);
-				break;
+	auto i = std::find(m_node_set.begin(), m_node_set.end(), m_node);
+	return i == m_node_set.end() ? m_node_set.size() : i - m_node_set.begin() + 1;
+}
 
-			case AxisType::AncestorOrSelf:
-				if (pred(context.m_node))
-					result.push_back(context.m_node);
-				iterate_ancestor(context_element, result, pred);
-				break;
+// --------------------------------------------------------------------
 
-			case AxisType::Self:
-				if (pred(context.m_node))
-					result.push_back(context.m_node);
+class expression;
+
+using expression_ptr = std::shared_ptr<expression>;
+using expression_list = std::vector<expression_ptr>;
+
+// Receives the nodes of a node-set one by one, returns false to stop
+using node_visitor = std::function<bool(node *)>;
+
+// Receives candidate context nodes, returns true when done
+using context_visitor = std::function<bool(const node *)>;
+
+class expression : public std::enable_shared_from_this<expression>
+{
+  public:
+	virtual ~expression() {}
+	virtual object evaluate(expression_context &context) = 0;
+
+	// Evaluate over a compact_document, node-sets in the result are
+	// compact node-sets. Only evaluation is supported for these.
+	virtual object evaluate(compact_expression_context &context) = 0;
+
+	// Pass the nodes of the node-set this expression evaluates to, in
+	// document order, to \a visitor. Returns false if the visitor asked
+	// to stop. The default evaluates the complete node-set first, the
+	// expressions that can do better produce the nodes while searching.
+	virtual bool visit(expression_context &context, const node_visitor &visitor);
+
+	// Returns true if none of the nodes visited is an ancestor of
+	// another, used to decide a path can be visited without sorting
+	virtual bool unnested() const { return false; }
+
+	// Returns true if all nodes visited are in the subtree of the
+	// context node, including the context node itself and attributes
+	virtual bool stays_in_subtree() const { return false; }
+
+	// Pattern matching, used by xpath::matches. Returns true if \a n is
+	// in the node-set this expression evaluates to in \a context. The
+	// default evaluates the expression until \a n is found or passed.
+	virtual bool matches(const node *n, expression_context &context);
+
+	// Returns true if this expression implements contexts_for
+	virtual bool invertible() const { return false; }
+
+	// Pass each node that, used as context node, results in a node-set
+	// containing \a n to \a visitor, nearest first. Returns true as soon
+	// as the visitor does. \a context provides the variables.
+	virtual bool contexts_for(const node * /*n*/, expression_context & /*context*/, const context_visitor & /*visitor*/) { return false; }
+
+	// The optimizer pass run after parsing. Returns an expression that
+	// evaluates to the same result as this one, possibly this one itself.
+	// Composite expressions optimize their operands first.
+	virtual expression_ptr optimize() { return shared_from_this(); }
+
+	// Returns true if the result does not depend on the context at all
+	virtual bool is_constant() const { return false; }
+
+	// Returns true if the result depends on the position of the context
+	// node in the context node set, i.e. uses position() or last()
+	virtual bool uses_position() const { return false; }
+
+	// Returns true if this expression always results in a node-set
+	virtual bool returns_node_set() const { return false; }
+
+	// Returns true if this expression always results in a boolean
+	virtual bool returns_boolean() const { return false; }
+
+	// The name of this expression in an xpath_profile
+	virtual std::string description() const { return "(...)"; }
+};
+
+#if MXML_STATS
+void expression_context::profile(const expression &e, std::size_t visited, std::size_t selected)
+{
+	if (m_profile == nullptr)
+		return;
+
+	std::shared_ptr<const void> key = e.shared_from_this();
+
+	auto i = m_profile->m_index.find(key);
+	if (i == m_profile->m_index.end())
+	{
+		i = m_profile->m_index.emplace(std::move(key), m_profile->steps.size()).first;
+		m_profile->steps.push_back({ e.description() });
+	}
+
+	auto &step = m_profile->steps[i->second];
+	++step.evaluations;
+	step.nodes_visited += visited;
+	step.nodes_selected += selected;
+	step.max_node_set_size = std::max(step.max_node_set_size, selected);
+}
+#endif
+
+bool expression::visit(expression_context &context, const node_visitor &visitor)
+{
+	object v = evaluate(context);
+	if (v.type() != object_type::node_set)
+		throw exception("expression does not evaluate to a node-set");
+
+	node_set s = v.as<const node_set &>();
+	sort_document_order(s);
+
+	for (auto n : s)
+	{
+		if (not visitor(n))
+			return false;
+	}
+
+	return true;
+}
+
+bool expression::matches(const node *n, expression_context &context)
+{
+	bool result = false;
+
+	auto order = n->document_order();
+	visit(context, [n, order, &result](node *e)
+		{
+		result = e == n;
+		return not result and e->cached_document_order() < order; });
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+// The result of constant folding
+
+class constant_expression : public expression
+{
+  public:
+	constant_expression(const object &value)
+		: m_value(value)
+	{
+	}
+
+	object evaluate(expression_context & /*context*/) override
+	{
+		return m_value;
+	}
+
+	object evaluate(compact_expression_context & /*context*/) override
+	{
+		return m_value;
+	}
+
+	bool is_constant() const override { return true; }
+	bool returns_boolean() const override { return m_value.type() == object_type::boolean; }
+
+	const object &value() const { return m_value; }
+
+  private:
+	object m_value;
+};
+
+// Replace \a expr by a constant_expression holding its value, if possible
+
+expression_ptr fold_constant(expression_ptr expr)
+{
+	if (expr->is_constant() and dynamic_cast<constant_expression *>(expr.get()) == nullptr)
+	{
+		try
+		{
+			context_imp variables;
+			node_set empty;
+			expression_context context(variables, nullptr, empty);
+
+			expr = std::make_shared<constant_expression>(expr->evaluate(context));
+		}
+		catch (const exception &)
+		{
+			// leave it to the actual evaluation to report the error
+		}
+	}
+
+	return expr;
+}
+
+// --------------------------------------------------------------------
+
+class step_expression : public expression
+{
+  public:
+	step_expression(AxisType axis)
+		: m_axis(axis)
+	{
+	}
+
+	bool returns_node_set() const override { return true; }
+
+	bool unnested() const override
+	{
+		return m_axis == AxisType::Parent or m_axis == AxisType::Self or m_axis == AxisType::Child or
+		       m_axis == AxisType::Attribute or m_axis == AxisType::Namespace or
+		       m_axis == AxisType::FollowingSibling or m_axis == AxisType::PrecedingSibling;
+	}
+
+	bool stays_in_subtree() const override
+	{
+		return m_axis == AxisType::Self or m_axis == AxisType::Child or
+		       m_axis == AxisType::Descendant or m_axis == AxisType::DescendantOrSelf or
+		       m_axis == AxisType::Attribute or m_axis == AxisType::Namespace;
+	}
+
+	bool invertible() const override
+	{
+		return m_axis == AxisType::Self or m_axis == AxisType::Child or
+		       m_axis == AxisType::Descendant or m_axis == AxisType::DescendantOrSelf or
+		       m_axis == AxisType::Attribute or m_axis == AxisType::Namespace;
+	}
+
+	using expression::contexts_for;
+
+	bool matches(const node *n, expression_context &context) override
+	{
+		if (not invertible())
+			return expression::matches(n, context);
+
+		return contexts_for(n, context, [&context](const node *c)
+			{ return c == context.m_node; });
+	}
+
+	// Returns true if the axis runs backwards through the document
+	bool reverse() const
+	{
+		return m_axis == AxisType::Ancestor or m_axis == AxisType::AncestorOrSelf or
+		       m_axis == AxisType::Preceding or m_axis == AxisType::PrecedingSibling;
+	}
+
+	AxisType axis() const { return m_axis; }
+	void axis(AxisType axis) { m_axis = axis; }
+
+	// Stop collecting nodes after the first \a limit found, in the order
+	// of the axis. Used for positional predicates like [1].
+	void limit(std::size_t limit) { m_limit = limit; }
+
+	std::string description() const override
+	{
+		return std::string(kAxisNames[static_cast<std::size_t>(m_axis)]) + "::" + node_test();
+	}
+
+  protected:
+	// The node test as written in the xpath, like para or text()
+	virtual std::string node_test() const = 0;
+
+	template <typename T>
+	object evaluate(expression_context &context, T pred, bool elementsOnly);
+
+	template <typename T>
+	bool visit(expression_context &context, T pred, bool elementsOnly, const node_visitor &visitor);
+
+	template <typename T, typename SINK>
+	bool collect(expression_context &context, T &pred, bool elementsOnly, SINK &sink);
+
+	template <typename T, typename SINK>
+	bool collect_axis(expression_context &context, T &pred, bool elementsOnly, SINK &sink);
+
+	template <typename T>
+	object evaluate(compact_expression_context &context, T pred, bool elementsOnly);
+
+	template <typename T, typename SINK>
+	bool collect_axis(compact_expression_context &context, T &pred, bool elementsOnly, SINK &sink);
+
+	template <typename T>
+	bool contexts_for(const node *n, T &pred, bool elementsOnly, const context_visitor &visitor) const;
+
+	template <typename T>
+	node_set evaluate_parallel(expression_context &context, T &pred, bool elementsOnly);
+
+	AxisType m_axis;
+	std::size_t m_limit = std::numeric_limits<std::size_t>::max();
+};
+
+template <typename T>
+object step_expression::evaluate(expression_context &context, T pred, bool elementsOnly)
+{
+	if (context.m_thread_pool != nullptr and m_limit == std::numeric_limits<std::size_t>::max() and
+		(m_axis == AxisType::Descendant or m_axis == AxisType::DescendantOrSelf) and
+		(context.m_node->type() == node_type::element or context.m_node->type() == node_type::document))
+		return evaluate_parallel(context, pred, elementsOnly);
+
+	node_set result = context.new_node_set();
+
+	auto sink = [&result, limit = m_limit](node *n)
+	{
+		result.push_back(n);
+		return result.size() < limit;
+	};
+
+	collect(context, pred, elementsOnly, sink);
+
+	return result;
+}
+
+template <typename T>
+node_set step_expression::evaluate_parallel(expression_context &context, T &pred, bool elementsOnly)
+{
+	// The tree is cut in parts, subtrees searched by the threads and the
+	// nodes above them, which are tested here. Together they are in
+	// document order, so are the results.
+	struct part
+	{
+		node *m_node;
+		bool m_subtree;
+	};
+
+	std::vector<part> parts;
+
+	auto add_children = [&parts, elementsOnly](element_container *e)
+	{
+		if (elementsOnly)
+		{
+			for (auto &c : *e)
+				parts.push_back({ &c, true });
+		}
+		else
+		{
+			for (auto &c : e->nodes())
+				parts.push_back({ &c, c.type() == node_type::element });
+		}
+	};
+
+	if (m_axis == AxisType::DescendantOrSelf)
+		parts.push_back({ context.m_node, false });
+	add_children(static_cast<element_container *>(context.m_node));
+
+	// Split the subtrees until there are enough of them
+	const std::size_t wanted = 8 * context.m_thread_pool->size();
+	for (int depth = 0; depth < 8; ++depth)
+	{
+		auto subtrees = std::count_if(parts.begin(), parts.end(), [](const part &p)
+			{ return p.m_subtree; });
+		if (static_cast<std::size_t>(subtrees) >= wanted or subtrees == 0)
+			break;
+
+		std::vector<part> split;
+		std::swap(split, parts);
+
+		for (auto &p : split)
+		{
+			if (p.m_subtree)
+			{
+				parts.push_back({ p.m_node, false });
+				add_children(static_cast<element_container *>(p.m_node));
+			}
+			else
+				parts.push_back(p);
+		}
+	}
+
+	std::vector<node_set> results(parts.size());
+
+	run_parallel(*context.m_thread_pool, parts.size(), [&](std::size_t b, std::size_t e)
+		{
+			for (auto i = b; i < e; ++i)
+			{
+				auto &result = results[i];
+				auto sink = [&result](node *n)
+				{
+					result.push_back(n);
+					return true;
+				};
+
+				auto n = parts[i].m_node;
+				if (pred(n))
+					result.push_back(n);
+
+				if (parts[i].m_subtree)
+					iterate_children(static_cast<element_container *>(n), true, pred, elementsOnly, sink);
+			} });
+
+	node_set result;
+	for (auto &r : results)
+		result.insert(result.end(), r.begin(), r.end());
+
+	return result;
+}
+
+template <typename T>
+bool step_expression::visit(expression_context &context, T pred, bool elementsOnly, const node_visitor &visitor)
+{
+	// reverse axes have to be sorted first
+	if (reverse())
+		return expression::visit(context, visitor);
+
+	bool result = true;
+	std::size_t count = 0;
+
+	auto sink = [&](node *n)
+	{
+		if (not visitor(n))
+			result = false;
+		return result and ++count < m_limit;
+	};
+
+	collect(context, pred, elementsOnly, sink);
+
+	return result;
+}
+
+template <typename T, typename SINK>
+bool step_expression::collect(expression_context &context, T &pred, bool elementsOnly, SINK &sink)
+{
+#if MXML_STATS
+	if (context.m_profile != nullptr)
+	{
+		std::size_t visited = 0, selected = 0;
+
+		auto counting_pred = [&](const node *n)
+		{
+			++visited;
+			return pred(n);
+		};
+
+		auto counting_sink = [&](node *n)
+		{
+			++selected;
+			return sink(n);
+		};
+
+		bool result = collect_axis(context, counting_pred, elementsOnly, counting_sink);
+		context.profile(*this, visited, selected);
+		return result;
+	}
+#endif
+
+	return collect_axis(context, pred, elementsOnly, sink);
+}
+
+template <typename T, typename SINK>
+bool step_expression::collect_axis(expression_context &context, T &pred, bool elementsOnly, SINK &sink)
+{
+	bool result = true;
+
+	if (context.m_node->type() == node_type::element or context.m_node->type() == node_type::document)
+	{
+		element_container *context_element = static_cast<element_container *>(context.m_node);
+		switch (m_axis)
+		{
+			case AxisType::Parent:
+			{
+				auto p = context.m_node->parent();
+				if (p != nullptr and pred(p))
+					result = sink(p);
+				break;
+			}
+
+			case AxisType::Ancestor:
+				result = iterate_ancestor(context_element, pred, sink);
+				break;
+
+			case AxisType::AncestorOrSelf:
+				if (pred(context.m_node))
+					result = sink(context.m_node);
+				if (result)
+					result = iterate_ancestor(context_element, pred, sink);
+				break;
+
+			case AxisType::Self:
+				if (pred(context.m_node))
+					result = sink(context.m_node);
+				break;
+
+			case AxisType::Child:
+				result = iterate_children(context_element, false, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Descendant:
+				result = iterate_children(context_element, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::DescendantOrSelf:
+				if (pred(context.m_node))
+					result = sink(context.m_node);
+				if (result)
+					result = iterate_children(context_element, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Following:
+				result = iterate_following(context.m_node, false, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::FollowingSibling:
+				result = iterate_following(context.m_node, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Preceding:
+				result = iterate_preceding(context.m_node, false, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::PrecedingSibling:
+				result = iterate_preceding(context.m_node, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Attribute:
+				if (context_element->type() == node_type::element)
+					result = iterate_attributes(static_cast<element *>(context_element), pred, sink);
+				break;
+
+			case AxisType::Namespace:
+				if (context_element->type() == node_type::element)
+					result = iterate_namespaces(static_cast<element *>(context_element), pred, sink);
+				break;
+
+			case AxisType::AxisTypeCount:;
+		}
+	}
+
+	return result;
+}
+
+template <typename T>
+object step_expression::evaluate(compact_expression_context &context, T pred, bool elementsOnly)
+{
+	compact_node_set result;
+
+	auto sink = [&result, limit = m_limit](const compact_node &n)
+	{
+		result.push_back(n);
+		return result.size() < limit;
+	};
+
+	collect_axis(context, pred, elementsOnly, sink);
+
+	return result;
+}
+
+template <typename T, typename SINK>
+bool step_expression::collect_axis(compact_expression_context &context, T &pred, bool elementsOnly, SINK &sink)
+{
+	bool result = true;
+
+	const compact_node &n = context.m_node;
+
+	if (n.type() == node_type::element or n.type() == node_type::document)
+	{
+		switch (m_axis)
+		{
+			case AxisType::Parent:
+			{
+				auto p = n.parent();
+				if (p and pred(p))
+					result = sink(p);
+				break;
+			}
+
+			case AxisType::Ancestor:
+				result = iterate_ancestor(n, pred, sink);
+				break;
+
+			case AxisType::AncestorOrSelf:
+				if (pred(n))
+					result = sink(n);
+				if (result)
+					result = iterate_ancestor(n, pred, sink);
+				break;
+
+			case AxisType::Self:
+				if (pred(n))
+					result = sink(n);
 				break;
 
 			case AxisType::Child:
-				iterate_children(context_element, result, false, pred, elementsOnly);
+				result = iterate_children(n, false, pred, elementsOnly, sink);
 				break;
 
 			case AxisType::Descendant:
-				iterate_children(context_element, result, true, pred, elementsOnly);
+				result = iterate_children(n, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::DescendantOrSelf:
+				if (pred(n))
+					result = sink(n);
+				if (result)
+					result = iterate_children(n, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Following:
+				result = iterate_following(n, false, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::FollowingSibling:
+				result = iterate_following(n, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Preceding:
+				result = iterate_preceding(n, false, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::PrecedingSibling:
+				result = iterate_preceding(n, true, pred, elementsOnly, sink);
+				break;
+
+			case AxisType::Attribute:
+				if (n.type() == node_type::element)
+					result = iterate_attributes(n, false, pred, sink);
+				break;
+
+			case AxisType::Namespace:
+				if (n.type() == node_type::element)
+					result = iterate_attributes(n, true, pred, sink);
+				break;
+
+			case AxisType::AxisTypeCount:;
+		}
+	}
+
+	return result;
+}
+
+// The inverse of collect, for the invertible axes
+
+template <typename T>
+bool step_expression::contexts_for(const node *n, T &pred, bool elementsOnly, const context_visitor &visitor) const
+{
+	auto is_container = [](const node *c)
+	{
+		return c->type() == node_type::element or c->type() == node_type::document;
+	};
+
+	// can n be found by iterate_children
+	bool child_node = n->type() != node_type::attribute and
+	                  (not elementsOnly or n->type() == node_type::element);
+
+	bool result = false;
+
+	switch (m_axis)
+	{
+		case AxisType::DescendantOrSelf:
+			if (is_container(n) and pred(n) and visitor(n))
+				return true;
+			[[fallthrough]];
+
+		case AxisType::Descendant:
+			if (child_node and pred(n))
+			{
+				for (auto c = n->parent(); c != nullptr and not result; c = c->parent())
+					result = visitor(c);
+			}
+			break;
+
+		case AxisType::Child:
+			if (child_node and n->parent() != nullptr and pred(n))
+				result = visitor(n->parent());
+			break;
+
+		case AxisType::Self:
+			result = is_container(n) and pred(n) and visitor(n);
+			break;
+
+		case AxisType::Namespace:
+			if (n->type() != node_type::attribute or not static_cast<const attribute *>(n)->is_namespace())
 				break;
+			[[fallthrough]];
+
+		case AxisType::Attribute:
+			if (n->type() == node_type::attribute and n->parent() != nullptr and pred(n))
+				result = visitor(n->parent());
+			break;
+
+		default:
+			break;
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+class name_test_step_expression : public step_expression
+{
+  public:
+	name_test_step_expression(AxisType axis, std::string_view name)
+		: step_expression(axis)
+		, m_name(name)
+		, m_atom(name)
+	{
+	}
+
+  private:
+	template <typename F>
+	auto with_test(F &&f) const
+	{
+		if (m_name == "*")
+			return f([](const auto &) { return true; });
+		else
+			return f([this](const auto &n) { return name_matches(n); });
+	}
+
+	// The elements found by a descendant name test on a document that
+	// keeps an index of element names, nullptr otherwise
+	const element_set *indexed(const expression_context &context) const
+	{
+		if ((m_axis == AxisType::Descendant or m_axis == AxisType::DescendantOrSelf) and
+			m_name != "*" and context.m_node->type() == node_type::document)
+			return static_cast<const document *>(context.m_node)->indexed_elements(m_name);
+		return nullptr;
+	}
+
+  public:
+	object evaluate(expression_context &context) override
+	{
+		if (auto elements = indexed(context); elements != nullptr)
+		{
+			auto n = std::min(elements->size(), m_limit);
+#if MXML_STATS
+			context.profile(*this, n, n);
+#endif
+			return node_set(elements->begin(), elements->begin() + n);
+		}
+
+		return with_test([&](auto test)
+			{ return step_expression::evaluate(context, test, true); });
+	}
+
+	object evaluate(compact_expression_context &context) override
+	{
+		return with_test([&](auto test)
+			{ return step_expression::evaluate(context, test, true); });
+	}
+
+	bool visit(expression_context &context, const node_visitor &visitor) override
+	{
+		if (auto elements = indexed(context); elements != nullptr)
+		{
+			std::size_t i = 0;
+			bool result = true;
+
+			while (result and i < elements->size() and i < m_limit)
+				result = visitor((*elements)[i++]);
+
+#if MXML_STATS
+			context.profile(*this, i, i);
+#endif
+			return result;
+		}
 
-			case AxisType::DescendantOrSelf:
-				if (pred(context.m_node))
-					result.push_back(context.m_node);
-				iterate_children(context_element, result, true, pred, elementsOnly);
-				break;
+		return with_test([&](auto test)
+			{ return step_expression::visit(context, test, true, visitor); });
+	}
 
-			case AxisType::Following:
-				iterate_following(context.m_node, result, false, pred, elementsOnly);
-				break;
+	bool contexts_for(const node *n, expression_context & /*context*/, const context_visitor &visitor) override
+	{
+		return with_test([&](auto test)
+			{ return step_expression::contexts_for(n, test, true, visitor); });
+	}
 
-			case AxisType::FollowingSibling:
-				iterate_following(context.m_node, result, true, pred, elementsOnly);
-				break;
+  protected:
+	std::string node_test() const override { return m_name; }
 
-			case AxisType::Preceding:
-				iterate_preceding(context.m_node, result, false, pred, elementsOnly);
-				break;
+	bool name_matches(const node *n) const
+	{
+		bool result;
 
-			case AxisType::PrecedingSibling:
-				iterate_preceding(context.m_node, result, true, pred, elementsOnly);
+		// element and attribute names may be interned, compare those directly
+		switch (n->type())
+		{
+			case node_type::element:
+				result = static_cast<const element *>(n)->qname_atom().local_name_is(m_atom);
 				break;
 
-			case AxisType::Attribute:
-				if (context_element->type() == node_type::element)
-					iterate_attributes(static_cast<element *>(context_element), result, pred);
+			case node_type::attribute:
+				result = static_cast<const attribute *>(n)->qname_atom().local_name_is(m_atom);
 				break;
 
-			case AxisType::Namespace:
-				if (context_element->type() == node_type::element)
-					iterate_namespaces(static_cast<element *>(context_element), result, pred);
+			default:
+				result = n->name() == m_name;
 				break;
-
-			case AxisType::AxisTypeCount:;
 		}
-	}
 
-	return result;
-}
-
-// --------------------------------------------------------------------
-
-class name_test_step_expression : public step_expression
-{
-  public:
-	name_test_step_expression(AxisType axis, std::string_view name)
-		: step_expression(axis)
-		, m_name(name)
-	{
-		m_test = std::bind(&name_test_step_expression::name_matches, this, std::placeholders::_1);
+		return result;
 	}
 
-	object evaluate(expression_context &context) override;
-
-  protected:
-	bool name_matches(const node *n)
+	bool name_matches(const compact_node &n) const
 	{
-		bool result = m_name == "*" or n->name() == m_name;
-		return result;
+		return n.name() == m_name;
 	}
 
 	std::string m_name;
-	std::function<bool(const node *)> m_test;
+	atom m_atom;
 };
 
-object name_test_step_expression::evaluate(expression_context &context)
-{
-	return step_expression::evaluate(context, m_test, true);
-}
-
 // --------------------------------------------------------------------
 
 class node_type_expression : public step_expression
@@ -797,14 +1871,57 @@ class node_type_expression : public step_expression
 	{
 	}
 
+  private:
+	template <typename F>
+	auto with_test(F &&f) const
+	{
+		if (not m_node_type.has_value())
+			return f([](const auto & /*n*/) { return true; });
+		else if (*m_node_type == node_type::text)
+			return f([](const auto &n) { return deref(n).type() == node_type::text or deref(n).type() == node_type::cdata; });
+		else
+			return f([t = *m_node_type](const auto &n) { return deref(n).type() == t; });
+	}
+
+  public:
 	object evaluate(expression_context &context) override
 	{
-		if (m_node_type.has_value())
-			return step_expression::evaluate(context, [](const node *n) { return true; }, false);
+		return with_test([&](auto test)
+			{ return step_expression::evaluate(context, test, false); });
+	}
+
+	object evaluate(compact_expression_context &context) override
+	{
+		return with_test([&](auto test)
+			{ return step_expression::evaluate(context, test, false); });
+	}
+
+	bool visit(expression_context &context, const node_visitor &visitor) override
+	{
+		return with_test([&](auto test)
+			{ return step_expression::visit(context, test, false, visitor); });
+	}
+
+	bool contexts_for(const node *n, expression_context & /*context*/, const context_visitor &visitor) override
+	{
+		return with_test([&](auto test)
+			{ return step_expression::contexts_for(n, test, false, visitor); });
+	}
+
+	// true for node()
+	bool matches_any_node() const { return not m_node_type.has_value(); }
+
+  protected:
+	std::string node_test() const override
+	{
+		if (not m_node_type.has_value())
+			return "node()";
 		else if (*m_node_type == node_type::text)
-			return step_expression::evaluate(context, [](const node *n) { return n->type() == node_type::text or n->type() == node_type::cdata; }, false);
+			return "text()";
+		else if (*m_node_type == node_type::comment)
+			return "comment()";
 		else
-			return step_expression::evaluate(context, [t=*m_node_type](const node *n) { return n->type() == t; }, false);
+			return "processing-instruction()";
 	}
 
   private:
@@ -817,6 +1934,15 @@ class root_expression : public expression
 {
   public:
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	bool returns_node_set() const override { return true; }
+	bool unnested() const override { return true; }
+
+	bool matches(const node *n, expression_context &context) override
+	{
+		return n == context.m_node->root();
+	}
 };
 
 object root_expression::evaluate(expression_context &context)
@@ -826,6 +1952,13 @@ object root_expression::evaluate(expression_context &context)
 	return result;
 }
 
+object root_expression::evaluate(compact_expression_context &context)
+{
+	compact_node_set result;
+	result.push_back(context.m_node.root());
+	return result;
+}
+
 // --------------------------------------------------------------------
 
 template <Token OP>
@@ -838,14 +1971,37 @@ class operator_expression : public expression
 	{
 	}
 
-	object evaluate(expression_context &context) override;
+	object evaluate(expression_context &context) override { return evaluate_in(context); }
+	object evaluate(compact_expression_context &context) override { return evaluate_in(context); }
+
+	expression_ptr optimize() override
+	{
+		m_lhs = m_lhs->optimize();
+		m_rhs = m_rhs->optimize();
+		return fold_constant(shared_from_this());
+	}
+
+	bool is_constant() const override { return m_lhs->is_constant() and m_rhs->is_constant(); }
+	bool uses_position() const override { return m_lhs->uses_position() or m_rhs->uses_position(); }
+
+	bool returns_boolean() const override
+	{
+		return OP == Token::OperatorEqual or OP == Token::OperatorNotEqual or
+		       OP == Token::OperatorLess or OP == Token::OperatorLessOrEqual or
+		       OP == Token::OperatorGreater or OP == Token::OperatorGreaterOrEqual or
+		       OP == Token::OperatorAnd or OP == Token::OperatorOr;
+	}
 
   private:
+	template <typename Context>
+	object evaluate_in(Context &context);
+
 	expression_ptr m_lhs, m_rhs;
 };
 
 template <>
-object operator_expression<Token::OperatorAdd>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorAdd>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -854,7 +2010,8 @@ object operator_expression<Token::OperatorAdd>::evaluate(expression_context &con
 }
 
 template <>
-object operator_expression<Token::OperatorSubstract>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorSubstract>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -863,7 +2020,8 @@ object operator_expression<Token::OperatorSubstract>::evaluate(expression_contex
 }
 
 template <>
-object operator_expression<Token::OperatorEqual>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorEqual>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -872,7 +2030,8 @@ object operator_expression<Token::OperatorEqual>::evaluate(expression_context &c
 }
 
 template <>
-object operator_expression<Token::OperatorNotEqual>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorNotEqual>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -881,7 +2040,8 @@ object operator_expression<Token::OperatorNotEqual>::evaluate(expression_context
 }
 
 template <>
-object operator_expression<Token::OperatorLess>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorLess>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -890,7 +2050,8 @@ object operator_expression<Token::OperatorLess>::evaluate(expression_context &co
 }
 
 template <>
-object operator_expression<Token::OperatorLessOrEqual>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorLessOrEqual>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -899,7 +2060,8 @@ object operator_expression<Token::OperatorLessOrEqual>::evaluate(expression_cont
 }
 
 template <>
-object operator_expression<Token::OperatorGreater>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorGreater>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -908,7 +2070,8 @@ object operator_expression<Token::OperatorGreater>::evaluate(expression_context
 }
 
 template <>
-object operator_expression<Token::OperatorGreaterOrEqual>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorGreaterOrEqual>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -917,7 +2080,8 @@ object operator_expression<Token::OperatorGreaterOrEqual>::evaluate(expression_c
 }
 
 template <>
-object operator_expression<Token::OperatorAnd>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorAnd>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -926,7 +2090,8 @@ object operator_expression<Token::OperatorAnd>::evaluate(expression_context &con
 }
 
 template <>
-object operator_expression<Token::OperatorOr>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorOr>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -935,7 +2100,8 @@ object operator_expression<Token::OperatorOr>::evaluate(expression_context &cont
 }
 
 template <>
-object operator_expression<Token::OperatorMod>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorMod>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -944,7 +2110,8 @@ object operator_expression<Token::OperatorMod>::evaluate(expression_context &con
 }
 
 template <>
-object operator_expression<Token::OperatorDiv>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::OperatorDiv>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -953,7 +2120,8 @@ object operator_expression<Token::OperatorDiv>::evaluate(expression_context &con
 }
 
 template <>
-object operator_expression<Token::Asterisk>::evaluate(expression_context &context)
+template <typename Context>
+object operator_expression<Token::Asterisk>::evaluate_in(Context &context)
 {
 	object v1 = m_lhs->evaluate(context);
 	object v2 = m_rhs->evaluate(context);
@@ -971,13 +2139,27 @@ class negate_expression : public expression
 	{
 	}
 
-	object evaluate(expression_context &context) override;
+	object evaluate(expression_context &context) override { return evaluate_in(context); }
+	object evaluate(compact_expression_context &context) override { return evaluate_in(context); }
+
+	expression_ptr optimize() override
+	{
+		m_expr = m_expr->optimize();
+		return fold_constant(shared_from_this());
+	}
+
+	bool is_constant() const override { return m_expr->is_constant(); }
+	bool uses_position() const override { return m_expr->uses_position(); }
 
   private:
+	template <typename Context>
+	object evaluate_in(Context &context);
+
 	expression_ptr m_expr;
 };
 
-object negate_expression::evaluate(expression_context &context)
+template <typename Context>
+object negate_expression::evaluate_in(Context &context)
 {
 	object v = m_expr->evaluate(context);
 	return -v.as<double>();
@@ -995,6 +2177,36 @@ class path_expression : public expression
 	}
 
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	bool visit(expression_context &context, const node_visitor &visitor) override;
+
+	bool unnested() const override
+	{
+		return m_lhs->unnested() and m_rhs->unnested() and m_rhs->stays_in_subtree();
+	}
+
+	bool stays_in_subtree() const override
+	{
+		return m_lhs->stays_in_subtree() and m_rhs->stays_in_subtree();
+	}
+
+	// Match right to left, find the context nodes for which the rhs
+	// results in n and check if one of them matches the lhs
+	bool matches(const node *n, expression_context &context) override
+	{
+		if (not m_rhs->invertible())
+			return expression::matches(n, context);
+
+		return m_rhs->contexts_for(n, context, [this, &context](const node *c)
+			{ return m_lhs->matches(c, context); });
+	}
+
+	expression_ptr optimize() override;
+
+	// the rhs is evaluated with the nodes of the lhs as context
+	bool uses_position() const override { return m_lhs->uses_position(); }
+	bool returns_node_set() const override { return true; }
 
   private:
 	expression_ptr m_lhs, m_rhs;
@@ -1006,16 +2218,81 @@ object path_expression::evaluate(expression_context &context)
 	if (v.type() != object_type::node_set)
 		throw exception("filter does not evaluate to a node-set");
 
-	node_set result;
-	for (node *n : v.as<const node_set &>())
+	node_set nodes = v.release_node_set();
+
+	node_set result = context.new_node_set();
+
+	if (context.m_thread_pool != nullptr and nodes.size() >= kMinParallelNodes)
+	{
+		std::vector<node_set> results(nodes.size());
+
+		nodes.front()->document_order();
+
+		run_parallel(*context.m_thread_pool, nodes.size(), [&](std::size_t b, std::size_t e)
+			{
+				node_set_pool pool;
+
+				for (auto i = b; i < e; ++i)
+				{
+					expression_context ctxt(context, nodes[i], nodes);
+					ctxt.m_pool = &pool;
+					ctxt.m_position = i + 1;
+					results[i] = m_rhs->evaluate(ctxt).release_node_set();
+				} });
+
+		for (auto &r : results)
+			result.insert(result.end(), r.begin(), r.end());
+	}
+	else
 	{
-		expression_context ctxt(context, n, v.as<const node_set &>());
+		expression_context ctxt(context, nullptr, nodes);
+		ctxt.m_thread_pool = context.m_thread_pool;
+
+		for (node *n : nodes)
+		{
+			ctxt.m_node = n;
+			++ctxt.m_position;
+
+			node_set s = m_rhs->evaluate(ctxt).release_node_set();
+
+			if (result.empty())
+				std::swap(result, s);
+			else
+				result.insert(result.end(), s.begin(), s.end());
+
+			context.recycle(std::move(s));
+		}
+	}
+
+	context.recycle(std::move(nodes));
+
+	sort_document_order(result);
+
+	return result;
+}
+
+object path_expression::evaluate(compact_expression_context &context)
+{
+	object v = m_lhs->evaluate(context);
+	if (v.type() != object_type::compact_node_set)
+		throw exception("filter does not evaluate to a node-set");
+
+	compact_node_set nodes = v.release_compact_node_set();
+	compact_node_set result;
 
-		node_set s = m_rhs->evaluate(ctxt).as<const node_set &>();
+	compact_expression_context ctxt(context, {}, nodes);
+
+	for (auto &n : nodes)
+	{
+		ctxt.m_node = n;
+		++ctxt.m_position;
 
-		copy(s.begin(), s.end(), back_inserter(result));
+		compact_node_set s = m_rhs->evaluate(ctxt).release_compact_node_set();
+		result.insert(result.end(), s.begin(), s.end());
 	}
 
+	sort_document_order(result);
+
 	return result;
 }
 
@@ -1030,34 +2307,319 @@ class predicate_expression : public expression
 	{
 	}
 
-	object evaluate(expression_context &context) override;
+	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	bool visit(expression_context &context, const node_visitor &visitor) override;
+	bool unnested() const override { return m_path->unnested(); }
+	bool stays_in_subtree() const override { return m_path->stays_in_subtree(); }
+
+	bool invertible() const override { return m_path->invertible(); }
+
+	bool matches(const node *n, expression_context &context) override
+	{
+		if (not invertible())
+			return expression::matches(n, context);
+
+		return contexts_for(n, context, [&context](const node *c)
+			{ return c == context.m_node; });
+	}
+
+	bool contexts_for(const node *n, expression_context &context, const context_visitor &visitor) override;
+
+	expression_ptr optimize() override;
+
+	// the predicate is evaluated with the nodes of the path as context
+	bool uses_position() const override { return m_path->uses_position(); }
+	bool returns_node_set() const override { return m_path->returns_node_set(); }
+
+	// Returns false if the outcome of the predicate for a node does not
+	// depend on the position of that node in the node-set being filtered
+	bool is_positional() const
+	{
+		return m_index > 0 or m_pred->uses_position() or
+		       not(m_pred->returns_boolean() or m_pred->returns_node_set());
+	}
+
+	const expression_ptr &path() const { return m_path; }
+
+	std::string description() const override
+	{
+		return m_path->description() + '[' + (m_index > 0 ? std::to_string(m_index) : "...") + ']';
+	}
+
+  private:
+	expression_ptr m_path, m_pred;
+
+	// set for predicates that are a constant number, like [1]
+	std::size_t m_index = 0;
+};
+
+// Returns the step a chain of predicates filters, or nullptr. If
+// \a positional is false the chain may only contain predicates that
+// do not depend on position.
+
+step_expression *base_step(expression *e, bool positional)
+{
+	while (auto pred = dynamic_cast<predicate_expression *>(e))
+	{
+		if (not positional and pred->is_positional())
+			return nullptr;
+		e = pred->path().get();
+	}
+
+	return dynamic_cast<step_expression *>(e);
+}
+
+object predicate_expression::evaluate(expression_context &context)
+{
+	object v = m_path->evaluate(context);
+
+	node_set result;
+
+	if (m_index > 0)
+	{
+		auto &s = v.as<const node_set &>();
+		if (m_index <= s.size())
+			result.push_back(s[m_index - 1]);
+#if MXML_STATS
+		context.profile(*this, s.size(), result.size());
+#endif
+		return result;
+	}
+
+	node_set nodes = v.release_node_set();
+
+	if (context.m_thread_pool != nullptr and nodes.size() >= kMinParallelNodes and not is_positional())
+	{
+		std::vector<char> keep(nodes.size());
+
+		nodes.front()->document_order();
+
+		run_parallel(*context.m_thread_pool, nodes.size(), [&](std::size_t b, std::size_t e)
+			{
+				node_set_pool pool;
+
+				for (auto i = b; i < e; ++i)
+				{
+					expression_context ctxt(context, nodes[i], nodes);
+					ctxt.m_pool = &pool;
+					keep[i] = m_pred->evaluate(ctxt).as<bool>();
+				} });
+
+		for (std::size_t i = 0; i < nodes.size(); ++i)
+		{
+			if (keep[i])
+				result.push_back(nodes[i]);
+		}
+
+#if MXML_STATS
+		context.profile(*this, nodes.size(), result.size());
+#endif
+		return result;
+	}
+
+	// Filtered in place, the nodes that are kept are moved to the front
+	std::size_t kept = 0;
+
+	expression_context ctxt(context, nullptr, nodes);
+
+	for (std::size_t i = 0; i < nodes.size(); ++i)
+	{
+		node *n = nodes[i];
+
+		ctxt.m_node = n;
+		ctxt.m_position = i + 1;
+
+		object test = m_pred->evaluate(ctxt);
+
+		if (test.type() == object_type::number ? ctxt.m_position == test.as<double>() : test.as<bool>())
+			nodes[kept++] = n;
+	}
+
+#if MXML_STATS
+	context.profile(*this, nodes.size(), kept);
+#endif
+
+	nodes.resize(kept);
+
+	return nodes;
+}
+
+object predicate_expression::evaluate(compact_expression_context &context)
+{
+	object v = m_path->evaluate(context);
+
+	if (m_index > 0)
+	{
+		compact_node_set result;
+		auto &s = v.as<const compact_node_set &>();
+		if (m_index <= s.size())
+			result.push_back(s[m_index - 1]);
+		return result;
+	}
+
+	compact_node_set nodes = v.release_compact_node_set();
+
+	// Filtered in place, the nodes that are kept are moved to the front
+	std::size_t kept = 0;
+
+	compact_expression_context ctxt(context, {}, nodes);
+
+	for (std::size_t i = 0; i < nodes.size(); ++i)
+	{
+		ctxt.m_node = nodes[i];
+		ctxt.m_position = i + 1;
+
+		object test = m_pred->evaluate(ctxt);
+
+		if (test.type() == object_type::number ? ctxt.m_position == test.as<double>() : test.as<bool>())
+			nodes[kept++] = nodes[i];
+	}
+
+	nodes.resize(kept);
+
+	return nodes;
+}
+
+bool predicate_expression::visit(expression_context &context, const node_visitor &visitor)
+{
+	// Positions are counted in the order of the axis, for reverse axes
+	// that is not the order nodes are visited in
+	auto step = base_step(m_path.get(), true);
+	if (step != nullptr and step->reverse())
+		return expression::visit(context, visitor);
+
+	bool result = true;
+
+	if (m_index > 0)
+	{
+		std::size_t count = 0;
+		m_path->visit(context, [&](node *n)
+			{
+			if (++count < m_index)
+				return true;
+			result = visitor(n);
+			return false; });
+	}
+	else if (not is_positional())
+	{
+		node_set empty;
+		m_path->visit(context, [&](node *n)
+			{
+			expression_context ctxt(context, n, empty);
+			if (m_pred->evaluate(ctxt).as<bool>())
+				result = visitor(n);
+			return result; });
+	}
+	else
+		result = expression::visit(context, visitor);
+
+	return result;
+}
+
+bool predicate_expression::contexts_for(const node *n, expression_context &context, const context_visitor &visitor)
+{
+	return m_path->contexts_for(n, context, [&](const node *c)
+		{
+		bool result;
+
+		if (is_positional())
+		{
+			// the position of n has to be known, evaluate for this context
+			node_set empty;
+			expression_context ctxt(context, c, empty);
+			auto s = evaluate(ctxt).as<const node_set &>();
+			result = std::find(s.begin(), s.end(), n) != s.end();
+		}
+		else
+		{
+			node_set empty;
+			expression_context ctxt(context, n, empty);
+			result = m_pred->evaluate(ctxt).as<bool>();
+		}
+
+		return result and visitor(c); });
+}
+
+expression_ptr predicate_expression::optimize()
+{
+	m_path = m_path->optimize();
+	m_pred = fold_constant(m_pred->optimize());
+
+	if (auto c = dynamic_cast<constant_expression *>(m_pred.get()); c != nullptr)
+	{
+		if (c->value().type() != object_type::number)
+		{
+			if (c->value().as<bool>())
+				return m_path;
+		}
+		else if (double d = c->value().as<double>(); d >= 1 and d == std::floor(d))
+		{
+			m_index = static_cast<std::size_t>(d);
+
+			// the step can stop looking after having found that many nodes
+			if (auto step = dynamic_cast<step_expression *>(m_path.get()); step != nullptr)
+				step->limit(m_index);
+		}
+	}
+
+	return shared_from_this();
+}
+
+bool path_expression::visit(expression_context &context, const node_visitor &visitor)
+{
+	// Without nesting in the lhs, the subtrees searched by the rhs are
+	// disjoint and in document order, so the nodes can be passed on as
+	// they are found
+	if (not m_lhs->unnested() or not m_rhs->stays_in_subtree())
+		return expression::visit(context, visitor);
 
-  private:
-	expression_ptr m_path, m_pred;
-};
+	node_set empty;
+	bool result = true;
 
-object predicate_expression::evaluate(expression_context &context)
+	m_lhs->visit(context, [&](node *n)
+		{
+		expression_context ctxt(context, n, empty);
+		result = m_rhs->visit(ctxt, visitor);
+		return result; });
+
+	return result;
+}
+
+expression_ptr path_expression::optimize()
 {
-	object v = m_path->evaluate(context);
+	m_lhs = m_lhs->optimize();
+	m_rhs = m_rhs->optimize();
 
-	node_set result;
+	// Rewrite descendant-or-self::node()/child::x, which is what //x
+	// expands to, into descendant::x. That is one scan instead of a
+	// scan over the children of each node. Predicates on x are allowed
+	// as long as they do not depend on the position of x.
 
-	for (node *n : v.as<const node_set &>())
+	auto is_descendant_or_self_node = [](const expression_ptr &e)
 	{
-		expression_context ctxt(context, n, v.as<const node_set &>());
+		auto step = dynamic_cast<node_type_expression *>(e.get());
+		return step != nullptr and step->axis() == AxisType::DescendantOrSelf and step->matches_any_node();
+	};
 
-		object test = m_pred->evaluate(ctxt);
+	auto step = base_step(m_rhs.get(), false);
+	if (step != nullptr and step->axis() == AxisType::Child)
+	{
+		if (is_descendant_or_self_node(m_lhs))
+		{
+			step->axis(AxisType::Descendant);
+			return m_rhs;
+		}
 
-		if (test.type() == object_type::number)
+		if (auto lhs = dynamic_cast<path_expression *>(m_lhs.get()); lhs != nullptr and is_descendant_or_self_node(lhs->m_rhs))
 		{
-			if (ctxt.position() == test.as<double>())
-				result.push_back(n);
+			step->axis(AxisType::Descendant);
+			m_lhs = lhs->m_lhs;
 		}
-		else if (test.as<bool>())
-			result.push_back(n);
 	}
 
-	return result;
+	return shared_from_this();
 }
 
 // --------------------------------------------------------------------
@@ -1071,6 +2633,7 @@ class variable_expression : public expression
 	}
 
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
 
   private:
 	std::string m_var;
@@ -1081,6 +2644,11 @@ object variable_expression::evaluate(expression_context &context)
 	return context.get(m_var);
 }
 
+object variable_expression::evaluate(compact_expression_context &context)
+{
+	return context.get(m_var);
+}
+
 // --------------------------------------------------------------------
 
 class literal_expression : public expression
@@ -1092,6 +2660,9 @@ class literal_expression : public expression
 	}
 
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	bool is_constant() const override { return true; }
 
   private:
 	std::string m_lit;
@@ -1102,6 +2673,11 @@ object literal_expression::evaluate(expression_context & /*context*/)
 	return object(m_lit);
 }
 
+object literal_expression::evaluate(compact_expression_context & /*context*/)
+{
+	return object(m_lit);
+}
+
 // --------------------------------------------------------------------
 
 class number_expression : public expression
@@ -1113,6 +2689,9 @@ class number_expression : public expression
 	}
 
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	bool is_constant() const override { return true; }
 
   private:
 	double m_number;
@@ -1123,6 +2702,11 @@ object number_expression::evaluate(expression_context & /*context*/)
 	return object(m_number);
 }
 
+object number_expression::evaluate(compact_expression_context & /*context*/)
+{
+	return object(m_number);
+}
+
 // --------------------------------------------------------------------
 
 template <CoreFunction CF>
@@ -1134,126 +2718,273 @@ class core_function_expression : public expression
 	{
 	}
 
-	object evaluate(expression_context &context) override;
+	object evaluate(expression_context &context) override { return evaluate_in(context); }
+	object evaluate(compact_expression_context &context) override { return evaluate_in(context); }
+
+	expression_ptr optimize() override
+	{
+		for (auto &arg : m_args)
+			arg = arg->optimize();
+		return fold_constant(shared_from_this());
+	}
+
+	bool is_constant() const override
+	{
+		// Functions without arguments mostly use the context node instead
+		if constexpr (CF == CoreFunction::True or CF == CoreFunction::False)
+			return true;
+		else if constexpr (CF == CoreFunction::Id or CF == CoreFunction::Lang or
+						   CF == CoreFunction::Last or CF == CoreFunction::Position)
+			return false;
+		else
+			return not m_args.empty() and std::all_of(m_args.begin(), m_args.end(), [](auto &arg)
+											  { return arg->is_constant(); });
+	}
+
+	bool uses_position() const override
+	{
+		if constexpr (CF == CoreFunction::Last or CF == CoreFunction::Position)
+			return true;
+		else
+			return std::any_of(m_args.begin(), m_args.end(), [](auto &arg)
+				{ return arg->uses_position(); });
+	}
+
+	bool returns_boolean() const override
+	{
+		return CF == CoreFunction::Boolean or CF == CoreFunction::Not or
+		       CF == CoreFunction::True or CF == CoreFunction::False or
+		       CF == CoreFunction::Contains or CF == CoreFunction::StartsWith or
+		       CF == CoreFunction::Lang;
+	}
 
   private:
+	template <typename Context>
+	object evaluate_in(Context &context);
+
 	expression_list m_args;
 };
 
 template <CoreFunction CF>
-object core_function_expression<CF>::evaluate(expression_context & /*context*/)
+template <typename Context>
+object core_function_expression<CF>::evaluate_in(Context & /*context*/)
 {
 	throw exception("unimplemented function ");
 }
 
 template <>
-object core_function_expression<CoreFunction::Position>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Position>::evaluate_in(Context &context)
 {
 	return object(double(context.position()));
 }
 
 template <>
-object core_function_expression<CoreFunction::Last>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Last>::evaluate_in(Context &context)
 {
 	return object(double(context.last()));
 }
 
 template <>
-object core_function_expression<CoreFunction::Count>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Count>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
-	size_t result = v.as<const node_set &>().size();
+	size_t result = v.as<const typename Context::node_set_type &>().size();
 
 	return object(double(result));
 }
 
+// The elements in the tree containing \a n that have an ID attribute with
+// one of the whitespace separated values in \a ids, in document order.
+// Documents that keep an index look these up directly.
+node_set find_by_id(node *n, const std::string &ids)
+{
+	node_set result;
+
+	node *top = n;
+	while (top->parent() != nullptr)
+		top = top->parent();
+
+	for (std::string::size_type b = ids.find_first_not_of(" \t\r\n"); b != std::string::npos;
+		 b = ids.find_first_not_of(" \t\r\n", b))
+	{
+		auto e = ids.find_first_of(" \t\r\n", b);
+		std::string_view id = std::string_view{ ids }.substr(b, e == std::string::npos ? e : e - b);
+		b = e;
+
+		if (top->type() == node_type::document)
+		{
+			if (auto el = static_cast<document *>(top)->get_element_by_id(id); el != nullptr)
+				result.push_back(el);
+		}
+		else if (top->type() == node_type::element)
+		{
+			auto pred = [id](const node *m)
+			{
+				for (auto &a : static_cast<const element *>(m)->attributes())
+				{
+					if (a.is_id() and a.value() == id)
+						return true;
+				}
+				return false;
+			};
+
+			auto sink = [&result](node *m)
+			{
+				result.push_back(m);
+				return false;
+			};
+
+			if (pred(top))
+				sink(top);
+			else
+				iterate_child_elements(static_cast<element *>(top), true, pred, sink);
+		}
+	}
+
+	sort_document_order(result);
+
+	return result;
+}
+
+// The same for a compact_document, which is scanned
+compact_node_set find_by_id(const compact_node &n, const std::string &ids)
+{
+	compact_node_set result;
+
+	auto top = n.root();
+
+	for (std::string::size_type b = ids.find_first_not_of(" \t\r\n"); b != std::string::npos;
+		 b = ids.find_first_not_of(" \t\r\n", b))
+	{
+		auto e = ids.find_first_of(" \t\r\n", b);
+		std::string_view id = std::string_view{ ids }.substr(b, e == std::string::npos ? e : e - b);
+		b = e;
+
+		for (auto m = top.next(); m; m = m.next())
+		{
+			if (m.type() == node_type::element and m.id() == id)
+			{
+				result.push_back(m);
+				break;
+			}
+		}
+	}
+
+	sort_document_order(result);
+
+	return result;
+}
+
+std::string element_id(const node *n)
+{
+	return static_cast<const element *>(n)->id();
+}
+
+std::string element_id(const compact_node &n)
+{
+	return std::string{ n.id() };
+}
+
 template <>
-object core_function_expression<CoreFunction::Id>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Id>::evaluate_in(Context &context)
 {
-	node *n = nullptr;
+	typename Context::node_handle n{};
 
 	if (m_args.empty())
 		n = context.m_node;
 	else
 	{
 		object v = m_args.front()->evaluate(context);
-		if (not v.as<const node_set &>().empty())
-			n = v.as<const node_set &>().front();
+
+		// id('a b') selects the elements with these IDs
+		if (v.type() != object_type::node_set and v.type() != object_type::compact_node_set)
+			return find_by_id(context.m_node, v.as<std::string>());
+
+		if (auto &s = v.as<const typename Context::node_set_type &>(); not s.empty())
+			n = s.front();
 	}
 
-	if (n == nullptr or n->type() != node_type::element)
+	if (not n or deref(n).type() != node_type::element)
 		throw exception("argument is not an element in function 'id()'");
 
-	return static_cast<element *>(n)->id();
+	return element_id(n);
 }
 
 template <>
-object core_function_expression<CoreFunction::LocalName>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::LocalName>::evaluate_in(Context &context)
 {
-	node *n = nullptr;
+	typename Context::node_handle n{};
 
 	if (m_args.empty())
 		n = context.m_node;
 	else
 	{
 		object v = m_args.front()->evaluate(context);
-		if (not v.as<const node_set &>().empty())
-			n = v.as<const node_set &>().front();
+		if (auto &s = v.as<const typename Context::node_set_type &>(); not s.empty())
+			n = s.front();
 	}
 
-	if (n == nullptr)
+	if (not n)
 		throw exception("argument is not an element in function 'local-name'");
 
-	return n->name();
+	return deref(n).name();
 }
 
 template <>
-object core_function_expression<CoreFunction::NamespaceUri>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::NamespaceUri>::evaluate_in(Context &context)
 {
-	node *n = nullptr;
+	typename Context::node_handle n{};
 
 	if (m_args.empty())
 		n = context.m_node;
 	else
 	{
 		object v = m_args.front()->evaluate(context);
-		if (not v.as<const node_set &>().empty())
-			n = v.as<const node_set &>().front();
+		if (auto &s = v.as<const typename Context::node_set_type &>(); not s.empty())
+			n = s.front();
 	}
 
-	if (n == nullptr)
+	if (not n)
 		throw exception("argument is not an element in function 'namespace-uri'");
 
-	return n->get_ns();
+	return deref(n).get_ns();
 }
 
 template <>
-object core_function_expression<CoreFunction::Name>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Name>::evaluate_in(Context &context)
 {
-	node *n = nullptr;
+	typename Context::node_handle n{};
 
 	if (m_args.empty())
 		n = context.m_node;
 	else
 	{
 		object v = m_args.front()->evaluate(context);
-		if (not v.as<const node_set &>().empty())
-			n = v.as<const node_set &>().front();
+		if (auto &s = v.as<const typename Context::node_set_type &>(); not s.empty())
+			n = s.front();
 	}
 
-	if (n == nullptr)
+	if (not n)
 		throw exception("argument is not an element in function 'name'");
 
-	return n->get_qname();
+	return deref(n).get_qname();
 }
 
 template <>
-object core_function_expression<CoreFunction::String>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::String>::evaluate_in(Context &context)
 {
 	std::string result;
 
 	if (m_args.empty())
-		result = context.m_node->str();
+		result = deref(context.m_node).str();
 	else
 	{
 		object v = m_args.front()->evaluate(context);
@@ -1264,43 +2995,47 @@ object core_function_expression<CoreFunction::String>::evaluate(expression_conte
 }
 
 template <>
-object core_function_expression<CoreFunction::Concat>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Concat>::evaluate_in(Context &context)
 {
-	std::string result;
+	std::string result, buffer;
 	for (expression_ptr &e : m_args)
 	{
 		object v = e->evaluate(context);
-		result += v.as<std::string>();
+		result += v.as_view(buffer);
 	}
 	return result;
 }
 
 template <>
-object core_function_expression<CoreFunction::StringLength>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::StringLength>::evaluate_in(Context &context)
 {
-	std::string result;
+	std::size_t result;
 
 	if (m_args.empty())
-		result = context.m_node->str();
+		result = deref(context.m_node).str().length();
 	else
 	{
+		std::string buffer;
 		object v = m_args.front()->evaluate(context);
-		result = v.as<std::string>();
+		result = v.as_view(buffer).length();
 	}
 
-	return double(result.length());
+	return double(result);
 }
 
 template <>
-object core_function_expression<CoreFunction::StartsWith>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::StartsWith>::evaluate_in(Context &context)
 {
 	object v1 = m_args.front()->evaluate(context);
 	object v2 = m_args.back()->evaluate(context);
 
 	try
 	{
-		return v2.as<std::string>().empty() or
-		       v1.as<std::string>().starts_with(v2.as<std::string>());
+		std::string b1, b2;
+		return v1.as_view(b1).starts_with(v2.as_view(b2));
 	}
 	catch (const std::exception &)
 	{
@@ -1309,17 +3044,16 @@ object core_function_expression<CoreFunction::StartsWith>::evaluate(expression_c
 }
 
 template <>
-object core_function_expression<CoreFunction::Contains>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Contains>::evaluate_in(Context &context)
 {
 	object v1 = m_args.front()->evaluate(context);
 	object v2 = m_args.back()->evaluate(context);
 
 	try
 	{
-		auto s1 = v1.as<std::string>();
-		auto s2 = v2.as<std::string>();
-
-		return s1.find(s2) != std::string::npos;
+		std::string b1, b2;
+		return v1.as_view(b1).find(v2.as_view(b2)) != std::string_view::npos;
 	}
 	catch (...)
 	{
@@ -1328,19 +3062,23 @@ object core_function_expression<CoreFunction::Contains>::evaluate(expression_con
 }
 
 template <>
-object core_function_expression<CoreFunction::SubstringBefore>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::SubstringBefore>::evaluate_in(Context &context)
 {
 	object v1 = m_args.front()->evaluate(context);
 	object v2 = m_args.back()->evaluate(context);
 
 	try
 	{
-		std::string result;
-		if (not v2.as<std::string>().empty())
+		std::string b1, b2;
+		std::string_view s1 = v1.as_view(b1), s2 = v2.as_view(b2);
+
+		std::string_view result;
+		if (not s2.empty())
 		{
-			std::string::size_type p = v1.as<std::string>().find(v2.as<std::string>());
-			if (p != std::string::npos)
-				result = v1.as<std::string>().substr(0, p);
+			std::string_view::size_type p = s1.find(s2);
+			if (p != std::string_view::npos)
+				result = s1.substr(0, p);
 		}
 
 		return result;
@@ -1352,21 +3090,25 @@ object core_function_expression<CoreFunction::SubstringBefore>::evaluate(express
 }
 
 template <>
-object core_function_expression<CoreFunction::SubstringAfter>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::SubstringAfter>::evaluate_in(Context &context)
 {
 	object v1 = m_args.front()->evaluate(context);
 	object v2 = m_args.back()->evaluate(context);
 
 	try
 	{
-		std::string result;
-		if (v2.as<std::string>().empty())
-			result = v1.as<std::string>();
+		std::string b1, b2;
+		std::string_view s1 = v1.as_view(b1), s2 = v2.as_view(b2);
+
+		std::string_view result;
+		if (s2.empty())
+			result = s1;
 		else
 		{
-			std::string::size_type p = v1.as<std::string>().find(v2.as<std::string>());
-			if (p != std::string::npos and p + v2.as<std::string>().length() < v1.as<std::string>().length())
-				result = v1.as<std::string>().substr(p + v2.as<std::string>().length());
+			std::string_view::size_type p = s1.find(s2);
+			if (p != std::string_view::npos and p + s2.length() < s1.length())
+				result = s1.substr(p + s2.length());
 		}
 
 		return result;
@@ -1378,7 +3120,8 @@ object core_function_expression<CoreFunction::SubstringAfter>::evaluate(expressi
 }
 
 template <>
-object core_function_expression<CoreFunction::Substring>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Substring>::evaluate_in(Context &context)
 {
 	expression_list::iterator a = m_args.begin();
 
@@ -1393,7 +3136,8 @@ object core_function_expression<CoreFunction::Substring>::evaluate(expression_co
 
 	try
 	{
-		return v1.as<std::string>().substr(v2.as<int>() - 1, v3.as<int>());
+		std::string buffer;
+		return v1.as_view(buffer).substr(v2.as<int>() - 1, v3.as<int>());
 	}
 	catch (...)
 	{
@@ -1402,19 +3146,22 @@ object core_function_expression<CoreFunction::Substring>::evaluate(expression_co
 }
 
 template <>
-object core_function_expression<CoreFunction::NormalizeSpace>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::NormalizeSpace>::evaluate_in(Context &context)
 {
-	std::string s;
+	object v;
 
 	if (m_args.empty())
-		s = context.m_node->str();
+		v = deref(context.m_node).str();
 	else
-	{
-		object v = m_args.front()->evaluate(context);
-		s = v.as<std::string>();
-	}
+		v = m_args.front()->evaluate(context);
+
+	std::string buffer;
+	std::string_view s = v.as_view(buffer);
 
 	std::string result;
+	result.reserve(s.length());
+
 	bool space = true;
 
 	for (char c : s)
@@ -1439,7 +3186,8 @@ object core_function_expression<CoreFunction::NormalizeSpace>::evaluate(expressi
 }
 
 template <>
-object core_function_expression<CoreFunction::Translate>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Translate>::evaluate_in(Context &context)
 {
 	expression_list::iterator a = m_args.begin();
 
@@ -1454,9 +3202,12 @@ object core_function_expression<CoreFunction::Translate>::evaluate(expression_co
 		const std::string &f = v2.as<const std::string &>();
 		const std::string &r = v3.as<const std::string &>();
 
+		std::string buffer;
+		std::string_view s = v1.as_view(buffer);
+
 		std::string result;
-		result.reserve(v1.as<std::string>().length());
-		for (char c : v1.as<std::string>())
+		result.reserve(s.length());
+		for (char c : s)
 		{
 			std::string::size_type fi = f.find(c);
 			if (fi == std::string::npos)
@@ -1474,33 +3225,38 @@ object core_function_expression<CoreFunction::Translate>::evaluate(expression_co
 }
 
 template <>
-object core_function_expression<CoreFunction::Boolean>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Boolean>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 	return v.as<bool>();
 }
 
 template <>
-object core_function_expression<CoreFunction::Not>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Not>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 	return not v.as<bool>();
 }
 
 template <>
-object core_function_expression<CoreFunction::True>::evaluate(expression_context & /*context*/)
+template <typename Context>
+object core_function_expression<CoreFunction::True>::evaluate_in(Context & /*context*/)
 {
 	return true;
 }
 
 template <>
-object core_function_expression<CoreFunction::False>::evaluate(expression_context & /*context*/)
+template <typename Context>
+object core_function_expression<CoreFunction::False>::evaluate_in(Context & /*context*/)
 {
 	return false;
 }
 
 template <>
-object core_function_expression<CoreFunction::Lang>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Lang>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 
@@ -1508,7 +3264,7 @@ object core_function_expression<CoreFunction::Lang>::evaluate(expression_context
 	for (auto &ch : test)
 		ch = std::tolower(ch);
 
-	std::string lang = context.m_node->lang();
+	std::string lang{ deref(context.m_node).lang() };
 	for (auto &ch : lang)
 		ch = std::tolower(ch);
 
@@ -1523,34 +3279,38 @@ object core_function_expression<CoreFunction::Lang>::evaluate(expression_context
 }
 
 template <>
-object core_function_expression<CoreFunction::Number>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Number>::evaluate_in(Context &context)
 {
 	object v;
 
 	if (m_args.size() == 1)
 		v = m_args.front()->evaluate(context);
 	else
-		v = context.m_node->str();
+		v = deref(context.m_node).str();
 
 	return v.as<double>();
 }
 
 template <>
-object core_function_expression<CoreFunction::Floor>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Floor>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 	return floor(v.as<double>());
 }
 
 template <>
-object core_function_expression<CoreFunction::Ceiling>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Ceiling>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 	return ceil(v.as<double>());
 }
 
 template <>
-object core_function_expression<CoreFunction::Round>::evaluate(expression_context &context)
+template <typename Context>
+object core_function_expression<CoreFunction::Round>::evaluate_in(Context &context)
 {
 	object v = m_args.front()->evaluate(context);
 	return round(v.as<double>());
@@ -1568,6 +3328,22 @@ class union_expression : public expression
 	}
 
 	object evaluate(expression_context &context) override;
+	object evaluate(compact_expression_context &context) override;
+
+	expression_ptr optimize() override
+	{
+		m_lhs = m_lhs->optimize();
+		m_rhs = m_rhs->optimize();
+		return shared_from_this();
+	}
+
+	bool uses_position() const override { return m_lhs->uses_position() or m_rhs->uses_position(); }
+	bool returns_node_set() const override { return true; }
+
+	bool matches(const node *n, expression_context &context) override
+	{
+		return m_lhs->matches(n, context) or m_rhs->matches(n, context);
+	}
 
   private:
 	expression_ptr m_lhs, m_rhs;
@@ -1581,10 +3357,48 @@ object union_expression::evaluate(expression_context &context)
 	if (v1.type() != object_type::node_set or v2.type() != object_type::node_set)
 		throw exception("union operator works only on node sets");
 
-	node_set s1 = v1.as<const node_set &>();
-	node_set s2 = v2.as<const node_set &>();
+	node_set s1 = v1.release_node_set();
+	node_set s2 = v2.release_node_set();
+
+	// Both are in document order, usually, merge them
+	sort_document_order(s1);
+	sort_document_order(s2);
+
+	auto before = [](const node *a, const node *b)
+	{
+		return a->cached_document_order() < b->cached_document_order();
+	};
+
+	if (s1.empty())
+		std::swap(s1, s2);
+	else if (not s2.empty())
+	{
+		s1.front()->document_order();
+
+		auto m = s1.size();
+		s1.insert(s1.end(), s2.begin(), s2.end());
+		std::inplace_merge(s1.begin(), s1.begin() + m, s1.end(), before);
+		s1.erase(std::unique(s1.begin(), s1.end()), s1.end());
+	}
+
+	context.recycle(std::move(s2));
+
+	return s1;
+}
+
+object union_expression::evaluate(compact_expression_context &context)
+{
+	object v1 = m_lhs->evaluate(context);
+	object v2 = m_rhs->evaluate(context);
+
+	if (v1.type() != object_type::compact_node_set or v2.type() != object_type::compact_node_set)
+		throw exception("union operator works only on node sets");
+
+	compact_node_set s1 = v1.release_compact_node_set();
+	compact_node_set s2 = v2.release_compact_node_set();
 
-	copy(s2.begin(), s2.end(), back_inserter(s1));
+	s1.insert(s1.end(), s2.begin(), s2.end());
+	sort_document_order(s1);
 
 	return s1;
 }
@@ -1606,7 +3420,7 @@ struct xpath_parser
 
 	expression_ptr location_path();
 	expression_ptr absolute_location_path();
-	expression_ptr relative_location_path();
+	expression_ptr relative_location_path(expression_ptr lhs = {});
 	expression_ptr step();
 	expression_ptr node_test(AxisType axis);
 
@@ -1655,17 +3469,13 @@ expression_ptr xpath_parser::parse(const std::string &path)
 	m_end = m_path.end();
 
 	m_lookahead = get_next_token();
-	auto result = location_path();
 
-	while (m_lookahead == Token::OperatorUnion)
-	{
-		match(Token::OperatorUnion);
-		result.reset(new union_expression(result, location_path()));
-	}
+	// a union of location paths or of filter expressions like id('x')/y
+	auto result = union_expr();
 
 	match(Token::Eof);
 
-	return result;
+	return result->optimize();
 }
 
 void xpath_parser::preprocess(const std::string &path)
@@ -2123,18 +3933,27 @@ expression_ptr xpath_parser::location_path()
 		match(Token::Slash);
 	}
 
-	expression_ptr result(relative_location_path());
+	expression_ptr result;
 
 	if (absolute)
-		result.reset(new path_expression(expression_ptr(new root_expression()), result));
+		result = relative_location_path(expression_ptr(new root_expression()));
+	else
+		result = relative_location_path();
 
 	return result;
 }
 
-expression_ptr xpath_parser::relative_location_path()
+// Paths are built left-deep, the rhs of a path_expression is always a
+// step, possibly with predicates. \a lhs is the filter or root the
+// path starts with, if any.
+
+expression_ptr xpath_parser::relative_location_path(expression_ptr lhs)
 {
 	expression_ptr result(step());
 
+	if (lhs)
+		result.reset(new path_expression(lhs, result));
+
 	while (m_lookahead == Token::Slash)
 	{
 		match(Token::Slash);
@@ -2188,7 +4007,7 @@ expression_ptr xpath_parser::node_test(AxisType axis)
 		else if (name == "processing-instruction")
 			result.reset(new node_type_expression(axis, node_type::processing_instruction));
 		else if (name == "node")
-			result.reset(new node_type_expression(axis, {}));
+			result.reset(new node_type_expression(axis));
 		else
 			throw exception("invalid node type specified: " + name);
 	}
@@ -2307,6 +4126,7 @@ expression_ptr xpath_parser::function_call()
 		case CoreFunction::Contains: result.reset(new core_function_expression<CoreFunction::Contains>(arguments)); break;
 		case CoreFunction::SubstringBefore: result.reset(new core_function_expression<CoreFunction::SubstringBefore>(arguments)); break;
 		case CoreFunction::SubstringAfter: result.reset(new core_function_expression<CoreFunction::SubstringAfter>(arguments)); break;
+		case CoreFunction::Substring: result.reset(new core_function_expression<CoreFunction::Substring>(arguments)); break;
 		case CoreFunction::StringLength: result.reset(new core_function_expression<CoreFunction::StringLength>(arguments)); break;
 		case CoreFunction::NormalizeSpace: result.reset(new core_function_expression<CoreFunction::NormalizeSpace>(arguments)); break;
 		case CoreFunction::Translate: result.reset(new core_function_expression<CoreFunction::Translate>(arguments)); break;
@@ -2352,7 +4172,7 @@ expression_ptr xpath_parser::path_expr()
 		if (m_lookahead == Token::Slash)
 		{
 			match(Token::Slash);
-			result.reset(new path_expression(result, relative_location_path()));
+			result = relative_location_path(result);
 		}
 	}
 	else
@@ -2543,12 +4363,121 @@ xpath::xpath(const std::string &path)
 {
 }
 
+// --------------------------------------------------------------------
+// The cache of compiled xpaths. It is split in shards, each with its own
+// lock and LRU list, to keep threads using different paths from blocking
+// each other.
+
+class xpath_cache
+{
+  public:
+	static xpath_cache &instance()
+	{
+		static xpath_cache s_instance;
+		return s_instance;
+	}
+
+	xpath get(const std::string &path)
+	{
+		auto &shard = m_shards[std::hash<std::string>{}(path) % kShardCount];
+
+		{
+			std::lock_guard lock(shard.m_mutex);
+
+			if (auto i = shard.m_index.find(path); i != shard.m_index.end())
+			{
+				shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, i->second);
+				return i->second->second;
+			}
+		}
+
+		// Compile outside the lock, if another thread beats us to it
+		// the first one is kept. Invalid paths throw and are not cached.
+		xpath result(path);
+
+		std::lock_guard lock(shard.m_mutex);
+
+		if (auto i = shard.m_index.find(path); i != shard.m_index.end())
+			return i->second->second;
+
+		shard.m_lru.emplace_front(path, result);
+		shard.m_index.emplace(shard.m_lru.front().first, shard.m_lru.begin());
+
+		if (shard.m_lru.size() > kShardCapacity)
+		{
+			shard.m_index.erase(shard.m_lru.back().first);
+			shard.m_lru.pop_back();
+		}
+
+		return result;
+	}
+
+  private:
+	static constexpr std::size_t kShardCount = 16;
+	static constexpr std::size_t kShardCapacity = 64;
+
+	struct shard
+	{
+		std::mutex m_mutex;
+		std::list<std::pair<std::string, xpath>> m_lru;
+		std::unordered_map<std::string_view, std::list<std::pair<std::string, xpath>>::iterator> m_index;
+	};
+
+	shard m_shards[kShardCount];
+};
+
+xpath xpath::cached(const std::string &path)
+{
+	return xpath_cache::instance().get(path);
+}
+
 template <>
 node_set xpath::evaluate<node>(const node &root, const context &ctxt) const
 {
 	node_set empty;
+	node_set_pool pool;
+	expression_context context(*ctxt.m_impl, &root, empty);
+	context.m_pool = &pool;
+
+	node_set result = m_impl->evaluate(context).release_node_set();
+	sort_document_order(result);
+
+	return result;
+}
+
+void xpath::for_each(const node &root, const std::function<bool(node *)> &f, const context &ctxt) const
+{
+	node_set empty;
+	node_set_pool pool;
 	expression_context context(*ctxt.m_impl, &root, empty);
-	return m_impl->evaluate(context).as<const node_set &>();
+	context.m_pool = &pool;
+
+	m_impl->visit(context, f);
+}
+
+template <>
+node *xpath::first<node>(const node &root, const context &ctxt) const
+{
+	node *result = nullptr;
+	for_each(root, [&result](node *n)
+		{
+		result = n;
+		return false; },
+		ctxt);
+	return result;
+}
+
+template <>
+element *xpath::first<element>(const node &root, const context &ctxt) const
+{
+	element *result = nullptr;
+	for_each(root, [&result](node *n)
+		{
+		if (n->type() == node_type::element)
+			result = static_cast<element *>(n);
+		return result == nullptr; },
+		ctxt);
+	return result;
 }
 
 template <>
@@ -2565,21 +4494,91 @@ element_set xpath::evaluate<element>(const node &root, const context &ctxt) cons
 	return result;
 }
 
+template <>
+node_set xpath::evaluate<node>(const node &root, xpath_profile &profile, const context &ctxt) const
+{
+	node_set empty;
+	node_set_pool pool;
+	expression_context context(*ctxt.m_impl, &root, empty);
+	context.m_pool = &pool;
+	context.m_profile = &profile;
+
+	node_set result = m_impl->evaluate(context).release_node_set();
+	sort_document_order(result);
+
+	return result;
+}
+
+template <>
+element_set xpath::evaluate<element>(const node &root, xpath_profile &profile, const context &ctxt) const
+{
+	element_set result;
+
+	for (node *n : evaluate<node>(root, profile, ctxt))
+	{
+		if (n->type() == node_type::element)
+			result.push_back(static_cast<element *>(n));
+	}
+
+	return result;
+}
+
+template <>
+node_set xpath::evaluate_parallel<node>(const node &root, thread_pool &threads, const context &ctxt) const
+{
+	node_set empty;
+	node_set_pool pool;
+	expression_context context(*ctxt.m_impl, &root, empty);
+	if (threads.size() > 1)
+		context.m_thread_pool = &threads;
+	context.m_pool = &pool;
+
+	// number the nodes before the threads need it
+	root.document_order();
+
+	node_set result = m_impl->evaluate(context).release_node_set();
+	sort_document_order(result);
+
+	return result;
+}
+
+template <>
+element_set xpath::evaluate_parallel<element>(const node &root, thread_pool &threads, const context &ctxt) const
+{
+	element_set result;
+
+	for (node *n : evaluate_parallel<node>(root, threads, ctxt))
+	{
+		if (n->type() == node_type::element)
+			result.push_back(static_cast<element *>(n));
+	}
+
+	return result;
+}
+
+std::vector<compact_node> xpath::evaluate(const compact_node &root, const context &ctxt) const
+{
+	if (not root)
+		throw exception("cannot evaluate an xpath without a context node");
+
+	compact_node_set empty;
+	compact_expression_context context(*ctxt.m_impl, root, empty);
+
+	compact_node_set result = m_impl->evaluate(context).release_compact_node_set();
+	sort_document_order(result);
+
+	return result;
+}
+
 bool xpath::matches(const node *n, const context &ctxt) const
 {
 	bool result = false;
-	if (n != nullptr)
+	if (n != nullptr and n->root() != nullptr)
 	{
-		const node *root = n->root();
+		node_set empty;
+		expression_context context(*ctxt.m_impl, n->root(), empty);
 
-		for (node *e : evaluate<node>(*root, ctxt))
-		{
-			if (e == n)
-			{
-				result = true;
-				break;
-			}
-		}
+		result = m_impl->matches(n, context);
 	}
 
 	return result;
@@ -498,4 +498,199 @@ struct st_2
 
 // 	type_map types;
 // 	schema_creator sc(types, )
-// }
\ No newline at end of file
+// }
+// --------------------------------------------------------------------
+
+struct st_3
+{
+	int id;
+	std::string name;
+	std::optional<double> value;
+	std::vector<st_1> items;
+	E e;
+
+	template <class Archive>
+	void serialize(Archive &ar, unsigned long /*v*/)
+	{
+		// clang-format off
+		ar & mxml::make_attribute_nvp("id", id)
+		   & mxml::make_attribute_nvp("name", name)
+		   & mxml::make_element_nvp("value", value)
+		   & mxml::make_element_nvp("item", items)
+		   & mxml::make_element_nvp("e", e);
+		// clang-format on
+	}
+};
+
+struct st_late_attribute
+{
+	int i = 0;
+
+	template <class Archive>
+	void serialize(Archive &ar, unsigned long)
+	{
+		// clang-format off
+		ar & mxml::make_element_nvp("i", i)
+		   & mxml::make_attribute_nvp("j", i);
+		// clang-format on
+	}
+};
+
+TEST_CASE("stream_serializer_1")
+{
+	using namespace mxml;
+	value_serializer<E>::instance("my-enum")(E::aap, "aap")(E::noot, "noot")(E::mies, "mies");
+
+	st_3 s{ 1, "a \"quoted\" <name>", 0.5, { { 1, "x & y" }, { 2, "" } }, E::noot };
+
+	// the same output as when writing the elements
+	document doc;
+	to_xml(doc, "s", s);
+
+	std::ostringstream os;
+	to_xml(os, "s", s);
+
+	CHECK(os.str() == (std::ostringstream() << doc).str());
+	CHECK(os.str() == R"(<s id="1" name="a &quot;quoted&quot; &lt;name&gt;"><value>0.5</value><item><i>1</i><s>x &amp; y</s></item><item><i>2</i><s></s></item><e>noot</e></s>)");
+
+	st_3 s2;
+	from_xml(document(os.str()), "s", s2);
+
+	CHECK(s2.name == s.name);
+	CHECK(s2.items == s.items);
+	CHECK(s2.e == s.e);
+
+	// many records, to a string
+	std::string out;
+	{
+		stream_serializer sr(out);
+		sr.start_element("list");
+		for (int i = 0; i < 1000; ++i)
+			sr.serialize_element("i", i);
+	}
+
+	document list(out);
+	CHECK(list.front().size() == 1000);
+	CHECK(list.front().back().get_content() == "999");
+
+	// attributes cannot follow content
+	st_late_attribute la;
+	CHECK_THROWS_AS(to_xml(os, "la", la), mxml::exception);
+}
+
+TEST_CASE("stream_deserializer_1")
+{
+	using namespace mxml;
+	value_serializer<E>::instance("my-enum")(E::aap, "aap")(E::noot, "noot")(E::mies, "mies");
+
+	st_3 s{ 1, "a \"quoted\" <name>", 0.5, { { 1, "x & y" }, { 2, "" } }, E::mies };
+
+	std::ostringstream os;
+	to_xml(os, "s", s);
+
+	std::istringstream is(os.str());
+	st_3 s2;
+	from_xml(is, "s", s2);
+
+	CHECK(s2.id == s.id);
+	CHECK(s2.name == s.name);
+	CHECK(s2.value == s.value);
+	CHECK(s2.items == s.items);
+	CHECK(s2.e == s.e);
+
+	// members in another order, unknown elements, comments and arrays
+	std::string xml = R"(<list><x/><S_arr><ds><c>aap</c><a>1</a><b>0.5</b></ds><vi>1</vi><!-- c --><unknown><vi>9</vi></unknown><vi>2</vi>)"
+					  R"(<ds><a>2</a><b>1.5</b><c>noot</c></ds></S_arr><S_arr><vi>3</vi></S_arr></list>)";
+
+	reader r(std::string_view{ xml });
+	stream_deserializer dsr(r);
+
+	S_arr sa;
+	REQUIRE(dsr.deserialize_element("S_arr", sa));
+	CHECK(sa.vi == std::vector<int>{ 1, 2 });
+	REQUIRE(sa.ds.size() == 2);
+	CHECK(sa.ds[0] == S{ 1, 0.5f, "aap" });
+	CHECK(sa.ds[1] == S{ 2, 1.5f, "noot" });
+
+	REQUIRE(dsr.deserialize_element("S_arr", sa));
+	CHECK(sa.vi == std::vector<int>{ 3 });
+	CHECK(sa.ds.empty());
+
+	CHECK_FALSE(dsr.deserialize_element("S_arr", sa));
+}
+
+// --------------------------------------------------------------------
+
+enum class color
+{
+	red,
+	green,
+	blue
+};
+
+template <>
+struct mxml::enum_values<color>
+{
+	static constexpr std::string_view name = "color";
+	static constexpr std::array values{
+		std::pair{ color::red, std::string_view{ "red" } },
+		std::pair{ color::green, std::string_view{ "green" } },
+		std::pair{ color::blue, std::string_view{ "blue" } }
+	};
+};
+
+static_assert(mxml::enum_table<color>::from_string("green") == color::green);
+static_assert(mxml::enum_table<color>::to_string(color::blue) == "blue");
+
+struct st_color
+{
+	color fg = color::red;
+	std::vector<color> bg;
+
+	template <class Archive>
+	void serialize(Archive &ar, unsigned long)
+	{
+		// clang-format off
+		ar & mxml::make_attribute_nvp("fg", fg)
+		   & mxml::make_element_nvp("bg", bg);
+		// clang-format on
+	}
+};
+
+TEST_CASE("enum_values_1")
+{
+	using namespace mxml;
+
+	CHECK(value_serializer<color>::type_name() == "color");
+	CHECK(value_serializer<color>::to_string(color::green) == "green");
+	CHECK(value_serializer<color>::from_string("blue") == color::blue);
+	CHECK(value_serializer<color>::from_string("purple") == color::red);
+
+	st_color c{ color::blue, { color::green, color::red } };
+
+	document doc;
+	to_xml(doc, "c", c);
+
+	std::ostringstream os;
+	to_xml(os, "c", c);
+
+	CHECK(os.str() == R"(<c fg="blue"><bg>green</bg><bg>red</bg></c>)");
+	CHECK(os.str() == (std::ostringstream() << doc).str());
+
+	st_color c2;
+	from_xml(doc, "c", c2);
+	CHECK(c2.fg == color::blue);
+	CHECK(c2.bg == c.bg);
+
+	// the runtime map still works, also when changed directly
+	value_serializer<E>::init("my-enum", { { E::aap, "aap" }, { E::noot, "noot" } });
+	CHECK(value_serializer<E>::from_string("noot") == E::noot);
+	value_serializer<E>::instance().m_value_map[E::mies] = "mies";
+	CHECK(value_serializer<E>::from_string("mies") == E::mies);
+
+	// renaming a value
+	value_serializer<E>::instance()(E::noot, "nut");
+	CHECK(value_serializer<E>::from_string("nut") == E::noot);
+	CHECK(value_serializer<E>::from_string("noot") == E{});
+	CHECK(value_serializer<E>::to_string(E::noot) == "nut");
+}
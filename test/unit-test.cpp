@@ -7,6 +7,8 @@
 #endif
 
 #include <filesystem>
+#include <fstream>
+#include <thread>
 
 #include "mxml.hpp"
 // #include "mxml.ixx"
@@ -885,6 +887,46 @@ TEST_CASE("named_char_2")
 				  << b << '\n';
 }
 
+TEST_CASE("named_char_3")
+{
+	using namespace mxml::literals;
+
+	// the first, last and some names in between from the table
+	auto a = R"(<!DOCTYPE html SYSTEM "about:legacy-compat" ><p>&AElig;&zwnj;&amp;&hellip;&Bernoullis;&nbsp;&lt;&zscr;</p>)"_xml;
+	CHECK(a.front().get_content() == "Æ\u200C&…ℬ\u00A0<𝓏");
+
+	CHECK_THROWS_AS(R"(<!DOCTYPE html SYSTEM "about:legacy-compat" ><p>&AEli;</p>)"_xml, mxml::exception);
+	CHECK_THROWS_AS(R"(<!DOCTYPE html SYSTEM "about:legacy-compat" ><p>&zwnjx;</p>)"_xml, mxml::exception);
+
+	// not an HTML document
+	CHECK_THROWS_AS(R"(<p>&hellip;</p>)"_xml, mxml::exception);
+}
+
+TEST_CASE("entities-1")
+{
+	// enough entities to grow the hash table a few times
+	std::string xml = "<!DOCTYPE r [\n";
+	for (int i = 0; i < 200; ++i)
+		xml += "<!ENTITY e" + std::to_string(i) + " '<v>" + std::to_string(i) + "</v>'>\n";
+	xml += "<!ENTITY e7 'redefined'>\n<!ENTITY % p '<!ENTITY pv \"x\">'>\n<!ENTITY % p '<!ENTITY pv \"y\">'>\n%p;\n]>\n<r>";
+	for (int i = 199; i >= 0; i -= 3)
+		xml += "&e" + std::to_string(i) + ";";
+	xml += "&e7;&pv;&amp;</r>";
+
+	mxml::document doc(xml);
+
+	auto v = doc.find("//v");
+	REQUIRE(v.size() == 68);
+	CHECK(v.front()->get_content() == "199");
+	CHECK(v[66]->get_content() == "1");
+
+	// the first declaration is binding
+	CHECK(v.back()->get_content() == "7");
+	CHECK(doc.front().get_content() == "x&");
+
+	CHECK_THROWS_AS(mxml::document("<!DOCTYPE r [ <!ENTITY a 'a'> ]><r>&b;</r>"), mxml::exception);
+}
+
 TEST_CASE("doc-test-1")
 {
 	mxml::document doc;
@@ -941,4 +983,1552 @@ TEST_CASE("sort-1")
 
 	CHECK((std::ostringstream() << e).str() == R"(<test aap="1" noot="2" mies="3" boom="4" roos="5" vis="6" vuur="7"/>)");
 
-}
\ No newline at end of file
+}
+TEST_CASE("buffer-1")
+{
+	using namespace std::literals;
+
+	mxml::document a("<test a='1'>\r\naap\r</test>"sv);
+	CHECK(a.front().get_attribute("a") == "1");
+	CHECK(a.front().str() == "\naap\n");
+
+	// UTF-16 with BOM
+	const char utf16le[] = "\xff\xfe<\0t\0/\0>\0";
+	mxml::document b(std::string_view{ utf16le, sizeof(utf16le) - 1 });
+	CHECK(b.front().name() == "t");
+
+	std::string s = R"(<?xml version="1.0" encoding="ISO-8859-1"?><t>caf)" "\xe9" R"(</t>)";
+	mxml::document c(s);
+	CHECK(c.front().str() == "café");
+}
+
+TEST_CASE("mmap-1")
+{
+	auto file = std::filesystem::temp_directory_path() / "mxml-mmap-test.xml";
+
+	{
+		std::ofstream out(file, std::ios::binary);
+		out << R"(<?xml version="1.0"?><data><a>1</a><b x="y"/></data>)";
+	}
+
+	mxml::document doc(file);
+	std::filesystem::remove(file);
+
+	REQUIRE(doc.child() != nullptr);
+	CHECK(doc.find("//a").size() == 1);
+	CHECK(doc.find_first("//b")->get_attribute("x") == "y");
+
+	CHECK_THROWS_AS(mxml::document(file), mxml::exception);
+}
+
+TEST_CASE("scan-1")
+{
+	using namespace std::literals;
+
+	std::string text(100, 'x');
+	mxml::document a("<t a='"s + text + "&amp;" + text + "'>" + text + "\n" + text + "&lt;" + text + "<![CDATA[" + text + "]]></t>");
+	CHECK(a.front().get_attribute("a") == text + '&' + text);
+	CHECK(a.front().str() == text + '\n' + text + '<' + text + text);
+
+	CHECK_THROWS_AS(mxml::document("<t>"s + text + "]]>" + text + "</t>"), mxml::not_wf_exception);
+	CHECK_THROWS_AS(mxml::document("<t>"s + text + "\x01" + text + "</t>"), mxml::not_wf_exception);
+
+	try
+	{
+		mxml::document b("<t>"s + text + "\n" + text + "\n" + text + "\x01</t>");
+		CHECK(false);
+	}
+	catch (const mxml::exception &ex)
+	{
+		CHECK(std::string{ ex.what() }.find("line: 3") != std::string::npos);
+	}
+}
+
+TEST_CASE("sax-view-1")
+{
+	using namespace std::literals;
+
+	mxml::parser p(R"(<r xmlns:m="http://m"><m:a x="1" m:y="2">text<?pi data?></m:a><!--c--></r>)"sv);
+
+	std::vector<std::string> events;
+
+	p.start_element_view_handler = [&](std::string_view name, std::string_view uri, const mxml::parser::attr_view_list_type &atts)
+	{
+		std::string e = "start " + std::string{ name } + " " + std::string{ uri };
+		for (auto &a : atts)
+			e += " " + std::string{ a.m_ns } + "|" + std::string{ a.m_name } + "=" + std::string{ a.m_value };
+		events.emplace_back(e);
+	};
+
+	p.end_element_view_handler = [&](std::string_view name, std::string_view /*uri*/)
+	{ events.emplace_back("end " + std::string{ name }); };
+
+	p.character_data_view_handler = [&](std::string_view data)
+	{ events.emplace_back("text " + std::string{ data }); };
+
+	p.processing_instruction_view_handler = [&](std::string_view target, std::string_view data)
+	{ events.emplace_back("pi " + std::string{ target } + " " + std::string{ data }); };
+
+	p.comment_view_handler = [&](std::string_view data)
+	{ events.emplace_back("comment " + std::string{ data }); };
+
+	p.parse(false, false);
+
+	std::vector<std::string> expected{
+		"start r ",
+		"start a http://m |x=1 http://m|y=2",
+		"text text",
+		"pi pi data",
+		"end a",
+		"comment c",
+		"end r"
+	};
+
+	CHECK(events == expected);
+
+	// values are normalized and defaulted as before, both callbacks see the same
+	mxml::parser p2(R"(<!DOCTYPE r [<!ATTLIST r d CDATA "def">]><r a="x&amp;y" b="1&#9;2	3"/>)"sv);
+
+	std::string views, strings;
+
+	p2.start_element_view_handler = [&](std::string_view /*name*/, std::string_view /*uri*/, const mxml::parser::attr_view_list_type &atts)
+	{
+		for (auto &a : atts)
+			views += " " + std::string{ a.m_name } + "=" + std::string{ a.m_value };
+	};
+
+	p2.start_element_handler = [&](const std::string & /*name*/, const std::string & /*uri*/, const mxml::parser::attr_list_type &atts)
+	{
+		for (auto &a : atts)
+			strings += " " + a.m_name + "=" + a.m_value;
+	};
+
+	p2.parse(false, false);
+
+	CHECK(views == " a=x&y b=1\t2 3 d=def");
+	CHECK(strings == views);
+}
+
+TEST_CASE("push-1")
+{
+	using namespace std::literals;
+
+	const std::string_view xml = R"(<?xml version="1.0"?><r xmlns:m="http://m"><m:a x="1" m:y="2">text &amp; more</m:a><!--c--><![CDATA[<cdata>]]></r>)";
+
+	for (size_t chunk_size : { 1, 3, 7, 1000 })
+	{
+		mxml::parser p;
+
+		std::string events;
+
+		p.start_element_handler = [&](const std::string &name, const std::string & /*uri*/, const mxml::parser::attr_list_type &atts)
+		{ events += "<" + name + ":" + std::to_string(atts.size()) + ">"; };
+		p.end_element_handler = [&](const std::string &name, const std::string & /*uri*/)
+		{ events += "</" + name + ">"; };
+		p.character_data_handler = [&](const std::string &data)
+		{ events += data; };
+		p.comment_handler = [&](const std::string &data)
+		{ events += "#" + data; };
+
+		for (size_t o = 0; o < xml.length(); o += chunk_size)
+			p.feed(xml.substr(o, chunk_size), false);
+		p.feed({}, true);
+
+		CHECK(events == "<r:0><a:2>text & more</a>#c<cdata></r>");
+
+		CHECK_THROWS_AS(p.feed("<more/>", true), mxml::exception);
+	}
+
+	mxml::parser p2;
+	p2.feed("<r><a>", false);
+	CHECK_THROWS_AS(p2.feed("</b></r>", true), mxml::not_wf_exception);
+	CHECK_THROWS_AS(p2.feed("</r>", true), mxml::exception);
+
+	// destruction halfway
+	mxml::parser p3;
+	p3.feed("<r><a>", false);
+
+	CHECK_THROWS_AS(mxml::parser().parse(false, false), mxml::exception);
+
+	// events are fired on the feeding thread, as soon as the markup is complete
+	mxml::parser p4;
+
+	std::string events;
+	std::thread::id thread_id;
+
+	p4.start_element_handler = [&](const std::string &name, const std::string & /*uri*/, const mxml::parser::attr_list_type & /*atts*/)
+	{
+		events += "<" + name + ">";
+		thread_id = std::this_thread::get_id();
+	};
+	p4.character_data_handler = [&](const std::string &data)
+	{ events += data; };
+
+	p4.feed("<r><a x='>", false);
+	CHECK(events == "<r>");
+	p4.feed("1'>te", false);
+	CHECK(events == "<r><a>");
+	p4.feed("xt\r", false);
+	CHECK(events == "<r><a>");
+	p4.feed("\n</a", false);
+	CHECK(events == "<r><a>text\n");
+	p4.feed("></r>", true);
+	CHECK(events == "<r><a>text\n");
+	CHECK(thread_id == std::this_thread::get_id());
+
+	// UTF-16 with a byte order mark, fed one byte at a time
+	const std::string_view utf16{ "\xff\xfe<\0r\0>\0\xe9\0<\0/\0r\0>\0", 18 };
+
+	mxml::parser p5;
+	events.clear();
+	p5.start_element_handler = p4.start_element_handler;
+	p5.character_data_handler = p4.character_data_handler;
+
+	for (auto ch : utf16)
+		p5.feed({ &ch, 1 }, false);
+	p5.feed({}, true);
+
+	CHECK(events == "<r>\xc3\xa9");
+}
+
+TEST_CASE("reader-1")
+{
+	using namespace std::literals;
+	using event_type = mxml::reader::event_type;
+
+	mxml::reader r(R"(<r xmlns="http://r"><a x="1">one<b>two</b>three</a><!--c--><skip><deep><deeper/></deep>text</skip><?pi data?><a x="2"/></r>)"sv);
+
+	std::string result;
+
+	CHECK(r.type() == event_type::none);
+
+	while (r.next())
+	{
+		switch (r.type())
+		{
+			case event_type::start_element:
+				if (r.name() == "skip")
+				{
+					r.skip_subtree();
+					CHECK(r.type() == event_type::end_element);
+					CHECK(r.name() == "skip");
+					result += "[skipped]";
+					break;
+				}
+				CHECK(r.uri() == "http://r");
+				result += "<" + std::string{ r.name() } + std::to_string(r.depth());
+				for (auto &a : r.attributes())
+					result += " " + std::string{ a.m_name } + "=" + std::string{ a.m_value };
+				result += ">";
+				break;
+
+			case event_type::end_element:
+				result += "</" + std::string{ r.name() } + ">";
+				break;
+
+			case event_type::text:
+				result += r.value();
+				break;
+
+			case event_type::comment:
+				result += "#" + std::string{ r.value() };
+				break;
+
+			case event_type::processing_instruction:
+				result += "?" + std::string{ r.name() } + " " + std::string{ r.value() };
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	CHECK(result == "<r1><a2 x=1>one<b3>two</b>three</a>#c[skipped]?pi data<a2 x=2></a></r>");
+	CHECK(r.type() == event_type::none);
+
+	// large documents, skipping most of the records
+	std::string doc = "<records>";
+	for (int i = 0; i < 10000; ++i)
+		doc += "<record nr='" + std::to_string(i) + "'><data><x>" + std::to_string(i) + "</x></data></record>";
+	doc += "</records>";
+
+	mxml::reader r2(doc);
+	int records = 0, sum = 0;
+	while (r2.next())
+	{
+		if (r2.type() == event_type::start_element and r2.name() == "record")
+		{
+			++records;
+			if (records % 100 != 0)
+			{
+				r2.skip_subtree();
+				continue;
+			}
+		}
+
+		if (r2.type() == event_type::text)
+			sum += std::stoi(std::string{ r2.value() });
+	}
+
+	CHECK(records == 10000);
+	CHECK(sum == 504900); // 99 + 199 + ... + 9999
+
+	// adjacent text is reported once, comments in the DTD are not reported
+	mxml::reader r5(R"(<!DOCTYPE r [<!--dtd-->]><!--c--><r>a&amp;b<![CDATA[c]]><e/></r>)"sv);
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::comment);
+	CHECK(r5.value() == "c");
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::start_element);
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::text);
+	CHECK(r5.value() == "a&bc");
+	CHECK(r5.depth() == 1);
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::start_element);
+	CHECK(r5.name() == "e");
+	CHECK(r5.depth() == 2);
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::end_element);
+	CHECK(r5.name() == "e");
+	REQUIRE(r5.next());
+	CHECK(r5.type() == event_type::end_element);
+	CHECK(r5.name() == "r");
+	CHECK(r5.depth() == 1);
+	CHECK(not r5.next());
+
+	// errors
+	mxml::reader r3("<r><a></b></r>"sv);
+	CHECK_THROWS_AS([&]
+		{ while (r3.next()); }(),
+		mxml::not_wf_exception);
+
+	// early destruction
+	mxml::reader r4(doc);
+	CHECK(r4.next());
+}
+
+TEST_CASE("records-1")
+{
+	using namespace std::literals;
+	using namespace mxml::literals;
+
+	std::string xml = R"(<?xml version="1.0"?>
+<feed xmlns:m="http://m">
+	<title>test</title>
+	<records>
+)";
+	for (int i = 0; i < 1000; ++i)
+		xml += "\t\t<m:record nr='" + std::to_string(i) + "'><value>" + std::to_string(i * 2) + "</value><record/></m:record>\n";
+	xml += R"(	</records>
+</feed>)";
+
+	for (auto path : { "m:record"sv, "records/m:record"sv, "/feed/records/m:record"sv })
+	{
+		mxml::document doc;
+
+		int count = 0;
+		doc.parse_records(xml, path, [&](mxml::element &e)
+			{
+				CHECK(e.name() == "record");
+				CHECK(e.get_ns() == "http://m");
+				CHECK(e.get_attribute("nr") == std::to_string(count));
+
+				auto v = e.find_first("value");
+				REQUIRE(v != e.end());
+				CHECK(v->str() == std::to_string(count * 2));
+
+				++count;
+			});
+
+		CHECK(count == 1000);
+		CHECK(doc == R"(<feed xmlns:m="http://m"><title>test</title><records/></feed>)"_xml);
+	}
+
+	mxml::document doc;
+	int count = 0;
+	doc.parse_records(xml, "/records/m:record", [&](mxml::element &)
+		{ ++count; });
+	CHECK(count == 0);
+
+	std::vector<mxml::element> kept;
+	std::istringstream is(xml);
+	mxml::document doc2;
+	doc2.parse_records(is, "value", [&](mxml::element &e)
+		{ kept.emplace_back(std::move(e)); });
+	CHECK(kept.size() == 1000);
+	CHECK(kept.back().str() == "1998");
+
+	mxml::document doc3;
+	CHECK_THROWS_AS(doc3.parse_records(xml, "a//b", [](mxml::element &) {}), mxml::exception);
+}
+
+TEST_CASE("parallel-1")
+{
+	using namespace std::literals;
+
+	std::string xml = R"(<?xml version="1.0"?>
+<!-- leading comment -->
+<feed xmlns="http://feed" xmlns:m="http://m">
+)";
+	for (int i = 0; i < 20000; ++i)
+	{
+		xml += "\t<m:record nr=\"" + std::to_string(i) + "\" note='a > b'><value>" + std::to_string(i) + "</value>";
+		if (i % 7 == 0)
+			xml += "<![CDATA[<not-a-tag>]]><!-- <nor-this> --><?pi <x>?>";
+		xml += "<empty/></m:record>\n";
+	}
+	xml += "</feed>\n<!-- trailing comment -->";
+
+	mxml::document a(xml);
+
+	mxml::thread_pool pool(4);
+
+	mxml::document b;
+	b.parse_parallel(xml, pool);
+
+	CHECK(a == b);
+	CHECK(b.child()->size() == 20000);
+	CHECK(b.child()->back().get_attribute("nr") == "19999");
+	CHECK(b.child()->back().front().get_ns() == "http://feed");
+	CHECK(b.nodes().back().str() == " trailing comment ");
+
+	// errors in one of the parts should be reported
+	auto bad = xml;
+	bad.replace(bad.find("<value>12345</value>"), 20, "<value>12345</valeu>");
+
+	mxml::document c;
+	CHECK_THROWS_AS(c.parse_parallel(bad, pool), mxml::not_wf_exception);
+
+	// a DOCTYPE means sequential parsing, which should work as well
+	auto with_doctype = "<!DOCTYPE feed [ <!ENTITY e 'entity'> ]>" + xml.substr(xml.find("<feed"));
+	with_doctype.replace(with_doctype.find("<value>1</value>"), 16, "<value>&e;</value>");
+
+	mxml::document d;
+	d.parse_parallel(with_doctype);
+	CHECK(std::next(d.child()->begin())->front().str() == "entity");
+}
+
+TEST_CASE("builder-1")
+{
+	using namespace mxml::literals;
+
+	// parsers can override start_element, it receives views
+	struct counting_parser : public mxml::parser
+	{
+		counting_parser(std::string_view data)
+			: parser(data)
+		{
+		}
+
+		void start_element(std::string_view name, std::string_view /*uri*/, const attr_view_list_type &atts) override
+		{
+			m_names += name;
+			m_attrs += atts.size();
+		}
+
+		std::string m_names;
+		size_t m_attrs = 0;
+	};
+
+	counting_parser p(R"(<a x="1"><b y="2" z="3"/><c/></a>)");
+	p.parse(false, false);
+
+	CHECK(p.m_names == "abc");
+	CHECK(p.m_attrs == 3);
+
+	// the document builds the names and values from the parser's views
+	auto doc = R"(<a xmlns:m="http://m" m:x="1" y="2"><b m:x="3"/></a>)"_xml;
+	CHECK(doc.child()->get_attribute("m:x") == "1");
+	CHECK(doc.child()->get_attribute("y") == "2");
+	CHECK(doc.child()->front().get_attribute("m:x") == "3");
+}
+
+TEST_CASE("atom-1")
+{
+	using namespace mxml::literals;
+
+	// not interned, compared as strings
+	mxml::atom u("m:record");
+
+	mxml::atom::set_interning(true);
+
+	mxml::atom a("m:record"), b(std::string{ "m:record" }), c("record");
+
+	CHECK(u == a);
+	CHECK(u.local_name() == c);
+	CHECK(a.local_name_is(c));
+	CHECK(u.local_name_is(c));
+	CHECK(u.local_str() == "record");
+
+	CHECK(a == b);
+	CHECK(a.str() == "m:record");
+	CHECK(a.local_name() == c);
+	CHECK(c.local_name() == c);
+	CHECK(a != c);
+	CHECK(mxml::atom().empty());
+	CHECK(mxml::atom("").empty());
+	CHECK(mxml::atom("x").local_name() == "x");
+
+	// very long names are not interned, but should compare the same way
+	std::string long_name(1000, 'x');
+	mxml::atom l1(long_name), l2(long_name), l3(l1);
+	CHECK(l1 == l2);
+	CHECK(l1 == l3);
+	CHECK(l1 != a);
+	CHECK(mxml::atom("p:" + long_name).local_name() == l1);
+
+	auto doc = R"(<m:a xmlns:m="http://m" m:x="1"><b/><m:b/></m:a>)"_xml;
+	CHECK(doc.child()->name() == "a");
+	CHECK(doc.child()->qname_atom() == mxml::atom("m:a"));
+	CHECK(doc.child()->attributes().find("m:x")->name() == "x");
+	CHECK(doc.find("//b").size() == 2);
+	CHECK(mxml::xpath("//@x").evaluate<mxml::node>(doc).size() == 1);
+
+	mxml::atom::set_interning(false);
+
+	CHECK(doc.child()->qname_atom() == mxml::atom("m:a"));
+	CHECK(doc.find("//b").size() == 2);
+}
+
+TEST_CASE("ns-scope-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<a xmlns="urn:a" xmlns:p="urn:p">
+	<p:b p:x="1">
+		<c xmlns="urn:c" xmlns:q="urn:q" q:y="2"><p:d/></c>
+		<e/>
+	</p:b>
+</a>)"_xml;
+
+	auto a = doc.child();
+	auto &b = a->front();
+	auto &c = b.front();
+	auto &d = c.front();
+	auto &e = b.back();
+
+	CHECK(b.get_qname() == "p:b");
+	CHECK(b.get_ns() == "urn:p");
+	CHECK(b.attributes().find("p:x") != b.attributes().end());
+
+	CHECK(c.get_qname() == "c");
+	CHECK(c.get_ns() == "urn:c");
+	CHECK(c.prefix_for_namespace("urn:p") == std::make_pair(std::string{ "p" }, true));
+	CHECK(c.namespace_for_prefix("q") == "urn:q");
+	CHECK(c.attributes().find("q:y") != c.attributes().end());
+
+	CHECK(d.get_qname() == "p:d");
+	CHECK(d.get_ns() == "urn:p");
+
+	CHECK(e.get_qname() == "e");
+	CHECK(e.get_ns() == "urn:a");
+	CHECK(e.namespace_for_prefix("q").empty());
+	CHECK(e.prefix_for_namespace("urn:c").second == false);
+}
+
+TEST_CASE("ns-scope-2")
+{
+	using namespace mxml::literals;
+
+	// the namespaces in scope are cached, check that changes to the
+	// tree are noticed
+
+	auto doc = R"(<a xmlns="urn:a" xmlns:p="urn:p"><b><p:c/></b></a>)"_xml;
+
+	auto a = doc.child();
+	auto &b = a->front();
+	auto &c = b.front();
+
+	CHECK(c.get_ns() == "urn:p");
+	CHECK(b.get_ns() == "urn:a");
+
+	a->attributes().find("xmlns:p")->set_value("urn:p2");
+	CHECK(c.get_ns() == "urn:p2");
+	CHECK(c.prefix_for_namespace("urn:p").second == false);
+
+	b.set_attribute("xmlns:p", "urn:p3");
+	CHECK(c.get_ns() == "urn:p3");
+	CHECK(c.prefix_for_namespace("urn:p3") == std::make_pair(std::string{ "p" }, true));
+
+	b.attributes().emplace("xmlns:p", "urn:p4");
+	CHECK(c.get_ns() == "urn:p4");
+
+	b.attributes().find("xmlns:p")->set_qname("xmlns:q");
+	CHECK(c.get_ns() == "urn:p2");
+	CHECK(c.namespace_for_prefix("q") == "urn:p4");
+
+	// an empty uri is skipped, lookup continues with the parent
+	b.set_attribute("xmlns:p", "");
+	CHECK(c.get_ns() == "urn:p2");
+	CHECK(c.prefix_for_namespace("").second);
+
+	b.attributes().erase("xmlns:p");
+	b.attributes().erase("xmlns:q");
+	CHECK(c.namespace_for_prefix("q").empty());
+
+	// elements looked up while detached see their new ancestors
+	mxml::element d("p:d");
+	CHECK(d.get_ns().empty());
+
+	auto dd = c.emplace_back(d);
+	CHECK(dd->get_ns() == "urn:p2");
+
+	mxml::element e("e", { { "xmlns", "urn:e" } });
+	e.emplace_back("p:f");
+	CHECK(e.front().get_ns().empty());
+	CHECK(e.front().namespace_for_prefix("").empty() == false);
+
+	auto ee = c.emplace_back(std::move(e));
+	CHECK(ee->front().get_ns() == "urn:p2");
+	CHECK(ee->namespace_for_prefix("") == "urn:e");
+	CHECK(c.namespace_for_prefix("") == "urn:a");
+
+	doc.child()->attributes().clear();
+	CHECK(ee->front().get_ns().empty());
+	CHECK(ee->get_ns() == "urn:e");
+}
+
+TEST_CASE("arena-1")
+{
+	std::string xml = R"(<?xml version="1.0"?>
+<root xmlns:m="http://m">
+)";
+	for (int i = 0; i < 20000; ++i)
+		xml += "\t<m:record nr=\"" + std::to_string(i) + "\"><value>" + std::to_string(i) + "</value><!-- c --></m:record>\n";
+	xml += "</root>";
+
+	mxml::document a(xml);
+
+	mxml::document b;
+	b.set_use_arena(true);
+	std::istringstream is(xml);
+	is >> b;
+	CHECK(a == b);
+
+	mxml::document c;
+	c.set_use_arena(true);
+	c.parse_parallel(xml);
+	CHECK(a == c);
+
+	// nodes can be removed and added after parsing
+	auto root = b.child();
+	root->erase(root->begin());
+	root->emplace_back("m:record")->emplace_back("value")->set_content("new");
+	CHECK(root->size() == 20000);
+
+	// copies outlive the document with the arena
+	mxml::element e;
+	{
+		mxml::document d;
+		d.set_use_arena(true);
+		mxml::thread_pool single(1);
+		d.parse_parallel(xml, single);
+		e = d.child()->back();
+
+		mxml::document m(std::move(d));
+		CHECK(m.child()->size() == 20000);
+	}
+	CHECK(e.get_attribute("nr") == "19999");
+	CHECK(e.front().str() == "19999");
+}
+
+TEST_CASE("compact-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<?xml version="1.0"?>
+<!-- prolog -->
+<m:root xmlns:m="http://m" xmlns="http://d">
+	<item id="1">one<![CDATA[ <two> ]]></item>
+	<item id="2"><sub>three</sub><?pi data?></item>
+	<m:item id="3"/>
+</m:root>)"_xml;
+
+	mxml::compact_document cd(doc);
+
+	auto root = cd.child();
+	REQUIRE(root);
+	CHECK(root.type() == mxml::node_type::element);
+	CHECK(root.get_qname() == "m:root");
+	CHECK(root.name() == "root");
+	CHECK(root.get_ns() == "http://m");
+	CHECK(root.parent() == cd.root());
+	CHECK(root.str() == doc.child()->str());
+	CHECK(cd.root().first_child().type() == mxml::node_type::comment);
+
+	auto items = root.find("item");
+	REQUIRE(items.size() == 3);
+	CHECK(items[0].get_attribute("id") == "1");
+	CHECK(items[0].get_ns() == "http://d");
+	CHECK(items[0].str() == "one <two> ");
+	CHECK(items[1].find_first("sub").str() == "three");
+	CHECK(items[2].get_ns() == "http://m");
+	CHECK(items[2].empty());
+	CHECK(root.find("*").size() == 3);
+	CHECK(root.find(".//*").size() == 4);
+	CHECK(root.find("nope").empty());
+
+	size_t n = 0;
+	for (auto c : items[1])
+	{
+		if (n++ == 1)
+		{
+			CHECK(c.type() == mxml::node_type::processing_instruction);
+			CHECK(c.get_qname() == "pi");
+			CHECK(c.text() == "data");
+		}
+	}
+	CHECK(n == 2);
+
+	CHECK(root.attribute_count() == 2);
+	CHECK(root.attribute(0) == std::make_pair(std::string_view{ "xmlns:m" }, std::string_view{ "http://m" }));
+
+	// and back again
+	auto doc2 = cd.to_document();
+	CHECK(doc2 == doc);
+	CHECK(doc2.find("//item").size() == 3);
+
+	// parsed directly, without a document
+	mxml::compact_document cd2(R"(<?xml version="1.0"?>
+<!-- prolog -->
+<m:root xmlns:m="http://m" xmlns="http://d">
+	<item id="1">one<![CDATA[ <two> ]]></item>
+	<item id="2"><sub>three</sub><?pi data?></item>
+	<m:item id="3"/>
+</m:root>)");
+
+	CHECK(cd2.size() == cd.size() - 1); // the CDATA section is merged with the text
+	CHECK(cd2.child().str() == root.str());
+	CHECK(cd2.child().find(".//*").size() == 4);
+	CHECK(cd2.to_document().str() == doc.str());
+}
+
+TEST_CASE("compact-2")
+{
+	// ID flags and the doctype are kept
+	std::string xml = R"(<!DOCTYPE r SYSTEM "r.dtd" [
+<!ATTLIST e key ID #IMPLIED>
+]>
+<r><e key="a" n="1"/><e key="b" n="2"/></r>)";
+
+	mxml::compact_document cd(xml);
+
+	CHECK(cd.get_doctype().m_root == "r");
+	CHECK(cd.get_doctype().m_dtd == "r.dtd");
+	CHECK(cd.child().find_first("e[2]").id() == "b");
+	CHECK(cd.child().find_first("e[2]").attribute_node(0).is_id());
+	CHECK(not cd.child().find_first("e[2]").attribute_node(1).is_id());
+	CHECK(cd.child().find_first("id('b')").get_attribute("n") == "2");
+
+	auto doc = cd.to_document();
+	CHECK(doc.get_doctype().m_root == "r");
+	CHECK(doc.find_first("id('b')")->get_attribute("n") == "2");
+
+	mxml::compact_document cd2(doc);
+	CHECK(cd2.get_doctype().m_root == "r");
+	CHECK(cd2.child().find_first("id('a')").get_attribute("n") == "1");
+}
+
+TEST_CASE("compact-xpath-1")
+{
+	// The same xpaths evaluated over a document and a compact_document
+	std::string xml = R"(<?xml version="1.0"?>
+<!DOCTYPE r [
+<!ATTLIST a id ID #IMPLIED>
+]>
+<!-- before -->
+<r xmlns:x="http://x" xml:lang="en-US">
+	<a id="a1" n="1">text 1<b>b1</b><b n="2">b2</b><!-- c --></a>
+	<a id="a2" n="2" xml:lang="nl"><x:b>xb</x:b><?pi data?><c><b n="3">b3</b></c></a>
+	<a id="a3" n="3">3.5</a>
+	<d><e/><e n="4"/><e/></d>
+</r>)";
+
+	mxml::document doc(xml);
+	mxml::compact_document cd(xml);
+
+	auto describe = [](mxml::node_type type, std::string_view name, const std::string &str)
+	{
+		return std::to_string(static_cast<int>(type)) + ':' + std::string{ name } + '=' + str + ';';
+	};
+
+	const char *paths[] = {
+		"//b", "//b/@n", "//*", "//node()", "//text()", "//comment()", "//processing-instruction()",
+		"/r/a[2]/*", "//a[@n > 1]", "//a[last()]", "//a[position() = 2]/@id", "//b[1]", "(//b)[2]",
+		"//b/ancestor::*", "//b/ancestor-or-self::a", "//e[2]/preceding-sibling::*", "//e[2]/following-sibling::e",
+		"//b[@n='3']/preceding::*", "//a[1]/following::*", "//c/..", "//e/parent::node()",
+		"//a | //e", "//b[. = 'b2'] | //a[1]", "//a[count(b) = 2]", "//a[contains(., 'b')]",
+		"//*[local-name() = 'b']", "//*[name() = 'x:b']", "//*[namespace-uri() = 'http://x']",
+		"id('a2 a3')", "id('a1')/b", "//a[lang('nl')]", "//b[lang('en')]", "//a[number(.) = 3.5]",
+		"//a[string-length(@id) = 2][2]", "//e[not(@n)]", "//@*", "//a/@*[. = 2]", "//*[starts-with(name(), 'x')]",
+		"/*", "//a[normalize-space(.) = '3.5']", "//namespace::*", "//d//e[$n]", "//a[@n = $n]"
+	};
+
+	mxml::context ctxt;
+	ctxt.set("n", 2.0);
+
+	for (auto path : paths)
+	{
+		INFO(path);
+
+		mxml::xpath xp(path);
+
+		std::string expected;
+		for (auto n : xp.evaluate<mxml::node>(doc, ctxt))
+			expected += describe(n->type(), n->name(), n->str());
+
+		std::string result;
+		for (auto &n : xp.evaluate(cd.root(), ctxt))
+			result += describe(n.type(), n.name(), n.str());
+
+		CHECK(result == expected);
+	}
+
+	// and with an element as context node
+	mxml::xpath xp("b");
+	CHECK(xp.evaluate(cd.child().find_first("a")).size() == 2);
+	CHECK(cd.child().find("a/b").size() == 3);
+	CHECK(cd.child().find_first("a[2]/b").get_qname() == "x:b");
+	CHECK(not cd.child().find_first("nope"));
+}
+
+TEST_CASE("doc-order-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1"><b id="2"/><c id="3"><b id="4"/></c></a><b id="5"/></r>)"_xml;
+
+	auto ids = [](const mxml::element_set &s)
+	{
+		std::string result;
+		for (auto e : s)
+			result += e->get_attribute("id");
+		return result;
+	};
+
+	// unions and paths are returned in document order, without duplicates
+	CHECK(ids(doc.find("//c | //b | //a")) == "12345");
+	CHECK(ids(doc.find("//b | //b")) == "245");
+	CHECK(ids(doc.find("//b/ancestor::*")) == "13");
+	CHECK(ids(doc.find("//*//b")) == "245");
+
+	auto a = doc.find_first("//a");
+	auto b4 = doc.find_first("//b[@id='4']");
+	CHECK(a->document_order() < a->attributes().front().document_order());
+	CHECK(a->attributes().front().document_order() < b4->document_order());
+
+	// the tree is renumbered after a modification
+	auto n = a->emplace_front("d");
+	n->set_attribute("id", "0");
+	CHECK(n->document_order() < b4->document_order());
+	CHECK(ids(doc.find("//b | //d")) == "0245");
+
+	mxml::xpath xp("//c/b");
+	CHECK(xp.matches(&*b4));
+	CHECK(not xp.matches(&*n));
+}
+
+TEST_CASE("xpath-opt-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1">t<!--c--><b id="2"/><c id="3"><b id="4"/></c></a><b id="5"/></r>)"_xml;
+
+	auto ids = [&doc](const char *path)
+	{
+		std::string result;
+		for (auto e : doc.find(path))
+			result += e->get_attribute("id");
+		return result;
+	};
+
+	// //x is rewritten into a descendant scan, the results are the same
+	CHECK(ids("//b") == "245");
+	CHECK(ids("//*//b") == "245");
+	CHECK(ids("/r/a//b") == "24");
+	CHECK(ids("//b[@id]") == "245");
+
+	// positional predicates still apply per parent
+	CHECK(ids("//b[1]") == "245");
+	CHECK(ids("//*[2]") == "35");
+	CHECK(ids("/r/a/*[1+1]") == "3");
+	CHECK(ids("//*[position() = 2]") == "35");
+	CHECK(ids("/r/*[last()]") == "5");
+	CHECK(ids("//b[true()]") == "245");
+	CHECK(ids("//b[false()]") == "");
+
+	auto nodes = mxml::xpath("//text() | //comment()").evaluate<mxml::node>(doc);
+	REQUIRE(nodes.size() == 2);
+	CHECK(nodes[0]->type() == mxml::node_type::text);
+	CHECK(nodes[1]->type() == mxml::node_type::comment);
+	CHECK(mxml::xpath("/self::node()").evaluate<mxml::node>(doc).size() == 1);
+}
+
+TEST_CASE("xpath-cache-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1"><b id="2"/><c id="3"><b id="4"/></c></a><b id="5"/></r>)"_xml;
+
+	CHECK(mxml::xpath::cached("//b").evaluate<mxml::element>(doc).size() == 3);
+	CHECK(mxml::xpath::cached("//b").evaluate<mxml::element>(doc).size() == 3);
+	CHECK_THROWS_AS(mxml::xpath::cached("//b["), mxml::exception);
+	CHECK_THROWS_AS(mxml::xpath::cached("//b["), mxml::exception);
+
+	// many threads querying the same document, with more paths than
+	// fit in the cache
+	std::atomic<size_t> errors = 0;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&doc, &errors, t]()
+			{
+			for (int i = 0; i < 2000; ++i)
+			{
+				int n = (i * 7 + t) % 1500;
+				auto path = "//b[@id='" + std::to_string(n % 6) + "' or " + std::to_string(n) + " = 0]";
+				size_t expected = n == 0 ? 3 : (n % 6 == 2 or n % 6 == 4 or n % 6 == 5) ? 1 : 0;
+				if (doc.find(path).size() != expected)
+					++errors;
+			} });
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	CHECK(errors == 0);
+}
+
+TEST_CASE("xpath-lazy-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1"><b id="2"/><c id="3"><b id="4"><d id="6"/></b></c></a><b id="5"><d id="7"/></b></r>)"_xml;
+
+	for (auto path : { "//b", "//b[1]", "//b/d", "/r/*/b", "//*[@id > 3]", "//d/ancestor::*[1]", "//b | //c", "//@id" })
+	{
+		mxml::xpath xp(path);
+
+		mxml::node_set s;
+		xp.for_each(doc, [&s](mxml::node *n)
+			{
+			s.push_back(n);
+			return true; });
+
+		CHECK(s == xp.evaluate<mxml::node>(doc));
+	}
+
+	// stop after the second node
+	std::vector<std::string> ids;
+	mxml::xpath("//b").for_each(doc, [&ids](mxml::node *n)
+		{
+		ids.push_back(static_cast<mxml::element *>(n)->get_attribute("id"));
+		return ids.size() < 2; });
+	CHECK(ids == std::vector<std::string>{ "2", "4" });
+
+	auto e = mxml::xpath("/r/*[d]").first<mxml::element>(doc);
+	REQUIRE(e != nullptr);
+	CHECK(e->get_attribute("id") == "5");
+	CHECK(mxml::xpath("//@id").first<mxml::element>(doc) == nullptr);
+	CHECK(mxml::xpath("//x").first<mxml::node>(doc) == nullptr);
+
+	CHECK(doc.find_first("//d")->get_attribute("id") == "6");
+}
+
+TEST_CASE("xpath-matches-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1" k="v"><b id="2"/><c id="3"><b id="4"><d id="6"/></b></c></a><b id="5"><d id="7"/></b></r>)"_xml;
+
+	auto all = mxml::xpath("/descendant-or-self::node() | //@*").evaluate<mxml::node>(doc);
+
+	// matching right to left must agree with evaluating from the root
+	for (auto path : { "b", "r/a", "/r/a/b", "//b", "//b/d", "//*[b]/c", "//b[1]", "/r/a/*[2]", "//b[last()]",
+			 "//d[../@id = 4]", "//@k", "/r/a/@*", "//b | //c", "//d/ancestor::*", "//b/following-sibling::*" })
+	{
+		mxml::xpath xp(path);
+		auto s = xp.evaluate<mxml::node>(doc);
+
+		for (auto n : all)
+			CHECK(xp.matches(n) == (std::find(s.begin(), s.end(), n) != s.end()));
+	}
+
+	mxml::element e("b");
+	CHECK_FALSE(mxml::xpath("//b").matches(&e));
+}
+
+TEST_CASE("doc-index-1")
+{
+	std::string xml = R"(<!DOCTYPE r [
+<!ELEMENT r ANY>
+<!ATTLIST b key ID #IMPLIED>
+]>
+<r><a><b key="k1"/><c><b key="k2"/></c></a><b key="k3"/><a/></r>)";
+
+	for (bool use_index : { false, true })
+	{
+		mxml::document doc(xml);
+		doc.set_use_index(use_index);
+
+		CHECK(doc.uses_index() == use_index);
+
+		REQUIRE(doc.get_element_by_id("k2") != nullptr);
+		CHECK(doc.get_element_by_id("k2")->parent()->name() == "c");
+		CHECK(doc.get_element_by_id("k4") == nullptr);
+
+		CHECK(doc.find("//b").size() == 3);
+		CHECK(doc.find("//a").size() == 2);
+		CHECK(doc.find("//x").empty());
+		CHECK(doc.find_first("/descendant::b[2]")->get_attribute("key") == "k2");
+		CHECK(doc.find("id('k3 k1')").size() == 2);
+		CHECK(doc.find_first("id('k3 k1')")->get_attribute("key") == "k1");
+		CHECK(doc.find("id('k1')/../c/b").front() == doc.get_element_by_id("k2"));
+
+		// the indexes follow modifications of the tree
+		auto b = doc.get_element_by_id("k3");
+		b->attributes().find("key")->set_value("k4");
+		CHECK(doc.get_element_by_id("k3") == nullptr);
+		CHECK(doc.get_element_by_id("k4") == b);
+
+		b->set_qname("x");
+		CHECK(doc.find("//b").size() == 2);
+		CHECK(doc.find("//x").size() == 1);
+
+		doc.front().emplace_back("b");
+		CHECK(doc.find("//b").size() == 3);
+		CHECK(doc.find("/descendant::b[last()]").front() == &doc.front().back());
+	}
+}
+
+TEST_CASE("xpath-parallel-1")
+{
+	std::string xml = "<feed>";
+	for (int i = 0; i < 1000; ++i)
+	{
+		xml += "<record nr=\"" + std::to_string(i) + "\"><value>" + std::to_string(i % 7) + "</value>";
+		if (i % 3 == 0)
+			xml += "<sub><value>x</value><b/></sub>";
+		xml += "text</record>";
+	}
+	xml += "</feed>";
+
+	mxml::document doc(xml);
+	mxml::thread_pool pool(4);
+
+	// the parallel results are the same, in the same order
+	for (auto path : { "//value", "//*", "/descendant-or-self::node()", "//record/value", "//record[value = 3]",
+			 "//record[sub]/@nr", "//sub//b | //record[value = 1]", "//text()", "/feed/record[value = 2][1]",
+			 "//record[last()]", "//value/.." })
+	{
+		mxml::xpath xp(path);
+		CHECK(xp.evaluate_parallel<mxml::node>(doc, pool) == xp.evaluate<mxml::node>(doc));
+	}
+
+	CHECK(mxml::xpath("//record").evaluate_parallel<mxml::element>(doc).size() == 1000);
+	CHECK_THROWS_AS(mxml::xpath("//record[$v = 1]").evaluate_parallel<mxml::node>(doc, pool), std::exception);
+}
+
+TEST_CASE("thread-pool-1")
+{
+	mxml::thread_pool pool(3);
+	CHECK(pool.size() == 3);
+
+	std::vector<int> done(100);
+	auto caller = std::this_thread::get_id();
+
+	// nested runs do not wait for each other
+	pool.run(10, [&](std::size_t i)
+		{
+			if (i == 0)
+				CHECK(std::this_thread::get_id() == caller);
+
+			pool.run(10, [&](std::size_t j)
+				{ ++done[i * 10 + j]; });
+		});
+
+	CHECK(std::count(done.begin(), done.end(), 1) == 100);
+
+	CHECK_THROWS_AS(pool.run(10, [](std::size_t i)
+						{ if (i == 5) throw mxml::exception("5"); }),
+		mxml::exception);
+
+	mxml::thread_pool single(1);
+	single.run(3, [&](std::size_t i)
+		{ done[i] = 0; });
+	CHECK(done[2] == 0);
+}
+
+TEST_CASE("xpath-objects-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r><a id="1">  x  y </a><b id="2">hello</b><a id="3">world</a><c id="4"/></r>)"_xml;
+
+	auto ids = [&doc](const char *path)
+	{
+		std::string result;
+		for (auto e : doc.find(path))
+			result += e->get_attribute("id");
+		return result;
+	};
+
+	// unions are merged in document order, without duplicates
+	CHECK(ids("//c | //a | //b") == "1234");
+	CHECK(ids("//a | //a[2] | //*[@id = 1]") == "13");
+	CHECK(ids("//nothing | //b") == "2");
+
+	// predicates over the results of a path, with positions
+	CHECK(ids("/r/*[position() mod 2 = 1]") == "13");
+	CHECK(ids("/r/*[last() - 1]") == "3");
+	CHECK(ids("/r/a[2]") == "3");
+
+	// string functions
+	CHECK(ids("//*[normalize-space() = 'x y']") == "1");
+	CHECK(ids("//*[concat(string(), '!', @id) = 'hello!2']") == "2");
+	CHECK(ids("//a[substring(string(), 2, 3) = 'orl']") == "3");
+	CHECK(ids("//*[substring-before(string(), 'l') = 'he']") == "2");
+	CHECK(ids("//*[substring-after(string(), 'wor') = 'ld']") == "3");
+	CHECK(ids("//*[starts-with(string(), 'wo') or contains(string(), 'ell')]") == "23");
+	CHECK(ids("//*[string-length() = 5]") == "23");
+	CHECK(ids("//*[translate(string(), 'lo', 'L') = 'heLL']") == "2");
+}
+
+TEST_CASE("writer-1")
+{
+	using namespace mxml::literals;
+
+	auto doc = R"(<r a="x &quot;y&quot;">text &amp; more<!--c--><b>&lt;&#9;&gt;</b><?pi data?></r>)"_xml;
+
+	std::ostringstream os;
+	os << doc;
+
+	// the same output, whether written to a string or an ostream
+	std::string s;
+	{
+		mxml::writer w(s);
+		w << doc;
+	}
+	CHECK(s == os.str());
+	CHECK(s == R"(<r a="x &quot;y&quot;">text &amp; more<!--c--><b>&lt;	&gt;</b><?pi data?></r>)");
+
+	s.clear();
+	{
+		mxml::writer w(s);
+		w << *doc.child()->find_first("b");
+	}
+	CHECK(s == "<b>&lt;\t&gt;</b>");
+
+	// long runs go through the vectorized scan, make sure nothing is missed
+	std::string text;
+	for (int i = 0; i < 1000; ++i)
+		text += std::string(i % 37, 'x') + "ü<\x01\"\n&>" + char('a' + i % 26);
+
+	std::string expected;
+	for (char ch : text)
+	{
+		switch (ch)
+		{
+			case '<': expected += "&lt;"; break;
+			case '>': expected += "&gt;"; break;
+			case '&': expected += "&amp;"; break;
+			case '"': expected += "&quot;"; break;
+			case '\n': expected += "&#10;"; break;
+			case '\x01': expected += "&#1;"; break;
+			default: expected += ch; break;
+		}
+	}
+
+	s.clear();
+	{
+		mxml::writer w(s);
+		w.write_escaped(text, true, true);
+	}
+	CHECK(s == expected);
+
+	CHECK_THROWS_AS(mxml::writer(s).write_escaped(std::string_view("a\0b", 3)), mxml::exception);
+
+	// and write to a file descriptor, larger than the buffer
+	mxml::element e("big");
+	e.set_content(text + text + text + text + text + text + text + text + text + text + text + text + text + text + text + text + text + text + text + text);
+
+	std::ostringstream big;
+	big << e;
+
+	std::FILE *f = std::tmpfile();
+	REQUIRE(f != nullptr);
+	{
+		mxml::writer w(fileno(f));
+		w << e;
+	}
+
+	std::string read_back(big.str().length() + 1, ' ');
+	std::rewind(f);
+	read_back.resize(std::fread(read_back.data(), 1, read_back.length(), f));
+	std::fclose(f);
+
+	CHECK(read_back == big.str());
+	CHECK(read_back.length() > 64 * 1024);
+}
+
+TEST_CASE("content-model-1")
+{
+	const std::string dtd = R"(<!DOCTYPE r [
+<!ELEMENT r (a, (b | c)*, d?, (e, e)+)>
+<!ELEMENT a EMPTY>
+<!ELEMENT b EMPTY>
+<!ELEMENT c EMPTY>
+<!ELEMENT d (#PCDATA | b)*>
+<!ELEMENT e ANY>
+<!ATTLIST a t NMTOKENS #IMPLIED n IDREFS #IMPLIED>
+<!ATTLIST b id ID #IMPLIED>
+]>
+)";
+
+	auto valid = [&dtd](const std::string &content)
+	{
+		mxml::document doc;
+		doc.set_validating(true);
+
+		std::istringstream is(dtd + content);
+
+		try
+		{
+			is >> doc;
+			return true;
+		}
+		catch (const mxml::invalid_exception &)
+		{
+			return false;
+		}
+	};
+
+	CHECK(valid("<r><a/><e/><e/></r>"));
+	CHECK(valid("<r><a/><b/><c/><b/><d>x<b/>y</d><e/><e><a/></e><e/><e/></r>"));
+	CHECK(valid("<r><a/><c/><c/><e/><e/></r>"));
+
+	CHECK_FALSE(valid("<r><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><a/><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><d/><b/><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><e/><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><e/><e/><b/></r>"));
+	CHECK_FALSE(valid("<r><a>x</a><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a/><d><c/></d><e/><e/></r>"));
+
+	// attribute values are normalized while validating
+	mxml::document doc;
+	doc.set_validating(true);
+	std::istringstream is(dtd + "<r><a t='  x   y z ' n=' i1  i2 '/><b id='i1'/><b id=' i2'/><e/><e/></r>");
+	is >> doc;
+
+	CHECK(doc.find_first("//a")->get_attribute("t") == "x y z");
+	CHECK(doc.find_first("//a")->get_attribute("n") == "i1 i2");
+	CHECK(doc.find("//b")[1]->get_attribute("id") == "i2");
+
+	CHECK_FALSE(valid("<r><a t='x, y'/><e/><e/></r>"));
+	CHECK_FALSE(valid("<r><a n='i1 1i'/><b id='i1'/><e/><e/></r>"));
+}
+
+TEST_CASE("dtd-cache-1")
+{
+	const std::string dtd = R"(<!ELEMENT msg (to, body)>
+<!ELEMENT to (#PCDATA)>
+<!ELEMENT body (#PCDATA)>
+<!ATTLIST msg kind (note | alert) "note">
+<!ENTITY sig "-- the sender">
+<!NOTATION gif SYSTEM "image/gif">
+)";
+
+	std::atomic<int> loads = 0;
+
+	auto cache = std::make_shared<mxml::dtd_cache>();
+
+	auto parse = [&](const std::string &xml, const std::string &dir = {})
+	{
+		mxml::document doc;
+		doc.set_validating(true);
+		doc.set_base_dir(dir);
+		doc.set_dtd_cache(cache);
+		doc.set_entity_loader([&](const std::string &, const std::string &, const std::string &sysid) -> std::istream *
+			{
+				++loads;
+				return sysid == "msg.dtd" ? new std::istringstream(dtd) : nullptr;
+			});
+		std::istringstream is(xml);
+		is >> doc;
+		return doc;
+	};
+
+	const std::string head = R"(<!DOCTYPE msg SYSTEM "msg.dtd">)";
+
+	auto doc = parse(head + "<msg><to>you</to><body>hi &sig;</body></msg>");
+	CHECK(loads == 1);
+	CHECK(cache->size() == 1);
+	CHECK(doc.find_first("//body")->get_content() == "hi -- the sender");
+
+	// the second time the DTD is taken from the cache, with the same results
+	doc = parse(head + "<msg kind='alert'><to>me</to><body>hi &sig;</body></msg>");
+	CHECK(loads == 1);
+	CHECK(doc.find_first("//body")->get_content() == "hi -- the sender");
+	CHECK(doc.front().get_attribute("kind") == "alert");
+	CHECK(parse(head + "<msg><to/><body/></msg>").front().get_attribute("kind") == "note");
+
+	CHECK_THROWS_AS(parse(head + "<msg><body/><to/></msg>"), mxml::invalid_exception);
+	CHECK_THROWS_AS(parse(head + "<msg kind='x'><to/><body/></msg>"), mxml::invalid_exception);
+
+	// an internal subset means the DTD is parsed again
+	doc = parse(R"(<!DOCTYPE msg SYSTEM "msg.dtd" [ <!ENTITY sig "-- me"> ]><msg><to/><body>&sig;</body></msg>)");
+	CHECK(loads == 2);
+	CHECK(doc.find_first("//body")->get_content() == "-- me");
+
+	// and the cache can be used from several threads at once
+	std::vector<std::thread> threads;
+	std::atomic<int> valid = 0;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		threads.emplace_back([&]()
+			{
+				for (int j = 0; j < 100; ++j)
+				{
+					auto d = parse(head + "<msg><to>" + std::to_string(j) + "</to><body>&sig;</body></msg>");
+					if (d.find_first("//body")->get_content() == "-- the sender")
+						++valid;
+				}
+			});
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	CHECK(valid == 400);
+	CHECK(loads == 2);
+
+	cache->clear();
+	CHECK(cache->size() == 0);
+	parse(head + "<msg><to/><body/></msg>");
+	CHECK(loads == 3);
+
+	// the same system ID in another DTD directory is another DTD
+	parse(head + "<msg><to/><body/></msg>", "other");
+	CHECK(loads == 4);
+	CHECK(cache->size() == 2);
+}
+
+TEST_CASE("transcode-1")
+{
+	using namespace std::literals;
+
+	// Long runs of 7-bit text, with some characters that need more work in between
+	std::u32string text;
+	for (int i = 0; i < 200; ++i)
+		text += U"The quick brown fox jumps over the lazy dog éè € \U0001D11E\r\n";
+
+	std::u32string xml = U"<?xml version=\"1.0\" encoding=\"UTF-16\"?>\r\n<t a='é€'>" + text + U"</t>";
+
+	auto to_utf16 = [](std::u32string_view s, bool big_endian)
+	{
+		std::string result = big_endian ? "\xfe\xff" : "\xff\xfe";
+
+		auto put = [&](char32_t u)
+		{
+			char b[2] = { static_cast<char>(u & 0xff), static_cast<char>(u >> 8) };
+			if (big_endian)
+				std::swap(b[0], b[1]);
+			result.append(b, 2);
+		};
+
+		for (char32_t uc : s)
+		{
+			if (uc >= 0x10000)
+			{
+				put(0xD800 + ((uc - 0x10000) >> 10));
+				put(0xDC00 + ((uc - 0x10000) & 0x3ff));
+			}
+			else
+				put(uc);
+		}
+
+		return result;
+	};
+
+	std::string expected;
+	for (char32_t uc : text)
+	{
+		if (uc != '\r')
+			mxml::append(expected, uc);
+	}
+
+	for (bool big_endian : { false, true })
+	{
+		auto data = to_utf16(xml, big_endian);
+
+		mxml::document a(std::string_view{ data });
+		CHECK(a.front().get_attribute("a") == "é€");
+		CHECK(a.front().str() == expected);
+
+		std::istringstream is(data);
+		mxml::document b;
+		is >> b;
+		CHECK(a == b);
+
+		// unpaired surrogates are not allowed
+		auto bad = to_utf16(U"<t>abc</t>", big_endian);
+		bad.insert(8, big_endian ? "\xd8\x00"s : "\x00\xd8"s);
+		CHECK_THROWS_AS(mxml::document(std::string_view{ bad }), mxml::not_wf_exception);
+
+		// and the push parser feeds one byte at a time
+		mxml::parser p;
+		std::string content;
+		p.character_data_handler = [&](const std::string &s)
+		{ content += s; };
+
+		for (char ch : data)
+			p.feed(std::string_view{ &ch, 1 }, false);
+		p.feed({}, true);
+
+		CHECK(content == expected);
+	}
+
+	// ISO-8859-1
+	std::string latin1 = "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n<t a='\xe9\xe8'>";
+	expected.clear();
+	for (int i = 0; i < 200; ++i)
+	{
+		latin1 += "The quick brown fox jumps over the lazy dog \xe9\xe8\xff\n";
+		expected += "The quick brown fox jumps over the lazy dog éèÿ\n";
+	}
+	latin1 += "</t>";
+
+	mxml::document c(std::string_view{ latin1 });
+	CHECK(c.front().get_attribute("a") == "éè");
+	CHECK(c.front().str() == expected);
+
+	std::istringstream is(latin1);
+	mxml::document d;
+	is >> d;
+	CHECK(c == d);
+}
+
+TEST_CASE("istream-1")
+{
+	// Streams that do not read from a file or a string are read a byte at
+	// a time, the data following the point where parsing stopped is left.
+	struct span_buf : std::streambuf
+	{
+		span_buf(std::string &s)
+		{
+			setg(s.data(), s.data(), s.data() + s.size());
+		}
+	};
+
+	std::string data = "<a><b>text</c></a>" + std::string(100000, 'x');
+	span_buf buf(data);
+	std::istream is(&buf);
+
+	CHECK_THROWS_AS(mxml::document(is), mxml::exception);
+	CHECK(buf.in_avail() >= 100000);
+
+	// the result is the same as when reading in blocks, also when transcoding
+	std::string xml = "<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n<t a='\xe9'>caf\xe9</t>";
+
+	std::string copy = xml;
+	span_buf buf2(copy);
+	std::istream is2(&buf2);
+	mxml::document a(is2);
+
+	std::istringstream is3(xml);
+	mxml::document b(is3);
+
+	CHECK(a == b);
+	CHECK(a.front().str() == "caf\xc3\xa9");
+	CHECK(a.front().get_attribute("a") == "\xc3\xa9");
+}
+
+TEST_CASE("stats-1")
+{
+	using namespace std::literals;
+
+	auto xml = R"(<?xml version="1.0"?>
+<!DOCTYPE r [
+<!ELEMENT r (a*)>
+<!ELEMENT a (#PCDATA)>
+<!ATTLIST a id ID #REQUIRED n CDATA #IMPLIED>
+<!ENTITY e "entity">
+]>
+<r><a id="a1" n="1">&e;</a><a id="a2">text<![CDATA[cdata]]></a><!-- comment --><?pi data?></r>)"s;
+
+	mxml::document doc;
+	doc.set_validating(true);
+	doc.set_preserve_cdata(true);
+
+	std::istringstream is(xml);
+	is >> doc;
+
+	auto ds = doc.get_stats();
+	CHECK(ds.elements == 3);
+	CHECK(ds.attributes == 3);
+	CHECK(ds.texts == 2);
+	CHECK(ds.cdata_sections == 1);
+	CHECK(ds.comments == 1);
+	CHECK(ds.processing_instructions == 1);
+	CHECK(ds.memory >= 3 * sizeof(mxml::element) + 3 * sizeof(mxml::attribute));
+
+	auto &ps = doc.get_parser_stats();
+
+	mxml::xpath_profile profile;
+	auto found = mxml::xpath("//a[@n]").evaluate<mxml::element>(doc, profile);
+	REQUIRE(found.size() == 1);
+	CHECK(found.front()->get_attribute("id") == "a1");
+
+#if MXML_STATS
+	CHECK(ps.bytes_read == xml.length());
+	CHECK(ps.elements == 3);
+	CHECK(ps.attributes == 3);
+	CHECK(ps.entity_expansions == 1);
+	CHECK(ps.max_depth == 2);
+	CHECK(ps.tokens > 0);
+	CHECK(ps.allocations >= 2);
+
+	auto step = [&profile](std::string_view expression)
+	{
+		auto i = std::find_if(profile.steps.begin(), profile.steps.end(), [expression](auto &s)
+			{ return s.expression == expression; });
+		REQUIRE(i != profile.steps.end());
+		return *i;
+	};
+
+	REQUIRE(profile.steps.size() == 3);
+
+	auto a = step("descendant::a");
+	CHECK(a.evaluations == 1);
+	CHECK(a.nodes_visited == 3);
+	CHECK(a.nodes_selected == 2);
+	CHECK(a.max_node_set_size == 2);
+
+	auto n = step("attribute::n");
+	CHECK(n.evaluations == 2);
+	CHECK(n.nodes_visited == 3);
+	CHECK(n.nodes_selected == 1);
+
+	auto pred = step("descendant::a[...]");
+	CHECK(pred.evaluations == 1);
+	CHECK(pred.nodes_visited == 2);
+	CHECK(pred.nodes_selected == 1);
+
+	// counters add up over evaluations
+	mxml::xpath("//a[@n]").evaluate<mxml::element>(doc, profile);
+	CHECK(profile.steps.size() == 6);
+
+	profile.clear();
+	mxml::xpath("/r/a[2]").evaluate<mxml::node>(doc, profile);
+	CHECK(step("child::a[2]").nodes_selected == 1);
+	CHECK(step("child::a").max_node_set_size == 2);
+#else
+	CHECK(ps.elements == 0);
+	CHECK(ps.bytes_read == 0);
+	CHECK(profile.steps.empty());
+#endif
+}